@@ -15,4 +15,6 @@ KERNEL_UNITY_BUILD = yes
 ENABLE_KERNAL_ASAN = no
 ENABLE_KERNEL_ASLR = no
 ENABLE_KERNEL_UBSAN = no
+ENABLE_SCHED_TRACE = no
+ENABLE_KERNEL_DEBUG_CHECKS = no
 DEFAULT_TARGET = help-text
@@ -1,20 +1,24 @@
 KERNEL_CXX_SRCS += Status.cpp \
 	core/Clock.cpp core/Config.cpp core/CppRuntime.cpp \
 	core/Ipl.cpp core/Logging.cpp core/PageAccess.cpp core/PageAlloc.cpp \
-	core/Panic.cpp core/Scheduler.cpp core/Smp.cpp core/Wait.cpp \
-	core/Worker.cpp\
+	core/Panic.cpp core/Rcu.cpp core/SchedTrace.cpp core/Scheduler.cpp \
+	core/Smp.cpp core/Wait.cpp core/Worker.cpp\
 	debugger/EnclaveApi.cpp debugger/Event.cpp debugger/GdbProtocol.cpp \
 	debugger/KernelApi.cpp \
 	entry/Allocators.cpp entry/BringUp.cpp entry/ConfigRoot.cpp \
 	entry/EfiRuntime.cpp entry/InitProgram.cpp \
-	io/Interfaces.cpp io/Packet.cpp \
-	lib/Memory.cpp lib/Printf.cpp lib/Time.cpp lib/Units.cpp \
+	io/Interfaces.cpp io/Packet.cpp io/RamDisk.cpp \
+	lib/Compression.cpp lib/Memory.cpp lib/Printf.cpp lib/Time.cpp \
+	lib/Units.cpp \
 	loader/Elf.cpp loader/Filter.cpp \
-	namespace/Handles.cpp namespace/Objects.cpp \
+	namespace/Files.cpp namespace/Handles.cpp namespace/Objects.cpp \
 	process/Init.cpp process/Job.cpp process/Process.cpp process/Signals.cpp \
 	process/Thread.cpp \
 	video/Video.cpp video/Text.cpp \
 	vm/KernelStack.cpp vm/PageTables.cpp vm/Pool.cpp vm/Space.cpp \
+	vm/Compressed.cpp vm/FileSource.cpp vm/PageCache.cpp vm/Swap.cpp \
+	vm/Pin.cpp \
+	vm/Merge.cpp vm/QuantumCache.cpp vm/WorkingSet.cpp \
 	$(BAKED_CONSTANTS_FILE) $(addprefix np-syslib/, $(LIB_SYSLIB_CXX_SRCS))
 
 # TODO: ASAN support
@@ -23,6 +27,14 @@ ifeq ($(ENABLE_KERNEL_UBSAN), yes)
 	KERNEL_CXX_FLAGS += -fsanitize=undefined
 endif
 
+ifeq ($(ENABLE_SCHED_TRACE), yes)
+	KERNEL_CXX_FLAGS += -DNPK_HAS_SCHED_TRACE
+endif
+
+ifeq ($(ENABLE_KERNEL_DEBUG_CHECKS), yes)
+	KERNEL_CXX_FLAGS += -DNPK_HAS_DEBUG_CHECKS
+endif
+
 ifeq ($(KERNEL_BOOT_PROTOCOL), limine)
 	KERNEL_CXX_SRCS += entry/Limine.cpp
 else
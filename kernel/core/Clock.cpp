@@ -97,6 +97,11 @@ namespace Npk
         if (!clockQueue->events.Empty())
             return HwSetAlarm(clockQueue->events.Front().expiry);
 
+        //isolated cpus are fully tickless, the alarm is armed again when an
+        //event is queued.
+        if (IsCpuIsolated(MyCoreId()))
+            return;
+
         Log("Empty clock queue, alarm set for free interval of %zums", 
             LogLevel::Info, AlarmFreeMs);
         HwSetAlarm(HwReadTimestamp() + AlarmFreeInterval);
@@ -203,6 +208,17 @@ namespace Npk
         return true;
     }
 
+    sl::TimePoint Private::NextLocalClockExpiry()
+    {
+        clockQueue->lock.Lock();
+        const auto next = clockQueue->events.Empty() 
+            ? HwReadTimestamp() + AlarmFreeInterval
+            : clockQueue->events.Front().expiry;
+        clockQueue->lock.Unlock();
+
+        return next;
+    }
+
     //Called by the hardware layer when the hardware alarm interrupt has fired,
     //from within the interrupt handler.
     void DispatchAlarm()
@@ -1,10 +1,13 @@
 #include <Core.hpp>
 #include <lib/Memory.hpp>
+#include <lib/Maths.hpp>
 
 namespace Npk
 {
     constexpr char KeyValueDelim = '=';
     constexpr char ElementDelim = ';';
+    constexpr char ListDelim = ',';
+    constexpr char RangeDelim = '-';
 
     static sl::StringSpan configStore {};
 
@@ -148,4 +151,31 @@ namespace Npk
 
         return configStore.Subspan(offset, valueLength);
     }
+
+    bool ReadConfigListHas(sl::StringSpan key, size_t value)
+    {
+        sl::StringSpan list = ReadConfigString(key, {});
+
+        //elements are either a single number or an inclusive range, like
+        //"1,4-7".
+        while (!list.Empty())
+        {
+            const size_t length = sl::MemFind(list.Begin(), ListDelim, 
+                list.Size());
+            const auto element = list.Subspan(0, length);
+            list = list.Subspan(sl::Min(length + 1, list.Size()), -1);
+
+            const size_t split = sl::MemFind(element.Begin(), RangeDelim,
+                element.Size());
+            const size_t first = ParseNum(element.Subspan(0, split));
+            size_t last = first;
+            if (split < element.Size())
+                last = ParseNum(element.Subspan(split + 1, -1));
+
+            if (value >= first && value <= last)
+                return true;
+        }
+
+        return false;
+    }
 }
@@ -72,7 +72,10 @@ namespace Npk
             case Ipl::Dpc:
                 RunDpcs();
                 if (target == Ipl::Passive)
+                {
+                    Private::RcuQuiescentState();
                     Private::PrePassiveRunLevel();
+                }
                 break;
             case Ipl::Passive:
                 break;
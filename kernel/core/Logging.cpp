@@ -22,6 +22,9 @@
  * exists so that one cpu doesn't get stuck writing logs for the other cpus while
  * not progressing it's own work.
  * When `selfDrainLogs` is clear, log write-out is handled by the worker thread.
+ * Isolated cpus never self-drain, they queue a work item on their housekeeping
+ * cpu to do it instead (or leave it for the next log, if they can't queue work
+ * items at the current IPL).
  */
 namespace Npk
 {
@@ -43,6 +46,8 @@ namespace Npk
 
     static sl::Atomic<bool> selfDrainLogs = true;
     static bool initialized = false;
+    static sl::Atomic<bool> drainQueued = false;
+    static WorkItem drainWork;
 
     static IntrSpinLock writeoutLock; //TODO: disabling preemption is enough, IplSpinLock<Dpc> should do the trick
     static sl::List<LogSink, &LogSink::listHook> logSinks; //protected by writeout lock
@@ -96,6 +101,25 @@ namespace Npk
         writeoutLock.Unlock();
     }
 
+    static void DrainLogs(WorkItem* item, void* arg)
+    {
+        (void)item;
+        (void)arg;
+
+        drainQueued.Store(false, sl::Release);
+        TryWriteoutLogItems(static_cast<size_t>(-1));
+    }
+
+    static void QueueLogDrain(CpuId cpu)
+    {
+        if (CurrentIpl() > Ipl::Dpc || drainQueued.Exchange(true, sl::Acquire))
+            return;
+
+        drainWork.function = DrainLogs;
+        drainWork.arg = nullptr;
+        QueueWorkItem(&drainWork, HousekeepingCpu(cpu));
+    }
+
     void Log(const char* message, LogLevel level, ...)
     {
         auto logItem = AllocLogItem();
@@ -116,7 +140,12 @@ namespace Npk
         details.text = sl::StringSpan(logItem->data, realLength);
 
         InsertLogItem(logItem);
-        if (selfDrainLogs)
+        if (!selfDrainLogs)
+            return;
+
+        if (IsCpuIsolated(details.cpu))
+            QueueLogDrain(details.cpu);
+        else
             TryWriteoutLogItems(MaxSelfDrainCount);
     }
 
@@ -1,11 +1,18 @@
-#include <Core.hpp>
+#include <private/Core.hpp>
+#include <lib/Maths.hpp>
 #include <lib/Memory.hpp>
 
 namespace Npk
 {
-    //NOTE: assumes dom.freeLists.lock is held
-    static PageInfo* TakePage(SystemDomain& dom)
+    constexpr size_t ReclaimBatchSize = 16;
+    constexpr size_t TakeBatchSize = 16;
+
+    //NOTE: assumes dom.freeLists.lock is held. Pages taken from the free
+    //list (rather than the zeroed list) have `*dirty` set, they must be
+    //zeroed by the caller once the lock is released.
+    static PageInfo* TakePage(SystemDomain& dom, bool* dirty)
     {
+        *dirty = false;
         if (!dom.freeLists.zeroed.Empty())
         {
             dom.freeLists.pageCount--;
@@ -23,9 +30,7 @@ namespace Npk
                 dom.freeLists.free.PushBack(next);
             }
 
-            auto access = AccessPage(page);
-            sl::MemSet(access->value, 0, PageSize());
-
+            *dirty = true;
             dom.freeLists.pageCount--;
             return page;
         }
@@ -33,18 +38,109 @@ namespace Npk
         return nullptr;
     }
 
+    static void ZeroPage(PageInfo* page)
+    {
+        auto access = AccessPage(page);
+        sl::MemSet(access->value, 0, PageSize());
+    }
+
+    //takes up to `pages.Size()` pages from the free lists, acquiring the
+    //lock once. Returns the number of pages taken.
+    static size_t TakePages(SystemDomain& dom, sl::Span<PageInfo*> pages)
+    {
+        bool dirty[TakeBatchSize];
+        size_t taken = 0;
+
+        while (taken < pages.Size())
+        {
+            const size_t batch = sl::Min(TakeBatchSize,
+                pages.Size() - taken);
+
+            size_t count = 0;
+            dom.freeLists.lock.Lock();
+            while (count < batch)
+            {
+                pages[taken + count] = TakePage(dom, &dirty[count]);
+                if (pages[taken + count] == nullptr)
+                    break;
+                count++;
+            }
+            dom.freeLists.lock.Unlock();
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (dirty[i])
+                    ZeroPage(pages[taken + i]);
+            }
+            taken += count;
+
+            if (count != batch)
+                break;
+        }
+
+        return taken;
+    }
+
+    //reclaiming memory can allocate (IOPs for swap writes, pool memory),
+    //those allocations must not start another reclaim: it would try to take
+    //locks that the outer reclaim already holds.
+    static size_t TryReclaim(size_t count)
+    {
+        if (CurrentIpl() != Ipl::Passive)
+            return 0;
+
+        ThreadContext* thread = GetCurrentThread();
+        if (thread == nullptr || thread->reclaiming)
+            return 0;
+
+        thread->reclaiming = true;
+        const size_t released = Private::ReclaimAnonPages(count);
+        thread->reclaiming = false;
+
+        return released;
+    }
+
     PageInfo* AllocPage(bool canFail)
     {
         SystemDomain& dom = MySystemDomain();
 
-        dom.freeLists.lock.Lock();
-        PageInfo* page = TakePage(dom);
-        dom.freeLists.lock.Unlock();
-
+        PageInfo* page;
+        TakePages(dom, { &page, 1 });
         if (page != nullptr || canFail)
             return page;
 
-        NPK_UNREACHABLE(); //TODO: wait for a page to be available
+        //no free pages: try to evict cached pages or push some anonymous
+        //memory out to swap. This blocks on IO so it's only possible at
+        //passive ipl.
+        while (page == nullptr)
+        {
+            if (TryReclaim(ReclaimBatchSize) == 0)
+                break;
+
+            TakePages(dom, { &page, 1 });
+        }
+
+        if (page == nullptr)
+            Panic("Out of memory: no free pages and none could be reclaimed",
+                nullptr);
+
+        return page;
+    }
+
+    size_t AllocPages(sl::Span<PageInfo*> pages)
+    {
+        SystemDomain& dom = MySystemDomain();
+
+        size_t count = TakePages(dom, pages);
+        while (count < pages.Size())
+        {
+            if (TryReclaim(pages.Size() - count) == 0)
+                break;
+
+            count += TakePages(dom, pages.Subspan(count, -1));
+        }
+
+        return count;
     }
 
     void FreePage(PageInfo* page)
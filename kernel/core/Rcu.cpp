@@ -0,0 +1,298 @@
+#include <private/Core.hpp>
+
+/* Read-copy-update: readers only raise the IPL to DPC, which prevents them
+ * from being preempted or migrated, so a cpu that has context switched or
+ * returned to passive IPL can't still be inside a read-side section it
+ * started earlier. These points are reported as quiescent states by the
+ * scheduler and `LowerIpl()`.
+ * Grace periods are numbered, a grace period is complete once every online
+ * cpu has reported a quiescent state since it began. Callbacks are queued
+ * per-cpu and move through three lists: `next` (not yet waiting on a grace
+ * period), `wait` (waiting on `waitGp`) and `done` (ready to run). A single
+ * periodic DPC drives this: it advances the lists of all cpus, starts a new
+ * grace period when needed and nudges any cpus that are holding up the
+ * current one (idle cpus only report a quiescent state after an interrupt).
+ * Ready callbacks are run in batches by a work item on the cpu that queued
+ * them.
+ */
+namespace Npk
+{
+    constexpr size_t DefaultRcuIntervalMs = 4;
+    constexpr size_t RcuBatchSize = 64;
+
+    struct RcuCpuState
+    {
+        IntrSpinLock lock;
+        RcuQueue next;
+        RcuQueue wait;
+        RcuQueue done;
+        uint64_t waitGp;
+        bool workQueued;
+        WorkItem work;
+
+        sl::Atomic<uint64_t> seenGp;
+        bool online;
+        CpuId id;
+    };
+
+    struct RcuControl
+    {
+        //serializes starting grace periods and cpus coming online
+        IplSpinLock<Ipl::Dpc> lock;
+        sl::Atomic<uint64_t> current;
+        sl::Atomic<uint64_t> completed;
+        sl::Atomic<size_t> pendingCpus;
+        size_t onlineCpus;
+        //callbacks that have been queued but not yet run
+        sl::Atomic<size_t> outstanding;
+
+        sl::TimeCount interval;
+        sl::Atomic<bool> armed;
+        ClockEvent clockEvent;
+        Dpc dpc;
+    };
+
+    struct RcuWaiter
+    {
+        RcuHead head;
+        Condition complete;
+    };
+
+    static RcuControl rcu;
+
+    CPU_LOCAL(RcuCpuState, static rcuState);
+
+    CPU_LOCAL_CTOR(
+    {
+        new(rcuState.Get()) RcuCpuState {};
+    });
+
+    static void ArmRcuDriver()
+    {
+        if (rcu.interval.ticks == 0 || rcu.armed.Exchange(true))
+            return;
+
+        rcu.clockEvent.expiry = GetMonotonicTime() + rcu.interval;
+        AddClockEvent(&rcu.clockEvent);
+    }
+
+    //NOTE: assumes rcu.lock is held
+    static void NudgeLaggingCpus(uint64_t gp)
+    {
+        auto& dom = MySystemDomain();
+        for (size_t i = 0; i < dom.smpControls.Size(); i++)
+        {
+            const CpuId id = dom.smpBase + i;
+            auto* state = RemoteStatus(id)->rcu;
+            if (state == nullptr || id == MyCoreId())
+                continue;
+
+            if (state->seenGp.Load(sl::Relaxed) != gp)
+                NudgeCpu(id);
+        }
+    }
+
+    //NOTE: assumes rcu.lock is held and no grace period is in progress.
+    //Returns whether any callbacks are waiting on the next grace period.
+    static bool AdvanceCallbacks(uint64_t completed)
+    {
+        auto& dom = MySystemDomain();
+        bool needGp = false;
+
+        for (size_t i = 0; i < dom.smpControls.Size(); i++)
+        {
+            auto* state = RemoteStatus(dom.smpBase + i)->rcu;
+            if (state == nullptr)
+                continue;
+
+            state->lock.Lock();
+            if (!state->wait.Empty() && state->waitGp <= completed)
+            {
+                while (!state->wait.Empty())
+                    state->done.PushBack(state->wait.PopFront());
+            }
+            if (state->wait.Empty() && !state->next.Empty())
+            {
+                state->wait.Exchange(state->next);
+                state->waitGp = completed + 1;
+            }
+            needGp = needGp || !state->wait.Empty();
+
+            const bool runWork = !state->done.Empty() && !state->workQueued;
+            if (runWork)
+                state->workQueued = true;
+            state->lock.Unlock();
+
+            if (runWork)
+                QueueWorkItem(&state->work, state->id);
+        }
+
+        return needGp;
+    }
+
+    static void RcuDriverDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        (void)arg;
+
+        rcu.lock.Lock();
+        const uint64_t current = rcu.current.Load(sl::Relaxed);
+        const uint64_t completed = rcu.completed.Load(sl::Acquire);
+
+        if (current != completed)
+            NudgeLaggingCpus(current);
+        else if (AdvanceCallbacks(completed))
+        {
+            //pendingCpus must be visible before anyone sees the new grace
+            //period number.
+            rcu.pendingCpus.Store(rcu.onlineCpus, sl::Relaxed);
+            rcu.current.Store(completed + 1, sl::Release);
+        }
+        rcu.lock.Unlock();
+
+        rcu.armed.Store(false, sl::Release);
+        if (rcu.outstanding.Load(sl::Relaxed) != 0)
+            ArmRcuDriver();
+    }
+
+    static void RcuWork(WorkItem* item, void* arg)
+    {
+        (void)item;
+        auto& state = *static_cast<RcuCpuState*>(arg);
+
+        RcuQueue batch {};
+        state.lock.Lock();
+        for (size_t i = 0; i < RcuBatchSize && !state.done.Empty(); i++)
+            batch.PushBack(state.done.PopFront());
+        const bool more = !state.done.Empty();
+        state.workQueued = more;
+        state.lock.Unlock();
+
+        size_t count = 0;
+        while (!batch.Empty())
+        {
+            auto* head = batch.PopFront();
+            head->function(head);
+            count++;
+        }
+        rcu.outstanding.Sub(count, sl::Relaxed);
+
+        //run any remaining callbacks later, rather than monopolizing the
+        //worker thread.
+        if (more)
+            QueueWorkItem(&state.work, state.id);
+    }
+
+    static void WakeRcuWaiter(RcuHead* head)
+    {
+        auto* waiter = reinterpret_cast<RcuWaiter*>(
+            reinterpret_cast<uintptr_t>(head) - offsetof(RcuWaiter, head));
+        SetCondition(&waiter->complete);
+    }
+
+    void Private::InitRcu()
+    {
+        //callbacks would never run without the driver, so it can't be
+        //disabled.
+        size_t intervalMs = ReadConfigUint("npk.rcu.interval_ms",
+            DefaultRcuIntervalMs);
+        if (intervalMs == 0)
+            intervalMs = 1;
+        rcu.interval = sl::TimeCount(sl::Millis, intervalMs);
+
+        rcu.dpc.function = RcuDriverDpc;
+        rcu.dpc.arg = nullptr;
+        rcu.clockEvent.dpc = &rcu.dpc;
+        rcu.clockEvent.waitable = nullptr;
+
+        Log("RCU grace periods driven every %zums", LogLevel::Verbose,
+            intervalMs);
+    }
+
+    void Private::RcuOnlineCpu()
+    {
+        auto& state = *rcuState;
+        state.id = MyCoreId();
+        state.work.function = RcuWork;
+        state.work.arg = &state;
+
+        //a cpu coming online can't be inside a read-side section, so it
+        //counts as having passed through any grace period already started.
+        sl::ScopedLock scopeLock(rcu.lock);
+        state.seenGp.Store(rcu.current.Load(sl::Acquire), sl::Relaxed);
+        state.online = true;
+        rcu.onlineCpus++;
+        RemoteStatus(state.id)->rcu = &state;
+    }
+
+    void Private::RcuQuiescentState()
+    {
+        auto& state = *rcuState;
+        if (!state.online)
+            return;
+
+        const uint64_t gp = rcu.current.Load(sl::Acquire);
+        if (state.seenGp.Load(sl::Relaxed) == gp)
+            return;
+        state.seenGp.Store(gp, sl::Relaxed);
+
+        //nothing to report if no grace period is in progress.
+        if (rcu.completed.Load(sl::Acquire) == gp)
+            return;
+
+        //the grace period can't complete without this cpu, so it's still
+        //the current one. The final report completes it, the driver notices
+        //this on its next run.
+        if (rcu.pendingCpus.FetchSub(1) == 1)
+            rcu.completed.Store(gp, sl::Release);
+    }
+
+    Ipl RcuReadLock()
+    {
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        return prevIpl;
+    }
+
+    void RcuReadUnlock(Ipl prev)
+    {
+        if (prev < Ipl::Dpc)
+            LowerIpl(prev);
+    }
+
+    void RcuCall(RcuHead* head, RcuCallback function)
+    {
+        NPK_CHECK(head != nullptr, );
+        NPK_CHECK(function != nullptr, );
+
+        head->function = function;
+        rcu.outstanding.Add(1, sl::Relaxed);
+
+        //the callback lists are per-cpu, stay on this cpu while accessing
+        //them.
+        const Ipl prevIpl = RcuReadLock();
+        auto& state = *rcuState;
+        state.lock.Lock();
+        state.next.PushBack(head);
+        state.lock.Unlock();
+        RcuReadUnlock(prevIpl);
+
+        ArmRcuDriver();
+    }
+
+    void RcuSynchronize()
+    {
+        AssertIpl(Ipl::Passive);
+
+        RcuWaiter waiter {};
+        NPK_ASSERT(ResetCondition(&waiter.complete, 1) == NpkStatus::Success);
+        RcuCall(&waiter.head, WakeRcuWaiter);
+
+        WaitEntry entry {};
+        const auto result = WaitOne(&waiter.complete, &entry, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        NPK_ASSERT(result == NpkStatus::Success);
+    }
+}
@@ -0,0 +1,258 @@
+#include <private/Core.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
+#include <Vm.hpp>
+
+/* Scheduler events are recorded into a fixed-size ring per cpu, which is
+ * allocated at boot and never resized. Each slot carries a sequence number
+ * (the index it was written at, plus one) which the writer clears before
+ * filling the slot and sets once it's done, so readers on other cpus can
+ * copy a slot and then check it wasn't overwritten or still being written.
+ * Writers only ever use their own cpu's ring, slots are claimed with an
+ * atomic increment so an interrupt that records an event in the middle of
+ * another is harmless.
+ * The rings can be read with `ReadSchedTrace()`, found by a debugger via
+ * `RemoteCpuStatus::schedTrace`, or periodically written to the log (see
+ * `npk.sched.trace_dump_ms`) for `misc/SchedTraceToJson.py` to convert into
+ * a chrome trace.
+ */
+namespace Npk
+{
+    constexpr size_t DefaultTraceEntries = 4096;
+    constexpr size_t DumpBatchSize = 32;
+
+    struct SchedTraceSlot
+    {
+        sl::Atomic<uint64_t> sequence;
+        SchedTraceEntry entry;
+    };
+    //the layout is relied on by misc/SchedTraceToJson.py
+    static_assert(sizeof(SchedTraceSlot) == 32);
+
+    struct SchedTraceRing
+    {
+        sl::Atomic<uint64_t> head;
+        uint64_t mask;
+        SchedTraceSlot* slots;
+        //only accessed by the dump work item
+        uint64_t dumpCursor;
+    };
+
+    struct SchedTraceDumper
+    {
+        sl::TimeCount interval;
+        ClockEvent event;
+        Dpc dpc;
+        WorkItem work;
+    };
+
+    static SchedTraceDumper dumper;
+
+    sl::Atomic<bool> Private::schedTraceEnabled;
+
+    static const char* SchedEventStr(SchedEvent type)
+    {
+        switch (type)
+        {
+        case SchedEvent::Switch: return "switch";
+        case SchedEvent::Wake: return "wake";
+        case SchedEvent::Enqueue: return "enqueue";
+        case SchedEvent::Migrate: return "migrate";
+        case SchedEvent::Preempt: return "preempt";
+        case SchedEvent::IdleEnter: return "idle-enter";
+        case SchedEvent::IdleExit: return "idle-exit";
+        default: return "unknown";
+        }
+    }
+
+    static size_t RingSize(size_t entries)
+    {
+        return AlignUpPage(sizeof(SchedTraceRing)
+            + entries * sizeof(SchedTraceSlot));
+    }
+
+    static void DumpSchedTrace(WorkItem* item, void* arg)
+    {
+        (void)item;
+        (void)arg;
+
+        SchedTraceEntry entries[DumpBatchSize];
+        const size_t cpuCount = MySystemDomain().smpControls.Size();
+        for (size_t i = 0; i < cpuCount; i++)
+        {
+            auto status = RemoteStatus(i);
+            if (status == nullptr || status->schedTrace == nullptr)
+                continue;
+
+            auto& cursor = status->schedTrace->dumpCursor;
+            size_t count;
+            while ((count = ReadSchedTrace(i, cursor, entries)) != 0)
+            {
+                for (size_t e = 0; e < count; e++)
+                {
+                    const auto& entry = entries[e];
+                    Log("schedtrace: cpu=%u ts=%lu ev=%s thread=0x%lx "
+                        "arg=%u prio=%u", LogLevel::Verbose, entry.cpu,
+                        entry.timestamp, SchedEventStr(entry.type),
+                        entry.thread, entry.arg, entry.priority);
+                }
+            }
+        }
+
+        dumper.event.expiry = GetMonotonicTime() + dumper.interval;
+        AddClockEvent(&dumper.event);
+    }
+
+    static void DumpDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        (void)arg;
+
+        //the work item re-arms the event, so it's never queued twice.
+        QueueWorkItem(&dumper.work, MyCoreId());
+    }
+
+    void Private::InitSchedTrace(uintptr_t& virtBase)
+    {
+#ifdef NPK_HAS_SCHED_TRACE
+        size_t entries = ReadConfigUint("npk.sched.trace_entries",
+            DefaultTraceEntries);
+#else
+        size_t entries = 0;
+#endif
+        if (entries == 0)
+            return;
+
+        //round up to a power of two so indices can be masked
+        size_t rounded = 1;
+        while (rounded < entries)
+            rounded <<= 1;
+        entries = rounded;
+
+        const size_t cpuCount = MySystemDomain().smpControls.Size();
+        const size_t ringSize = RingSize(entries);
+        for (size_t i = 0; i < cpuCount; i++)
+        {
+            const uintptr_t ringBase = virtBase;
+            virtBase += ringSize;
+
+            for (uintptr_t p = ringBase; p != virtBase; p += PageSize())
+            {
+                NPK_ASSERT(SetKernelMap(p, LookupPagePaddr(AllocPage(false)),
+                    VmFlag::Write) == NpkStatus::Success);
+            }
+            sl::MemSet(reinterpret_cast<void*>(ringBase), 0, ringSize);
+
+            auto ring = reinterpret_cast<SchedTraceRing*>(ringBase);
+            ring->mask = entries - 1;
+            ring->slots = reinterpret_cast<SchedTraceSlot*>(ring + 1);
+            RemoteStatus(i)->schedTrace = ring;
+        }
+
+        const bool enabled = ReadConfigUint("npk.sched.trace", true);
+        schedTraceEnabled.Store(enabled, sl::Relaxed);
+
+        const auto conv = sl::ConvertUnits(ringSize);
+        Log("Scheduler trace rings: %zu entries (%zu.%zu %sB) per cpu, "
+            "recording %s", LogLevel::Info, entries, conv.major, conv.minor,
+            conv.prefix, enabled ? "enabled" : "disabled");
+    }
+
+    void Private::StartSchedTraceDump()
+    {
+        if (RemoteStatus(MyCoreId())->schedTrace == nullptr)
+            return;
+
+        const size_t intervalMs = ReadConfigUint("npk.sched.trace_dump_ms", 0);
+        if (intervalMs == 0)
+            return;
+
+        dumper.interval = sl::TimeCount(sl::Millis, intervalMs);
+        dumper.work.function = DumpSchedTrace;
+        dumper.work.arg = nullptr;
+        dumper.dpc.function = DumpDpc;
+        dumper.dpc.arg = nullptr;
+        dumper.event.dpc = &dumper.dpc;
+        dumper.event.waitable = nullptr;
+
+        dumper.event.expiry = GetMonotonicTime() + dumper.interval;
+        AddClockEvent(&dumper.event);
+    }
+
+    void Private::WriteSchedEvent(SchedEvent type, ThreadContext* thread,
+        uint32_t arg)
+    {
+        auto ring = RemoteStatus(MyCoreId())->schedTrace;
+        if (ring == nullptr)
+            return;
+
+        const uint64_t index = ring->head.FetchAdd(1, sl::Relaxed);
+        auto& slot = ring->slots[index & ring->mask];
+
+        //readers must not mistake a partially overwritten slot for the
+        //previous event that was stored in it.
+        slot.sequence.Store(0, sl::Relaxed);
+        sl::AtomicThreadFence(sl::Release);
+
+        slot.entry.timestamp = GetMonotonicTime().epoch;
+        slot.entry.thread = reinterpret_cast<uintptr_t>(thread);
+        slot.entry.arg = arg;
+        slot.entry.type = type;
+        slot.entry.priority = thread == nullptr ? 0 : thread->Priority();
+        slot.sequence.Store(index + 1, sl::Release);
+    }
+
+    bool SetSchedTraceEnabled(bool enabled)
+    {
+#ifdef NPK_HAS_SCHED_TRACE
+        if (RemoteStatus(MyCoreId())->schedTrace == nullptr)
+            return false;
+
+        Private::schedTraceEnabled.Store(enabled, sl::Relaxed);
+        return true;
+#else
+        (void)enabled;
+        return false;
+#endif
+    }
+
+    size_t ReadSchedTrace(CpuId cpu, uint64_t& cursor,
+        sl::Span<SchedTraceEntry> entries)
+    {
+        auto status = RemoteStatus(cpu);
+        NPK_CHECK(status != nullptr, 0);
+
+        auto ring = status->schedTrace;
+        if (ring == nullptr)
+            return 0;
+
+        const uint64_t head = ring->head.Load(sl::Acquire);
+        const uint64_t capacity = ring->mask + 1;
+        if (head - cursor > capacity)
+            cursor = head - capacity;
+
+        size_t count = 0;
+        while (cursor < head && count < entries.Size())
+        {
+            auto& slot = ring->slots[cursor & ring->mask];
+            const uint64_t sequence = slot.sequence.Load(sl::Acquire);
+            if (sequence == 0 || sequence < cursor + 1)
+                break; //still being written, try again later
+
+            if (sequence == cursor + 1)
+            {
+                entries[count] = slot.entry;
+                sl::AtomicThreadFence(sl::Acquire);
+                if (slot.sequence.Load(sl::Relaxed) == sequence)
+                {
+                    entries[count].cpu = cpu;
+                    count++;
+                }
+            }
+            //else: the slot was overwritten by a newer event, skip it.
+            cursor++;
+        }
+
+        return count;
+    }
+}
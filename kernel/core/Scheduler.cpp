@@ -1,5 +1,6 @@
 #include <private/Core.hpp>
 #include <lib/Maths.hpp>
+#include <Vm.hpp>
 
 namespace Npk
 {
@@ -7,11 +8,72 @@ namespace Npk
     constexpr uint8_t NicenessBias = 20;
     constexpr size_t PriorityScale = 4;
     constexpr size_t InteractivityThreshold = 30;
+    constexpr size_t DefaultBalanceIntervalMs = 20;
+    constexpr size_t DefaultMigrationCostUs = 500;
+    constexpr size_t DefaultTimeSliceMs = 10;
+    constexpr size_t DefaultDeadlineLimitPct = 95;
+    constexpr size_t SpareThreadDepth = 8;
+    constexpr HeapTag ThreadTag = NPK_MAKE_HEAP_TAG("Thrd");
+    constexpr size_t DeadlineShift = 20;
+    constexpr uint64_t LoadPeriodNs = 1 << 20;
+    constexpr size_t LoadHalfLife = 32;
+    //`SchedStatus::load` units for a single always-runnable thread
+    constexpr uint32_t LoadPerThread = 32;
+
+    //y^n scaled by 2^32, where y^LoadHalfLife = 0.5
+    constexpr uint32_t LoadDecayTable[LoadHalfLife] =
+    {
+        0xFFFF'FFFF, 0xFA83'B2DA, 0xF525'7D14, 0xEFE4'B99A,
+        0xEAC0'C6E6, 0xE5B9'06E6, 0xE0CC'DEEB, 0xDBFB'B796,
+        0xD744'FCC9, 0xD2A8'1D91, 0xCE24'8C14, 0xC9B9'BD85,
+        0xC567'2A10, 0xC12C'4CC9, 0xBD08'A39E, 0xB8FB'AF46,
+        0xB504'F333, 0xB123'F581, 0xAD58'3EE9, 0xA9A1'5AB4,
+        0xA5FE'D6A9, 0xA270'4302, 0x9EF5'325F, 0x9B8D'39B9,
+        0x9837'F050, 0x94F4'EFA8, 0x91C3'D373, 0x8EA4'398A,
+        0x8B95'C1E3, 0x8898'0E80, 0x85AA'C367, 0x82CD'8698,
+    };
     constexpr size_t RtQueueCount = 
         ((MaxRtPriority - MinRtPriority) >> PriorityScale) + 1;
     constexpr size_t TsQueueCount = 
         ((MaxTsPriority - MinTsPriority) >> PriorityScale) + 1;
 
+    /* Run queues are ordered by increasing priority: the idle queue, then
+     * the timeshared queues, then the realtime queues. A bitmap tracks which
+     * are non-empty, so the highest priority queue with a thread in it is
+     * found with a single bit scan. Deadline threads are kept in a tree
+     * ordered by deadline instead of a queue, but have the bitmap's next
+     * bit above the realtime queues.
+     */
+    constexpr size_t IdleQueueIndex = 0;
+    constexpr size_t TsQueueBase = IdleQueueIndex + 1;
+    constexpr size_t RtQueueBase = TsQueueBase + TsQueueCount;
+    constexpr size_t QueueCount = RtQueueBase + RtQueueCount;
+    constexpr size_t DeadlineIndex = QueueCount;
+    static_assert(DeadlineIndex < 32);
+
+    /* Scheduling domains, innermost first. A cpu's domain at each level
+     * contains its domain at the level below: SMT siblings of the same core,
+     * cpus sharing a last level cache, cpus in the same NUMA domain, and
+     * finally every cpu.
+     */
+    constexpr size_t DomainCore = 0;
+    constexpr size_t DomainLlc = 1;
+    constexpr size_t DomainNode = 2;
+    constexpr size_t DomainSystem = 3;
+    constexpr size_t DomainLevels = 4;
+
+    /* An idle cpu picks the deepest idle state it expects to stay in for
+     * long enough to be worthwhile, predicting how long it'll be idle from
+     * the next expiring clock event and a decaying average of recent idle
+     * periods (most wakeups aren't timers). If the prediction is under
+     * `npk.sched.idle_poll_us` it polls instead.
+     */
+    constexpr size_t MaxIdleStates = 8;
+    constexpr size_t DefaultIdlePollUs = 5;
+    constexpr size_t IdleAvgShift = 3;
+    constexpr size_t PollIdleState = MaxIdleStates;
+    constexpr size_t WakeLineSize = 64;
+
     union SchedStatus
     {
         uint32_t squish;
@@ -23,41 +85,127 @@ namespace Npk
         };
     };
 
-    /* TODO: list
-     * - calculate `load` for each local scheduler
-     * - topology stuff for thread selection and migration
-     * - balancing work between cpus
-     * - think about where to call UpdateInteractivity()
-     */
+    struct DeadlineLt
+    {
+        bool operator()(const ThreadContext& a, const ThreadContext& b)
+        {
+            return a.deadline.absDeadline.epoch < b.deadline.absDeadline.epoch;
+        }
+    };
+
+    using DeadlineTree = sl::RBTree<ThreadContext, 
+        &ThreadContext::deadlineHook, DeadlineLt>;
 
     struct LocalScheduler
     {
         IplSpinLock<Ipl::Dpc> queuesLock;
-        ThreadQueue rtQueues[RtQueueCount];
-        ThreadQueue tsQueues[TsQueueCount];
-        ThreadQueue idleQueue;
+        ThreadQueue queues[QueueCount];
+        DeadlineTree deadlines;
+        uint32_t queueBitmap;
 
         ThreadContext* idleThread;
         ThreadContext* prevThread;
 
-        //cleared locally, but may be set by other CPUs (see `nextThread`)
-        sl::Atomic<bool> switchPending;
-        //this is used by other CPUs in the same cohort to determine if they
-        //should preempt this cpu's running thread.
-        sl::Atomic<SchedStatus> status;
+        //these share a cache line that an idle cpu monitors, so other cpus
+        //can wake it by writing to them. Nothing else lives in the line, to
+        //avoid spurious wakeups.
+        //`switchPending` is cleared locally, but may be set by other CPUs
+        //(see `nextThread`).
+        alignas(WakeLineSize) sl::Atomic<bool> switchPending;
+        //set while idling in a state that's woken by writes to this line,
+        //in which case other cpus don't need to send an IPI.
+        sl::Atomic<bool> idleMonitoring;
         //other CPUs will place a thread here if they want us to run it.
         sl::Atomic<ThreadContext*> nextThread;
+        //this is used by other CPUs in the same cohort to determine if they
+        //should preempt this cpu's running thread.
+        alignas(WakeLineSize) sl::Atomic<SchedStatus> status;
+
+        //number of threads in the run queues, protected by `queuesLock`
+        //but read without it by other cpus looking for work to steal.
+        sl::Atomic<size_t> queued;
+        //protected by `queuesLock`, the decayed average is published via
+        //`status.load`.
+        bool runningThread;
+        LoadAverage load;
+
+        CpuId id;
+        //isolated cpus only run threads pinned to them, they're skipped when
+        //placing threads and don't steal or balance work.
+        bool isolated;
+        HwCpuTopology topology;
+        //each level is a circular list of the cpus in this cpu's domain at
+        //that level. Cpus are only ever added, under `domainsLock`.
+        sl::Atomic<LocalScheduler*> domainNext[DomainLevels];
+
+        //threads that stopped running more recently than this are assumed to
+        //still be cache-hot, and aren't stolen by other cpus.
+        uint64_t migrationCostNs;
+        sl::TimeCount balanceInterval;
+        ClockEvent balanceEvent;
+        Dpc balanceDpc;
+
+        //time slicing, `sliceEvent` is only armed while queued threads are
+        //competing with the running one. `runningIndex` is protected by
+        //`queuesLock`, the other fields are only accessed by the owning cpu
+        //(other cpus ask for the slice to be armed via `sliceRequested`).
+        uint64_t sliceNs;
+        size_t runningIndex;
+        sl::TimePoint runBegin;
+        uint64_t runningSliceNs;
+        sl::Atomic<bool> sliceArmed;
+        sl::Atomic<bool> sliceRequested;
+        ClockEvent sliceEvent;
+        Dpc sliceDpc;
+
+        //deadline of the running thread, or zero if it's not a deadline
+        //thread. Read by other cpus to decide whether to preempt it.
+        sl::Atomic<uint64_t> runningDeadline;
+        //deadline of the thread in `nextThread`, or zero if it's not a
+        //deadline thread. Written with `queuesLock` held.
+        sl::Atomic<uint64_t> nextDeadline;
+        //sum of the bandwidth of deadline threads admitted to this cpu, out
+        //of `deadlineLimit`. Both are scaled by 2^DeadlineShift.
+        sl::Atomic<uint64_t> deadlineBandwidth;
+        uint64_t deadlineLimit;
+
+        //idle governor state, only accessed by the owning cpu.
+        HwIdleState idleStates[MaxIdleStates];
+        size_t idleStateCount;
+        uint64_t idlePollNs;
+        uint64_t idleAvgNs;
     };
 
+    /* Threads that have exited are queued here by the cpu they last ran on,
+     * which queues `reaper` to process them at passive IPL. Threads created
+     * by `CreateKernelThread()` are first left for an RCU grace period, as
+     * priority inheritance may still be walking a chain that includes them,
+     * and are then placed in `graced` for the reaper to pick up again. From
+     * there they're reset and kept in `spares` (stack and all) for reuse, or
+     * freed once there are `SpareThreadDepth` spares.
+     */
     struct CleanupJobs
     {
         IntrSpinLock lock;
         ThreadQueue queue;
+        ThreadQueue graced;
+        bool reaperQueued;
+        WorkItem reaper;
+        ThreadQueue spares;
+        size_t spareCount;
     };
 
     CPU_LOCAL(LocalScheduler, static localSched);
     CPU_LOCAL(CleanupJobs, static cleanup);
+
+    static IntrSpinLock domainsLock;
     
+    //packs the source and destination cpus of a migration for tracing
+    static uint32_t MigrateArg(CpuId from, CpuId to)
+    {
+        return (static_cast<uint32_t>(from) << 16) | (to & 0xFFFF);
+    }
+
     static LocalScheduler* RemoteSched(CpuId who)
     {
         auto remoteStatus = RemoteStatus(who);
@@ -67,84 +215,192 @@ namespace Npk
         return remoteStatus->scheduler;
     }
 
-    //NOTE: assumes this queue is locked (via its parent scheduler.lock)
-    static ThreadContext* PopStealableThread(ThreadQueue& queue)
+    static uint64_t DecayLoad(uint64_t value, uint64_t periods)
     {
-        for (auto it = queue.Begin(); it != queue.End(); ++it)
-        {
-            it->scheduling.lock.Lock();
-            const bool pinned = it->scheduling.isPinned;
-            it->scheduling.lock.Unlock();
+        if (periods >= LoadHalfLife * 32)
+            return 0;
 
-            if (pinned)
-                continue;
+        value >>= periods / LoadHalfLife;
+        return (value * LoadDecayTable[periods % LoadHalfLife]) >> 32;
+    }
 
-            return &*it;
-        }
+    //folds the time since `avg` was last updated into it, assuming the state
+    //(`runnable` threads, whether one was `running`) held for all of it.
+    static void UpdateLoad(LoadAverage& avg, sl::TimePoint now, 
+        size_t runnable, bool running)
+    {
+        if (now.epoch <= avg.updated.epoch)
+            return;
 
-        return nullptr;
+        const uint64_t periods = (now.epoch - avg.updated.epoch) / LoadPeriodNs;
+        if (periods == 0)
+            return;
+        avg.updated.epoch += periods * LoadPeriodNs;
+
+        const uint64_t fill = LoadScale - DecayLoad(LoadScale, periods);
+        avg.runnable = DecayLoad(avg.runnable, periods) + runnable * fill;
+        avg.running = DecayLoad(avg.running, periods) + (running ? fill : 0);
     }
 
-    static ThreadContext* PopThread(LocalScheduler& sched, bool stealing)
+    //converts the runnable average of `avg` to `SchedStatus::load` units.
+    static uint32_t LoadUnits(const LoadAverage& avg)
     {
-        sl::ScopedLock scopeLock(sched.queuesLock);
+        return sl::Min<uint32_t>(0xFF, (avg.runnable * LoadPerThread)
+            / LoadScale);
+    }
+
+    //NOTE: assumes sched.queuesLock is held. This must be called before the
+    //number of runnable threads changes.
+    static void UpdateCpuLoad(LocalScheduler& sched)
+    {
+        const size_t runnable = sched.queued.Load(sl::Relaxed) 
+            + (sched.runningThread ? 1 : 0);
+        UpdateLoad(sched.load, GetMonotonicTime(), runnable, 
+            sched.runningThread);
+
+        const uint32_t load = LoadUnits(sched.load);
 
-        for (size_t i = RtQueueCount; i != 0; i--)
+        //other fields are updated by the owning cpu without this lock.
+        SchedStatus expected = sched.status.Load(sl::Relaxed);
+        SchedStatus desired;
+        do
         {
-            auto& queue = sched.rtQueues[i - 1];
+            if (expected.load == load)
+                return;
+            desired = expected;
+            desired.load = load;
+        }
+        while (!sched.status.CompareExchange(expected, desired));
+    }
 
-            if (queue.Empty())
-                continue;
-            if (stealing)
-                return PopStealableThread(queue);
-            return queue.PopFront();
+    static size_t HighestQueue(uint32_t bitmap)
+    {
+        return 31 - __builtin_clz(bitmap);
+    }
+
+    static size_t PriorityQueueIndex(uint8_t priority)
+    {
+        if (priority >= MinRtPriority)
+            return RtQueueBase + ((priority - MinRtPriority) >> PriorityScale);
+        if (priority >= MinTsPriority)
+            return TsQueueBase + ((priority - MinTsPriority) >> PriorityScale);
+        return IdleQueueIndex;
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held!
+    static size_t QueueIndex(ThreadContext* thread)
+    {
+        if (thread->deadline.enabled)
+            return DeadlineIndex;
+        if (thread->scheduling.isInteractive)
+            return RtQueueBase;
+        return PriorityQueueIndex(thread->Priority());
+    }
+
+    //NOTE: assumes sched.queuesLock is held
+    static void UnlinkThread(LocalScheduler& sched, ThreadContext* thread)
+    {
+        const size_t index = thread->queueInfo.index;
+        UpdateCpuLoad(sched);
+        sched.queued.Sub(1, sl::Relaxed);
+
+        bool empty;
+        if (index == DeadlineIndex)
+        {
+            sched.deadlines.Remove(thread);
+            empty = sched.deadlines.GetRoot() == nullptr;
         }
+        else
+        {
+            sched.queues[index].Remove(thread);
+            empty = sched.queues[index].Empty();
+        }
+
+        if (empty)
+            sched.queueBitmap &= ~(1u << index);
+    }
+
+    //NOTE: assumes sched.queuesLock is held. Pinned threads and those that
+    //are likely still cache-hot aren't stolen. A stolen thread is returned
+    //with its scheduling lock held and its affinity set to `thief`, so that
+    //nobody else tries to dequeue it from `sched` in the meantime.
+    static ThreadContext* PopStealableThread(LocalScheduler& sched, 
+        ThreadQueue& queue, CpuId thief)
+    {
+        const auto now = GetMonotonicTime();
 
-        for (size_t i = TsQueueCount; i != 0; i--)
+        for (auto it = queue.Begin(); it != queue.End(); ++it)
         {
-            auto& queue = sched.tsQueues[i - 1];
+            const auto& info = it->queueInfo;
+            if (info.pinned 
+                || now.epoch - info.lastRun.epoch < sched.migrationCostNs)
+                continue;
 
-            if (queue.Empty())
+            //the usual lock order is the thread's lock before the queue's,
+            //so only try for it and move on if it's busy. Whoever holds it
+            //may be about to dequeue or pin the thread.
+            ThreadContext* thread = &*it;
+            auto& data = thread->scheduling;
+            if (!data.lock.TryLock())
                 continue;
-            if (stealing)
-                return PopStealableThread(queue);
-            return queue.PopFront();
-        }
+            if (data.state != ThreadState::Ready || data.isPinned
+                || data.affinity != sched.id)
+            {
+                data.lock.Unlock();
+                continue;
+            }
 
-        if (!sched.idleQueue.Empty())
-        {
-            if (stealing)
-                return PopStealableThread(sched.idleQueue);
-            return sched.idleQueue.PopFront();
+            UnlinkThread(sched, thread);
+            Private::RecordSchedEvent(SchedEvent::Migrate, thread,
+                MigrateArg(sched.id, thief));
+            data.affinity = thief;
+            return thread;
         }
 
         return nullptr;
     }
 
-    //NOTE: assumes thread->scheduling.lock is held!
-    static ThreadQueue& GetQueue(LocalScheduler& sched, ThreadContext* thread)
+    //pops the next thread to run from `sched`'s queues, or if `thief` is
+    //given the best thread for that cpu to steal. See PopStealableThread().
+    static ThreadContext* PopThread(LocalScheduler& sched, 
+        sl::Opt<CpuId> thief = {})
     {
-        auto& data = thread->scheduling;
+        const bool stealing = thief.HasValue();
+        sl::ScopedLock scopeLock(sched.queuesLock);
 
-        if (data.isInteractive)
-            return sched.rtQueues[0];
-        else if (thread->Priority() >= MinRtPriority)
+        uint32_t bitmap = sched.queueBitmap;
+        while (bitmap != 0)
         {
-            const uint8_t index = (thread->Priority() - MinRtPriority) 
-                >> PriorityScale;
-            NPK_ASSERT(index < RtQueueCount);
-            return sched.rtQueues[index];
-        }
-        else if (thread->Priority() >= MinTsPriority)
-        {
-            const uint8_t index = (thread->Priority() - MinTsPriority) 
-                >> PriorityScale;
-            NPK_ASSERT(index < TsQueueCount);
-            return sched.tsQueues[index];
+            const size_t index = HighestQueue(bitmap);
+            bitmap &= ~(1u << index);
+
+            //deadline threads are never stolen, they stay on the cpu that
+            //admitted them.
+            if (index == DeadlineIndex)
+            {
+                if (stealing)
+                    continue;
+
+                ThreadContext* thread = sched.deadlines.First();
+                UnlinkThread(sched, thread);
+                return thread;
+            }
+
+            auto& queue = sched.queues[index];
+            ThreadContext* thread = nullptr;
+            if (stealing)
+                thread = PopStealableThread(sched, queue, *thief);
+            else
+            {
+                thread = &queue.Front();
+                UnlinkThread(sched, thread);
+            }
+
+            if (thread != nullptr)
+                return thread;
         }
-        else
-            return sched.idleQueue;
 
+        return nullptr;
     }
 
     //NOTE: assumes thread->scheduling.lock is held
@@ -210,33 +466,191 @@ namespace Npk
         data.isInteractive = GenerateScore(thread) < InteractivityThreshold;
     }
     
-    //NOTE: assumes thread->scheduling.lock is held!
+    //NOTE: assumes thread->scheduling.lock is held. Higher priority threads
+    //get longer slices. Interactive threads get the shortest, so one that
+    //turns cpu-bound is soon noticed by `UpdateInteractivity()`.
+    static uint64_t TimeSlice(const LocalScheduler& sched, 
+        ThreadContext* thread)
+    {
+        const uint64_t shortest = sched.sliceNs / 2;
+        const uint64_t longest = sched.sliceNs * 2;
+        const uint8_t priority = thread->Priority();
+
+        if (thread->scheduling.isInteractive || priority < MinTsPriority)
+            return shortest;
+        if (priority >= MinRtPriority)
+            return longest;
+
+        return shortest + ((longest - shortest) * (priority - MinTsPriority))
+            / (MaxTsPriority - MinTsPriority);
+    }
+
+    //NOTE: assumes sched.queuesLock is held. Only threads in the same or
+    //higher queues as the running thread compete with it, anything lower
+    //wouldn't be picked at the end of its slice anyway.
+    static bool HasCompetition(const LocalScheduler& sched)
+    {
+        if (!sched.runningThread)
+            return false;
+
+        return (sched.queueBitmap >> sched.runningIndex) != 0;
+    }
+
+    //asks the cpu owning `sched` to reschedule. An idle cpu monitoring its
+    //wake line notices the write to `switchPending` without an IPI.
+    static void KickScheduler(LocalScheduler& sched)
+    {
+        sched.switchPending.Store(true, sl::SeqCst);
+        if (&sched == &*localSched)
+            return;
+
+        //pairs with the idle loop setting `idleMonitoring` before it
+        //checks `switchPending`: either it sees our write, or we see it's
+        //not monitoring.
+        if (!sched.idleMonitoring.Load(sl::SeqCst))
+            NudgeCpu(sched.id);
+    }
+
+    //asks the cpu owning `sched` to arm its slice timer, it'll do this
+    //next time it returns to passive IPL.
+    static void RequestSlice(LocalScheduler& sched)
+    {
+        if (sched.sliceNs == 0 || sched.sliceArmed.Load(sl::Relaxed))
+            return;
+        if (sched.sliceRequested.Exchange(true, sl::AcqRel))
+            return;
+
+        if (&sched != &*localSched)
+            NudgeCpu(sched.id);
+    }
+
+    //NOTE: must be called at Ipl::Dpc, on the cpu owning `sched`. If the
+    //slice event is already armed (or its dpc is pending) it's left alone,
+    //`SliceDpc()` will re-evaluate things when it runs. For deadline threads
+    //the slice is their remaining budget, which is always enforced.
+    static void UpdateSlice(LocalScheduler& sched)
+    {
+        sched.sliceRequested.Store(false, sl::Relaxed);
+        if (sched.sliceArmed.Load(sl::Relaxed))
+            return;
+
+        bool arm = sched.runningDeadline.Load(sl::Relaxed) != 0;
+        if (!arm && sched.sliceNs != 0)
+        {
+            sched.queuesLock.Lock();
+            arm = HasCompetition(sched);
+            sched.queuesLock.Unlock();
+        }
+
+        if (!arm)
+            return;
+
+        sched.sliceArmed.Store(true, sl::Relaxed);
+        sched.sliceEvent.expiry = sched.runBegin 
+            + sl::TimeCount(sl::TimePoint::Frequency, sched.runningSliceNs);
+        AddClockEvent(&sched.sliceEvent);
+    }
+
+    static void SliceDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        auto& sched = *static_cast<LocalScheduler*>(arg);
+
+        sched.sliceArmed.Store(false, sl::Relaxed);
+
+        //the event may have been armed for a thread that has since stopped
+        //running, in which case start timing the slice of the current one.
+        const auto expiry = sched.runBegin 
+            + sl::TimeCount(sl::TimePoint::Frequency, sched.runningSliceNs);
+        if (GetMonotonicTime() < expiry)
+        {
+            UpdateSlice(sched);
+            return;
+        }
+
+        //a deadline thread has used its budget, it's throttled when it
+        //stops running.
+        if (sched.runningDeadline.Load(sl::Relaxed) != 0)
+        {
+            Private::RecordSchedEvent(SchedEvent::Preempt, nullptr, sched.id);
+            sched.switchPending.Store(true, sl::Release);
+            return;
+        }
+
+        sched.queuesLock.Lock();
+        const bool competing = HasCompetition(sched);
+        sched.queuesLock.Unlock();
+
+        //the running thread is placed at the back of its queue when it's
+        //preempted, so threads of equal priority take turns.
+        if (competing)
+        {
+            Private::RecordSchedEvent(SchedEvent::Preempt, nullptr, sched.id);
+            sched.switchPending.Store(true, sl::Release);
+        }
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held! Threads are queued FIFO
+    //within each queue.
     static void PushThread(LocalScheduler& sched, ThreadContext* thread)
     {
+        Private::RecordSchedEvent(SchedEvent::Enqueue, thread, sched.id);
         UpdateInteractivity(thread);
-        auto& queue = GetQueue(sched, thread);
+        const size_t index = QueueIndex(thread);
 
         sl::ScopedLock scopeLock(sched.queuesLock);
-        queue.InsertSorted(thread, [](ThreadContext* a, ThreadContext* b)
-            { return a->Priority() > b->Priority(); });
+        UpdateCpuLoad(sched);
+        thread->queueInfo.index = index;
+        thread->queueInfo.pinned = thread->scheduling.isPinned;
+        thread->queueInfo.lastRun = thread->scheduling.lastRun;
+        if (index == DeadlineIndex)
+            sched.deadlines.Insert(thread);
+        else
+            sched.queues[index].PushBack(thread);
+        sched.queueBitmap |= 1u << index;
+        sched.queued.Add(1, sl::Relaxed);
+
+        if (sched.runningThread && index >= sched.runningIndex)
+            RequestSlice(sched);
     }
 
     //NOTE: assumes thread->scheduling.lock is held!
     static void RemoveThread(LocalScheduler& sched, ThreadContext* thread)
     {
-        auto& queue = GetQueue(sched, thread);
-
         sl::ScopedLock scopeLock(sched.queuesLock);
-        queue.Remove(thread);
+        UnlinkThread(sched, thread);
     }
 
-    //NOTE: assumes thread->scheduling.lock is held!
-    static void SetNextThread(LocalScheduler& sched, ThreadContext* thread)
+    //NOTE: assumes thread->scheduling.lock is held! Stages `thread` to run
+    //next on `sched`, unless a deadline thread that's due first is already
+    //staged there, in which case `thread` is queued instead. Returns whether
+    //`thread` was staged.
+    static bool SetNextThread(LocalScheduler& sched, ThreadContext* thread)
     {
-        auto prev = sched.nextThread.Exchange(thread, sl::AcqRel);
+        const uint64_t deadline = thread->deadline.enabled
+            ? thread->deadline.absDeadline.epoch : 0;
+
+        sched.queuesLock.Lock();
+        const uint64_t staged = sched.nextDeadline.Load(sl::Relaxed);
+        const bool keep = staged != 0
+            && sched.nextThread.Load(sl::Relaxed) != nullptr
+            && (deadline == 0 || staged <= deadline);
+        ThreadContext* prev = nullptr;
+        if (!keep)
+        {
+            sched.nextDeadline.Store(deadline, sl::Relaxed);
+            prev = sched.nextThread.Exchange(thread, sl::AcqRel);
+        }
+        sched.queuesLock.Unlock();
 
+        if (keep)
+        {
+            PushThread(sched, thread);
+            return false;
+        }
         if (prev != nullptr)
             PushThread(sched, prev);
+        return true;
     }
 
     //NOTE: assumes thread->scheduling.lock is held
@@ -245,6 +659,19 @@ namespace Npk
         const SchedStatus status = sched->status.Load(sl::Acquire);
         auto& data = thread->scheduling;
 
+        //deadline threads are scheduled EDF, ahead of everything else. This
+        //includes a deadline thread already staged to run next.
+        const uint64_t staged = sched->nextDeadline.Load(sl::Relaxed);
+        if (thread->deadline.enabled)
+        {
+            const uint64_t deadline = thread->deadline.absDeadline.epoch;
+            const uint64_t running = sched->runningDeadline.Load(sl::Relaxed);
+            if (staged != 0 && staged <= deadline)
+                return false;
+            return running == 0 || deadline < running;
+        }
+        if (staged != 0)
+            return false;
         if (status.activePriority == IdlePriority)
             return true;
         if (!status.isInteractive && data.isInteractive
@@ -257,47 +684,406 @@ namespace Npk
         return false;
     }
 
+    //NOTE: assumes thread->scheduling.lock is held. Places the thread in the
+    //run queues of the cpu given by its affinity, preempting that cpu's
+    //running thread if it should.
+    static void MakeReady(ThreadContext* thread)
+    {
+        auto& data = thread->scheduling;
+        data.state = ThreadState::Ready;
+
+        auto targetSched = RemoteSched(data.affinity);
+        NPK_ASSERT(targetSched != nullptr);
+
+        //SetNextThread() queues the thread itself if it can't be staged.
+        if (!WouldPreemptOn(thread, targetSched))
+            PushThread(*targetSched, thread);
+        else if (SetNextThread(*targetSched, thread))
+        {
+            Private::RecordSchedEvent(SchedEvent::Preempt, thread, 
+                targetSched->id);
+            KickScheduler(*targetSched);
+        }
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held. Charges a deadline thread
+    //for `ranNs` of cpu time, returning whether it has used up its budget.
+    static bool ChargeDeadline(ThreadContext* thread, sl::TimePoint now,
+        uint64_t ranNs)
+    {
+        auto& dl = thread->deadline;
+
+        //don't charge for time before the current period began, which is
+        //only possible if the thread was running when it became deadline
+        //class.
+        const uint64_t periodStart = dl.absDeadline.epoch - dl.deadlineNs;
+        if (now.epoch - ranNs < periodStart)
+            ranNs = now.epoch > periodStart ? now.epoch - periodStart : 0;
+        dl.budgetNs -= static_cast<int64_t>(ranNs);
+
+        //only count each deadline as missed once
+        if (now.epoch > dl.absDeadline.epoch 
+            && dl.lastMissed.epoch != dl.absDeadline.epoch)
+        {
+            dl.lastMissed = dl.absDeadline;
+            dl.stats.missed++;
+        }
+
+        return dl.budgetNs <= 0;
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held. The thread is kept out of
+    //the run queues until its next period begins.
+    static void ThrottleThread(ThreadContext* thread)
+    {
+        auto& dl = thread->deadline;
+        dl.throttled = true;
+        dl.stats.throttled++;
+        thread->scheduling.state = ThreadState::Standby;
+
+        const uint64_t periodStart = dl.absDeadline.epoch - dl.deadlineNs;
+        dl.replenishEvent.expiry = periodStart + dl.periodNs;
+        AddClockEvent(&dl.replenishEvent);
+    }
+
+    static void ReplenishDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        auto thread = static_cast<ThreadContext*>(arg);
+        auto& dl = thread->deadline;
+
+        sl::ScopedLock threadLock(thread->scheduling.lock);
+        if (!dl.throttled)
+            return; //parameters changed while we were pending
+
+        //any overrun is paid for out of the following periods' budgets.
+        dl.throttled = false;
+        do
+        {
+            dl.absDeadline.epoch += dl.periodNs;
+            dl.budgetNs = sl::Min<int64_t>(dl.budgetNs + dl.runtimeNs, 
+                dl.runtimeNs);
+        }
+        while (dl.budgetNs <= 0);
+
+        MakeReady(thread);
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held. Reserves `bandwidth` on
+    //a cpu the thread can run on, choosing the one with the most spare
+    //deadline bandwidth. Returns `NoAffinity` if none can admit it.
+    static CpuId AdmitDeadline(ThreadContext* thread, uint64_t bandwidth)
+    {
+        auto& data = thread->scheduling;
+        auto& dom = MySystemDomain();
+        const bool pinned = data.isPinned && data.affinity != NoAffinity;
+
+        while (true)
+        {
+            LocalScheduler* best = nullptr;
+            uint64_t bestUsed = 0;
+            for (size_t i = 0; i < dom.smpControls.Size(); i++)
+            {
+                const CpuId id = dom.smpBase + i;
+                auto sched = RemoteSched(id);
+                if (sched == nullptr || (pinned && id != data.affinity))
+                    continue;
+                if (!pinned && sched->isolated)
+                    continue;
+
+                const uint64_t used = sched->deadlineBandwidth.Load(sl::Relaxed);
+                if (used + bandwidth > sched->deadlineLimit)
+                    continue;
+                if (best == nullptr || used < bestUsed)
+                {
+                    best = sched;
+                    bestUsed = used;
+                }
+            }
+
+            if (best == nullptr)
+                return NoAffinity;
+
+            //retry if someone else changed the cpu's bandwidth since we
+            //looked at it.
+            if (best->deadlineBandwidth.CompareExchange(bestUsed, 
+                bestUsed + bandwidth))
+                return best->id;
+        }
+    }
+
+    static bool SharesDomain(const LocalScheduler& a, const LocalScheduler& b,
+        size_t level)
+    {
+        const auto& ta = a.topology;
+        const auto& tb = b.topology;
+
+        switch (level)
+        {
+        case DomainCore:
+            return ta.numaDomain == tb.numaDomain
+                && ta.packageId == tb.packageId && ta.coreId == tb.coreId;
+        case DomainLlc:
+            return ta.numaDomain == tb.numaDomain
+                && ta.packageId == tb.packageId && ta.llcId == tb.llcId;
+        case DomainNode:
+            return ta.numaDomain == tb.numaDomain;
+        default:
+            return true;
+        }
+    }
+
+    //NOTE: assumes domainsLock is held
+    static void JoinDomains(LocalScheduler& sched)
+    {
+        for (size_t level = 0; level < DomainLevels; level++)
+        {
+            LocalScheduler* peer = nullptr;
+            for (CpuId cpu = 0; cpu < MySystemDomain().smpControls.Size(); 
+                cpu++)
+            {
+                auto other = RemoteSched(cpu);
+                if (other == nullptr || other == &sched)
+                    continue;
+                if (!SharesDomain(sched, *other, level))
+                    continue;
+
+                peer = other;
+                break;
+            }
+
+            //the ring may be walked concurrently, so only publish ourselves
+            //after our link is valid.
+            if (peer == nullptr)
+                sched.domainNext[level].Store(&sched, sl::Release);
+            else
+            {
+                auto next = peer->domainNext[level].Load(sl::Relaxed);
+                sched.domainNext[level].Store(next, sl::Release);
+                peer->domainNext[level].Store(&sched, sl::Release);
+            }
+        }
+    }
+
+    static bool IsIdle(const LocalScheduler& sched)
+    {
+        return sched.status.Load(sl::Relaxed).activePriority == IdlePriority;
+    }
+
+    static bool IsCoreIdle(LocalScheduler& sched)
+    {
+        LocalScheduler* it = &sched;
+        do
+        {
+            if (!IsIdle(*it))
+                return false;
+            it = it->domainNext[DomainCore].Load(sl::Acquire);
+        }
+        while (it != &sched);
+
+        return true;
+    }
+
+    struct Placement
+    {
+        LocalScheduler* idleCore;
+        LocalScheduler* idleCpu;
+        LocalScheduler* preempts;
+        LocalScheduler* leastLoaded;
+        uint8_t preemptsLoad;
+        uint8_t leastLoad;
+    };
+
+    //NOTE: assumes thread->scheduling.lock is held
+    static void ConsiderPlacement(ThreadContext* thread, LocalScheduler& sched,
+        Placement& found)
+    {
+        if (sched.isolated)
+            return;
+
+        const auto load = sched.status.Load(sl::Relaxed).load;
+
+        if (IsIdle(sched))
+        {
+            if (found.idleCore == nullptr && IsCoreIdle(sched))
+                found.idleCore = &sched;
+            else if (found.idleCpu == nullptr)
+                found.idleCpu = &sched;
+        }
+        if (load < found.leastLoad)
+        {
+            found.leastLoad = load;
+            found.leastLoaded = &sched;
+        }
+        if (WouldPreemptOn(thread, &sched) && load < found.preemptsLoad)
+        {
+            found.preemptsLoad = load;
+            found.preempts = &sched;
+        }
+    }
+
+    //NOTE: assumes thread->scheduling.lock is held. Cpus in `origin`'s
+    //domain at the level below have already been considered, so they're
+    //skipped.
+    static void ScanDomain(ThreadContext* thread, LocalScheduler& origin,
+        size_t level, Placement& found)
+    {
+        LocalScheduler* it = &origin;
+        do
+        {
+            if (level == DomainCore || !SharesDomain(origin, *it, level - 1))
+                ConsiderPlacement(thread, *it, found);
+            it = it->domainNext[level].Load(sl::Acquire);
+        }
+        while (it != &origin);
+    }
+
     //NOTE: assumes thread->scheduling.lock is held
     static CpuId SelectScheduler(ThreadContext* thread)
     {
         auto& data = thread->scheduling;
 
-        if (data.affinity != NoAffinity && data.isPinned)
+        if (data.affinity != NoAffinity 
+            && (data.isPinned || thread->deadline.enabled))
             return data.affinity;
 
-        //TODO: topology-awareness
-        CpuId leastLoadedCpu = NoAffinity;
-        CpuId preemptsOnCpu = NoAffinity;
-        uint8_t leastLoadedLoad = 0xFF;
-        uint8_t preemptsOnLoad = 0xFF;
+        auto origin = RemoteSched(MyCoreId());
+        if (origin == nullptr)
+            return data.affinity != NoAffinity ? data.affinity : MyCoreId();
+
+        //if the cpu the thread last ran on is idle and shares a cache with
+        //us, some of the thread's working set is likely still cached there.
+        if (data.affinity != NoAffinity)
+        {
+            auto prev = RemoteSched(data.affinity);
+            if (prev != nullptr && !prev->isolated && IsIdle(*prev)
+                && SharesDomain(*origin, *prev, DomainLlc))
+                return data.affinity;
+        }
+
+        //search outwards from our llc, preferring a fully idle core over an
+        //idle SMT sibling of a busy one.
+        Placement found {};
+        found.preemptsLoad = 0xFF;
+        found.leastLoad = 0xFF;
 
-        for (CpuId cpu = 0; cpu < MySystemDomain().smpControls.Size(); cpu++)
+        for (size_t level = DomainCore; level < DomainLevels; level++)
         {
-            auto sched = RemoteSched(cpu);
-            if (sched == nullptr)
+            ScanDomain(thread, *origin, level, found);
+            if (level < DomainLlc)
                 continue;
 
-            auto load = sched->status.Load(sl::Relaxed).load;
-            if (load < leastLoadedLoad)
+            if (found.idleCore != nullptr)
+                return found.idleCore->id;
+            if (found.idleCpu != nullptr)
+                return found.idleCpu->id;
+            if (found.preempts != nullptr)
+                return found.preempts->id;
+        }
+
+        //no idle cpus: only move the thread away from where it last ran if
+        //that evens out the load by more than the thread itself adds to it,
+        //otherwise it may as well keep its cache footprint.
+        if (found.leastLoaded != nullptr && data.affinity != NoAffinity)
+        {
+            auto prev = RemoteSched(data.affinity);
+            if (prev != nullptr && !prev->isolated
+                && prev->status.Load(sl::Relaxed).load
+                <= found.leastLoad + LoadUnits(data.load))
+                return data.affinity;
+        }
+        if (found.leastLoaded != nullptr)
+            return found.leastLoaded->id;
+        if (data.affinity != NoAffinity)
+            return HousekeepingCpu(data.affinity);
+        return HousekeepingCpu(MyCoreId());
+    }
+
+    //returns the most loaded cpu with at least `threshold` threads queued,
+    //from the nearest domain that has one.
+    static LocalScheduler* FindBusiest(LocalScheduler& local, size_t threshold)
+    {
+        for (size_t level = DomainCore; level < DomainLevels; level++)
+        {
+            LocalScheduler* busiest = nullptr;
+            uint8_t busiestLoad = 0;
+
+            LocalScheduler* it = local.domainNext[level].Load(sl::Acquire);
+            for (; it != &local; it = it->domainNext[level].Load(sl::Acquire))
             {
-                leastLoadedLoad = load;
-                leastLoadedCpu = cpu;
+                if (level != DomainCore && SharesDomain(local, *it, level - 1))
+                    continue;
+
+                if (it->queued.Load(sl::Relaxed) < threshold)
+                    continue;
+
+                const uint8_t load = it->status.Load(sl::Relaxed).load;
+                if (busiest == nullptr || load > busiestLoad)
+                {
+                    busiest = it;
+                    busiestLoad = load;
+                }
             }
-            if (WouldPreemptOn(thread, sched) && load < preemptsOnLoad)
+
+            if (busiest != nullptr)
+                return busiest;
+        }
+
+        return nullptr;
+    }
+
+    //an idle cpu takes any queued work it can find, otherwise only steal
+    //when the imbalance is large enough that the thread won't just end up
+    //being moved back. The stolen thread is returned with its scheduling
+    //lock held, still in the ready state but not in any run queue.
+    static ThreadContext* StealThread(LocalScheduler& local, bool idle)
+    {
+        if (local.isolated)
+            return nullptr;
+
+        const size_t localQueued = local.queued.Load(sl::Relaxed);
+        const size_t threshold = localQueued + (idle ? 1 : 2);
+
+        auto busiest = FindBusiest(local, threshold);
+        if (busiest == nullptr)
+            return nullptr;
+
+        return PopThread(*busiest, local.id);
+    }
+
+    static void ArmBalancer(LocalScheduler& sched)
+    {
+        sched.balanceEvent.expiry = GetMonotonicTime() + sched.balanceInterval;
+        AddClockEvent(&sched.balanceEvent);
+    }
+
+    static void BalanceDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        auto& sched = *static_cast<LocalScheduler*>(arg);
+
+        //this doubles as the periodic tick for the cpu's load average.
+        sched.queuesLock.Lock();
+        UpdateCpuLoad(sched);
+        sched.queuesLock.Unlock();
+
+        const bool idle = IsIdle(sched) 
+            && sched.nextThread.Load(sl::Relaxed) == nullptr;
+        auto thread = StealThread(sched, idle);
+        if (thread != nullptr)
+        {
+            if (!WouldPreemptOn(thread, &sched))
+                PushThread(sched, thread);
+            else if (SetNextThread(sched, thread))
             {
-                preemptsOnCpu = cpu;
-                preemptsOnLoad = load;
+                Private::RecordSchedEvent(SchedEvent::Preempt, thread, 
+                    sched.id);
+                sched.switchPending.Store(true, sl::Release);
             }
-
+            thread->scheduling.lock.Unlock();
         }
 
-        if (preemptsOnCpu != NoAffinity)
-            return preemptsOnCpu;
-        if (leastLoadedCpu != NoAffinity)
-            return leastLoadedCpu;
-        if (data.affinity != NoAffinity)
-            return data.affinity;
-        return MyCoreId();
+        ArmBalancer(sched);
     }
 
     static void EndYield()
@@ -306,16 +1092,51 @@ namespace Npk
         auto prevThread = localSched->prevThread;
         localSched->prevThread = nullptr;
 
-        //update scheduler's state field to represent the now-current thread
-        SchedStatus nextStatus = localSched->status.Load(sl::Acquire);
-        nextStatus.isInteractive = current->scheduling.isInteractive;
-        nextStatus.activePriority = current->Priority();
-        localSched->status.Store(nextStatus, sl::Release);
+        //update scheduler's state field to represent the now-current thread,
+        //`load` may be updated concurrently by other cpus.
+        SchedStatus expected = localSched->status.Load(sl::Acquire);
+        SchedStatus desired;
+        do
+        {
+            desired = expected;
+            desired.isInteractive = current->scheduling.isInteractive;
+            desired.activePriority = current->Priority();
+        }
+        while (!localSched->status.CompareExchange(expected, desired));
 
+        const size_t runningIndex = QueueIndex(current);
+        uint64_t sliceNs = TimeSlice(*localSched, current);
+        uint64_t runningDeadline = 0;
+        if (current->deadline.enabled)
+        {
+            sliceNs = sl::Max<int64_t>(current->deadline.budgetNs, 0);
+            runningDeadline = current->deadline.absDeadline.epoch;
+        }
+        localSched->runningDeadline.Store(runningDeadline, sl::Relaxed);
         GetCurrentThread()->scheduling.lock.Unlock();
 
-        //fixup prevThread's state
-        if (prevThread->scheduling.state == ThreadState::Executing)
+        localSched->queuesLock.Lock();
+        UpdateCpuLoad(*localSched);
+        localSched->runningThread = current != localSched->idleThread;
+        localSched->runningIndex = runningIndex;
+        localSched->queuesLock.Unlock();
+
+        //fixup prevThread's state, including charging it for the time it
+        //just spent running.
+        const auto now = GetMonotonicTime();
+        const uint64_t ranNs = now.epoch - localSched->runBegin.epoch;
+        prevThread->scheduling.lastRun = now;
+        prevThread->scheduling.runTime += ranNs;
+        UpdateLoad(prevThread->scheduling.load, now, 1, true);
+
+        bool throttle = false;
+        if (prevThread->deadline.enabled)
+            throttle = ChargeDeadline(prevThread, now, ranNs);
+
+        bool queueReaper = false;
+        if (prevThread->scheduling.state == ThreadState::Executing && throttle)
+            ThrottleThread(prevThread);
+        else if (prevThread->scheduling.state == ThreadState::Executing)
         {
             prevThread->scheduling.state = ThreadState::Ready;
 
@@ -327,17 +1148,45 @@ namespace Npk
                 //running it, put it into their queue.
                 auto remoteSched = RemoteSched(prevThread->scheduling.affinity);
                 NPK_ASSERT(remoteSched != nullptr);
+                Private::RecordSchedEvent(SchedEvent::Migrate, prevThread,
+                    MigrateArg(localSched->id, remoteSched->id));
                 PushThread(*remoteSched, prevThread);
             }
         }
         else if (prevThread->scheduling.state == ThreadState::Dead)
         {
-            sl::ScopedLock scopeLock(cleanup->lock);
-            cleanup->queue.PushBack(prevThread);
+            //give back the dead thread's share of the cpu
+            auto& dl = prevThread->deadline;
+            if (dl.enabled)
+            {
+                auto dlSched = RemoteSched(prevThread->scheduling.affinity);
+                NPK_ASSERT(dlSched != nullptr);
+                dlSched->deadlineBandwidth.Sub(dl.bandwidth, sl::Relaxed);
+                dl.enabled = false;
+            }
+
+            auto& jobs = *cleanup;
+            jobs.lock.Lock();
+            jobs.queue.PushBack(prevThread);
+            queueReaper = !jobs.reaperQueued;
+            jobs.reaperQueued = true;
+            jobs.lock.Unlock();
         }
         //else: thread state was intentionally changed, leave it.
 
         prevThread->scheduling.lock.Unlock();
+        if (queueReaper)
+            QueueWorkItem(&cleanup->reaper, localSched->id);
+
+        //start timing the new thread's slice, this only arms the slice event
+        //if other threads are competing for this cpu.
+        auto& sched = *localSched;
+        sched.runBegin = now;
+        sched.runningSliceNs = sliceNs;
+        if (sched.sliceArmed.Load(sl::Relaxed) 
+            && RemoveClockEvent(&sched.sliceEvent))
+            sched.sliceArmed.Store(false, sl::Relaxed);
+        UpdateSlice(sched);
     }
 
     static void EnterNewThread(void* arg, void(*Entry)(void*))
@@ -350,9 +1199,10 @@ namespace Npk
         NPK_UNREACHABLE();
     }
 
-    //NOTE: assumes thread->scheduling.lock is held
-    static void ThreadPriorityChanged(ThreadContext* thread, uint8_t oldBase,
-        uint8_t oldDyn)
+    //NOTE: assumes thread->scheduling.lock is held. Returns the mutex whose
+    //owner should inherit the thread's new priority, if any.
+    static Waitable* ThreadPriorityChanged(ThreadContext* thread,
+        uint8_t oldBase, uint8_t oldDyn)
     {
         const auto oldEffective = oldDyn == 0 ? oldBase : oldDyn;
         const auto effective = thread->Priority();
@@ -363,7 +1213,7 @@ namespace Npk
             NPK_UNREACHABLE();
 
         case ThreadState::Standby:
-            return;
+            return nullptr;
 
         case ThreadState::Ready:
             {
@@ -376,22 +1226,20 @@ namespace Npk
                 NPK_ASSERT(sched != nullptr);
 
                 if (sched->nextThread.Load(sl::Relaxed) == thread)
+                {
+                    sched->nextDeadline.Store(0, sl::Relaxed);
                     sched->nextThread.Store(nullptr, sl::Release);
+                }
                 else
                     RemoveThread(*sched, thread);
 
                 thread->scheduling.affinity = SelectScheduler(thread);
                 sched = RemoteSched(thread->scheduling.affinity);
 
-                if (WouldPreemptOn(thread, sched))
-                {
-                    SetNextThread(*sched, thread);
-                    sched->switchPending.Store(true, sl::Release);
-                    if (sched != &*localSched)
-                        NudgeCpu(thread->scheduling.affinity);
-                }
-                else
+                if (!WouldPreemptOn(thread, sched))
                     PushThread(*sched, thread);
+                else if (SetNextThread(*sched, thread))
+                    KickScheduler(*sched);
                 break;
             }
 
@@ -403,57 +1251,29 @@ namespace Npk
                 auto sched = RemoteSched(thread->scheduling.affinity);
                 NPK_ASSERT(sched != nullptr);
 
-                //check queues with a higher priority than the new effective
-                //priority for any threads, if one is found signal preemption.
-                bool shouldPreempt = false;
+                //check for threads in queues with a higher priority than
+                //the new effective priority, if any signal preemption.
+                const size_t index = QueueIndex(thread);
+                const uint32_t higher = ~((2u << index) - 1);
 
                 sched->queuesLock.Lock();
-                for (size_t i = oldEffective; 
-                    i >= sl::Max(MinRtPriority, effective); i--)
-                {
-                    const size_t index = (i - MinRtPriority) >> PriorityScale;
-                    if (sched->rtQueues[index].Empty())
-                        continue;
-
-                    shouldPreempt = true;
-                    break;
-                }
-
-                for (size_t i = sl::Min(oldEffective, MaxTsPriority);
-                    i >= sl::Max(MinTsPriority, effective); i--)
-                {
-                    const size_t index = (i - MinTsPriority) >> PriorityScale;
-                    if (sched->tsQueues[index].Empty())
-                        continue;
-
-                    shouldPreempt = true;
-                    break;
-                }
-
-                //also check the queue the thread would fall into for threads,
-                //this works because each queue is sorted by priority.
-                auto& queue = GetQueue(*sched, thread);
-                if (!queue.Empty() && queue.Front().Priority() > effective)
-                    shouldPreempt = true;
+                const bool shouldPreempt = (sched->queueBitmap & higher) != 0;
                 sched->queuesLock.Unlock();
 
                 if (shouldPreempt)
-                {
-                    sched->switchPending = true;
-                    if (sched != &*localSched)
-                        NudgeCpu(thread->scheduling.affinity);
-                }
+                    KickScheduler(*sched);
                 break;
             }
 
         case ThreadState::Waiting:
             break;
-            //TODO:
-            /* if the thread's effective priority is greater than the mutex
-             * holder's dynamic priority, we need to update that thread's
-             * dynPriority to match.
-             */
         }
+
+        //if the thread is blocked on a mutex its owner inherits any increase,
+        //this is left to the caller as it requires the mutex's list lock.
+        if (effective > oldEffective)
+            return thread->waiting.blockedOn;
+        return nullptr;
     }
 
     bool ResetThread(ThreadContext* thread)
@@ -468,13 +1288,21 @@ namespace Npk
 
         thread->scheduling.context = nullptr;
         thread->scheduling.affinity = NoAffinity;
+        thread->scheduling.lastRun = {};
+        thread->scheduling.load = {};
         thread->scheduling.sleepTime = 0;
         thread->scheduling.runTime = 0;
         thread->scheduling.basePriority = IdlePriority;
         thread->scheduling.dynPriority = 0;
         thread->scheduling.isPinned = false;
+        thread->waiting.blockedOn = nullptr;
         thread->scheduling.isInteractive = false;
         thread->scheduling.niceness = NicenessBias;
+        thread->deadline.enabled = false;
+        thread->deadline.throttled = false;
+        thread->deadline.stats = {};
+        if (thread->scheduling.extState != nullptr)
+            HwResetExtendedState(thread->scheduling.extState);
 
         return true;
     }
@@ -500,6 +1328,162 @@ namespace Npk
         return true;
     }
 
+    static void FreeThreadBlock(ThreadContext* thread)
+    {
+        if (thread->scheduling.extState != nullptr)
+            HwDestroyExtendedState(thread->scheduling.extState);
+        FreeKernelStack(thread->lifetime.stack);
+        PoolFreeWired(thread, sizeof(ThreadContext), ThreadTag);
+    }
+
+    //RCU callbacks can't block, so hand the thread back to the reaper.
+    static void ThreadGraceElapsed(RcuHead* head)
+    {
+        auto thread = reinterpret_cast<ThreadContext*>(
+            reinterpret_cast<uintptr_t>(head)
+            - offsetof(ThreadContext, lifetime.rcuHead));
+
+        auto& jobs = *cleanup;
+        jobs.lock.Lock();
+        jobs.graced.PushBack(thread);
+        const bool queueReaper = !jobs.reaperQueued;
+        jobs.reaperQueued = true;
+        jobs.lock.Unlock();
+
+        if (queueReaper)
+            QueueWorkItem(&jobs.reaper, MyCoreId());
+    }
+
+    static void ReapThreads(WorkItem* item, void* arg)
+    {
+        (void)item;
+        auto& jobs = *static_cast<CleanupJobs*>(arg);
+
+        ThreadQueue dead {};
+        ThreadQueue graced {};
+        jobs.lock.Lock();
+        dead.Exchange(jobs.queue);
+        graced.Exchange(jobs.graced);
+        jobs.reaperQueued = false;
+        jobs.lock.Unlock();
+
+        while (!dead.Empty())
+        {
+            auto thread = dead.PopFront();
+            if (!thread->lifetime.managed)
+                continue; //belongs to whoever prepared it
+
+            RcuCall(&thread->lifetime.rcuHead, ThreadGraceElapsed);
+        }
+
+        while (!graced.Empty())
+        {
+            auto thread = graced.PopFront();
+            NPK_ASSERT(ResetThread(thread));
+
+            //spares are reused most recently exited first, as their stacks
+            //are the most likely to still be in the cache.
+            jobs.lock.Lock();
+            const bool keep = jobs.spareCount < SpareThreadDepth;
+            if (keep)
+            {
+                jobs.spares.PushFront(thread);
+                jobs.spareCount++;
+            }
+            jobs.lock.Unlock();
+
+            if (!keep)
+                FreeThreadBlock(thread);
+        }
+    }
+
+    NpkStatus CreateKernelThread(ThreadContext** thread, uintptr_t entry, 
+        uintptr_t arg, sl::Opt<CpuId> affinity)
+    {
+        NPK_CHECK(thread != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(entry != 0, NpkStatus::InvalidArg);
+        AssertIpl(Ipl::Passive);
+
+        //we may migrate after choosing a cpu's spares, which is harmless as
+        //they're protected by the lock.
+        auto& jobs = *cleanup;
+        jobs.lock.Lock();
+        ThreadContext* created = jobs.spares.PopFront();
+        if (created != nullptr)
+            jobs.spareCount--;
+        jobs.lock.Unlock();
+
+        if (created == nullptr)
+        {
+            void* stack;
+            const auto result = AllocKernelStack(&stack);
+            if (result != NpkStatus::Success)
+                return result;
+
+            void* block = PoolAllocWired(sizeof(ThreadContext), ThreadTag);
+            if (block == nullptr)
+            {
+                FreeKernelStack(stack);
+                return NpkStatus::Shortage;
+            }
+
+            created = new(block) ThreadContext {};
+            NPK_ASSERT(ResetThread(created));
+            created->lifetime.managed = true;
+            created->lifetime.stack = stack;
+        }
+
+        const auto top = reinterpret_cast<uintptr_t>(created->lifetime.stack);
+        NPK_ASSERT(PrepareThread(created, entry, arg, top, affinity));
+        *thread = created;
+
+        return NpkStatus::Success;
+    }
+
+    NpkStatus EnableExtendedState(ThreadContext* thread)
+    {
+        NPK_CHECK(thread != nullptr, NpkStatus::InvalidArg);
+        AssertIpl(Ipl::Passive);
+
+        //allocated up front, as it can't be done while holding the lock.
+        auto state = HwCreateExtendedState();
+        if (state == nullptr)
+            return NpkStatus::Shortage;
+
+        thread->scheduling.lock.Lock();
+        auto result = NpkStatus::Success;
+        if (thread->scheduling.state != ThreadState::Dead)
+            result = NpkStatus::InUse;
+        else if (thread->scheduling.extState == nullptr)
+        {
+            thread->scheduling.extState = state;
+            state = nullptr;
+        }
+        thread->scheduling.lock.Unlock();
+
+        if (state != nullptr)
+            HwDestroyExtendedState(state);
+        return result;
+    }
+
+    void DisableExtendedState(ThreadContext* thread)
+    {
+        NPK_CHECK(thread != nullptr, );
+        AssertIpl(Ipl::Passive);
+
+        thread->scheduling.lock.Lock();
+        HwExtendedState* state = nullptr;
+        if (thread->scheduling.state == ThreadState::Dead)
+        {
+            state = thread->scheduling.extState;
+            thread->scheduling.extState = nullptr;
+        }
+        thread->scheduling.lock.Unlock();
+
+        if (state != nullptr)
+            HwDestroyExtendedState(state);
+    }
+
     void ExitThread(size_t code, void* data)
     { 
         auto thread = GetCurrentThread();
@@ -517,14 +1501,29 @@ namespace Npk
 
     void Yield()
     {
+        localSched->nextDeadline.Store(0, sl::Relaxed);
         auto next = localSched->nextThread.Exchange(nullptr, sl::Acquire);
         if (next == nullptr)
-            next = PopThread(*localSched, false);
+            next = PopThread(*localSched);
+        if (next == nullptr)
+        {
+            //a stolen thread isn't queued anywhere, so treat it as executing
+            //here until we switch to it: anyone changing its affinity or
+            //priority in the meantime will kick this cpu instead of trying
+            //to dequeue it.
+            next = StealThread(*localSched, true);
+            if (next != nullptr)
+            {
+                next->scheduling.state = ThreadState::Executing;
+                next->scheduling.lock.Unlock();
+            }
+        }
         if (next == nullptr)
             next = localSched->idleThread;
 
         auto current = GetCurrentThread();
-        NPK_ASSERT(current != next);
+        if (current == next)
+            return; //idle thread found nothing to steal
 
         //we're acquiring locks of the same rank, acquire by the lowest address
         //first to avoid deadlock.
@@ -540,10 +1539,15 @@ namespace Npk
         }
 
         SetCycleAccount(CycleAccount::Kernel); //update thread's cycle counters
+        Private::RcuQuiescentState();
+        UpdateLoad(next->scheduling.load, GetMonotonicTime(), 1, false);
         localSched->prevThread = current;
 
+        Private::RecordSchedEvent(SchedEvent::Switch, next, 
+            static_cast<uint32_t>(current->scheduling.state));
         next->scheduling.state = ThreadState::Executing;
         SetCurrentThread(next);
+        HwSwitchExtendedState(next->scheduling.extState);
         HwSwitchThread(&current->scheduling.context, next->scheduling.context);
         EndYield();
     }
@@ -556,23 +1560,37 @@ namespace Npk
         sl::ScopedLock threadLock(data.lock);
         NPK_CHECK(data.state == ThreadState::Standby, );
 
-        data.affinity = SelectScheduler(thread);
-        data.state = ThreadState::Ready;
-        UpdateInteractivity(thread);
+        auto& dl = thread->deadline;
+        if (dl.throttled)
+            return; //will be queued when its budget is replenished
 
-        auto targetSched = RemoteSched(data.affinity);
-        NPK_ASSERT(targetSched != nullptr);
+        const auto now = GetMonotonicTime();
+        UpdateLoad(data.load, now, 0, false);
 
-        if (WouldPreemptOn(thread, targetSched))
+        //constant bandwidth server wakeup rule: if the remaining budget can't
+        //be used before the current deadline without exceeding the thread's
+        //bandwidth, start a new period now.
+        if (dl.enabled)
         {
-            SetNextThread(*targetSched, thread);
-
-            targetSched->switchPending.Store(true, sl::Release);
-            if (targetSched != &*localSched)
-                NudgeCpu(data.affinity);
+            const bool expired = now.epoch >= dl.absDeadline.epoch;
+            const uint64_t left = expired ? 0 : dl.absDeadline.epoch - now.epoch;
+            if (expired || dl.budgetNs 
+                > static_cast<int64_t>((left * dl.bandwidth) >> DeadlineShift))
+            {
+                dl.absDeadline.epoch = now.epoch + dl.deadlineNs;
+                dl.budgetNs = dl.runtimeNs;
+            }
+            else if (dl.budgetNs <= 0)
+            {
+                ThrottleThread(thread);
+                return;
+            }
         }
-        else
-            PushThread(*targetSched, thread);
+
+        data.affinity = SelectScheduler(thread);
+        Private::RecordSchedEvent(SchedEvent::Wake, thread, data.affinity);
+        UpdateInteractivity(thread);
+        MakeReady(thread);
 
         threadLock.Release();
         if (CurrentIpl() == Ipl::Passive)
@@ -591,9 +1609,13 @@ namespace Npk
 
         sl::ScopedLock threadLock(data.lock);
         data.niceness = value;
-        ThreadPriorityChanged(thread, data.basePriority, data.dynPriority);
+        auto* blockedOn = ThreadPriorityChanged(thread, data.basePriority,
+            data.dynPriority);
+        const uint8_t effective = thread->Priority();
 
         threadLock.Release();
+        if (blockedOn != nullptr)
+            Private::PropagatePriority(blockedOn, effective);
         if (CurrentIpl() == Ipl::Passive)
             Private::OnPassiveRunLevel();
     }
@@ -610,13 +1632,54 @@ namespace Npk
 
         sl::ScopedLock threadLock(data.lock);
         sl::Swap(data.basePriority, value);
-        ThreadPriorityChanged(thread, value, thread->scheduling.dynPriority);
+        auto* blockedOn = ThreadPriorityChanged(thread, value,
+            thread->scheduling.dynPriority);
+        const uint8_t effective = thread->Priority();
 
         threadLock.Release();
+        if (blockedOn != nullptr)
+            Private::PropagatePriority(blockedOn, effective);
         if (CurrentIpl() == Ipl::Passive)
             Private::OnPassiveRunLevel();
     }
 
+    Waitable* Private::BoostThreadPriority(ThreadContext* thread,
+        uint8_t priority)
+    {
+        auto& data = thread->scheduling;
+        sl::ScopedLock threadLock(data.lock);
+
+        //bump the sequence even if we don't raise the priority: this boost
+        //may be what currently keeps the thread's priority where it is.
+        data.inheritSeq.Add(1, sl::Release);
+        if (priority <= thread->Priority())
+            return nullptr;
+
+        const uint8_t oldDyn = data.dynPriority;
+        data.dynPriority = priority;
+        return ThreadPriorityChanged(thread, data.basePriority, oldDyn);
+    }
+
+    bool Private::SetInheritedPriority(ThreadContext* thread, uint8_t priority,
+        uint32_t seq)
+    {
+        auto& data = thread->scheduling;
+        sl::ScopedLock threadLock(data.lock);
+
+        if (data.inheritSeq.Load(sl::Acquire) != seq)
+            return false;
+
+        const uint8_t oldDyn = data.dynPriority;
+        data.dynPriority = priority > data.basePriority ? priority : 0;
+        if (data.dynPriority != oldDyn)
+            ThreadPriorityChanged(thread, data.basePriority, oldDyn);
+
+        threadLock.Release();
+        if (CurrentIpl() == Ipl::Passive)
+            Private::OnPassiveRunLevel();
+        return true;
+    }
+
     void SetThreadAffinity(ThreadContext* thread, CpuId who)
     {
         NPK_CHECK(thread != nullptr, );
@@ -627,6 +1690,8 @@ namespace Npk
 
         auto& data = thread->scheduling;
         sl::ScopedLock threadLock(data.lock);
+        if (thread->deadline.enabled)
+            return; //stays on the cpu it was admitted to
         data.isPinned = true;
 
         const auto prevAffinity = data.affinity;
@@ -655,20 +1720,21 @@ namespace Npk
 
         if (data.state == ThreadState::Executing)
         {
-            remoteSched->switchPending.Store(true, sl::Release);
-            NudgeCpu(prevAffinity);
+            KickScheduler(*remoteSched);
         }
         else if (data.state == ThreadState::Ready)
         {
             RemoveThread(*remoteSched, thread);
+            Private::RecordSchedEvent(SchedEvent::Migrate, thread,
+                MigrateArg(prevAffinity, who));
 
             auto targetSched = RemoteSched(who);
             NPK_ASSERT(targetSched != nullptr);
 
-            if (WouldPreemptOn(thread, targetSched))
-                SetNextThread(*targetSched, thread);
-            else
+            if (!WouldPreemptOn(thread, targetSched))
                 PushThread(*targetSched, thread);
+            else
+                SetNextThread(*targetSched, thread);
         }
     }
 
@@ -682,6 +1748,124 @@ namespace Npk
         data.isPinned = false;
     }
 
+    NpkStatus SetThreadDeadline(ThreadContext* thread, 
+        const DeadlineParams* params)
+    {
+        NPK_CHECK(thread != nullptr, NpkStatus::InvalidArg);
+
+        uint64_t runtime = 0;
+        uint64_t deadline = 0;
+        uint64_t period = 0;
+        uint64_t bandwidth = 0;
+        if (params != nullptr)
+        {
+            runtime = params->runtime.Rebase(sl::TimePoint::Frequency).ticks;
+            deadline = params->deadline.Rebase(sl::TimePoint::Frequency).ticks;
+            period = params->period.Rebase(sl::TimePoint::Frequency).ticks;
+            if (runtime == 0 || runtime > deadline || deadline > period)
+                return NpkStatus::InvalidArg;
+            bandwidth = (runtime << DeadlineShift) / period;
+        }
+
+        auto& data = thread->scheduling;
+        auto& dl = thread->deadline;
+        sl::ScopedLock threadLock(data.lock);
+        if (data.state == ThreadState::Dead)
+            return NpkStatus::InvalidArg;
+
+        //admit the new bandwidth before releasing the old, so a failure
+        //leaves the thread untouched. This is pessimistic when a deadline
+        //thread is only changing its parameters.
+        CpuId cpu = NoAffinity;
+        if (params != nullptr)
+        {
+            cpu = AdmitDeadline(thread, bandwidth);
+            if (cpu == NoAffinity)
+                return NpkStatus::Shortage;
+        }
+        if (dl.enabled)
+        {
+            auto prevSched = RemoteSched(data.affinity);
+            NPK_ASSERT(prevSched != nullptr);
+            prevSched->deadlineBandwidth.Sub(dl.bandwidth, sl::Relaxed);
+        }
+
+        //take the thread out of the run queues, it's queued again once its
+        //new parameters are in place.
+        const CpuId prevAffinity = data.affinity;
+        bool requeue = false;
+        if (data.state == ThreadState::Ready)
+        {
+            auto sched = RemoteSched(data.affinity);
+            NPK_ASSERT(sched != nullptr);
+
+            if (sched->nextThread.Load(sl::Relaxed) == thread)
+            {
+                sched->nextDeadline.Store(0, sl::Relaxed);
+                sched->nextThread.Store(nullptr, sl::Release);
+            }
+            else
+                RemoveThread(*sched, thread);
+            requeue = true;
+        }
+        else if (dl.throttled)
+        {
+            //a replenish dpc that's already pending will see this and do
+            //nothing.
+            dl.throttled = false;
+            RemoveClockEvent(&dl.replenishEvent);
+            requeue = true;
+        }
+
+        dl.enabled = params != nullptr;
+        dl.runtimeNs = runtime;
+        dl.deadlineNs = deadline;
+        dl.periodNs = period;
+        dl.bandwidth = bandwidth;
+        dl.budgetNs = static_cast<int64_t>(runtime);
+        dl.absDeadline = GetMonotonicTime().epoch + deadline;
+        dl.replenishDpc.function = ReplenishDpc;
+        dl.replenishDpc.arg = thread;
+        dl.replenishEvent.dpc = &dl.replenishDpc;
+        dl.replenishEvent.waitable = nullptr;
+        if (dl.enabled)
+            data.affinity = cpu;
+
+        if (dl.enabled)
+        {
+            Log("Thread %p admitted to deadline class on cpu %zu: runtime %luns,"
+                " deadline %luns, period %luns", LogLevel::Verbose, thread,
+                cpu, runtime, deadline, period);
+        }
+
+        if (requeue)
+            MakeReady(thread);
+        else if (data.state == ThreadState::Executing)
+        {
+            //have the cpu running the thread switch away from it, at which
+            //point it's queued according to its new class (and cpu).
+            auto sched = RemoteSched(prevAffinity);
+            NPK_ASSERT(sched != nullptr);
+
+            KickScheduler(*sched);
+        }
+
+        threadLock.Release();
+        if (CurrentIpl() == Ipl::Passive)
+            Private::OnPassiveRunLevel();
+        return NpkStatus::Success;
+    }
+
+    NpkStatus GetThreadDeadlineStats(ThreadContext* thread, 
+        DeadlineStats& stats)
+    {
+        NPK_CHECK(thread != nullptr, NpkStatus::InvalidArg);
+
+        sl::ScopedLock threadLock(thread->scheduling.lock);
+        stats = thread->deadline.stats;
+        return NpkStatus::Success;
+    }
+
     sl::Opt<uint8_t> GetThreadNiceness(ThreadContext* thread)
     {
         NPK_CHECK(thread != nullptr, {});
@@ -730,13 +1914,178 @@ namespace Npk
         idle->scheduling.isPinned = true;
         idle->scheduling.lock.Unlock();
 
-        localSched->idleThread = idle;
+        auto& sched = *localSched;
+        sched.idleThread = idle;
+        sched.id = MyCoreId();
+        sched.isolated = IsCpuIsolated(sched.id);
+        HwGetMyTopology(sched.topology);
+        Log("Cpu %zu topology: package %u, core %u, thread %u, llc %u, node %u",
+            LogLevel::Verbose, sched.id, sched.topology.packageId,
+            sched.topology.coreId, sched.topology.threadId,
+            sched.topology.llcId, sched.topology.numaDomain);
+
+        sched.migrationCostNs = sl::TimeCount(sl::Micros, 
+            ReadConfigUint("npk.sched.migration_cost_us", 
+            DefaultMigrationCostUs)).Rebase(sl::TimePoint::Frequency).ticks;
+        sched.balanceInterval = sl::TimeCount(sl::Millis,
+            ReadConfigUint("npk.sched.balance_interval_ms",
+            DefaultBalanceIntervalMs));
+        sched.balanceDpc.function = BalanceDpc;
+        sched.balanceDpc.arg = &sched;
+        sched.balanceEvent.dpc = &sched.balanceDpc;
+        sched.balanceEvent.waitable = nullptr;
+
+        sched.deadlineLimit = (sl::Min<size_t>(100, 
+            ReadConfigUint("npk.sched.deadline_limit_pct", 
+            DefaultDeadlineLimitPct)) << DeadlineShift) / 100;
+        sched.sliceDpc.function = SliceDpc;
+        sched.sliceDpc.arg = &sched;
+        sched.sliceEvent.dpc = &sched.sliceDpc;
+        sched.sliceEvent.waitable = nullptr;
+        cleanup->reaper.function = ReapThreads;
+        cleanup->reaper.arg = &*cleanup;
+
+        sched.idleStateCount = HwGetIdleStates(sched.idleStates);
+        NPK_ASSERT(sched.idleStateCount != 0);
+        sched.idlePollNs = sl::TimeCount(sl::Micros,
+            ReadConfigUint("npk.sched.idle_poll_us", DefaultIdlePollUs))
+            .Rebase(sl::TimePoint::Frequency).ticks;
+        //until there's some history, allow any state the timers allow.
+        sched.idleAvgNs = 
+            sched.idleStates[sched.idleStateCount - 1].targetResidency;
+        Log("Cpu %zu has %zu idle states, monitored wakeups %s", 
+            LogLevel::Verbose, sched.id, sched.idleStateCount,
+            sched.idleStates[0].wakesOnWrite ? "supported" : "unsupported");
+
+        sl::ScopedLock scopeLock(domainsLock);
+        JoinDomains(sched);
+        RemoteStatus(sched.id)->scheduler = &sched;
+    }
+
+    void Private::StartSchedulerTimers()
+    {
+        auto& sched = *localSched;
 
-        RemoteStatus(MyCoreId())->scheduler = &*localSched;
+        //time slicing stays disabled (`sliceNs == 0`) until now, as the
+        //slice event can't be armed before this cpu's clock is ready.
+        sched.sliceNs = sl::TimeCount(sl::Millis, 
+            ReadConfigUint("npk.sched.timeslice_ms", DefaultTimeSliceMs))
+            .Rebase(sl::TimePoint::Frequency).ticks;
+
+        if (sched.balanceInterval.ticks != 0 && !sched.isolated)
+            ArmBalancer(sched);
+    }
+
+    //NOTE: must be called with interrupts disabled. Returns the index of the
+    //deepest idle state worth entering, or `PollIdleState`.
+    static size_t SelectIdleState(LocalScheduler& sched, sl::TimePoint now,
+        sl::TimePoint nextEvent)
+    {
+        uint64_t predicted = 0;
+        if (nextEvent.epoch > now.epoch)
+            predicted = nextEvent.epoch - now.epoch;
+        predicted = sl::Min(predicted, sched.idleAvgNs);
+
+        if (predicted < sched.idlePollNs)
+            return PollIdleState;
+
+        size_t index = 0;
+        for (size_t i = 1; i < sched.idleStateCount; i++)
+        {
+            if (sched.idleStates[i].targetResidency > predicted)
+                break;
+            index = i;
+        }
+
+        return index;
+    }
+
+    //NOTE: must be called with interrupts disabled, they're enabled when
+    //this returns. Spins until `switchPending` is set or the poll time
+    //runs out, in which case the shallowest idle state is used instead.
+    static void PollIdle(LocalScheduler& sched, sl::TimePoint begin)
+    {
+        IntrsOn();
+        const uint64_t pollEnd = begin.epoch + sched.idlePollNs;
+        while (!sched.switchPending.Load(sl::Relaxed))
+        {
+            if (GetMonotonicTime().epoch >= pollEnd)
+                break;
+            sl::HintSpinloop();
+        }
+        if (sched.switchPending.Load(sl::Relaxed))
+            return;
+
+        //no write can be missed while `idleMonitoring` changes, as
+        //`HwEnterIdle()` checks `switchPending` again.
+        IntrsOff();
+        const auto& state = sched.idleStates[0];
+        sched.idleMonitoring.Store(state.wakesOnWrite, sl::SeqCst);
+        HwEnterIdle(state, &sched.switchPending);
+    }
+
+    void Private::IdleLoop()
+    {
+        AssertIpl(Ipl::Passive);
+
+        //the idle thread is pinned, so this is always our scheduler.
+        auto& sched = *localSched;
+        while (true)
+        {
+            IntrsOff();
+            if (sched.switchPending.Load(sl::Relaxed))
+            {
+                IntrsOn();
+                OnPassiveRunLevel();
+                continue;
+            }
+
+            //there's no reason to wake an idle cpu for RCU if it's already
+            //reported a quiescent state for the current grace period.
+            RcuQuiescentState();
+
+            const auto begin = GetMonotonicTime();
+            const auto nextEvent = NextLocalClockExpiry();
+            const size_t index = SelectIdleState(sched, begin, nextEvent);
+            RecordSchedEvent(SchedEvent::IdleEnter, nullptr, index);
+
+            if (index == PollIdleState)
+            {
+                sched.idleMonitoring.Store(true, sl::SeqCst);
+                PollIdle(sched, begin);
+            }
+            else
+            {
+                const auto& state = sched.idleStates[index];
+                sched.idleMonitoring.Store(state.wakesOnWrite, sl::SeqCst);
+                HwEnterIdle(state, &sched.switchPending);
+            }
+            sched.idleMonitoring.Store(false, sl::Relaxed);
+            RecordSchedEvent(SchedEvent::IdleExit, nullptr, index);
+
+            //an interrupt that woke us may have switched to another thread
+            //before we got here, the timer would have ended the idle period
+            //anyway so that's as long as we count it.
+            const auto end = GetMonotonicTime();
+            uint64_t idleNs = sl::Min(end.epoch, nextEvent.epoch);
+            idleNs = idleNs > begin.epoch ? idleNs - begin.epoch : 0;
+            sched.idleAvgNs += (idleNs >> IdleAvgShift) 
+                - (sched.idleAvgNs >> IdleAvgShift);
+
+            OnPassiveRunLevel();
+        }
     }
 
     void Private::OnPassiveRunLevel()
     {
+        if (localSched->sliceRequested.Load(sl::Relaxed))
+        {
+            //lowering the IPL brings us back here, with the request cleared.
+            RaiseIpl(Ipl::Dpc);
+            UpdateSlice(*localSched);
+            LowerIpl(Ipl::Passive);
+        }
+
         auto& sched = *localSched;
 
         if (sched.switchPending.Exchange(false, sl::Acquire))
@@ -767,7 +2116,7 @@ namespace Npk
         auto& data = thread->scheduling;
 
         data.lock.Lock();
-        data.sleepTime = sleepEnd.epoch - data.sleepBegin.epoch;
+        data.sleepTime += sleepEnd.epoch - data.sleepBegin.epoch;
         data.state = ThreadState::Standby;
         data.lock.Unlock();
     }
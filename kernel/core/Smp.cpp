@@ -13,6 +13,8 @@ namespace Npk
     static void* freezeArg;
     static void (*freezeCommand)(void* arg);
 
+    CPU_LOCAL(bool, static localIsolated);
+
     static inline SmpControl* GetControl(CpuId who)
     {
         auto& dom = MySystemDomain();
@@ -93,6 +95,26 @@ namespace Npk
         return &control->status;
     }
 
+    bool IsCpuIsolated(CpuId who)
+    {
+        //checked by `Log()`, so this must work before the cpu is fully up.
+        if (who == MyCoreId())
+            return *localIsolated;
+
+        auto control = GetControl(who);
+        return control != nullptr && control->status.isolated;
+    }
+
+    CpuId HousekeepingCpu(CpuId who)
+    {
+        //prefer the nearest lower-numbered cpu, which is likely to be in the
+        //same package.
+        while (who != 0 && IsCpuIsolated(who))
+            who--;
+
+        return who;
+    }
+
     void SendMail(CpuId who, SmpMail* mail)
     {
         NPK_CHECK(mail != nullptr, );
@@ -273,6 +295,25 @@ namespace Npk::Private
         myNodeLocals = addr;
     }
 
+    void InitCpuIsolation()
+    {
+        const CpuId me = MyCoreId();
+        if (!ReadConfigListHas("npk.smp.isolated_cpus", me))
+            return;
+
+        //someone has to do the housekeeping.
+        if (me == 0)
+        {
+            Log("Cpu 0 can't be isolated, ignoring it.", LogLevel::Warning);
+            return;
+        }
+
+        localIsolated = true;
+        RemoteStatus(me)->isolated = true;
+        Log("Cpu %zu is isolated, cpu %zu will do its housekeeping.",
+            LogLevel::Info, me, HousekeepingCpu(me));
+    }
+
     uintptr_t MyNodeLocals()
     {
         return *myNodeLocals;
@@ -1,4 +1,5 @@
 #include <private/Core.hpp>
+#include <lib/Maths.hpp>
 
 /* Wait component design:
  * - 3 main phase: mark waitable as pending, process pending waitables (wake
@@ -23,6 +24,10 @@ namespace Npk
     };
     static_assert(sizeof(SxMutexState) == sizeof(size_t));
 
+    //limits how far a boost is passed along a chain of blocked owners, this
+    //also stops a deadlocked cycle of owners being walked forever.
+    constexpr size_t MaxInheritanceDepth = 8;
+
     CPU_LOCAL(WaitableMpScQueue, static pendingWaitables);
 
     CPU_LOCAL_CTOR(
@@ -164,6 +169,120 @@ namespace Npk
         }
     }
 
+    static bool HasOwner(Waitable* what)
+    {
+        return what->type == WaitableType::Mutex
+            || what->type == WaitableType::SxMutex;
+    }
+
+    //NOTE: assumes what->listLock is held
+    static uint8_t MaxWaiterPriority(Waitable* what)
+    {
+        uint8_t priority = 0;
+        auto& waiters = what->waitersList;
+        for (auto it = waiters.Begin(); it != waiters.End(); ++it)
+            priority = sl::Max(priority, it->thread->Priority());
+
+        return priority;
+    }
+
+    void Private::PropagatePriority(Waitable* mutex, uint8_t priority)
+    {
+        //the walk runs at Ipl::Dpc so any owner we find can't be reaped
+        //before we're done with it, and each owner is only touched while
+        //the lock of the mutex it holds is, so it can't release it.
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        for (size_t i = 0; i < MaxInheritanceDepth; i++)
+        {
+            if (mutex == nullptr || !HasOwner(mutex))
+                break;
+
+            mutex->listLock.Lock();
+            Waitable* next = nullptr;
+            if (mutex->owner != nullptr)
+                next = BoostThreadPriority(mutex->owner, priority);
+            mutex->listLock.Unlock();
+
+            mutex = next;
+        }
+
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+    }
+
+    //takes ownership of `mutex` for the current thread, inheriting the
+    //priority of anyone already waiting on it.
+    static void TakeOwnership(Waitable* mutex)
+    {
+        auto* thread = GetCurrentThread();
+
+        mutex->listLock.Lock();
+        mutex->owner = thread;
+        const uint8_t priority = MaxWaiterPriority(mutex);
+        mutex->listLock.Unlock();
+
+        thread->waiting.lock.Lock();
+        thread->waiting.heldMutexes.PushBack(mutex);
+        thread->waiting.lock.Unlock();
+        if (priority > thread->Priority())
+            Private::PropagatePriority(mutex, priority);
+    }
+
+    //gives up ownership of `mutex`, the owner's inherited priority is
+    //recalculated from the mutexes it still holds. This may be called by a
+    //thread other than the owner, so the owner's list of held mutexes is
+    //only accessed with its `waiting.lock` held.
+    //NOTE: the locks involved are Dpc spinlocks, so this must not be called
+    //above Ipl::Dpc.
+    static void DropOwnership(Waitable* mutex)
+    {
+        //like PropagatePriority(), run at Ipl::Dpc so the owner can't be
+        //reaped while we're looking at it.
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        mutex->listLock.Lock();
+        auto* thread = mutex->owner;
+        mutex->owner = nullptr;
+        mutex->listLock.Unlock();
+
+        if (thread != nullptr)
+        {
+            auto& held = thread->waiting.heldMutexes;
+            thread->waiting.lock.Lock();
+            held.Remove(mutex);
+            thread->waiting.lock.Unlock();
+
+            //retry if the owner is boosted while we're looking at the
+            //waiters, otherwise we might discard that boost.
+            while (true)
+            {
+                const auto seq = thread->scheduling.inheritSeq.Load(
+                    sl::Acquire);
+
+                uint8_t priority = 0;
+                thread->waiting.lock.Lock();
+                for (auto it = held.Begin(); it != held.End(); ++it)
+                {
+                    it->listLock.Lock();
+                    priority = sl::Max(priority, MaxWaiterPriority(&*it));
+                    it->listLock.Unlock();
+                }
+                thread->waiting.lock.Unlock();
+
+                if (Private::SetInheritedPriority(thread, priority, seq))
+                    break;
+            }
+        }
+
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+    }
+
     NpkStatus CancelWait(ThreadContext* thread)
     {
         if (thread == nullptr)
@@ -389,6 +508,25 @@ namespace Npk
 
         }
 
+        //the owners of any mutexes we're about to block on inherit our
+        //priority. Only a single mutex is recorded as what we're blocked on,
+        //so boosts through a wait on several mutexes aren't passed along
+        //any further.
+        if (!satisfied)
+        {
+            if (what.Size() == 1 && HasOwner(what[0]))
+            {
+                sl::ScopedLock scopeLock(thread->scheduling.lock);
+                waiter.blockedOn = what[0];
+            }
+
+            for (size_t i = 0; i < what.Size(); i++)
+            {
+                if (HasOwner(what[i]))
+                    Private::PropagatePriority(what[i], thread->Priority());
+            }
+        }
+
         Dpc wakeDpc {};
         wakeDpc.arg = thread;
         wakeDpc.function = WakeThreadDpc;
@@ -472,6 +610,12 @@ namespace Npk
         
         //3. cleanup. We're done here (for whatever result), undo any
         //linkages made in the setup phase.
+        if (waiter.blockedOn != nullptr)
+        {
+            sl::ScopedLock scopeLock(thread->scheduling.lock);
+            waiter.blockedOn = nullptr;
+        }
+
         for (size_t i = 0; i < what.Size(); i++)
         {
             auto& entry = entries[i];
@@ -693,7 +837,7 @@ namespace Npk
         if (result != NpkStatus::Success)
             return result;
 
-        mutex->owner = GetCurrentThread();
+        TakeOwnership(mutex);
 
         return result;
     }
@@ -704,8 +848,9 @@ namespace Npk
             return;
         if (mutex->type != WaitableType::Mutex)
             return;
+        NPK_ASSERT(CurrentIpl() <= Ipl::Dpc);
 
-        mutex->owner = nullptr;
+        DropOwnership(mutex);
         mutex->tickets.Add(1, sl::Release);
         QueueWaitable(mutex);
     }
@@ -744,7 +889,7 @@ namespace Npk
         if (result != NpkStatus::Success)
             return result;
 
-        mutex->owner = GetCurrentThread();
+        TakeOwnership(mutex);
 
         return result;
     }
@@ -781,8 +926,9 @@ namespace Npk
             return;
         if (mutex->type != WaitableType::SxMutex)
             return;
+        NPK_ASSERT(CurrentIpl() <= Ipl::Dpc);
 
-        mutex->owner = nullptr;
+        DropOwnership(mutex);
 
         auto tickets = mutex->tickets.Load(sl::Acquire);
         while (true)
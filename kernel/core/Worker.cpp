@@ -9,6 +9,7 @@ namespace Npk
         CpuId target = MyCoreId();
         if (who.HasValue())
             target = *who;
+        target = HousekeepingCpu(target);
 
         auto status = RemoteStatus(target);
         NPK_CHECK(status != nullptr, );
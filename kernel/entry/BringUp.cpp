@@ -379,8 +379,10 @@ R"(                                             888                      )"
                 ctorCount == 1 ? "" : "s");
         }
 
+        Private::InitCpuIsolation();
         Private::InitLocalScheduler(idle);
         SetCurrentThread(idle);
+        Private::RcuOnlineCpu();
         Log("Cpu %zu is online and available.", LogLevel::Info, MyCoreId());
     }
 
@@ -457,6 +459,8 @@ R"(                                             888                      )"
         const auto smpData = InitPerCpuData(virtBase);
         ArchInitFull(virtBase);
         PlatInitFull(virtBase);
+        Private::InitRcu();
+        Private::InitSchedTrace(virtBase);
         HwBootAps(virtBase, smpData);
         InitDebugger(virtBase);
 
@@ -476,6 +480,8 @@ R"(                                             888                      )"
 
         //6. BSP initialization is complete.
         Log("BSP init done, loading init program.", LogLevel::Trace);
+        Private::StartSchedulerTimers();
+        Private::StartSchedTraceDump();
         IntrsOn();
 
         //7. Load userspace init program.
@@ -487,7 +493,6 @@ R"(                                             888                      )"
         }
 
         Log("Init program loaded, entering idle thread.", LogLevel::Trace);
-        while (true)
-            WaitForIntr();
+        Private::IdleLoop();
     }
 }
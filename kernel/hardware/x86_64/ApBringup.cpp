@@ -1,4 +1,5 @@
 #include <private/Entry.hpp>
+#include <private/Core.hpp>
 #include <hardware/x86_64/Cpuid.hpp>
 #include <hardware/x86_64/LocalApic.hpp>
 #include <hardware/x86_64/Private.hpp>
@@ -58,11 +59,11 @@ namespace Npk
         BringCpuOnline(&idleContext);
         CalibrateTsc();
         NPK_ASSERT(InitApLapic());
+        Private::StartSchedulerTimers();
 
         Log("AP init thread done, becoming idle thread.", LogLevel::Verbose);
         IntrsOn();
-        while (true)
-            WaitForIntr();
+        Private::IdleLoop();
     }
 
     static bool TryStartAp(uint32_t lapicId, BootInfo* bootInfo, 
@@ -144,8 +144,7 @@ namespace Npk
                 ReadMsr(Msr::CStar), ReadMsr(Msr::SFMask));
         }
 
-        //TODO: fixups: sse, xsave
-        
+        InitExtendedState();
         InitMachineChecking();
     }
 
@@ -199,6 +198,7 @@ namespace Npk
         NPK_ASSERT(InitBspLapic(virtBase));
         InitRefTimers(virtBase);
         CalibrateTsc();
+        ConfigureExtendedState();
 
         if (CpuHasFeature(CpuFeature::VGuest))
             hasPvClocks = TryInitPvClocks(virtBase);
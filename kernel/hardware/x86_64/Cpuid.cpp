@@ -51,6 +51,7 @@ namespace Npk
         { .leaf {1, 0}, .index = 'd', .shift = 19, .name = "clflush" },
         { .leaf {7, 0}, .index = 'b', .shift = 23, .name = "clflushopt" },
         { .leaf {7, 0}, .index = 'b', .shift = 24, .name = "clwb" },
+        { .leaf {1, 0}, .index = 'c', .shift = 3, .name = "mwait" },
     };
 
     static_assert(sizeof(accessors) / sizeof(CpuFeatureAccessor) 
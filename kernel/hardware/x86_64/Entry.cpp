@@ -44,7 +44,7 @@ namespace Npk
             break;
 
         case 0x7: //device (fpu/vpu) not available
-            NotifyOfBadOp();
+            HandleDeviceNotAvailable(frame);
             suppressEoi = true;
             break;
 
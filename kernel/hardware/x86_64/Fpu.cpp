@@ -0,0 +1,328 @@
+#include <hardware/x86_64/Private.hpp>
+#include <hardware/x86_64/Cpuid.hpp>
+#include <hardware/x86_64/Msr.hpp>
+#include <Core.hpp>
+#include <Vm.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+
+/* Extended state (the x87, sse, avx and avx-512 registers) isn't saved by
+ * `HwSwitchThread()`, threads that use it have a separate area created by
+ * `HwCreateExtendedState()`. Areas are sized from cpuid leaf 0xD and saved
+ * with the best instruction available: xsaves (compacted format), xsaveopt,
+ * xsave, and finally fxsave. Xsaves and xsaveopt skip components that are
+ * in their initial state, or that haven't been modified since they were
+ * last restored from the same area, so saving a thread that hasn't touched
+ * its vector registers is cheap.
+ *
+ * Each cpu tracks which area its registers were last loaded from (`owner`)
+ * and whether they may have been modified since (`dirty`). Dirty registers
+ * are always saved when their thread is switched out, as it may be resumed
+ * on another cpu. Restoring is either eager, when the thread is switched in,
+ * or lazy (`npk.x86.lazy_fpu`): cr0.TS is set on each switch so the first
+ * fpu/simd instruction the thread executes raises #NM, which restores its
+ * state. Nothing is restored if the registers still hold the thread's
+ * state from the last time it ran on this cpu.
+ * The kernel is built without simd, kernel code can only use these
+ * registers between `HwBeginKernelSimd()` and `HwEndKernelSimd()`.
+ */
+namespace Npk
+{
+    constexpr HeapTag FpuHeapTag = NPK_MAKE_HEAP_TAG("Fpu ");
+    constexpr CpuId NoCpu = static_cast<CpuId>(~0);
+    constexpr size_t ExtStateAlign = 64;
+    constexpr size_t LegacyAreaSize = 512;
+    constexpr size_t FcwOffset = 0;
+    constexpr size_t MxcsrOffset = 24;
+    constexpr size_t XcompBvOffset = LegacyAreaSize + 8;
+    constexpr uint64_t XcompBvCompacted = 1ull << 63;
+    constexpr uint16_t DefaultFcw = 0x37F;
+    constexpr uint32_t DefaultMxcsr = 0x1F80;
+    constexpr uint64_t LegacyComponents = 0b11; //x87 and sse
+    constexpr uint64_t AvxComponent = 1 << 2;
+    constexpr uint64_t Avx512Components = 0b111 << 5;
+
+    enum class SaveMethod
+    {
+        FxSave,
+        XSave,
+        XSaveOpt,
+        XSaves,
+    };
+
+    struct HwExtendedState
+    {
+        //the cpu whose registers were last loaded from `area`
+        CpuId loadedCpu;
+        uint8_t* area;
+    };
+
+    struct FpuCpuState
+    {
+        HwExtendedState* owner;
+        bool dirty;
+        bool tsSet;
+        bool inKernelSimd;
+    };
+
+    static SaveMethod saveMethod;
+    static uint64_t xcr0;
+    static size_t areaSize;
+    static bool lazyRestore;
+
+    CPU_LOCAL(FpuCpuState, static fpuState);
+
+    CPU_LOCAL_CTOR(
+    {
+        new(fpuState.Get()) FpuCpuState {};
+        fpuState->tsSet = true; //set by `CommonCpuSetup()`
+    });
+
+    static const char* SaveMethodStr(SaveMethod method)
+    {
+        switch (method)
+        {
+        case SaveMethod::FxSave: return "fxsave";
+        case SaveMethod::XSave: return "xsave";
+        case SaveMethod::XSaveOpt: return "xsaveopt";
+        case SaveMethod::XSaves: return "xsaves";
+        default: return "unknown";
+        }
+    }
+
+    static size_t AllocationSize()
+    {
+        return sizeof(HwExtendedState) + ExtStateAlign + areaSize;
+    }
+
+    static void SaveArea(HwExtendedState* state)
+    {
+        const uint32_t low = xcr0;
+        const uint32_t high = xcr0 >> 32;
+
+        switch (saveMethod)
+        {
+        case SaveMethod::FxSave:
+            asm volatile("fxsave64 (%0)" :: "r"(state->area) : "memory");
+            break;
+        case SaveMethod::XSave:
+            asm volatile("xsave64 (%0)" :: "r"(state->area), "a"(low),
+                "d"(high) : "memory");
+            break;
+        case SaveMethod::XSaveOpt:
+            asm volatile("xsaveopt64 (%0)" :: "r"(state->area), "a"(low),
+                "d"(high) : "memory");
+            break;
+        case SaveMethod::XSaves:
+            asm volatile("xsaves64 (%0)" :: "r"(state->area), "a"(low),
+                "d"(high) : "memory");
+            break;
+        }
+    }
+
+    static void RestoreArea(HwExtendedState* state)
+    {
+        const uint32_t low = xcr0;
+        const uint32_t high = xcr0 >> 32;
+
+        switch (saveMethod)
+        {
+        case SaveMethod::FxSave:
+            asm volatile("fxrstor64 (%0)" :: "r"(state->area) : "memory");
+            break;
+        case SaveMethod::XSave:
+        case SaveMethod::XSaveOpt:
+            asm volatile("xrstor64 (%0)" :: "r"(state->area), "a"(low),
+                "d"(high) : "memory");
+            break;
+        case SaveMethod::XSaves:
+            asm volatile("xrstors64 (%0)" :: "r"(state->area), "a"(low),
+                "d"(high) : "memory");
+            break;
+        }
+    }
+
+    static void SetTs(FpuCpuState& cpu)
+    {
+        if (cpu.tsSet)
+            return;
+
+        WRITE_CR(0, READ_CR(0) | (1 << 3));
+        cpu.tsSet = true;
+    }
+
+    static void ClearTs(FpuCpuState& cpu)
+    {
+        if (!cpu.tsSet)
+            return;
+
+        asm volatile("clts" ::: "memory");
+        cpu.tsSet = false;
+    }
+
+    //loads `state` into this cpu's registers, unless they already hold it.
+    static void LoadArea(FpuCpuState& cpu, HwExtendedState* state)
+    {
+        ClearTs(cpu);
+
+        const CpuId me = MyCoreId();
+        if (cpu.owner != state || state->loadedCpu != me)
+        {
+            RestoreArea(state);
+            cpu.owner = state;
+            state->loadedCpu = me;
+        }
+        cpu.dirty = true;
+    }
+
+    void InitExtendedState()
+    {
+        if (!CpuHasFeature(CpuFeature::XSave))
+        {
+            saveMethod = SaveMethod::FxSave;
+            xcr0 = LegacyComponents;
+            areaSize = LegacyAreaSize;
+            return;
+        }
+
+        CpuidLeaf data {};
+        DoCpuid(0xD, 0, data);
+        const uint64_t supported = data.a 
+            | (static_cast<uint64_t>(data.d) << 32);
+
+        //avx-512 needs avx, and all three of its components enabled together.
+        xcr0 = supported & (LegacyComponents | AvxComponent | Avx512Components);
+        if ((xcr0 & AvxComponent) == 0
+            || (xcr0 & Avx512Components) != Avx512Components)
+            xcr0 &= ~Avx512Components;
+        asm volatile("xsetbv" :: "c"(0), "a"(static_cast<uint32_t>(xcr0)),
+            "d"(static_cast<uint32_t>(xcr0 >> 32)));
+
+        //ebx of subleaf 0 reflects the components now enabled in xcr0.
+        areaSize = DoCpuid(0xD, 0, data).b;
+        saveMethod = SaveMethod::XSave;
+
+        DoCpuid(0xD, 1, data);
+        if (data.a & (1 << 3))
+        {
+            //no supervisor components are used, so the compacted area only
+            //covers xcr0.
+            WriteMsr(Msr::Xss, 0);
+            areaSize = DoCpuid(0xD, 1, data).b;
+            saveMethod = SaveMethod::XSaves;
+        }
+        else if (data.a & (1 << 0))
+            saveMethod = SaveMethod::XSaveOpt;
+    }
+
+    void ConfigureExtendedState()
+    {
+        lazyRestore = ReadConfigUint("npk.x86.lazy_fpu", false);
+
+        Log("Extended state: %zu bytes per thread, xcr0=0x%lx, saved with %s, "
+            "%s restore", LogLevel::Verbose, areaSize, xcr0,
+            SaveMethodStr(saveMethod), lazyRestore ? "lazy" : "eager");
+    }
+
+    void HandleDeviceNotAvailable(TrapFrame* frame)
+    {
+        auto& cpu = *fpuState;
+        NPK_ASSERT(!cpu.inKernelSimd);
+
+        auto thread = GetCurrentThread();
+        if (thread == nullptr || thread->scheduling.extState == nullptr)
+            Panic("Fpu/simd used by a thread without extended state", frame);
+
+        LoadArea(cpu, thread->scheduling.extState);
+    }
+
+    HwExtendedState* HwCreateExtendedState()
+    {
+        void* ptr = PoolAllocWired(AllocationSize(), FpuHeapTag);
+        if (ptr == nullptr)
+            return nullptr;
+
+        auto state = static_cast<HwExtendedState*>(ptr);
+        state->area = reinterpret_cast<uint8_t*>(sl::AlignUp(
+            reinterpret_cast<uintptr_t>(state + 1), ExtStateAlign));
+        HwResetExtendedState(state);
+
+        return state;
+    }
+
+    void HwDestroyExtendedState(HwExtendedState* state)
+    {
+        NPK_CHECK(state != nullptr, );
+
+        //a cpu may still consider this its owner, but any new area allocated
+        //here has `loadedCpu` reset so it won't be mistaken for it.
+        NPK_ASSERT(PoolFreeWired(state, AllocationSize(), FpuHeapTag));
+    }
+
+    void HwResetExtendedState(HwExtendedState* state)
+    {
+        NPK_CHECK(state != nullptr, );
+
+        //a zeroed xsave header means every component is in its initial
+        //state, except for mxcsr which is always loaded from the legacy area.
+        sl::MemSet(state->area, 0, areaSize);
+        sl::MemCopy(state->area + FcwOffset, &DefaultFcw, sizeof(DefaultFcw));
+        sl::MemCopy(state->area + MxcsrOffset, &DefaultMxcsr,
+            sizeof(DefaultMxcsr));
+        if (saveMethod == SaveMethod::XSaves)
+        {
+            const uint64_t xcompBv = XcompBvCompacted | xcr0;
+            sl::MemCopy(state->area + XcompBvOffset, &xcompBv, sizeof(xcompBv));
+        }
+
+        state->loadedCpu = NoCpu;
+    }
+
+    void HwSwitchExtendedState(HwExtendedState* next)
+    {
+        auto& cpu = *fpuState;
+        NPK_ASSERT(!cpu.inKernelSimd);
+
+        //dirty registers always belong to the outgoing thread.
+        if (cpu.dirty)
+        {
+            SaveArea(cpu.owner);
+            cpu.dirty = false;
+        }
+
+        if (lazyRestore || next == nullptr)
+            SetTs(cpu);
+        else
+            LoadArea(cpu, next);
+    }
+
+    void HwBeginKernelSimd()
+    {
+        AssertIpl(Ipl::Dpc);
+
+        auto& cpu = *fpuState;
+        NPK_ASSERT(!cpu.inKernelSimd);
+        cpu.inKernelSimd = true;
+
+        if (cpu.dirty)
+        {
+            SaveArea(cpu.owner);
+            cpu.dirty = false;
+        }
+        cpu.owner = nullptr;
+        ClearTs(cpu);
+    }
+
+    void HwEndKernelSimd()
+    {
+        AssertIpl(Ipl::Dpc);
+
+        auto& cpu = *fpuState;
+        NPK_ASSERT(cpu.inKernelSimd);
+        cpu.inKernelSimd = false;
+
+        //the registers hold whatever the kernel left in them, the current
+        //thread's state is restored by #NM if it uses them again.
+        SetTs(cpu);
+    }
+}
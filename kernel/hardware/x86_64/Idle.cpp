@@ -0,0 +1,98 @@
+#include <hardware/x86_64/Cpuid.hpp>
+#include <Hardware.hpp>
+#include <Core.hpp>
+
+/* Idle states are entered via mwait where it's available, falling back to
+ * hlt (C1) otherwise. The mwait hint selects a C-state in bits 7:4 (0 being
+ * C1) and a sub-state in bits 3:0, cpuid leaf 5 reports how many sub-states
+ * each C-state has. Only the first sub-state of each C-state is used.
+ * The real exit latencies are described by ACPI (_CST) or model specific
+ * tables, neither of which are parsed here. Instead we use conservative
+ * figures in the range of typical parts, the worst that can happen is the
+ * idle governor is slightly too cautious about using the deeper states.
+ */
+namespace Npk
+{
+    constexpr size_t MaxMwaitCStates = 7;
+    constexpr uint32_t MwaitCStateShift = 4;
+
+    struct IdleLatency
+    {
+        uint32_t exitUs;
+        uint32_t residencyUs;
+    };
+
+    constexpr IdleLatency mwaitLatencies[MaxMwaitCStates] =
+    {
+        { 1, 2 },
+        { 20, 60 },
+        { 80, 200 },
+        { 120, 600 },
+        { 200, 800 },
+        { 480, 5000 },
+        { 890, 5000 },
+    };
+
+    static HwIdleState MakeIdleState(size_t cstate, bool mwait)
+    {
+        HwIdleState state {};
+        state.hint = cstate << MwaitCStateShift;
+        state.exitLatency = mwaitLatencies[cstate].exitUs * 1000;
+        state.targetResidency = mwaitLatencies[cstate].residencyUs * 1000;
+        state.wakesOnWrite = mwait;
+
+        return state;
+    }
+
+    size_t HwGetIdleStates(sl::Span<HwIdleState> states)
+    {
+        if (states.Empty())
+            return 0;
+
+        const bool mwait = CpuHasFeature(CpuFeature::Monitor)
+            && ReadConfigUint("npk.x86.use_mwait", true);
+        states[0] = MakeIdleState(0, mwait);
+        if (!mwait)
+            return 1;
+
+        CpuidLeaf data {};
+        if (DoCpuid(BaseLeaf, 0, data).a < 5)
+            return 1;
+
+        //edx holds a 4-bit sub-state count for each C-state, starting at C0.
+        DoCpuid(5, 0, data);
+        size_t count = 1;
+        for (size_t i = 1; i < MaxMwaitCStates && count < states.Size(); i++)
+        {
+            if (((data.d >> ((i + 1) * 4)) & 0xF) != 0)
+                states[count++] = MakeIdleState(i, true);
+        }
+
+        return count;
+    }
+
+    void HwEnterIdle(const HwIdleState& state, const sl::Atomic<bool>* monitor)
+    {
+        if (state.wakesOnWrite && monitor != nullptr)
+        {
+            asm volatile("monitor" :: "a"(monitor), "c"(0), "d"(0) : "memory");
+            if (monitor->Load(sl::Acquire))
+            {
+                IntrsOn();
+                return;
+            }
+
+            //sti delays interrupts until after the next instruction, so an
+            //interrupt that arrives now still breaks us out of mwait.
+            asm volatile("sti; mwait" :: "a"(state.hint), "c"(0) : "memory");
+            return;
+        }
+
+        if (monitor != nullptr && monitor->Load(sl::Acquire))
+        {
+            IntrsOn();
+            return;
+        }
+        asm volatile("sti; hlt" ::: "memory");
+    }
+}
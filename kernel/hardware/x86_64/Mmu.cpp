@@ -26,6 +26,7 @@ namespace Npk
     constexpr uint64_t PresentFlag = 1 << 0;
     constexpr uint64_t WriteFlag = 1 << 1;
     constexpr uint64_t UserFlag = 1 << 2;
+    constexpr uint64_t AccessedFlag = 1 << 5;
     constexpr uint64_t NxFlag = 1ul << 63;
     constexpr uint64_t PatBitsMask = (1 << 7) | (1 << 4) | (1 << 3);
     constexpr uint64_t PatUcFlag = (1 << 4) | (1 << 3); //(3) for UC
@@ -355,6 +356,19 @@ namespace Npk
         return current;
     }
 
+    bool HwPteTestAndClearAccessed(HwPte* pte)
+    {
+        if (pte == nullptr)
+            return false;
+
+        //the mmu sets this bit asynchronously, so it must be cleared with
+        //an atomic operation rather than via a local copy.
+        const uint64_t prev = __atomic_fetch_and(&pte->value, ~AccessedFlag,
+            __ATOMIC_RELAXED);
+
+        return (prev & AccessedFlag) != 0;
+    }
+
     Paddr HwPteAddr(HwPte* pte, sl::Opt<Paddr> set)
     {
         if (pte == nullptr)
@@ -0,0 +1,165 @@
+#include <hardware/x86_64/Cpuid.hpp>
+#include <lib/AcpiTypes.hpp>
+#include <lib/Maths.hpp>
+#include <Core.hpp>
+
+/* The apic id of each cpu is made of bit fields: the lowest bits select the
+ * SMT thread within a core, the next the core within a package, and the
+ * remainder is the package id. Cpus sharing a cache have the same apic id
+ * once the bits below the cache's sharing width are discarded. The widths of
+ * these fields are read from cpuid, falling back to the legacy leaves on
+ * older cpus. NUMA domains come from the SRAT if present.
+ */
+namespace Npk
+{
+    constexpr uint32_t MaxTopologySubleaves = 8;
+    constexpr uint32_t MaxCacheSubleaves = 16;
+
+    struct TopologyShifts
+    {
+        uint32_t smt;
+        uint32_t package;
+    };
+
+    //returns the number of bits needed to represent `count` distinct ids
+    static uint32_t ShiftFor(uint32_t count)
+    {
+        uint32_t shift = 0;
+        while (shift < 32 && (1u << shift) < count)
+            shift++;
+
+        return shift;
+    }
+
+    //parses leaf 0x1F or 0xB, which enumerate each level of the topology
+    //and the shift to the next level's id.
+    static bool ReadExtendedTopology(uint32_t leaf, TopologyShifts& shifts,
+        uint32_t& apicId)
+    {
+        CpuidLeaf data {};
+        if (DoCpuid(leaf, 0, data).b == 0)
+            return false;
+
+        apicId = data.d;
+        shifts = {};
+        for (uint32_t sub = 0; sub < MaxTopologySubleaves; sub++)
+        {
+            DoCpuid(leaf, sub, data);
+            const uint32_t type = (data.c >> 8) & 0xFF;
+            if (type == 0)
+                break;
+
+            const uint32_t shift = data.a & 0x1F;
+            if (type == 1)
+                shifts.smt = shift;
+            shifts.package = shift;
+        }
+
+        return true;
+    }
+
+    static void ReadLegacyTopology(uint32_t maxLeaf, TopologyShifts& shifts,
+        uint32_t& apicId)
+    {
+        CpuidLeaf data {};
+        DoCpuid(1, 0, data);
+        apicId = data.b >> 24;
+
+        //edx bit 28 indicates the logical processor count is valid
+        uint32_t logical = 1;
+        if (data.d & (1 << 28))
+            logical = sl::Max((data.b >> 16) & 0xFF, 1u);
+
+        uint32_t cores = 1;
+        if (maxLeaf >= 4 && (DoCpuid(4, 0, data).a & 0x1F) != 0)
+            cores = ((data.a >> 26) & 0x3F) + 1;
+
+        shifts.package = ShiftFor(logical);
+        shifts.smt = ShiftFor(sl::Max(logical / cores, 1u));
+    }
+
+    //finds the highest level cache in a leaf 4 (or 0x8000'001D) style list,
+    //returning the shift of its sharing width.
+    static bool ReadLlcShift(uint32_t leaf, uint32_t& shift)
+    {
+        CpuidLeaf data {};
+        uint32_t bestLevel = 0;
+
+        for (uint32_t sub = 0; sub < MaxCacheSubleaves; sub++)
+        {
+            DoCpuid(leaf, sub, data);
+            if ((data.a & 0x1F) == 0)
+                break;
+
+            const uint32_t level = (data.a >> 5) & 0x7;
+            if (level < bestLevel)
+                continue;
+
+            bestLevel = level;
+            shift = ShiftFor(((data.a >> 14) & 0xFFF) + 1);
+        }
+
+        return bestLevel != 0;
+    }
+
+    static uint32_t LookupNumaDomain(uint32_t apicId)
+    {
+        auto maybeSrat = GetAcpiTable(sl::SigSrat);
+        if (!maybeSrat.HasValue())
+            return 0;
+
+        using namespace sl::SratStructs;
+        auto srat = static_cast<const sl::Srat*>(*maybeSrat);
+        for (auto sras = sl::NextSratSubtable(srat); sras != nullptr;
+            sras = sl::NextSratSubtable(srat, sras))
+        {
+            if (sras->type == sl::SrasType::LocalApic)
+            {
+                auto local = static_cast<const LocalApicSras*>(sras);
+                if (local->apicId != apicId || (local->flags & 1) == 0)
+                    continue;
+
+                return local->domain0 | (local->domain1[0] << 8)
+                    | (local->domain1[1] << 16) | (local->domain1[2] << 24);
+            }
+            else if (sras->type == sl::SrasType::X2Apic)
+            {
+                auto x2 = static_cast<const X2ApicSras*>(sras);
+                if (x2->apicId == apicId && (x2->flags & 1) != 0)
+                    return x2->domain;
+            }
+        }
+
+        return 0;
+    }
+
+    void HwGetMyTopology(HwCpuTopology& topology)
+    {
+        CpuidLeaf data {};
+        const uint32_t maxLeaf = DoCpuid(BaseLeaf, 0, data).a;
+        const uint32_t maxExtLeaf = DoCpuid(ExtendedLeaf, 0, data).a;
+
+        TopologyShifts shifts {};
+        uint32_t apicId = 0;
+        if (!(maxLeaf >= 0x1F && ReadExtendedTopology(0x1F, shifts, apicId))
+            && !(maxLeaf >= 0xB && ReadExtendedTopology(0xB, shifts, apicId)))
+            ReadLegacyTopology(maxLeaf, shifts, apicId);
+        if (shifts.package < shifts.smt)
+            shifts.package = shifts.smt;
+
+        //intel reports caches via leaf 4, amd via 0x8000'001D. If neither
+        //is available assume the llc is shared by the whole package.
+        uint32_t llcShift = shifts.package;
+        if (!(maxLeaf >= 4 && ReadLlcShift(4, llcShift))
+            && maxExtLeaf >= 0x8000'001D)
+            ReadLlcShift(0x8000'001D, llcShift);
+
+        const uint32_t coreMask = (1u << (shifts.package - shifts.smt)) - 1;
+
+        topology.packageId = apicId >> shifts.package;
+        topology.coreId = (apicId >> shifts.smt) & coreMask;
+        topology.threadId = apicId & ((1u << shifts.smt) - 1);
+        topology.llcId = apicId >> llcShift;
+        topology.numaDomain = LookupNumaDomain(apicId);
+    }
+}
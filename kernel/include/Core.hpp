@@ -4,6 +4,7 @@
 #include <lib/List.hpp>
 #include <lib/LruCache.hpp>
 #include <lib/Queue.hpp>
+#include <lib/RBTree.hpp>
 #include <lib/Locks.hpp>
 #include <lib/Efi.hpp>
 
@@ -254,6 +255,18 @@ namespace Npk
 
     using WorkItemQueue = sl::FwdList<WorkItem, &WorkItem::hook>;
 
+    struct RcuHead;
+
+    using RcuCallback = void (*)(RcuHead* self);
+
+    struct RcuHead
+    {
+        sl::FwdListHook hook;
+        RcuCallback function;
+    };
+
+    using RcuQueue = sl::FwdList<RcuHead, &RcuHead::hook>;
+
     enum class CycleAccount
     {
         User,
@@ -348,6 +361,10 @@ namespace Npk
      * threads attempt to acquire an SxMutex shared but cannot (and therefore
      * block) they will all be woken at the same time, provided there are enough
      * tickets available.
+     *
+     * The holder of a `Mutex`, or the exclusive holder of an `SxMutex`, is
+     * recorded as its `owner` and inherits the priority of any threads
+     * blocked on it. The owner field is protected by `listLock`.
      */
     struct Waitable
     {
@@ -361,11 +378,14 @@ namespace Npk
 
         IplSpinLock<Ipl::Dpc> listLock;
         WaitEntryList waitersList;
+        sl::ListHook ownerHook; //NOTE: protected by owner->waiting.lock
 
         sl::QueueMpScHook mpscHook;
         sl::Atomic<bool> pending;
     };
 
+    using WaitableList = sl::List<Waitable, &Waitable::ownerHook>;
+
     using Condition = Waitable;
     using Timer = Waitable;
     using Mutex = Waitable;
@@ -398,11 +418,16 @@ namespace Npk
     using FlushRequestQueue = sl::QueueMpSc<FlushRequest, &FlushRequest::hook>;
 
     struct LocalScheduler;
+    struct RcuCpuState;
+    struct SchedTraceRing;
 
     struct RemoteCpuStatus
     {
         sl::Atomic<sl::TimePoint> lastIpi;
         LocalScheduler* scheduler;
+        RcuCpuState* rcu;
+        SchedTraceRing* schedTrace;
+        bool isolated;
         IplSpinLock<Ipl::Dpc> workItemsLock;
         WorkItemQueue workItems;
         TrapFrame* lastIntrFrame;
@@ -545,6 +570,72 @@ namespace Npk
         Waiting,
     };
 
+    /* Exponentially decayed load averages, in the style of PELT. Time is
+     * split into periods of ~1ms and the weight of each period halves every
+     * 32 periods. `running` is the fraction of time spent executing, scaled
+     * to `LoadScale`. `runnable` is the same for time spent runnable
+     * (executing or queued), for a cpu this is summed across all of its
+     * threads so it may exceed `LoadScale`.
+     */
+    constexpr uint32_t LoadScale = 1024;
+
+    struct LoadAverage
+    {
+        sl::TimePoint updated;
+        uint32_t runnable;
+        uint32_t running;
+    };
+
+    /* Parameters of a deadline-class thread: each `period` it's guaranteed
+     * `runtime` of cpu time, received before `deadline` has passed since the
+     * start of the period. See `SetThreadDeadline()`.
+     */
+    struct DeadlineParams
+    {
+        sl::TimeCount runtime;
+        sl::TimeCount deadline;
+        sl::TimeCount period;
+    };
+
+    struct DeadlineStats
+    {
+        size_t missed;
+        size_t throttled;
+    };
+
+    /* Scheduler trace events, the meaning of `SchedTraceEntry::arg` depends
+     * on the event type:
+     * - `Switch`: `thread` starts running, `arg` is the state the previous
+     *   thread was left in (a `ThreadState`).
+     * - `Wake`: `thread` left standby, `arg` is the cpu selected for it.
+     * - `Enqueue`: `thread` was placed in the run queues of cpu `arg`.
+     * - `Migrate`: `thread` moved cpus, `arg` is the source cpu in the upper
+     *   16 bits and the destination cpu in the lower 16 bits.
+     * - `Preempt`: cpu `arg` was asked to reschedule, `thread` is what it
+     *   should run next, or null if the running thread's slice expired.
+     * - `IdleEnter` and `IdleExit`: `arg` is the index of the idle state.
+     */
+    enum class SchedEvent : uint8_t
+    {
+        Switch,
+        Wake,
+        Enqueue,
+        Migrate,
+        Preempt,
+        IdleEnter,
+        IdleExit,
+    };
+
+    struct SchedTraceEntry
+    {
+        uint64_t timestamp;
+        uintptr_t thread;
+        uint32_t arg;
+        uint16_t cpu;
+        SchedEvent type;
+        uint8_t priority;
+    };
+
     struct ThreadContext
     {
         struct 
@@ -557,30 +648,88 @@ namespace Npk
         {
             IntrSpinLock lock;
             HwThreadContext* context;
+            //fpu/simd registers, null if the thread doesn't use them.
+            HwExtendedState* extState;
 
             CpuId affinity;
             sl::TimePoint sleepBegin;
-            uint32_t sleepTime;
-            uint32_t runTime;
+            sl::TimePoint lastRun; //when the thread last stopped executing
+            LoadAverage load;
+            uint64_t sleepTime;
+            uint64_t runTime;
             uint8_t basePriority;
             uint8_t dynPriority;
+            //incremented whenever a priority is inherited by this thread
+            sl::Atomic<uint32_t> inheritSeq;
             bool isPinned;
             ThreadState state;
             bool isInteractive;
             uint8_t niceness;
         } scheduling;
         sl::ListHook queueHook; //NOTE: protected by scheduling.lock
+        sl::RBTreeHook deadlineHook; //NOTE: protected by the run queues lock
+        //copied from `scheduling` when the thread is queued, so queued threads
+        //can be inspected without taking their locks. Protected by the lock
+        //of the run queues the thread is in.
+        struct
+        {
+            uint8_t index;
+            bool pinned;
+            sl::TimePoint lastRun;
+        } queueInfo;
+
+        //deadline class state, protected by scheduling.lock. Times are in
+        //nanoseconds, `bandwidth` is runtime/period scaled by 2^20. The
+        //thread is throttled once `budgetNs` runs out, until its next period
+        //begins (a constant bandwidth server).
+        struct
+        {
+            bool enabled;
+            bool throttled;
+            uint64_t runtimeNs;
+            uint64_t deadlineNs;
+            uint64_t periodNs;
+            uint64_t bandwidth;
+            int64_t budgetNs;
+            sl::TimePoint absDeadline;
+            sl::TimePoint lastMissed;
+            ClockEvent replenishEvent;
+            Dpc replenishDpc;
+            DeadlineStats stats;
+        } deadline;
 
         struct
         {
             sl::Atomic<WaitStage> stage;
             Dpc* wakeDpc;
+            //protects `reason` and `heldMutexes`
             IplSpinLock<Ipl::Dpc> lock;
             sl::StringSpan reason;
+            //mutex this thread is blocked on, its owner inherits our priority.
+            //Protected by scheduling.lock.
+            Waitable* blockedOn;
+            WaitableList heldMutexes;
         } waiting;
 
+        //set while this thread is reclaiming memory: any pages it allocates
+        //in the meantime are not allowed to trigger reclaim again, since the
+        //locks taken by reclaim may already be held further up the stack.
+        //NOTE: only accessed by this thread
+        bool reclaiming;
+
+        //set for threads created by `CreateKernelThread()`, which own their
+        //stack and are recycled (or freed) by the reaper once they exit.
+        struct
+        {
+            bool managed;
+            void* stack;
+            RcuHead rcuHead;
+        } lifetime;
+
         inline uint8_t Priority() const
         {
+            if (deadline.enabled)
+                return MaxRtPriority;
             if (scheduling.dynPriority != 0)
                 return scheduling.dynPriority;
             return scheduling.basePriority;
@@ -614,6 +763,31 @@ namespace Npk
     Ipl RaiseIpl(Ipl target);
     void LowerIpl(Ipl target);
 
+    /* The kernel is built without simd, code that wants to use fpu or vector
+     * registers must be compiled with them enabled and only run between
+     * these calls. The IPL is raised to Dpc in the meantime, so the region
+     * can't be switched away from. Regions can't be nested, or entered from
+     * above Ipl::Dpc.
+     */
+    SL_ALWAYS_INLINE
+    Ipl BeginKernelSimd()
+    {
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+        HwBeginKernelSimd();
+
+        return prevIpl;
+    }
+
+    SL_ALWAYS_INLINE
+    void EndKernelSimd(Ipl prevIpl)
+    {
+        HwEndKernelSimd();
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+    }
+
     template<Ipl max, Ipl min>
     inline void IplSpinLock<max, min>::Lock()
     {
@@ -637,9 +811,11 @@ namespace Npk
             RaiseIpl(max);
         const bool success = lock.TryLock();
 
+        //`prevIpl` belongs to the holder until we own the lock.
+        if (success)
             prevIpl = lastIpl;
-        if (!success)
-            LowerIpl(prevIpl);
+        else if (lastIpl < max)
+            LowerIpl(lastIpl);
 
         return success;
     }
@@ -665,15 +841,52 @@ namespace Npk
 
     /* Queues a work item to be run by a kernel worker thread, with an optional
      * cpu affinity. This work item will be run at IPL::Passive but is not
-     * allowed to block.
+     * allowed to block. Work for an isolated cpu is run by its housekeeping
+     * cpu instead, so work items can't depend on which cpu they run on.
      */
     void QueueWorkItem(WorkItem* item, sl::Opt<CpuId> who);
 
+    /* Enters an RCU read-side critical section, which is done by raising the
+     * IPL to at least DPC. Objects reached from RCU-protected pointers inside
+     * the section remain valid until `RcuReadUnlock()`. Sections can nest,
+     * but must not block. Returns the previous IPL, to be passed to
+     * `RcuReadUnlock()`.
+     */
+    Ipl RcuReadLock();
+    void RcuReadUnlock(Ipl prev);
+
+    /* Queues `head` to have `function` called once all cpus have passed
+     * through a quiescent state (a context switch, or returning to passive
+     * IPL), meaning no read-side section that could have seen the object
+     * is still running. Callbacks run in batches from a work item on the cpu
+     * they were queued from (or its housekeeping cpu), and must not block.
+     * Can be called at any IPL up to and including DPC.
+     */
+    void RcuCall(RcuHead* head, RcuCallback function);
+
+    /* Must be called from passive IPL. Blocks until a full grace period has
+     * elapsed, see `RcuCall()`.
+     */
+    void RcuSynchronize();
+
     /* Get access to some cpu-local variables of another cpu. This can be an
      * expensive operation, best used sparingly.
      */
     RemoteCpuStatus* RemoteStatus(CpuId who);
 
+    /* Isolated cpus (listed in `npk.smp.isolated_cpus`, like "2-3,6") only
+     * run threads pinned to them and are kept free of housekeeping duties:
+     * they don't steal or balance work, their work items and log output are
+     * handled by another cpu, and their timer only fires for queued events.
+     * Cpu 0 is never isolated.
+     */
+    bool IsCpuIsolated(CpuId who);
+
+    /* Returns the cpu that handles housekeeping duties on behalf of `who`,
+     * this is `who` itself unless it's isolated.
+     */
+    CpuId HousekeepingCpu(CpuId who);
+
     /* Queue a function to run on a remote cpu, mail is processed at interrupt
      * IPL and can be a heavy primitive to use. For less-than-urgent work
      * consider using a work item.
@@ -752,6 +965,7 @@ namespace Npk
 
     void SetConfigStore(sl::StringSpan store, bool noLog);
     size_t ReadConfigUint(sl::StringSpan key, size_t defaultValue);
+    bool ReadConfigListHas(sl::StringSpan key, size_t value);
     sl::StringSpan ReadConfigString(sl::StringSpan key, 
         sl::StringSpan defaultValue);
 
@@ -792,6 +1006,15 @@ namespace Npk
      */
     PageInfo* AllocPage(bool canFail);
 
+    /* Allocates up to `pages.Size()` zeroed pages, taking them from the free
+     * lists in batches rather than one at a time. If there are not enough
+     * free pages, memory is reclaimed (if called from passive IPL). Returns
+     * the number of pages allocated, which are placed at the start of `pages`.
+     * Unlike `AllocPage()` this never panics, callers must handle a partial
+     * allocation.
+     */
+    size_t AllocPages(sl::Span<PageInfo*> pages);
+
     /* Marks a page (and its PageInfo metadata) as no longer in use and free for
      * use by the rest of the system.
      */
@@ -828,6 +1051,26 @@ namespace Npk
     bool ResetThread(ThreadContext* thread);
     bool PrepareThread(ThreadContext* thread, uintptr_t entry, uintptr_t arg, 
         uintptr_t stack, sl::Opt<CpuId> affinity);
+
+    /* Creates a kernel thread that will call `entry` with `arg`, leaving it in
+     * the standby state. Unlike threads set up with `PrepareThread()`, the
+     * thread block and its stack are owned by the kernel: once the thread
+     * exits they are reclaimed automatically, and must not be accessed again.
+     * Recently exited threads are cached per-cpu (with their stacks still
+     * mapped) and reused by later calls. Must be called at passive IPL.
+     */
+    NpkStatus CreateKernelThread(ThreadContext** thread, uintptr_t entry, 
+        uintptr_t arg, sl::Opt<CpuId> affinity);
+
+    /* Gives `thread` its own fpu/simd register state, which is required
+     * before it can use those registers (e.g. by running user code). The
+     * state is reset to its initial values by `ResetThread()`, and is
+     * released by `DisableExtendedState()` or when a thread created by
+     * `CreateKernelThread()` is freed. `thread` must be dead, and these must
+     * be called from passive IPL.
+     */
+    NpkStatus EnableExtendedState(ThreadContext* thread);
+    void DisableExtendedState(ThreadContext* thread);
     void ExitThread(size_t code, void* data);
     void Yield();
     void EnqueueThread(ThreadContext* thread);
@@ -849,6 +1092,27 @@ namespace Npk
      */
     void SetThreadAffinity(ThreadContext* thread, CpuId who);
 
+    /* Moves `thread` into the deadline scheduling class with the given
+     * parameters, or back to its previous class if `params` is null.
+     * Deadline threads run ahead of all realtime threads, in order of
+     * earliest deadline. Each is admitted to a single cpu (its pinned cpu,
+     * if it has one) with enough spare deadline bandwidth and stays there,
+     * so `SetThreadAffinity()` has no effect on them. A thread that uses
+     * its runtime before the end of its period is throttled until the next
+     * period begins.
+     * Returns `InvalidArg` unless `runtime <= deadline <= period` and
+     * `Shortage` if no cpu can admit the thread's bandwidth.
+     */
+    NpkStatus SetThreadDeadline(ThreadContext* thread,
+        const DeadlineParams* params);
+
+    /* Gets the deadline statistics for `thread`: the number of deadlines it
+     * missed (was still running or queued after the deadline passed) and
+     * the number of times it was throttled for using up its runtime.
+     */
+    NpkStatus GetThreadDeadlineStats(ThreadContext* thread, 
+        DeadlineStats& stats);
+
     /* Removes the pinned status of `thread`, allowing it migrate cpus again.
      */
     void ClearThreadAffinity(ThreadContext* thread);
@@ -876,6 +1140,21 @@ namespace Npk
      */
     sl::Opt<CpuId> GetThreadAffinity(ThreadContext* thread, bool& pinned);
 
+    /* Enables or disables recording of scheduler events. Returns false if
+     * the kernel wasn't built with scheduler tracing, or no trace buffers
+     * were allocated.
+     */
+    bool SetSchedTraceEnabled(bool enabled);
+
+    /* Copies events recorded by `cpu` into `entries`, oldest first, starting
+     * at `cursor` (which should initially be zero). `cursor` is advanced
+     * past the events returned, and past any that were overwritten before
+     * they could be read. Returns the number of entries filled.
+     * Safe to call from any cpu, at any IPL.
+     */
+    size_t ReadSchedTrace(CpuId cpu, uint64_t& cursor,
+        sl::Span<SchedTraceEntry> entries);
+
     /* Attempts to cancel a preparing or ongoing wait operation for a thread.
      * Returns whether a wait was successfully cancelled or not. Waiting
      * threads will be woken with an `Aborted` status.
@@ -972,8 +1251,10 @@ namespace Npk
     NpkStatus AcquireMutex(Mutex* mutex, sl::TimeCount timeout,
         sl::StringSpan reason = {});
 
-    /* Can be called from any IPL. Releases `mutex` and wakes at most one
-     * waiting thread, which will then compete to acquire it.
+    /* Can be called at or below Ipl::Dpc. Releases `mutex` and wakes at most
+     * one waiting thread, which will then compete to acquire it. Any priority
+     * the owner inherited from threads waiting on `mutex` is dropped. The
+     * caller does not need to be the thread that acquired `mutex`.
      */
     void ReleaseMutex(Mutex* mutex);
 
@@ -1003,8 +1284,10 @@ namespace Npk
      */
     void ReleaseSxMutexShared(SxMutex* mutex);
 
-    /* Can be called from any IPL. Releases the exclusive hold on `mutex` and
-     * wakes waiting threads.
+    /* Can be called at or below Ipl::Dpc. Releases the exclusive hold on
+     * `mutex` and wakes waiting threads. As with `ReleaseMutex()`, any
+     * inherited priority is dropped and the caller does not need to be the
+     * owner.
      */
     void ReleaseSxMutexExclusive(SxMutex* mutex);
 }
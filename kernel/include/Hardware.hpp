@@ -4,6 +4,7 @@
 #include <lib/Optional.hpp>
 #include <lib/Span.hpp>
 #include <lib/Flags.hpp>
+#include <lib/Atomic.hpp>
 #include <lib/Time.hpp>
 #include <lib/Memory.hpp>
 
@@ -34,6 +35,11 @@ namespace Npk
      */
     struct HwUserContext;
 
+    /* Opaque type. Represents a thread's floating point and vector register
+     * state, which isn't part of `HwThreadContext`.
+     */
+    struct HwExtendedState;
+
     /* Describes the major reason for an exit from a user mode context.
      */
     enum class HwUserExitType
@@ -318,6 +324,37 @@ namespace Npk
     void HwPrimeThread(HwThreadContext** store, uintptr_t stub, uintptr_t entry,
         uintptr_t arg, uintptr_t stack);
 
+    /* Allocates an extended state area, holding the initial register state.
+     * Returns nullptr if memory couldn't be allocated. Must be called from
+     * passive IPL.
+     */
+    HwExtendedState* HwCreateExtendedState();
+
+    /* Frees an extended state area. It must not belong to a running thread.
+     * Must be called from passive IPL.
+     */
+    void HwDestroyExtendedState(HwExtendedState* state);
+
+    /* Returns an extended state area to the initial register state, it must
+     * not belong to a running thread.
+     */
+    void HwResetExtendedState(HwExtendedState* state);
+
+    /* Called with interrupts disabled immediately before switching threads.
+     * The outgoing thread's registers are saved if they may have changed,
+     * and the registers of `next` (which is nullptr if the incoming thread
+     * doesn't have an extended state area) are restored or set up to be
+     * restored when they're first used.
+     */
+    void HwSwitchExtendedState(HwExtendedState* next);
+
+    /* Marks the start and end of a region of kernel code that uses floating
+     * point or vector registers, see `BeginKernelSimd()`. Both must be called
+     * at Ipl::Dpc, regions can't be nested.
+     */
+    void HwBeginKernelSimd();
+    void HwEndKernelSimd();
+
     /* Initializes a user mode context, typically to be used for the current
      * thread, but no such binding is enforced.
      */
@@ -479,6 +516,53 @@ namespace Npk
      */
     size_t HwGetCacheLineSize();
 
+    /* Describes where a cpu core sits in the system topology. Ids are only
+     * useful for comparison: two cpus are SMT siblings if they share a
+     * package and core id, and share a last level cache if they share a
+     * package and `llcId`.
+     */
+    struct HwCpuTopology
+    {
+        uint32_t packageId;
+        uint32_t coreId;
+        uint32_t threadId;
+        uint32_t llcId;
+        uint32_t numaDomain;
+    };
+
+    /* Fills `topology` with the details of the current cpu core.
+     */
+    void HwGetMyTopology(HwCpuTopology& topology);
+
+    /* An idle state a cpu core can enter while it has nothing to run. Entering
+     * a state and leaving it again takes at least `targetResidency`
+     * nanoseconds to be worthwhile, and waking up from it takes up to
+     * `exitLatency` nanoseconds. If `wakesOnWrite` is set the cpu also
+     * leaves the state when the monitored address is written to, see
+     * `HwEnterIdle()`.
+     */
+    struct HwIdleState
+    {
+        uint32_t hint;
+        uint32_t exitLatency;
+        uint32_t targetResidency;
+        bool wakesOnWrite;
+    };
+
+    /* Fills `states` with the idle states supported by the current cpu core,
+     * shallowest first. Returns the number of states written, there is
+     * always at least one.
+     */
+    size_t HwGetIdleStates(sl::Span<HwIdleState> states);
+
+    /* Must be called with interrupts disabled, enters the idle state `state`
+     * until an interrupt fires. If `state.wakesOnWrite` is set, a write to
+     * the cache line containing `monitor` also ends the idle period. The cpu
+     * doesn't idle at all if `*monitor` is already set once the monitor is
+     * armed. Interrupts are always enabled when this function returns.
+     */
+    void HwEnterIdle(const HwIdleState& state, const sl::Atomic<bool>* monitor);
+
     /* Sets the current kernel page table root pointer to `*next` if valid.
      * If `prev` is non-null, `*prev` is set to the current root pointer.
      *
@@ -530,6 +614,13 @@ namespace Npk
      */
     MmuFlags HwPteFlags(HwPte* pte, sl::Opt<MmuFlags> set);
 
+    /* Returns whether the MMU has recorded an access through a translatable
+     * PTE since the last call, atomically clearing that record. TLB entries
+     * for the PTE are not flushed, so accesses made through them may go
+     * unrecorded until they're evicted.
+     */
+    bool HwPteTestAndClearAccessed(HwPte* pte);
+
     /* Returns the physical address mapped by a PTE. If `set` is valid,
      * the PTE's address is updated to `*set`.
      */
@@ -7,6 +7,7 @@ namespace Npk
     struct VmSpace;
     struct Iop;
     struct Waitable;
+    struct UserPin;
 
     enum class IoError : size_t
     {
@@ -269,6 +270,10 @@ namespace Npk
 
         struct
         {
+            /* Byte offset within the target object where the transfer
+             * begins.
+             */
+            size_t offset;
         } readwrite;
 
         struct
@@ -309,6 +314,7 @@ namespace Npk
         sl::ListHook queueHook; //for usage by drivers
 
         sl::Span<IoBuffer> buffers;
+        UserPin* userPin; //released when the IOP completes, see CreateUserIop()
         //TODO: child iops/parent linkage?
         IopFrame frames[];
     };
@@ -330,12 +336,41 @@ namespace Npk
      */
     NpkStatus FreeIoBuffers(IoBuffer* buffers, size_t count);
 
+    /* Faults in and pins the pages backing `length` bytes of user memory at
+     * `base` in `space`, describing them as PageList IoBuffers so they can
+     * be handed to devices without copying. If `write` is set the pages are
+     * made private and writable first, which is required if the IO operation
+     * will store data into the buffer (i.e. a Read IOP).
+     * Pinned pages are not swapped out, and remain valid even if the memory
+     * is unmapped while pinned. If successful a handle is placed in `*pin`
+     * and the buffers (owned by the handle) in `*buffers`, these remain valid
+     * until the handle is passed to `UnpinUserBuffer()`.
+     * Must be called from passive IPL.
+     */
+    NpkStatus PinUserBuffer(UserPin** pin, sl::Span<IoBuffer>* buffers,
+        VmSpace& space, uintptr_t base, size_t length, bool write);
+
+    /* Releases the pages and buffers held by `pin`. Must be called from
+     * passive IPL.
+     */
+    void UnpinUserBuffer(UserPin* pin);
+
     /* - management of buffers memory is caller's responsiblity.
      * - right now iop makes a copy of `*params`, is this safe enough?
      */
     NpkStatus CreateIop(Iop** result, IoInterface* target, IoType type, 
         IoFlags flags, IopParams* params, sl::Span<IoBuffer> buffers);
     
+    /* Same as `CreateIop()` except the IOP operates on `length` bytes of user
+     * memory at `base` in `space`, which is pinned (see `PinUserBuffer()`)
+     * for the lifetime of the operation. The pages are unpinned once the IOP
+     * completes (or aborts), just before the completion callback is run. At
+     * this point the IOP's buffers are cleared.
+     */
+    NpkStatus CreateUserIop(Iop** result, IoInterface* target, IoType type,
+        IoFlags flags, IopParams* params, VmSpace& space, uintptr_t base,
+        size_t length);
+
     /*
      */
     NpkStatus DestroyIop(Iop* packet);
@@ -404,4 +439,12 @@ namespace Npk
     /* Returns a string representation of `status`.
      */
     sl::StringSpan IoStatusStr(IoStatus status);
+
+    /* Creates a block IoInterface of `length` bytes backed by main memory.
+     * All memory is allocated and zeroed upfront, the ram disk accepts `Read`
+     * and `Write` IOPs using `KernelVirtual` and `PageList` buffers. This is
+     * mainly useful as a stand-in for real block devices (e.g. for swap
+     * testing). If successful, the new interface is placed in `*ioi`.
+     */
+    NpkStatus CreateRamDisk(IoInterface** ioi, size_t length);
 }
@@ -4,6 +4,11 @@
 
 namespace Npk
 {
+    /* Forward declarations, see Vm.hpp and Io.hpp.
+     */
+    struct VmSource;
+    struct IoInterface;
+
     /* Defines the path delimiter used by the namespace subsystem.
      */
     constexpr char PathDelimiter = '/';
@@ -117,10 +122,40 @@ namespace Npk
      */
     size_t GetObjectName(sl::StringSpan& buffer, NsObject& obj);
 
-    /* TODO:
+    /* Creates a new file object of `length` bytes, with its contents stored
+     * on `backing`. All access to the file (reads, writes and mappings) goes
+     * through the page cache, which only uses `backing` on cache misses and
+     * when writing back modified data. The file object holds a reference to
+     * `backing` until it's destroyed. Other arguments are the same as
+     * `CreateObject()`.
+     */
+    NpkStatus CreateFileObject(NsObject** ptr, NsObjFlags flags,
+        sl::StringSpan name, IoInterface* backing, size_t length);
+
+    /* If `obj` is a file object, places the length of the file (in bytes)
+     * into `*size`.
+     */
+    NpkStatus GetFileObjectSize(size_t* size, NsObject& obj);
+
+    /* If `obj` is a file object, places a pointer to the VmSource
+     * representing its contents into `*vsrc`. This can be passed to
+     * `SpaceAttach()` to map the file. The pointer is only valid while the
+     * caller holds a reference to `obj`.
      */
     NpkStatus GetFileObjectVmSource(VmSource** vsrc, NsObject& obj);
 
+    /* If `obj` is a file object, places a pointer to an IoInterface that
+     * accepts `Read` and `Write` IOPs for the file into `*ioi`. These IOPs
+     * are serviced by the page cache. Like `GetFileObjectVmSource()`, the
+     * interface is only valid while the caller holds a reference to `obj`.
+     */
+    NpkStatus GetFileObjectIoInterface(IoInterface** ioi, NsObject& obj);
+
+    /* Writes back any modified data held in the page cache for the file
+     * object `obj`, returning once the writes have completed.
+     */
+    NpkStatus FlushFileObject(NsObject& obj);
+
     /* Creates a new namespace object with the values of `name`, `flags` and
      * extra length after the object struct header specified by `extraLength`.
      * The extra length is in addition to the length specified by NsObjType
@@ -10,6 +10,7 @@ namespace Npk
     struct Process;
     struct Job;
     struct Session;
+    struct WorkingSetInfo;
 
     enum class SignalTargetType
     {
@@ -52,6 +53,16 @@ namespace Npk
     void UnrefThread(Thread& thread);
 
     NpkStatus GetProcessVmSpace(VmSpace** space, Process& proc);
+    /* Sums the working set histograms of each tracked address space in the
+     * job. Spaces that aren't tracked are left out.
+     */
+    NpkStatus GetJobWorkingSet(Job& job, WorkingSetInfo* info);
+    /* Swaps out up to `count` pages of anonymous memory from the address
+     * spaces of user processes, see `SwapOutSpace()`. Sessions, jobs and
+     * processes that are locked by someone else are skipped. Returns the
+     * number of pages released.
+     */
+    size_t SwapOutProcesses(size_t count);
 
     NpkStatus SendSignal(SignalTargetType type, void* target, uint8_t priority,
         size_t signalId, void* arg);
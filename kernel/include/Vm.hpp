@@ -35,10 +35,55 @@ namespace Npk
         /* Internal flag: indicates if a range is borrowing the amap of another.
          */
         AmapNeedsCopy,
+
+        /* Only used when attaching a range: every page of the range is
+         * mapped up front, so accesses to it don't fault. Writable private
+         * ranges are given their own copy of each page. This is best-effort,
+         * any pages that can't be populated (e.g. due to a memory shortage)
+         * are faulted in on demand as usual.
+         */
+        Populate,
     };
 
     using VmFlags = sl::Flags<VmFlag>;
 
+    enum class VmAdvice
+    {
+        /* No particular access pattern expected, readahead and fault-around
+         * adapt to what is observed. This is the default for new ranges.
+         */
+        Normal,
+
+        /* The range will be accessed sequentially: readahead starts at the
+         * first access using the largest window, and more pages are mapped
+         * around each fault.
+         */
+        Sequential,
+
+        /* The range will be accessed randomly: readahead and fault-around
+         * are disabled.
+         */
+        Random,
+
+        /* The range will be accessed soon, start bringing its contents into
+         * memory. This does not change the range's access pattern.
+         */
+        WillNeed,
+
+        /* The contents of the range are no longer needed and are released
+         * immediately. Future accesses see zeroes (or the contents of the
+         * source object, if there is one).
+         */
+        DontNeed,
+
+        /* The contents of the range are no longer needed, but may be kept
+         * until there is memory pressure. Writing to a page before it is
+         * reclaimed keeps it, otherwise accesses may see zeroes. Only valid
+         * for anonymous memory.
+         */
+        Free,
+    };
+
     /* Forward declaration, see below.
      */
     struct VmSpace;
@@ -47,12 +92,28 @@ namespace Npk
      */
     struct VmSource;
 
+    /* Forward declaration, see Io.hpp.
+     */
+    struct IoInterface;
+
     struct AnonPage
     {
         sl::SpinLock lock;
         sl::RefCount refcount;
         PageInfo* page;
         void* swapSlot;
+        bool lazyFree; //contents can be discarded, cleared by writes
+
+        /* Page merging state, see vm/Merge.cpp. Merged pages are shared
+         * read-only by several amaps, and are never written to.
+         */
+        bool merged;
+        uint32_t mergeChecksum;
+        AnonPage* mergeNext;
+
+        //amap lookups don't take a reference until they've found the anon
+        //page, so its memory is only freed after an RCU grace period.
+        RcuHead rcuHead;
     };
 
     namespace Private
@@ -68,7 +129,9 @@ namespace Npk
         sl::RefCount refcount;
         Mutex mutex;
         size_t slotCount;
-        void* slots;
+        //lookups don't take `mutex`, the tables are RCU protected. See
+        //vm/Anon.cpp.
+        sl::Atomic<void*> slots;
     };
 
     namespace Private
@@ -79,6 +142,17 @@ namespace Npk
     using AnonMapRef = sl::Ref<AnonMap, &AnonMap::refcount,
         Private::DestroyAnonMap>;
 
+    /* Tracks a stream of accesses to a VmSource, so the page cache can
+     * detect sequential access and read ahead of it. See vm/PageCache.cpp.
+     */
+    struct ReadaheadState
+    {
+        size_t next; //index expected if access is sequential
+        size_t start; //first index of the current window
+        size_t size; //length of current window, 0 if not reading ahead
+        size_t trigger; //accessing this index starts the next window
+    };
+
     struct VmRange
     {
         Mutex mutex;
@@ -113,6 +187,18 @@ namespace Npk
         /* Offset within the source object that this range begins at.
          */
         size_t offset;
+
+        /* Expected access pattern (`Normal`, `Sequential` or `Random`) and
+         * readahead state for page faults within this range, both protected
+         * by `mutex`.
+         */
+        VmAdvice advice;
+        ReadaheadState readahead;
+
+        /* Idle age of each page in this range, in working set scan passes.
+         * Allocated by the scanner on first use and protected by `mutex`.
+         */
+        uint8_t* pageAges;
     };
 
     struct VmRangeLt
@@ -149,6 +235,21 @@ namespace Npk
     using VmFreeRangeTree = sl::RBTree<VmFreeRange, &VmFreeRange::hook, 
         VmFreeRangeLt, VmFreeRangeAggregator>;
 
+    /* Number of buckets in a working set histogram. Bucket 0 counts pages
+     * accessed since they were last scanned, bucket N (N > 0) counts pages
+     * idle for [2^(N-1), 2^N) scan passes and the last bucket also counts
+     * anything older.
+     */
+    constexpr size_t WorkingSetBuckets = 8;
+
+    struct WorkingSetInfo
+    {
+        size_t idlePages[WorkingSetBuckets];
+        size_t mappedPages;
+        size_t completedPasses;
+        uint64_t lastPassNs;
+    };
+
     struct VmSpace
     {
         HwMap map;
@@ -158,6 +259,30 @@ namespace Npk
 
         SxMutex rangesMutex;
         VmRangeTree ranges;
+
+        /* Address the next swap-out scan of this space begins at, this is
+         * only a hint and is updated without holding any locks.
+         */
+        sl::Atomic<uintptr_t> swapCursor;
+
+        /* Working set estimation, see vm/WorkingSet.cpp. The scan state is
+         * only accessed by the scanner, `wset` holds the results of the last
+         * complete pass and is protected by `wsetLock`.
+         */
+        sl::ListHook wsetHook;
+        bool wsetTracked;
+        uintptr_t wsetCursor;
+        sl::TimePoint wsetPassBegin;
+        size_t wsetBuilding[WorkingSetBuckets];
+        sl::SpinLock wsetLock;
+        WorkingSetInfo wset;
+
+        /* Same-page merging, see vm/Merge.cpp. Only accessed by the
+         * merge scanner.
+         */
+        sl::ListHook mergeHook;
+        bool mergeEnabled;
+        uintptr_t mergeCursor;
     };
 
     enum class PagerFlag
@@ -168,29 +293,70 @@ namespace Npk
     };
 
     using PagerFlags = sl::Flags<PagerFlag>;
+    using PagerCallback = void (*)(void* opaque, NpkStatus result);
 
     struct VmPagerOps
     {
         bool (*RefObj)(VmSource* src, PagerFlags flags);
         void (*UnrefObj)(VmSource* src);
-        NpkStatus (*Get)(VmSource* src, sl::Span<PageInfo> pages, 
-            size_t pagesOffset, size_t mainIndex, PagerFlags flags);
+
+        /* Fills `pages` with the contents of the backing object, starting
+         * at page `pagesOffset`. Called by the page cache without any locks
+         * held, bytes past the end of the source should be zeroed.
+         */
+        NpkStatus (*Get)(VmSource* src, sl::Span<PageInfo*> pages,
+            size_t pagesOffset, PagerFlags flags);
+
+        /* Optional asynchronous version of `Get()`, used for readahead.
+         * Returns `Pending` if the transfer was started, `callback` is later
+         * run with the result from a worker thread and must not block. For
+         * any other return value the callback is not run. `pages` only needs
+         * to remain valid for the duration of this call.
+         */
+        NpkStatus (*GetAsync)(VmSource* src, sl::Span<PageInfo*> pages,
+            size_t pagesOffset, PagerFlags flags, PagerCallback callback,
+            void* opaque);
         NpkStatus (*Fault)(VmSource* src, VmSpace& space, uintptr_t vaddr, 
             sl::Span<PageInfo> pages, size_t pagesOffset, size_t mainIndex, 
             PagerFlags flags);
-        NpkStatus (*Put)(VmSource* src, sl::Span<PageInfo> pages, 
+
+        /* Writes the contents of `pages` back to the backing object, starting
+         * at page `pagesOffset`. Called by the page cache without any locks
+         * held, bytes past the end of the source should not be written.
+         */
+        NpkStatus (*Put)(VmSource* src, sl::Span<PageInfo*> pages,
             size_t pagesOffset, PagerFlags flags);
         void (*Flush)(VmSource* src, size_t offsetPages, size_t lengthPages, 
             PagerFlags flags);
         void (*Release)(VmSource* src, PageInfo* page, size_t pageOffset);
     };
 
+    struct CacheFill;
+
     struct VmSource
     {
         const VmPagerOps* ops; //set before source is known to vm subsystem, readonly after - not protected by lock
 
         SxMutex mutex;
-        sl::FwdList<PageInfo, &PageInfo::vmoList> pages; //current list of pages
+        size_t length; //in bytes, readonly after init
+
+        /* Page cache state, see vm/PageCache.cpp. Pages are indexed by their
+         * offset (in pages) within the source using a radix tree, all fields
+         * are protected by `mutex`.
+         */
+        void* cacheRoot;
+        size_t cacheHeight;
+        size_t cachedPages;
+        size_t dirtyPages;
+        CacheFill* fills;
+
+        /* Every cache source is on a global list walked when reclaiming
+         * memory, `cacheHook` is protected by that list's mutex. The
+         * eviction scan of this source resumes from `evictCursor`, which is
+         * protected by `mutex`.
+         */
+        sl::ListHook cacheHook;
+        size_t evictCursor;
     };
 
     /* Provides fine control over address space allocation. Each field has a
@@ -289,13 +455,15 @@ namespace Npk
     NpkStatus ClearKernelMap(uintptr_t vaddr, Paddr* paddr);
 
     /* Attempts to allocate a kernel stack, the base (higher numerical) address
-     * is placed into `*stack` on success. This memory is backed immediately.
+     * is placed into `*stack` on success. This memory is backed immediately,
+     * and the page below the stack is left unmapped so an overflow faults.
      */
     NpkStatus AllocKernelStack(void** stack);
 
     /* Immediately released memory used by a kernel stack, DO NOT call this
      * for the current stack (insert stick in bicycle spoke meme here) - instead
-     * a defer-based mechanism should be used (RCU, DPCs, WorkItems).
+     * defer it with `RcuCall()` or a work item. Must be called from passive
+     * IPL. `stack` is the address returned by `AllocKernelStack()`.
      */
     void FreeKernelStack(void* stack);
 
@@ -349,7 +517,14 @@ namespace Npk
     NpkStatus SpaceFree(VmSpace& space, uintptr_t base, size_t length, 
         sl::TimeCount timeout = sl::NoTimeout);
 
-    /* TODO:
+    /* Attaches a range of `length` bytes at `base` in `space`, backed by
+     * `source` from `srcOffset`, or by anonymous memory if `source` is null.
+     * On success the new range is placed in `*range`.
+     * If `flags` has `VmFlag::Populate` set, the range's pages are mapped
+     * before returning. This is best-effort: a failure to populate (e.g. a
+     * memory shortage) doesn't fail the attach, and any pages left unmapped
+     * are faulted in on demand as usual.
+     * TODO:
      * - if `base` is not page-aligned, this function should allocate the base
      *   address.
      */
@@ -372,4 +547,93 @@ namespace Npk
     /* TODO:
      */
     NpkStatus SpaceClone(VmSpace** clone, VmSpace& source);
+
+    /* Adds (or removes if `enable` is cleared) `space` to the set of address
+     * spaces periodically scanned by the working set estimator. A space must
+     * be removed before it's destroyed.
+     */
+    NpkStatus SpaceTrackWorkingSet(VmSpace& space, bool enable);
+
+    /* Copies the working set histogram from the last complete scan pass of
+     * `space` into `*info`. Returns `NotAvailable` if the space is not
+     * tracked.
+     */
+    NpkStatus SpaceGetWorkingSet(VmSpace& space, WorkingSetInfo* info);
+
+    /* Adds (or removes if `enable` is cleared) `space` to the set of address
+     * spaces scanned for identical anonymous pages, which are merged into a
+     * single read-only copy. Writing to a merged page gives the writer a
+     * private copy again. A space must be removed before it's destroyed.
+     */
+    NpkStatus SpaceEnableMerging(VmSpace& space, bool enable);
+
+    /* Provides a hint about how `length` bytes starting at `base` in `space`
+     * will be used, see `VmAdvice` for details. Since ranges can't be split
+     * yet, access pattern advice (`Normal`, `Sequential`, `Random`) applies
+     * to every range overlapping the area in full. Returns `BadVaddr` if
+     * nothing is attached in the area.
+     */
+    NpkStatus SpaceAdvise(VmSpace& space, uintptr_t base, size_t length,
+        VmAdvice advice);
+
+    /* Registers `ioi` as backing store for anonymous memory. The interface
+     * must accept `Read` and `Write` IOPs with `PageList` buffers, and
+     * `length` bytes of it (starting at offset 0) are used for swap slots.
+     * The swap subsystem holds a reference to `ioi` from this point on,
+     * devices cannot currently be removed once added.
+     */
+    NpkStatus AddSwapDevice(IoInterface* ioi, size_t length);
+
+    /* Attempts to release up to `count` pages of resident anonymous memory
+     * mapped in `space`, either by compressing them into the compressed
+     * store or writing them out to a swap device. Pages are processed in
+     * clusters of adjacent addresses, and the scan resumes where
+     * the previous call left off. Returns the number of pages released.
+     * Ranges (or the whole space) that are locked by someone else are
+     * skipped rather than waited on. Must be called from passive IPL.
+     */
+    size_t SwapOutSpace(VmSpace& space, size_t count);
+
+    constexpr size_t CompressedLatencyBuckets = 16;
+    constexpr size_t CompressedLatencyBase = 8; //bucket 0 is < 2^8 ns
+
+    struct CompressedStoreStats
+    {
+        size_t storedPages;
+        size_t sameFilledPages;
+        size_t storedBytes;
+        size_t backingPages;
+        size_t rejectedPages;
+        size_t loads;
+        size_t loadLatency[CompressedLatencyBuckets];
+    };
+
+    /* Takes a snapshot of the compressed store's counters. `storedPages`
+     * includes same-filled pages, which occupy no backing memory.
+     * `loadLatency` is a histogram of decompression times: bucket N counts
+     * loads that took less than 2^(CompressedLatencyBase + N) nanoseconds,
+     * with the final bucket counting everything slower.
+     */
+    void GetCompressedStoreStats(CompressedStoreStats& stats);
+
+    /* Prints the compressed store stats to the kernel log, including the
+     * effective compression ratio and decompression latency histogram.
+     */
+    void LogCompressedStoreStats();
+
+    struct PageMergeStats
+    {
+        size_t sharedPages;
+        size_t sharingPages;
+        size_t scannedPages;
+        size_t mergedPages;
+        size_t splitPages;
+    };
+
+    /* Takes a snapshot of the page merging counters. `sharedPages` is the
+     * number of merged pages currently in use, and `sharingPages` the number
+     * of additional references to them (i.e. the pages saved). The other
+     * counters are totals since boot.
+     */
+    void GetPageMergeStats(PageMergeStats& stats);
 }
@@ -38,6 +38,7 @@ namespace Npk
         ClFlush,
         ClFlushOpt,
         ClWb,
+        Monitor,
 
         Count
     };
@@ -59,7 +59,10 @@ namespace Npk
 
     void InitUarts();
     void InitMachineChecking();
+    void InitExtendedState();
+    void ConfigureExtendedState();
 
     void HandleDebugException(TrapFrame* frame, bool int3);
     void HandleMachineCheckException(TrapFrame* frame);
+    void HandleDeviceNotAvailable(TrapFrame* frame);
 }
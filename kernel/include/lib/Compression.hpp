@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Types.hpp"
+
+namespace sl
+{
+    /* Size (in bytes) of the scratch memory required by `LzCompress()`.
+     */
+    constexpr size_t LzWorkspaceSize = 2048;
+
+    /* Largest input `LzCompress()` will accept, matches are encoded with
+     * 16-bit offsets.
+     */
+    constexpr size_t LzMaxInputSize = 0xFFFF;
+
+    /* Compresses `srcLen` bytes at `src` into `dest` using a simple LZ77
+     * (LZ4-like) byte-oriented format, favouring speed over compression ratio.
+     * `workspace` must point to at least `LzWorkspaceSize` bytes of scratch
+     * memory. Returns the length of the compressed data, or 0 if the output
+     * would not fit within `destLen` bytes.
+     */
+    size_t LzCompress(const void* src, size_t srcLen, void* dest, 
+        size_t destLen, void* workspace);
+
+    /* Decompresses data produced by `LzCompress()`. Returns the number of
+     * bytes written to `dest`, or 0 if the input is malformed or the output
+     * would exceed `destLen` bytes.
+     */
+    size_t LzDecompress(const void* src, size_t srcLen, void* dest, 
+        size_t destLen);
+}
@@ -9,7 +9,14 @@
 namespace Npk::Private
 {
     void SetMyNodePointer(uintptr_t addr);
+    void InitCpuIsolation();
     void InitLocalScheduler(ThreadContext* idle);
+    void StartSchedulerTimers();
+    /* Becomes the idle thread of the current cpu, never returns. Must be
+     * called at passive IPL after `StartSchedulerTimers()`.
+     */
+    [[noreturn]]
+    void IdleLoop();
     void PrePassiveRunLevel();
     void OnPassiveRunLevel();
     void BeginWait();
@@ -17,6 +24,64 @@ namespace Npk::Private
     void WakeThread(ThreadContext* thread);
     void WorkThreadEntry(void* arg);
     void SignalTimerWaitable(Timer* timer);
+    /* Returns when the next event in the local cpu's clock queue expires.
+     * Must be called with interrupts disabled.
+     */
+    sl::TimePoint NextLocalClockExpiry();
+
+    /* Priority inheritance: `BoostThreadPriority()` raises the effective
+     * priority of `thread` to at least `priority`, returning the mutex the
+     * thread is blocked on (if any) so the boost can be passed along to its
+     * owner. `SetInheritedPriority()` replaces the inherited priority of
+     * `thread`, failing if another boost was applied since `seq` was read
+     * from `scheduling.inheritSeq`. `PropagatePriority()` walks a chain of
+     * blocked owners starting at `mutex`'s owner, boosting each of them.
+     */
+    Waitable* BoostThreadPriority(ThreadContext* thread, uint8_t priority);
+    bool SetInheritedPriority(ThreadContext* thread, uint8_t priority,
+        uint32_t seq);
+    void PropagatePriority(Waitable* mutex, uint8_t priority);
+
+    void InitRcu();
+    void RcuOnlineCpu();
+    /* Reports a quiescent state for the local cpu: it's not within an RCU
+     * read-side section. Must be called with interrupts disabled.
+     */
+    void RcuQuiescentState();
+
+    /* Scheduler tracing is only built if `NPK_HAS_SCHED_TRACE` is defined,
+     * otherwise `RecordSchedEvent()` compiles to nothing. When built, the
+     * cost of recording while tracing is disabled is a single predictable
+     * branch. `InitSchedTrace()` allocates the per-cpu trace rings and
+     * `StartSchedTraceDump()` starts periodically writing them to the log,
+     * if configured to.
+     */
+    extern sl::Atomic<bool> schedTraceEnabled;
+
+    void InitSchedTrace(uintptr_t& virtBase);
+    void StartSchedTraceDump();
+    void WriteSchedEvent(SchedEvent type, ThreadContext* thread, uint32_t arg);
+
+    SL_ALWAYS_INLINE
+    void RecordSchedEvent(SchedEvent type, ThreadContext* thread,
+        uint32_t arg)
+    {
+#ifdef NPK_HAS_SCHED_TRACE
+        if (SL_UNLIKELY(schedTraceEnabled.Load(sl::Relaxed)))
+            WriteSchedEvent(type, thread, arg);
+#else
+        (void)type;
+        (void)thread;
+        (void)arg;
+#endif
+    }
+
+    /* Implemented by the VM subsystem: evicts clean page cache pages and
+     * pushes anonymous pages out to swap (or the compressed store) until
+     * `count` pages are freed, returning how many were. May block on IO, so
+     * it must only be called at passive IPL.
+     */
+    size_t ReclaimAnonPages(size_t count);
 
     void AcquirePanicOutputs(LogSinkList& sinks);
 }
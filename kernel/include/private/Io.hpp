@@ -11,4 +11,35 @@ namespace Npk::Private
     bool UnrefIoInterface(IoInterface* ioi);
     void QueueContinuation(Iop* packet);
     void RunPendingIopContinuations();
+
+    /* Returns the number of contiguous bytes of `buffer` accessible at
+     * `*ptr`, starting `pos` bytes into the buffer (after `buffer.offset`).
+     * `ref` keeps any temporary mapping alive while the caller accesses the
+     * memory. Returns 0 if `pos` is out of range or the buffer type is not
+     * directly accessible by the kernel.
+     */
+    size_t GetIoBufferChunk(IoBuffer& buffer, size_t pos, char** ptr,
+        PageAccessRef& ref);
+
+    /* Performs a synchronous transfer between `pages` and `ioi`, starting at
+     * byte `offset`. Each page is transferred in full except the last, for
+     * which only `tailLength` bytes are used. Must be called from passive
+     * IPL. If the transfer fails and `abortCode` is non-null, the IOP's abort
+     * code (if any) is placed in `*abortCode`.
+     */
+    NpkStatus SyncPageIo(IoInterface* ioi, IoType type, size_t offset,
+        sl::Span<PageInfo*> pages, size_t tailLength, size_t* abortCode);
+
+    using PageIoCallback = void (*)(void* opaque, NpkStatus result,
+        size_t abortCode);
+
+    /* Asynchronous version of SyncPageIo(). Returns `Pending` once the
+     * transfer has been started, `callback` is then run with the result from
+     * a worker thread, so it must not block. Any other return value means
+     * the transfer was not started and `callback` will not be run. `pages`
+     * only needs to remain valid for the duration of this call.
+     */
+    NpkStatus StartPageIo(IoInterface* ioi, IoType type, size_t offset,
+        sl::Span<PageInfo*> pages, size_t tailLength, PageIoCallback callback,
+        void* opaque);
 }
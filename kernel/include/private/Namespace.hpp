@@ -9,4 +9,13 @@ namespace Npk::Private
     constexpr HeapTag HandleHeapTag = NPK_MAKE_HEAP_TAG("Hndl");
 
     void InitNamespace();
+    void InitFileObjects();
+
+    /* Implemented by the VM subsystem (vm/FileSource.cpp): file objects are
+     * backed by a file source, whose contents are held in the page cache.
+     */
+    NpkStatus CreateFileSource(VmSource** source, IoInterface* backing,
+        size_t length);
+    IoInterface* GetFileSourceIoInterface(VmSource& source);
+    NpkStatus FlushFileSource(VmSource& source);
 }
@@ -91,9 +91,14 @@ namespace Npk
         Mutex jobsMutex;
         JobList jobs;
         Credentials credentials;
+
+        sl::ListHook registryHook;
     };
 
+    using SessionList = sl::List<Session, &Session::registryHook>;
+
     void InitProcessSubsystem();
+    void InitSessionRegistry();
 
     void SessionDtor(void* obj);
     void JobDtor(void* obj);
@@ -6,33 +6,166 @@
 namespace Npk
 {
     struct NsObject;
+    struct IoBuffer;
 }
 
 namespace Npk::Private
 {
     constexpr auto VmSourceTag = NPK_MAKE_HEAP_TAG("VSrc");
+    constexpr auto WorkingSetTag = NPK_MAKE_HEAP_TAG("WSet");
 
     MmuFlags VmToMmuFlags(VmFlags flags, MmuFlags extra);
 
     NpkStatus CreateAnonPage(AnonPage** page);
     void DestroyAnonPage(AnonPage* page);
-    NpkStatus AnonPageGetPage(PageInfo** info, AnonPageRef page);
+    NpkStatus AnonPageGetPage(PageInfo** info, AnonPageRef page, bool write);
 
     NpkStatus CreateAnonMap(AnonMap** map, size_t slotCount);
     void DestroyAnonMap(AnonMap* map);
     NpkStatus ResizeAnonMap(AnonMap& map, size_t newSlotCount);
     AnonPageRef AnonMapLookup(AnonMap& map, size_t slot);
     NpkStatus AnonMapAdd(AnonMap& map, size_t slot, AnonPageRef& anon);
+    NpkStatus AnonMapAddPage(AnonMap& map, size_t slot, PageInfo* page);
     AnonPageRef AnonMapRemove(AnonMap& map, size_t slot);
     NpkStatus AnonMapClone(AnonMapRef* clone, AnonMap& source);
 
+    NpkStatus SwapIn(PageInfo** page, void* swapSlot);
+    void SwapSlotFree(void* swapSlot);
+
+    /* Handles returned by the compressed store are pointer aligned, while
+     * swap device handles always have the lowest bit set. Both are stored in
+     * AnonPage::swapSlot.
+     */
+    inline bool IsCompressedHandle(void* handle)
+    {
+        return (reinterpret_cast<uintptr_t>(handle) & 1) == 0;
+    }
+
+    void InitCompressedStore();
+    bool CompressedStoreEnabled();
+    NpkStatus CompressedStoreSave(void** handle, PageInfo* page);
+    NpkStatus CompressedStoreLoad(PageInfo* page, void* handle);
+    void CompressedStoreRef(void* handle);
+    void CompressedStoreFree(void* handle);
+
+    /* Page cache flags, stored in `PageInfo::vm.flags` for pages owned by a
+     * VmSource. Protected by the source mutex.
+     */
+    constexpr uint32_t CachePageBusy = 1 << 0; //contents not yet valid
+    constexpr uint32_t CachePageDirty = 1 << 1;
+    constexpr uint32_t CachePageWriteback = 1 << 2;
+    constexpr uint32_t CachePageMappedWrite = 1 << 3;
+    constexpr uint32_t CachePageMapped = 1 << 4; //never evicted
+    constexpr uint32_t CachePageReferenced = 1 << 5;
+
+    void InitPageCache(uintptr_t base, size_t length);
+    NpkStatus InitCacheSource(VmSource& source, const VmPagerOps* ops,
+        size_t length);
+    void DestroyCacheSource(VmSource& source);
+    NpkStatus CacheGetPage(PageInfo** page, VmSource& source, size_t index,
+        bool mapWrite);
+    NpkStatus CacheTransfer(VmSource& source, size_t offset, IoBuffer& buffer,
+        bool write);
+    /* Informs the cache of an access to `count` pages starting at `index`,
+     * made by the stream `state` belongs to. If the stream looks sequential
+     * (or `assumeSequential` is set) this may start reading ahead. The
+     * caller must serialize access to `state`.
+     */
+    void CacheReadahead(VmSource& source, ReadaheadState& state, size_t index,
+        size_t count, bool assumeSequential);
+    /* Starts reading any of `count` pages from `index` that aren't cached,
+     * without waiting for them.
+     */
+    void CachePrefetch(VmSource& source, size_t index, size_t count);
+    /* Fills `pages` with the cached pages starting at `index`, or null for
+     * any that aren't resident (or are still being read in). Returns the
+     * number of pages found, which are no longer evictable as the caller is
+     * expected to map them.
+     */
+    size_t CacheLookupPages(VmSource& source, size_t index,
+        sl::Span<PageInfo*> pages);
+    NpkStatus CacheWriteback(VmSource& source, size_t index, size_t count);
+    /* Frees up to `count` clean cached pages that aren't in use, returning
+     * the number freed. Only try-acquires locks, so it's safe to call from
+     * reclaim.
+     */
+    size_t EvictCachePages(size_t count);
+
+    void InitPageMerging();
+    /* Called when the last reference to a merged anon page is dropped.
+     */
+    void ForgetMergedPage(AnonPage* page);
+    /* Tries to return a merged anon page to being private, which is only
+     * possible if `page` is referenced by a single amap and the caller.
+     * Returns whether the page is private.
+     */
+    bool UnmergeAnonPage(AnonPage& page);
+    /* Replaces the merged anon page at `slot` in `amap` with a private copy,
+     * which is returned in `copy`. Assumes the mutex of the range owning
+     * `amap` is held.
+     */
+    NpkStatus SplitMergedPage(PageInfo** copy, AnonMap& amap, size_t slot,
+        AnonPageRef& anon);
+
+    void InitFaultAround();
+    /* Maps every page of `range` ahead of time, see VmFlag::Populate.
+     * Assumes `range.mutex` is held.
+     */
+    void PopulateRange(VmSpace& space, VmRange& range);
+
+    /* Finds the page backing `addr` in `range`, faulting it in first if
+     * `write` is set. If the page belongs to an anon page, a reference to
+     * it is placed in `anon`. Assumes `range.mutex` is held.
+     */
+    NpkStatus ResolveRangePage(PageInfo** page, AnonPageRef& anon,
+        VmSpace& space, VmRange& range, uintptr_t addr, bool write);
+
     VmSource* AnonSourceAttach(size_t size);
     VmSource* NamedSourceAttach(NsObject& obj);
     //VmSource* DeviceSourceAttach(); TODO: revisit after driver subsystem
 
+    /* Invalidates any TLB entries for `length` bytes starting at `base` on
+     * all cpus, returning once the remote flushes have completed.
+     */
+    void ShootdownTlbs(uintptr_t base, size_t length);
+
+    /* Maps `pages` to consecutive addresses starting at `vaddr`, walking the
+     * page tables once per leaf table rather than once per page. Existing
+     * mappings are left untouched. Returns the number of pages processed,
+     * which is only less than `pages.Size()` if a page table could not be
+     * allocated.
+     */
+    size_t SetMapRun(HwMap map, uintptr_t vaddr, sl::Span<PageInfo*> pages,
+        VmFlags flags);
+
     sl::Opt<Paddr> AllocatePageTable(size_t level);
     void FreePageTable(size_t level, Paddr paddr);
 
+    /* Allocation directly from the free tree of `space`, bypassing the
+     * quantum caches. `SpaceFreeBatch()` returns up to `MaxFreeBatch`
+     * allocations of the same length while acquiring the allocator mutex
+     * once.
+     */
+    constexpr size_t MaxFreeBatch = 32;
+    NpkStatus SpaceAllocUncached(VmSpace& space, uintptr_t* addr,
+        size_t length, AllocConstraints constr);
+    NpkStatus SpaceFreeBatch(VmSpace& space, sl::Span<uintptr_t> bases,
+        size_t length, sl::TimeCount timeout);
+
+    /* Per-cpu caches of small kernel address allocations, see
+     * vm/QuantumCache.cpp. These return false if the request isn't suitable
+     * for caching (or the cache can't satisfy it), in which case the caller
+     * should use the free tree. When a free is handled by the cache its
+     * status is stored in `result`.
+     */
+    void InitQuantumCaches();
+    bool QuantumCacheAlloc(VmSpace& space, uintptr_t* addr, size_t length,
+        const AllocConstraints& constr);
+    bool QuantumCacheFree(VmSpace& space, uintptr_t base, size_t length,
+        NpkStatus* result);
+
+    void InitKernelStacks();
+    void InitWorkingSetScanner();
     void InitPool(uintptr_t base, size_t length);
     void* PoolAlloc(size_t len, HeapTag tag, bool paged, sl::TimeCount timeout 
         = sl::NoTimeout);
@@ -144,6 +144,11 @@ namespace Npk
         while (packet->flags.Load(sl::Acquire).Has(IopFlag::Busy))
             sl::HintSpinloop();
 
+        //completion processing never ran (e.g. the IOP was cancelled and
+        //never progressed), so the pinned pages are still held.
+        if (packet->userPin != nullptr)
+            UnpinUserBuffer(packet->userPin);
+
         IoInterface* target = packet->frames[0].interface;
 
         bool isWired = packet->flags.Load(sl::Relaxed).Has(IopFlag::Wired);
@@ -472,6 +477,13 @@ namespace Npk
         if (status == IoStatus::Abort)
             abortCode = packet->abortCode.Load(sl::Relaxed);
 
+        if (packet->userPin != nullptr)
+        {
+            UnpinUserBuffer(packet->userPin);
+            packet->userPin = nullptr;
+            packet->buffers = {};
+        }
+
         if (completeCallback != nullptr)
             completeCallback(packet, completeCbArg);
         if (completeCondVar != nullptr)
@@ -563,4 +575,184 @@ namespace Npk
             return "<>";
         }
     }
+
+    size_t Private::GetIoBufferChunk(IoBuffer& buffer, size_t pos, char** ptr,
+        PageAccessRef& ref)
+    {
+        pos += buffer.offset;
+
+        switch (buffer.type)
+        {
+        case IoBufferType::KernelVirtual:
+            *ptr = reinterpret_cast<char*>(buffer.kernel.base + pos);
+            return buffer.offset + buffer.length - pos;
+
+        case IoBufferType::PageList:
+            {
+                const size_t index = pos >> PfnShift();
+                if (index >= buffer.physical.pages.Size())
+                    return 0;
+
+                const size_t pageOffset = pos & PageMask();
+                ref = AccessPage(&buffer.physical.pages[index]);
+                *ptr = static_cast<char*>(ref->value) + pageOffset;
+
+                return PageSize() - pageOffset;
+            }
+
+        default:
+            return 0;
+        }
+    }
+
+    //builds an IOP transferring `pages` to/from `ioi`, see SyncPageIo() for
+    //the meaning of the arguments.
+    static NpkStatus CreatePageIop(Iop** iop, IoBuffer** buffers,
+        IoInterface* ioi, IoType type, size_t offset,
+        sl::Span<PageInfo*> pages, size_t tailLength)
+    {
+        NPK_CHECK(ioi != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(!pages.Empty(), NpkStatus::InvalidArg);
+        NPK_CHECK(tailLength != 0 && tailLength <= PageSize(),
+            NpkStatus::InvalidArg);
+
+        const size_t count = pages.Size();
+        auto result = AllocIoBuffers(buffers, count, true);
+        if (result != NpkStatus::Success)
+            return result;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& buffer = (*buffers)[i];
+            buffer.type = IoBufferType::PageList;
+            buffer.offset = 0;
+            buffer.length = i + 1 == count ? tailLength : PageSize();
+            buffer.physical.pages = { pages[i], 1 };
+        }
+
+        IopParams params {};
+        params.readwrite.offset = offset;
+
+        result = CreateIop(iop, ioi, type, IopFlag::Wired, &params,
+            { *buffers, count });
+        if (result != NpkStatus::Success)
+            FreeIoBuffers(*buffers, count);
+
+        return result;
+    }
+
+    NpkStatus Private::SyncPageIo(IoInterface* ioi, IoType type, size_t offset,
+        sl::Span<PageInfo*> pages, size_t tailLength, size_t* abortCode)
+    {
+        Iop* iop;
+        IoBuffer* buffers;
+        auto result = CreatePageIop(&iop, &buffers, ioi, type, offset, pages,
+            tailLength);
+        if (result != NpkStatus::Success)
+            return result;
+
+        Condition complete {};
+        NPK_ASSERT(ResetCondition(&complete, 1) == NpkStatus::Success);
+        iop->completeCondition = &complete;
+
+        result = StartIop(iop, false);
+        if (result == NpkStatus::Pending)
+        {
+            WaitEntry entry {};
+            result = WaitOne(&complete, &entry, sl::NoTimeout,
+                NPK_WAIT_LOCATION);
+            if (result == NpkStatus::Success
+                && iop->status.Load(sl::Acquire) != IoStatus::Complete)
+                result = NpkStatus::InternalError;
+        }
+
+        if (result != NpkStatus::Success && abortCode != nullptr)
+        {
+            *abortCode = 0;
+            ReadIopAbortCode(abortCode, iop);
+        }
+
+        DestroyIop(iop);
+        FreeIoBuffers(buffers, pages.Size());
+
+        return result;
+    }
+
+    struct AsyncPageIo
+    {
+        WorkItem work;
+        Iop* iop;
+        IoBuffer* buffers;
+        size_t count;
+        Private::PageIoCallback callback;
+        void* opaque;
+    };
+
+    static void AsyncPageIoFinish(WorkItem* item, void* arg)
+    {
+        (void)item;
+        auto* request = static_cast<AsyncPageIo*>(arg);
+
+        NpkStatus result = NpkStatus::Success;
+        size_t abortCode = 0;
+        if (request->iop->status.Load(sl::Acquire) != IoStatus::Complete)
+        {
+            result = NpkStatus::InternalError;
+            ReadIopAbortCode(&abortCode, request->iop);
+        }
+
+        DestroyIop(request->iop);
+        FreeIoBuffers(request->buffers, request->count);
+
+        const auto callback = request->callback;
+        void* opaque = request->opaque;
+        PoolFreeWired(request, sizeof(*request), Private::IoHeapTag);
+
+        callback(opaque, result, abortCode);
+    }
+
+    //the completion callback runs while ProgressIop() still owns the IOP,
+    //so it can't be destroyed here. Defer the rest to a worker thread.
+    static void AsyncPageIoDone(Iop* packet, void* opaque)
+    {
+        (void)packet;
+
+        auto* request = static_cast<AsyncPageIo*>(opaque);
+        QueueWorkItem(&request->work, {});
+    }
+
+    NpkStatus Private::StartPageIo(IoInterface* ioi, IoType type,
+        size_t offset, sl::Span<PageInfo*> pages, size_t tailLength,
+        PageIoCallback callback, void* opaque)
+    {
+        NPK_CHECK(callback != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(CurrentIpl() == Ipl::Passive, NpkStatus::InvalidArg);
+
+        void* ptr = PoolAllocWired(sizeof(AsyncPageIo), IoHeapTag);
+        if (ptr == nullptr)
+            return NpkStatus::Shortage;
+        auto* request = new(ptr) AsyncPageIo {};
+
+        auto result = CreatePageIop(&request->iop, &request->buffers, ioi,
+            type, offset, pages, tailLength);
+        if (result != NpkStatus::Success)
+        {
+            PoolFreeWired(request, sizeof(*request), IoHeapTag);
+            return result;
+        }
+
+        request->count = pages.Size();
+        request->callback = callback;
+        request->opaque = opaque;
+        request->work.function = AsyncPageIoFinish;
+        request->work.arg = request;
+        request->iop->completeCallback = AsyncPageIoDone;
+        request->iop->callbackOpaque = request;
+
+        //once started the completion callback is always run, even if the
+        //IOP completes or aborts immediately.
+        StartIop(request->iop, false);
+
+        return NpkStatus::Pending;
+    }
 }
@@ -0,0 +1,141 @@
+#include <private/Io.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
+
+namespace Npk
+{
+    constexpr HeapTag RamDiskTag = NPK_MAKE_HEAP_TAG("RDsk");
+
+    enum class RamDiskError : size_t
+    {
+        BadIopType = 1,
+        BadRange,
+        BadBuffer,
+    };
+
+    struct RamDisk
+    {
+        IoInterface ioi;
+        size_t length;
+        size_t pageCount;
+        PageInfo** pages;
+    };
+
+    static IoStatus RamDiskBegin(Iop* iop, void* opaque, void** stash)
+    {
+        (void)stash;
+
+        auto* disk = static_cast<RamDisk*>(opaque);
+        auto& frame = iop->frames[iop->frameIndex];
+
+        if (iop->type != IoType::Read && iop->type != IoType::Write)
+        {
+            frame.abortCode = static_cast<size_t>(RamDiskError::BadIopType);
+            return IoStatus::Abort;
+        }
+
+        const bool write = iop->type == IoType::Write;
+        size_t diskOffset = iop->frames[0].params.readwrite.offset;
+
+        for (size_t i = 0; i < iop->buffers.Size(); i++)
+        {
+            auto& buffer = iop->buffers[i];
+            if (buffer.type == IoBufferType::None)
+                continue;
+
+            if (diskOffset + buffer.length > disk->length
+                || diskOffset + buffer.length < diskOffset)
+            {
+                frame.abortCode = static_cast<size_t>(RamDiskError::BadRange);
+                return IoStatus::Abort;
+            }
+
+            size_t done = 0;
+            while (done < buffer.length)
+            {
+                PageAccessRef bufferRef {};
+                char* bufferPtr = nullptr;
+                size_t chunk = Private::GetIoBufferChunk(buffer, done,
+                    &bufferPtr, bufferRef);
+                if (chunk == 0)
+                {
+                    frame.abortCode =
+                        static_cast<size_t>(RamDiskError::BadBuffer);
+                    return IoStatus::Abort;
+                }
+
+                const size_t diskPage = diskOffset >> PfnShift();
+                const size_t diskPageOffset = diskOffset & PageMask();
+                chunk = sl::Min(chunk, buffer.length - done);
+                chunk = sl::Min(chunk, PageSize() - diskPageOffset);
+
+                auto diskRef = AccessPage(disk->pages[diskPage]);
+                char* diskPtr = static_cast<char*>(diskRef->value)
+                    + diskPageOffset;
+
+                if (write)
+                    sl::MemCopy(diskPtr, bufferPtr, chunk);
+                else
+                    sl::MemCopy(bufferPtr, diskPtr, chunk);
+
+                done += chunk;
+                diskOffset += chunk;
+            }
+        }
+
+        return IoStatus::Complete;
+    }
+
+    NpkStatus CreateRamDisk(IoInterface** ioi, size_t length)
+    {
+        NPK_CHECK(ioi != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(length != 0, NpkStatus::InvalidArg);
+
+        length = AlignUpPage(length);
+        const size_t pageCount = length >> PfnShift();
+        const size_t pagesLength = pageCount * sizeof(PageInfo*);
+
+        void* ptr = PoolAllocWired(sizeof(RamDisk), RamDiskTag);
+        if (ptr == nullptr)
+            return NpkStatus::Shortage;
+        auto* disk = new(ptr) RamDisk {};
+
+        disk->pages = static_cast<PageInfo**>(
+            PoolAllocWired(pagesLength, RamDiskTag));
+        if (disk->pages == nullptr)
+        {
+            PoolFreeWired(disk, sizeof(*disk), RamDiskTag);
+            return NpkStatus::Shortage;
+        }
+
+        for (size_t i = 0; i < pageCount; i++)
+        {
+            disk->pages[i] = AllocPage(true);
+            if (disk->pages[i] != nullptr)
+                continue;
+
+            for (size_t j = 0; j < i; j++)
+                FreePage(disk->pages[j]);
+            PoolFreeWired(disk->pages, pagesLength, RamDiskTag);
+            PoolFreeWired(disk, sizeof(*disk), RamDiskTag);
+
+            return NpkStatus::Shortage;
+        }
+
+        disk->length = length;
+        disk->pageCount = pageCount;
+        disk->ioi.refcount = 1;
+        disk->ioi.parent = nullptr;
+        disk->ioi.opaque = disk;
+        disk->ioi.Begin = RamDiskBegin;
+        disk->ioi.End = nullptr;
+
+        auto conv = sl::ConvertUnits(length);
+        Log("Created ram disk %p, %zu.%zu %sB", LogLevel::Verbose, &disk->ioi,
+            conv.major, conv.minor, conv.prefix);
+
+        *ioi = &disk->ioi;
+        return NpkStatus::Success;
+    }
+}
@@ -0,0 +1,201 @@
+#include <lib/Compression.hpp>
+#include <lib/Memory.hpp>
+
+/* Each sequence starts with a token byte: the upper nibble is the literal
+ * count and the lower nibble is the match length (minus `MinMatch`). A nibble
+ * value of 15 means the length continues in following bytes, each adding
+ * 0-255, terminated by a byte less than 255. The token is followed by
+ * the literal bytes, then a 16-bit little-endian match offset. The last
+ * sequence only contains literals, and ends at the end of the input.
+ */
+namespace sl
+{
+    constexpr size_t MinMatch = 4;
+    constexpr size_t LastLiterals = 5;
+    constexpr size_t HashBits = 10;
+    constexpr size_t NibbleMax = 15;
+    static_assert(LzWorkspaceSize >= (1 << HashBits) * sizeof(uint16_t));
+
+    static inline uint32_t Read32(const uint8_t* ptr)
+    {
+        uint32_t value;
+        MemCopy(&value, ptr, sizeof(value));
+
+        return value;
+    }
+
+    static inline size_t Hash(uint32_t value)
+    {
+        return (value * 2654435761u) >> (32 - HashBits);
+    }
+
+    static bool WriteLength(uint8_t* dest, size_t& head, size_t limit, 
+        size_t length)
+    {
+        while (length >= 255)
+        {
+            if (head == limit)
+                return false;
+            dest[head++] = 255;
+            length -= 255;
+        }
+
+        if (head == limit)
+            return false;
+        dest[head++] = length;
+
+        return true;
+    }
+
+    static bool ReadLength(const uint8_t* src, size_t& head, size_t limit,
+        size_t& length)
+    {
+        while (true)
+        {
+            if (head == limit)
+                return false;
+
+            const uint8_t next = src[head++];
+            length += next;
+            if (next != 255)
+                return true;
+        }
+    }
+
+    static bool EmitSequence(uint8_t* dest, size_t& head, size_t limit, 
+        const uint8_t* literals, size_t literalCount, size_t offset, 
+        size_t matchLength)
+    {
+        if (head == limit)
+            return false;
+
+        const size_t matchCode = matchLength == 0 ? 0 : matchLength - MinMatch;
+        const size_t litNibble = literalCount < NibbleMax 
+            ? literalCount : NibbleMax;
+        const size_t matchNibble = matchCode < NibbleMax 
+            ? matchCode : NibbleMax;
+        dest[head++] = (litNibble << 4) | matchNibble;
+
+        if (litNibble == NibbleMax
+            && !WriteLength(dest, head, limit, literalCount - NibbleMax))
+            return false;
+
+        if (limit - head < literalCount)
+            return false;
+        MemCopy(dest + head, literals, literalCount);
+        head += literalCount;
+
+        if (matchLength == 0)
+            return true;
+
+        if (limit - head < 2)
+            return false;
+        dest[head++] = offset & 0xFF;
+        dest[head++] = offset >> 8;
+
+        if (matchNibble == NibbleMax
+            && !WriteLength(dest, head, limit, matchCode - NibbleMax))
+            return false;
+
+        return true;
+    }
+
+    size_t LzCompress(const void* src, size_t srcLen, void* dest, 
+        size_t destLen, void* workspace)
+    {
+        if (srcLen > LzMaxInputSize || workspace == nullptr)
+            return 0;
+
+        auto* input = static_cast<const uint8_t*>(src);
+        auto* output = static_cast<uint8_t*>(dest);
+        auto* table = static_cast<uint16_t*>(workspace);
+        MemSet(table, 0, (1 << HashBits) * sizeof(uint16_t));
+
+        size_t outHead = 0;
+        size_t anchor = 0;
+        size_t head = 0;
+        const size_t matchLimit = srcLen > LastLiterals 
+            ? srcLen - LastLiterals : 0;
+
+        while (head + MinMatch <= matchLimit)
+        {
+            const uint32_t sequence = Read32(input + head);
+            const size_t hash = Hash(sequence);
+            const size_t candidate = table[hash];
+            table[hash] = head + 1; //zero means no entry
+
+            if (candidate == 0 || Read32(input + candidate - 1) != sequence)
+            {
+                head++;
+                continue;
+            }
+
+            const size_t matchBegin = candidate - 1;
+            size_t length = MinMatch;
+            while (head + length < matchLimit 
+                && input[matchBegin + length] == input[head + length])
+                length++;
+
+            if (!EmitSequence(output, outHead, destLen, input + anchor, 
+                head - anchor, head - matchBegin, length))
+                return 0;
+
+            head += length;
+            anchor = head;
+        }
+
+        if (!EmitSequence(output, outHead, destLen, input + anchor, 
+            srcLen - anchor, 0, 0))
+            return 0;
+
+        return outHead;
+    }
+
+    size_t LzDecompress(const void* src, size_t srcLen, void* dest, 
+        size_t destLen)
+    {
+        auto* input = static_cast<const uint8_t*>(src);
+        auto* output = static_cast<uint8_t*>(dest);
+
+        size_t head = 0;
+        size_t outHead = 0;
+        while (head < srcLen)
+        {
+            const uint8_t token = input[head++];
+
+            size_t literalCount = token >> 4;
+            if (literalCount == NibbleMax
+                && !ReadLength(input, head, srcLen, literalCount))
+                return 0;
+
+            if (srcLen - head < literalCount || destLen - outHead < literalCount)
+                return 0;
+            MemCopy(output + outHead, input + head, literalCount);
+            head += literalCount;
+            outHead += literalCount;
+
+            if (head == srcLen)
+                break;
+
+            if (srcLen - head < 2)
+                return 0;
+            const size_t offset = input[head] | (input[head + 1] << 8);
+            head += 2;
+
+            size_t length = token & NibbleMax;
+            if (length == NibbleMax && !ReadLength(input, head, srcLen, length))
+                return 0;
+            length += MinMatch;
+
+            if (offset == 0 || offset > outHead 
+                || destLen - outHead < length)
+                return 0;
+
+            //matches may overlap their own output, copy bytewise.
+            for (size_t i = 0; i < length; i++, outHead++)
+                output[outHead] = output[outHead - offset];
+        }
+
+        return outHead;
+    }
+}
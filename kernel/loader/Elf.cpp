@@ -21,11 +21,6 @@ namespace Npk::Private
         return NpkStatus::Unsupported;
     }
 
-    static NpkStatus GetFileObjectSize(size_t* size, NsObject& source)
-    {
-        NPK_UNREACHABLE();
-    }
-
     NpkStatus LoadElf(VmSpace& space, uintptr_t loadBase, NsObject& source)
     {
         Elf_Char ELFCLASS_CURRENT = ELFCLASSNONE;
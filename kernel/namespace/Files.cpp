@@ -0,0 +1,101 @@
+#include <private/Namespace.hpp>
+
+namespace Npk
+{
+    struct NsFile : public NsObject
+    {
+        VmSource* source;
+    };
+
+    static void FileObjDtor(void* obj)
+    {
+        auto* file = static_cast<NsFile*>(obj);
+        if (file->source != nullptr)
+            file->source->ops->UnrefObj(file->source);
+        file->source = nullptr;
+    }
+
+    static NsFile* AsFile(NsObject& obj)
+    {
+        if (GetObjectType(obj) != NsObjType::File)
+            return nullptr;
+
+        return static_cast<NsFile*>(&obj);
+    }
+
+    void Private::InitFileObjects()
+    {
+        SetObjectTypeInfo(NsObjType::File, FileObjDtor, sizeof(NsFile),
+            NamespaceHeapTag);
+    }
+
+    NpkStatus CreateFileObject(NsObject** ptr, NsObjFlags flags,
+        sl::StringSpan name, IoInterface* backing, size_t length)
+    {
+        NPK_CHECK(ptr != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(backing != nullptr, NpkStatus::InvalidArg);
+
+        VmSource* source;
+        auto result = Private::CreateFileSource(&source, backing, length);
+        if (result != NpkStatus::Success)
+            return result;
+
+        NsObject* obj;
+        result = CreateObject(&obj, NsObjType::File, flags, name, 0);
+        if (result != NpkStatus::Success)
+        {
+            source->ops->UnrefObj(source);
+            return result;
+        }
+
+        static_cast<NsFile*>(obj)->source = source;
+        *ptr = obj;
+
+        return NpkStatus::Success;
+    }
+
+    NpkStatus GetFileObjectSize(size_t* size, NsObject& obj)
+    {
+        NPK_CHECK(size != nullptr, NpkStatus::InvalidArg);
+
+        NsFile* file = AsFile(obj);
+        if (file == nullptr)
+            return NpkStatus::BadObject;
+
+        *size = file->source->length;
+        return NpkStatus::Success;
+    }
+
+    NpkStatus GetFileObjectVmSource(VmSource** vsrc, NsObject& obj)
+    {
+        NPK_CHECK(vsrc != nullptr, NpkStatus::InvalidArg);
+
+        NsFile* file = AsFile(obj);
+        if (file == nullptr)
+            return NpkStatus::BadObject;
+
+        *vsrc = file->source;
+        return NpkStatus::Success;
+    }
+
+    NpkStatus GetFileObjectIoInterface(IoInterface** ioi, NsObject& obj)
+    {
+        NPK_CHECK(ioi != nullptr, NpkStatus::InvalidArg);
+
+        NsFile* file = AsFile(obj);
+        if (file == nullptr)
+            return NpkStatus::BadObject;
+
+        *ioi = Private::GetFileSourceIoInterface(*file->source);
+        return *ioi == nullptr ? NpkStatus::InternalError : NpkStatus::Success;
+    }
+
+    NpkStatus FlushFileObject(NsObject& obj)
+    {
+        NsFile* file = AsFile(obj);
+        if (file == nullptr)
+            return NpkStatus::BadObject;
+
+        return Private::FlushFileSource(*file->source);
+    }
+}
@@ -75,6 +75,7 @@ namespace Npk
     {
         SetObjectTypeInfo(NsObjType::Directory, DirectoryObjDtor, 
             sizeof(NsDirectory), NamespaceHeapTag);
+        InitFileObjects();
 
         NsObjFlags flags = NsObjFlag::Wired;
         auto result = CreateObject(&rootObj, NsObjType::Directory, flags, 
@@ -5,6 +5,7 @@ namespace Npk
 {
     void InitProcessSubsystem()
     {
+        InitSessionRegistry();
         SetObjectTypeInfo(NsObjType::Session, SessionDtor, sizeof(Session), 
             ProcTreeTag);
         SetObjectTypeInfo(NsObjType::Job, JobDtor, sizeof(Job), ProcTreeTag);
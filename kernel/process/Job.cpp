@@ -1,7 +1,18 @@
 #include <private/Process.hpp>
+#include <lib/Maths.hpp>
 
 namespace Npk
 {
+    //all sessions ever created, sessions are never destroyed (yet) so this
+    //only grows.
+    static Mutex sessionsMutex;
+    static SessionList sessions;
+
+    void InitSessionRegistry()
+    {
+        ResetMutex(&sessionsMutex, 1);
+    }
+
     void SessionDtor(void* obj)
     {
         NPK_UNREACHABLE(); (void)obj;
@@ -52,6 +63,16 @@ namespace Npk
         auto* seshPtr = reinterpret_cast<Session*>(ptr);
         ResetMutex(&seshPtr->jobsMutex, 1);
 
+        result = AcquireMutex(&sessionsMutex, sl::NoTimeout);
+        if (result != NpkStatus::Success)
+        {
+            UnrefSession(*seshPtr);
+
+            return NpkStatus::LockAcquireFailed;
+        }
+        sessions.PushBack(seshPtr);
+        ReleaseMutex(&sessionsMutex);
+
         *sesh = seshPtr;
         return NpkStatus::Success;
     }
@@ -94,6 +115,68 @@ namespace Npk
         return NpkStatus::Success;
     }
 
+    NpkStatus GetJobWorkingSet(Job& job, WorkingSetInfo* info)
+    {
+        if (info == nullptr)
+            return NpkStatus::InvalidArg;
+
+        auto result = AcquireMutex(&job.processesMutex, sl::NoTimeout);
+        if (result != NpkStatus::Success)
+            return NpkStatus::LockAcquireFailed;
+
+        *info = {};
+        for (auto it = job.processes.Begin(); it != job.processes.End(); ++it)
+        {
+            WorkingSetInfo spaceInfo;
+            if (SpaceGetWorkingSet(it->vmSpace, &spaceInfo)
+                != NpkStatus::Success)
+                continue;
+
+            for (size_t i = 0; i < WorkingSetBuckets; i++)
+                info->idlePages[i] += spaceInfo.idlePages[i];
+            info->mappedPages += spaceInfo.mappedPages;
+            info->completedPasses += spaceInfo.completedPasses;
+            info->lastPassNs = sl::Max(info->lastPassNs, spaceInfo.lastPassNs);
+        }
+        ReleaseMutex(&job.processesMutex);
+
+        return NpkStatus::Success;
+    }
+
+    size_t SwapOutProcesses(size_t count)
+    {
+        //this is called when reclaiming memory, possibly on behalf of an
+        //allocation made while holding any of these mutexes: they're only
+        //ever try-acquired here.
+        if (AcquireMutex(&sessionsMutex, {}) != NpkStatus::Success)
+            return 0;
+
+        size_t released = 0;
+        for (auto sesh = sessions.Begin(); sesh != sessions.End()
+            && released < count; ++sesh)
+        {
+            if (AcquireMutex(&sesh->jobsMutex, {}) != NpkStatus::Success)
+                continue;
+
+            for (auto job = sesh->jobs.Begin(); job != sesh->jobs.End()
+                && released < count; ++job)
+            {
+                if (AcquireMutex(&job->processesMutex, {})
+                    != NpkStatus::Success)
+                    continue;
+
+                for (auto proc = job->processes.Begin();
+                    proc != job->processes.End() && released < count; ++proc)
+                    released += SwapOutSpace(proc->vmSpace, count - released);
+                ReleaseMutex(&job->processesMutex);
+            }
+            ReleaseMutex(&sesh->jobsMutex);
+        }
+        ReleaseMutex(&sessionsMutex);
+
+        return released;
+    }
+
     void UnrefSession(Session& sesh)
     {
         UnrefObject(sesh.nsObj);
@@ -9,12 +9,20 @@ namespace Npk::Private
     constexpr size_t AmapMaxLevels = (sizeof(size_t) * 8 + TableEntryBits - 1) 
         / TableEntryBits;
 
+    /* Lookups walk the tables without taking the amap mutex, inside an RCU
+     * read-side section. Tables unlinked from the tree are freed with
+     * `RcuCall()`, as is the memory of anon pages: a lookup may still find a
+     * leaf entry after it's removed, but it only takes a reference if the
+     * anon page's refcount hasn't already dropped to zero. Modifications
+     * are still serialized by the amap mutex, and never wait for lookups.
+     */
     struct AnonTable
     {
-        void* entries[TableEntryCount];
+        sl::Atomic<void*> entries[TableEntryCount];
+        RcuHead rcuHead;
+        uint8_t level;
         uint8_t validCount;
     };
-    static_assert(sizeof(void*) >= sizeof(AnonPageRef));
 
     struct AmapPathEntry
     {
@@ -43,39 +51,74 @@ namespace Npk::Private
         return slot;
     }
 
-    static AnonTable* AllocAnonTable()
+    //returns whether `slot` can be reached from a root table at `level`.
+    constexpr bool AnonTableCovers(size_t level, size_t slot)
+    {
+        const size_t shift = (level + 1) * TableEntryBits;
+        if (shift >= sizeof(slot) * 8)
+            return true;
+
+        return (slot >> shift) == 0;
+    }
+
+    //leaf entries hold a reference to their anon page as a raw pointer, this
+    //hands that reference over to an AnonPageRef.
+    static AnonPageRef AdoptLeaf(void* entry)
+    {
+        AnonPageRef ref = static_cast<AnonPage*>(entry);
+        ref->refcount--;
+
+        return ref;
+    }
+
+    static AnonTable* AllocAnonTable(size_t level)
     {
         void* ptr = PoolAllocWired(sizeof(AnonTable), AmapTag);
         if (ptr == nullptr)
             return nullptr;
 
-        return new(ptr) AnonTable {};
+        auto* table = new(ptr) AnonTable {};
+        table->level = level;
+
+        return table;
     }
 
-    static void FreeAnonTable(AnonTable* table, size_t level)
+    static void FreeAnonTable(AnonTable* table)
     {
         NPK_ASSERT(table != nullptr);
 
         for (size_t i = 0; i < TableEntryCount; i++)
         {
-            if (level == 0)
-            {
-                AnonPageRef ref = sl::Move(
-                    *reinterpret_cast<AnonPageRef*>(&table->entries[i]));
-
-                //`ref` goes out of scope here, the RAII type will cause the
-                //refcount of the anon page to be decremented.
+            void* entry = table->entries[i].Load(sl::Relaxed);
+            if (entry == nullptr)
                 continue;
-            }
 
-            AnonTable* ref = static_cast<AnonTable*>(table->entries[i]);
-            if (ref != nullptr)
-                FreeAnonTable(ref, level - 1);
+            //the adopted reference is dropped immediately.
+            if (table->level == 0)
+                AdoptLeaf(entry);
+            else
+                FreeAnonTable(static_cast<AnonTable*>(entry));
         }
 
         PoolFreeWired(table, sizeof(*table), AmapTag);
     }
 
+    static void AnonTableGraceElapsed(RcuHead* head)
+    {
+        auto* table = reinterpret_cast<AnonTable*>(
+            reinterpret_cast<uintptr_t>(head) - offsetof(AnonTable, rcuHead));
+        PoolFreeWired(table, sizeof(*table), AmapTag);
+    }
+
+    //NOTE: `table` must already be unlinked. Any tables it points to are
+    //still part of the tree.
+    static void RetireAnonTable(AnonTable* table)
+    {
+        RcuCall(&table->rcuHead, AnonTableGraceElapsed);
+    }
+
+    //NOTE: assumes map.mutex is held. `path` describes the tables above
+    //`begin`, empty tables are unlinked from the bottom up and retired.
     static void FreeEmptyTables(AnonMap& map, AmapPathEntry* path, 
         size_t depth, AnonTable* begin)
     {
@@ -86,8 +129,8 @@ namespace Npk::Private
         {
             if (depth == 0)
             {
-                map.slots = nullptr;
-                PoolFreeWired(begin, sizeof(*begin), AmapTag);
+                map.slots.Store(nullptr, sl::Release);
+                RetireAnonTable(begin);
 
                 return;
             }
@@ -95,8 +138,8 @@ namespace Npk::Private
             depth--;
             auto& point = path[depth];
 
-            point.table->entries[point.index] = nullptr;
-            PoolFreeWired(begin, sizeof(AnonTable), AmapTag);
+            point.table->entries[point.index].Store(nullptr, sl::Release);
+            RetireAnonTable(begin);
             begin = point.table;
 
             point.table->validCount--;
@@ -121,31 +164,140 @@ namespace Npk::Private
         return NpkStatus::Success;
     }
 
+    static void AnonPageGraceElapsed(RcuHead* head)
+    {
+        auto* page = reinterpret_cast<AnonPage*>(
+            reinterpret_cast<uintptr_t>(head) - offsetof(AnonPage, rcuHead));
+        PoolFreeWired(page, sizeof(*page), AnonPageTag);
+    }
+
     void DestroyAnonPage(AnonPage* page)
     {
         NPK_ASSERT(page != nullptr);
         NPK_ASSERT(page->refcount == 0);
 
-        //ensure we're not leaking any resources (these pointers should be
-        //null if there's nothing attached).
-        NPK_ASSERT(page->swapSlot == nullptr);
-        NPK_ASSERT(page->page == nullptr);
-
-        PoolFreeWired(page, sizeof(*page), AnonPageTag);
+        //release any resources still attached, no one else can reference
+        //this anon page so there's no need to take the lock.
+        if (page->merged)
+            ForgetMergedPage(page);
+        if (page->swapSlot != nullptr)
+            SwapSlotFree(page->swapSlot);
+        if (page->page != nullptr)
+            FreePage(page->page);
+
+        //amap lookups may still be looking at the refcount.
+        RcuCall(&page->rcuHead, AnonPageGraceElapsed);
     }
 
-    NpkStatus AnonPageGetPage(PageInfo** info, AnonPageRef page)
+    NpkStatus AnonPageGetPage(PageInfo** info, AnonPageRef page, bool write)
     {
         if (!page.Valid())
             return NpkStatus::InvalidArg;
         if (info == nullptr)
             return NpkStatus::InvalidArg;
 
+        //fast path: page is resident. If this is a write access the copy in
+        //swap (if any) is about to become stale, so release it.
+        void* staleSlot = nullptr;
+        page->lock.Lock();
+        void* swapSlot = page->swapSlot;
+        if (page->page != nullptr)
+        {
+            *info = page->page;
+            if (write)
+            {
+                staleSlot = page->swapSlot;
+                page->swapSlot = nullptr;
+                page->lazyFree = false;
+            }
+            page->lock.Unlock();
+
+            if (staleSlot != nullptr)
+                SwapSlotFree(staleSlot);
+            return NpkStatus::Success;
+        }
+
+        //the anon page owns the compressed entry and only drops it with the
+        //lock held, so take our own reference while we can.
+        const bool compressed = swapSlot != nullptr
+            && IsCompressedHandle(swapSlot);
+        if (compressed)
+            CompressedStoreRef(swapSlot);
+        page->lock.Unlock();
+
+        if (swapSlot == nullptr)
+            return NpkStatus::NotAvailable;
+
+        if (compressed)
+        {
+            //page is held by the compressed store, decompress it into a
+            //fresh page without holding the anon lock. Like swapping in,
+            //the first thread to finish installs its copy. The entry is
+            //released afterwards, since the store holds no copy of resident
+            //pages.
+            PageInfo* incoming = AllocPage(false);
+            auto result = CompressedStoreLoad(incoming, swapSlot);
+            if (result != NpkStatus::Success)
+            {
+                FreePage(incoming);
+                CompressedStoreFree(swapSlot);
+                return result;
+            }
+
+            page->lock.Lock();
+            if (page->page == nullptr && page->swapSlot == swapSlot)
+            {
+                page->page = incoming;
+                page->swapSlot = nullptr;
+                if (write)
+                    page->lazyFree = false;
+                incoming = nullptr;
+                staleSlot = swapSlot;
+            }
+            *info = page->page;
+            result = *info == nullptr ? NpkStatus::NotAvailable
+                : NpkStatus::Success;
+            page->lock.Unlock();
+
+            if (incoming != nullptr)
+                FreePage(incoming);
+            if (staleSlot != nullptr)
+                CompressedStoreFree(staleSlot);
+            CompressedStoreFree(swapSlot);
+
+            return result;
+        }
+
+        //slow path: page is in swap. Multiple threads may race to bring it
+        //back in, the first to finish wins and the others free their copies.
+        PageInfo* incoming;
+        auto result = SwapIn(&incoming, swapSlot);
+        if (result != NpkStatus::Success)
+            return result;
+
         page->lock.Lock();
-        //TODO: get pageinfo or page it in
-        auto result = NpkStatus::NotAvailable;
+        if (page->page == nullptr && page->swapSlot == swapSlot)
+        {
+            page->page = incoming;
+            incoming = nullptr;
+
+            if (write)
+            {
+                staleSlot = page->swapSlot;
+                page->swapSlot = nullptr;
+                page->lazyFree = false;
+            }
+        }
+        *info = page->page;
+        result = *info == nullptr ? NpkStatus::NotAvailable 
+            : NpkStatus::Success;
         page->lock.Unlock();
 
+        if (incoming != nullptr)
+            FreePage(incoming);
+        if (staleSlot != nullptr)
+            SwapSlotFree(staleSlot);
+
         return result;
     }
 
@@ -183,12 +335,10 @@ namespace Npk::Private
         NPK_ASSERT(map != nullptr);
         NPK_ASSERT(map->refcount == 0);
 
-        if (map->slotCount != 0)
-        {
-            auto table = static_cast<AnonTable*>(map->slots);
-            const size_t levels = AnonTableLevels(map->slotCount);
-            FreeAnonTable(table, levels - 1);
-        }
+        //lookups hold a reference to the map, so there are none left.
+        auto* root = static_cast<AnonTable*>(map->slots.Load(sl::Acquire));
+        if (root != nullptr)
+            FreeAnonTable(root);
 
         PoolFreeWired(map, sizeof(*map), AmapTag);
     }
@@ -220,21 +370,25 @@ namespace Npk::Private
             return NpkStatus::Success;
         }
 
-        if (map.slots != nullptr)
+        if (map.slots.Load(sl::Relaxed) != nullptr)
         {
             //there is already a table structure allocated, create a new
-            //set of tables to point to the existing mappings.
+            //set of tables to point to the existing mappings. Lookups use the
+            //level of the root table they find, so they see a consistent
+            //tree at every step.
             for (size_t i = curLevels; i != newLevels; i++)
             {
-                auto* table = AllocAnonTable();
+                auto* table = AllocAnonTable(i);
                 if (table == nullptr)
                 {
                     const size_t added = i - curLevels;
                     for (size_t j = 0; j < added; j++)
                     {
-                        auto* wrapper = static_cast<AnonTable*>(map.slots);
-                        map.slots = wrapper->entries[0];
-                        PoolFreeWired(wrapper, sizeof(AnonTable), AmapTag);
+                        auto* wrapper = static_cast<AnonTable*>(
+                            map.slots.Load(sl::Relaxed));
+                        map.slots.Store(wrapper->entries[0].Load(sl::Relaxed),
+                            sl::Release);
+                        RetireAnonTable(wrapper);
                     }
 
                     ReleaseMutex(&map.mutex);
@@ -242,10 +396,10 @@ namespace Npk::Private
                     return NpkStatus::Shortage;
                 }
 
-                auto* curRoot = static_cast<AnonTable*>(map.slots);
-                table->entries[0] = curRoot;
+                table->entries[0].Store(map.slots.Load(sl::Relaxed),
+                    sl::Relaxed);
                 table->validCount = 1;
-                map.slots = table;
+                map.slots.Store(table, sl::Release);
             }
         }
         //else: no existing tables, we'll do it lazily.
@@ -260,37 +414,34 @@ namespace Npk::Private
     {
         AnonMapRef mapRef = &map;
 
-        auto result = AcquireMutex(&map.mutex, sl::NoTimeout);
-        if (result != NpkStatus::Success)
-            return {};
-
-        if (slot >= map.slotCount)
-        {
-            ReleaseMutex(&map.mutex);
-
-            return {};
-        }
+        const Ipl prevIpl = RcuReadLock();
 
+        //`slotCount` can change underneath us, so the root table's level is
+        //used to bound the walk instead. Slots past `slotCount` are always
+        //empty.
         AnonPageRef ref {};
-
-        const size_t levels = AnonTableLevels(map.slotCount);
-        auto* table = static_cast<AnonTable*>(map.slots);
-        for (size_t i = levels; table != nullptr && i != 0; i--)
+        auto* table = static_cast<AnonTable*>(map.slots.Load(sl::Acquire));
+        if (table != nullptr && AnonTableCovers(table->level, slot))
         {
-            const size_t level = i - 1;
-            const size_t index = AnonTableIndex(level, slot);
-
-            auto* entry = table->entries[index];
-            if (entry == nullptr)
-                break;
-
-            if (level == 0)
-                ref = *reinterpret_cast<AnonPageRef*>(&entry);
-            else
-                table = static_cast<AnonTable*>(entry);
+            for (size_t level = table->level + 1; level != 0; level--)
+            {
+                const size_t index = AnonTableIndex(level - 1, slot);
+
+                void* entry = table->entries[index].Load(sl::Acquire);
+                if (entry == nullptr)
+                    break;
+
+                //the anon page isn't freed until we're done, but its last
+                //reference may already have been dropped, in which case
+                //`ref` stays empty.
+                if (level == 1)
+                    ref = static_cast<AnonPage*>(entry);
+                else
+                    table = static_cast<AnonTable*>(entry);
+            }
         }
 
-        ReleaseMutex(&map.mutex);
+        RcuReadUnlock(prevIpl);
 
         return ref;
     }
@@ -310,33 +461,47 @@ namespace Npk::Private
             return NpkStatus::InvalidArg;
         }
 
-        if (map.slots == nullptr)
+        const size_t levels = AnonTableLevels(map.slotCount);
+        auto* table = static_cast<AnonTable*>(map.slots.Load(sl::Relaxed));
+        if (table == nullptr)
         {
-            map.slots = AllocAnonTable();
+            table = AllocAnonTable(levels - 1);
 
-            if (map.slots == nullptr)
+            if (table == nullptr)
             {
                 ReleaseMutex(&map.mutex);
 
                 return NpkStatus::Shortage;
             }
+            map.slots.Store(table, sl::Release);
         }
 
         AmapPathEntry path[AmapMaxLevels];
         size_t pathDepth = 0;
+        void* replaced = nullptr;
 
-        const size_t levels = AnonTableLevels(map.slotCount);
-        auto* table = static_cast<AnonTable*>(map.slots);
+        //new tables and anon pages are fully set up before being published
+        //to lookups.
         for (size_t i = levels; i != 0; i--)
         {
             const size_t level = i - 1;
             const size_t index = AnonTableIndex(level, slot);
+            auto& entry = table->entries[index];
 
-            auto* entry = table->entries[index];
-            if (entry == nullptr && level != 0)
+            if (level == 0)
             {
-                auto* newTable = AllocAnonTable();
-                if (newTable == nullptr)
+                anon->refcount++;
+                replaced = entry.Exchange(&*anon, sl::AcqRel);
+                if (replaced == nullptr)
+                    table->validCount++;
+                break;
+            }
+
+            auto* next = static_cast<AnonTable*>(entry.Load(sl::Relaxed));
+            if (next == nullptr)
+            {
+                next = AllocAnonTable(level - 1);
+                if (next == nullptr)
                 {
                     if (table->validCount == 0)
                         FreeEmptyTables(map, path, pathDepth, table);
@@ -345,32 +510,46 @@ namespace Npk::Private
                     return NpkStatus::Shortage;
                 }
 
-                table->entries[index] = newTable;
+                entry.Store(next, sl::Release);
                 table->validCount++;
-                entry = newTable;
             }
 
-            if (level == 0)
-            {
-                auto& ref =
-                    *reinterpret_cast<AnonPageRef*>(&table->entries[index]);
-                if (!ref.Valid())
-                    table->validCount++;
-                ref = anon;
-                break;
-            }
-            else
-            {
-                path[pathDepth++] = { table, index };
-                table = static_cast<AnonTable*>(entry);
-            }
+            path[pathDepth++] = { table, index };
+            table = next;
         }
 
         ReleaseMutex(&map.mutex);
 
+        if (replaced != nullptr)
+            AdoptLeaf(replaced);
+
         return NpkStatus::Success;
     }
 
+    NpkStatus AnonMapAddPage(AnonMap& map, size_t slot, PageInfo* page)
+    {
+        AnonPage* anon;
+        auto result = CreateAnonPage(&anon);
+        if (result != NpkStatus::Success)
+            return result;
+
+        //the lock isn't necessary here, I'm using it for ordering.
+        anon->lock.Lock();
+        anon->page = page;
+        anon->lock.Unlock();
+
+        //hand the initial reference over to `ref`, afterwards the amap holds
+        //the only reference.
+        AnonPageRef ref = anon;
+        anon->refcount--;
+
+        result = AnonMapAdd(map, slot, ref);
+        if (result != NpkStatus::Success)
+            anon->page = nullptr; //page stays with the caller
+
+        return result;
+    }
+
     AnonPageRef AnonMapRemove(AnonMap& map, size_t slot)
     {
         AnonMapRef mapRef = &map;
@@ -379,7 +558,8 @@ namespace Npk::Private
         if (result != NpkStatus::Success)
             return {};
 
-        if (map.slots == nullptr || slot >= map.slotCount)
+        auto* table = static_cast<AnonTable*>(map.slots.Load(sl::Relaxed));
+        if (table == nullptr || slot >= map.slotCount)
         {
             ReleaseMutex(&map.mutex);
 
@@ -389,22 +569,21 @@ namespace Npk::Private
         AmapPathEntry path[AmapMaxLevels];
         size_t pathDepth = 0;
 
-        AnonPageRef ref {};
+        void* removed = nullptr;
         const size_t levels = AnonTableLevels(map.slotCount);
-        auto* table = static_cast<AnonTable*>(map.slots);
         for (size_t i = levels; i != 0; i--)
         {
             const size_t level = i - 1;
             const size_t index = AnonTableIndex(level, slot);
 
-            auto* entry = table->entries[index];
+            void* entry = table->entries[index].Load(sl::Relaxed);
             if (entry == nullptr)
                 break;
 
             if (level == 0)
             {
-                ref = sl::Move(
-                    *reinterpret_cast<AnonPageRef*>(&table->entries[index]));
+                removed = entry;
+                table->entries[index].Store(nullptr, sl::Release);
 
                 table->validCount--;
                 if (table->validCount == 0)
@@ -419,7 +598,9 @@ namespace Npk::Private
 
         ReleaseMutex(&map.mutex);
 
-        return ref;
+        if (removed == nullptr)
+            return {};
+        return AdoptLeaf(removed);
     }
 
     NpkStatus AnonMapClone(AnonMapRef* clone, AnonMap& source)
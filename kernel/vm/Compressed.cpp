@@ -0,0 +1,553 @@
+#include <private/Vm.hpp>
+#include <lib/Compression.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
+
+/* The compressed store is an in-memory tier that sits in front of swap
+ * devices: reclaim first tries to compress cold anon pages, and only writes
+ * them out to a device if they don't compress well. Pages filled with a
+ * repeating 64-bit value are stored without any backing memory.
+ * Compressed blobs are packed into pages divided into fixed size slots, with
+ * one list of partially used pages per size class. Pages are accessed via
+ * the temporary mapping cache, so the store does not consume address space.
+ */
+namespace Npk::Private
+{
+    constexpr HeapTag CompressedTag = NPK_MAKE_HEAP_TAG("Cmpr");
+    constexpr size_t ClassGranularity = 64;
+    constexpr size_t MaxSizeClasses = 64;
+    constexpr size_t SlotsBitmapBits = sizeof(uint64_t) * 8;
+    constexpr size_t DefaultReserveDepth = 64;
+
+    struct CompressedPage
+    {
+        sl::ListHook hook;
+        PageInfo* page;
+        uint64_t freeSlots;
+        uint16_t usedCount;
+        uint8_t sizeClass;
+    };
+
+    using CompressedPageList = sl::List<CompressedPage, &CompressedPage::hook>;
+
+    struct SizeClass
+    {
+        sl::SpinLock lock;
+        size_t slotSize;
+        size_t slotCount;
+        CompressedPageList partial;
+        CompressedPageList full;
+    };
+
+    struct CompressedEntry
+    {
+        CompressedPage* page; //null if this entry is same-filled
+        uint64_t fill;
+        sl::Atomic<uint32_t> refs;
+        uint16_t slot;
+        uint16_t length;
+    };
+
+    //each cpu compresses into its own scratch buffer, at Ipl::Dpc so the
+    //buffer can't be used by another thread part way through.
+    struct CompressorBuffers
+    {
+        void* scratch;
+        void* workspace;
+    };
+
+    //a free struct in one of the store's reserves.
+    struct ReserveNode
+    {
+        ReserveNode* next;
+    };
+
+    struct StructReserve
+    {
+        ReserveNode* head;
+        size_t count;
+    };
+
+    struct CompressedStore
+    {
+        bool enabled;
+        size_t maxStoredSize;
+        size_t classCount;
+        SizeClass classes[MaxSizeClasses];
+
+        CompressorBuffers* buffers;
+        size_t bufferCount;
+
+        //pages are only ever saved by reclaim, which can run inside any
+        //allocation (even one made by the pool itself), so saving a page
+        //must not allocate from the pool. Entries and page headers come
+        //from these reserves instead, which are topped up by a work item.
+        struct
+        {
+            sl::SpinLock lock;
+            size_t depth;
+            StructReserve entries;
+            StructReserve pages;
+            WorkItem refill;
+            sl::Atomic<bool> refillQueued;
+        } reserve;
+
+        struct
+        {
+            sl::Atomic<size_t> storedPages;
+            sl::Atomic<size_t> sameFilledPages;
+            sl::Atomic<size_t> storedBytes;
+            sl::Atomic<size_t> backingPages;
+            sl::Atomic<size_t> rejectedPages;
+            sl::Atomic<size_t> loads;
+            sl::Atomic<size_t> loadLatency[CompressedLatencyBuckets];
+        } stats;
+    };
+
+    static CompressedStore store;
+
+    static size_t LatencyBucket(uint64_t nanos)
+    {
+        size_t bucket = 0;
+        nanos >>= CompressedLatencyBase;
+        while (nanos != 0 && bucket < CompressedLatencyBuckets - 1)
+        {
+            nanos >>= 1;
+            bucket++;
+        }
+
+        return bucket;
+    }
+
+    //returns false if the reserve is already full, the caller should free
+    //`ptr` itself.
+    static bool PutReserved(StructReserve& res, void* ptr)
+    {
+        sl::ScopedLock scopeLock(store.reserve.lock);
+        if (res.count >= store.reserve.depth)
+            return false;
+
+        auto* node = new(ptr) ReserveNode {};
+        node->next = res.head;
+        res.head = node;
+        res.count++;
+
+        return true;
+    }
+
+    //takes a struct from a reserve without allocating, returns nullptr if
+    //the reserve is empty.
+    static void* TakeReserved(StructReserve& res)
+    {
+        store.reserve.lock.Lock();
+        ReserveNode* node = res.head;
+        if (node != nullptr)
+        {
+            res.head = node->next;
+            res.count--;
+        }
+        const bool low = res.count < store.reserve.depth / 2;
+        store.reserve.lock.Unlock();
+
+        if (low && !store.reserve.refillQueued.Exchange(true, sl::AcqRel))
+            QueueWorkItem(&store.reserve.refill, MyCoreId());
+
+        return node;
+    }
+
+    static void ReleaseReserved(StructReserve& res, void* ptr, size_t length)
+    {
+        if (!PutReserved(res, ptr))
+            PoolFreeWired(ptr, length, CompressedTag);
+    }
+
+    static void FillReserve(StructReserve& res, size_t length)
+    {
+        while (true)
+        {
+            store.reserve.lock.Lock();
+            const bool full = res.count >= store.reserve.depth;
+            store.reserve.lock.Unlock();
+            if (full)
+                return;
+
+            void* ptr = PoolAllocWired(length, CompressedTag);
+            if (ptr == nullptr)
+                return;
+            if (!PutReserved(res, ptr))
+            {
+                PoolFreeWired(ptr, length, CompressedTag);
+                return;
+            }
+        }
+    }
+
+    static void RefillReserves(WorkItem* item, void* arg)
+    {
+        (void)item;
+        (void)arg;
+
+        //cleared first, so anything taken while we're filling queues
+        //another pass.
+        store.reserve.refillQueued.Store(false, sl::Release);
+        FillReserve(store.reserve.entries, sizeof(CompressedEntry));
+        FillReserve(store.reserve.pages, sizeof(CompressedPage));
+    }
+
+    static bool IsSameFilled(const void* page, uint64_t* fill)
+    {
+        auto* words = static_cast<const uint64_t*>(page);
+        const size_t count = PageSize() / sizeof(uint64_t);
+
+        for (size_t i = 1; i < count; i++)
+        {
+            if (words[i] != words[0])
+                return false;
+        }
+
+        *fill = words[0];
+        return true;
+    }
+
+    //reserves a slot in size class `index`, returning the page containing it
+    //and the slot index in `*slot`. Returns nullptr if a new page was needed
+    //but could not be allocated.
+    static CompressedPage* AllocSlot(size_t index, uint16_t* slot)
+    {
+        auto& sc = store.classes[index];
+        CompressedPage* spare = nullptr;
+
+        while (true)
+        {
+            sc.lock.Lock();
+            if (sc.partial.Empty() && spare != nullptr)
+            {
+                sc.partial.PushBack(spare);
+                spare = nullptr;
+            }
+
+            if (!sc.partial.Empty())
+            {
+                CompressedPage* page = &sc.partial.Front();
+                const size_t found = __builtin_ctzll(page->freeSlots);
+
+                page->freeSlots &= ~(1ull << found);
+                page->usedCount++;
+                if (page->usedCount == sc.slotCount)
+                {
+                    sc.partial.Remove(page);
+                    sc.full.PushBack(page);
+                }
+                sc.lock.Unlock();
+
+                if (spare != nullptr)
+                {
+                    //someone else added a page to the class while we were
+                    //allocating ours, release it.
+                    FreePage(spare->page);
+                    ReleaseReserved(store.reserve.pages, spare,
+                        sizeof(*spare));
+                    store.stats.backingPages.Sub(1, sl::Relaxed);
+                }
+
+                *slot = found;
+                return page;
+            }
+            sc.lock.Unlock();
+
+            //no pages with free slots, add a new one. The backing page is
+            //allocated without reclaiming (we're likely already reclaiming).
+            void* ptr = TakeReserved(store.reserve.pages);
+            if (ptr == nullptr)
+                return nullptr;
+
+            spare = new(ptr) CompressedPage {};
+            spare->page = AllocPage(true);
+            if (spare->page == nullptr)
+            {
+                ReleaseReserved(store.reserve.pages, spare, sizeof(*spare));
+                return nullptr;
+            }
+
+            spare->sizeClass = index;
+            spare->usedCount = 0;
+            spare->freeSlots = sc.slotCount == SlotsBitmapBits
+                ? ~0ull : (1ull << sc.slotCount) - 1;
+            store.stats.backingPages.Add(1, sl::Relaxed);
+        }
+    }
+
+    static void FreeSlot(CompressedPage* page, uint16_t slot)
+    {
+        auto& sc = store.classes[page->sizeClass];
+
+        sc.lock.Lock();
+        NPK_ASSERT((page->freeSlots & (1ull << slot)) == 0);
+
+        if (page->usedCount == sc.slotCount)
+        {
+            sc.full.Remove(page);
+            sc.partial.PushBack(page);
+        }
+        page->freeSlots |= 1ull << slot;
+        page->usedCount--;
+
+        const bool empty = page->usedCount == 0;
+        if (empty)
+            sc.partial.Remove(page);
+        sc.lock.Unlock();
+
+        if (!empty)
+            return;
+
+        FreePage(page->page);
+        ReleaseReserved(store.reserve.pages, page, sizeof(*page));
+        store.stats.backingPages.Sub(1, sl::Relaxed);
+    }
+
+    void InitCompressedStore()
+    {
+        store.enabled = ReadConfigUint("npk.vm.compressed_store", true);
+        if (!store.enabled)
+            return;
+
+        //pages that compress worse than this are better off being written
+        //to a swap device.
+        const size_t maxPercent = sl::Clamp<size_t>(
+            ReadConfigUint("npk.vm.compressed_max_percent", 75), 10, 90);
+        store.maxStoredSize = sl::AlignDown(PageSize() * maxPercent / 100,
+            ClassGranularity);
+        store.classCount = sl::Min(store.maxStoredSize / ClassGranularity,
+            MaxSizeClasses);
+        store.maxStoredSize = store.classCount * ClassGranularity;
+
+        for (size_t i = 0; i < store.classCount; i++)
+        {
+            auto& sc = store.classes[i];
+            sc.slotSize = (i + 1) * ClassGranularity;
+            sc.slotCount = sl::Min(PageSize() / sc.slotSize, SlotsBitmapBits);
+        }
+
+        //all cpus are up by now, so the buffers can be sized for them.
+        store.bufferCount = MySystemDomain().smpControls.Size();
+        store.buffers = static_cast<CompressorBuffers*>(PoolAllocWired(
+            store.bufferCount * sizeof(CompressorBuffers), CompressedTag));
+        bool allocated = store.buffers != nullptr;
+        for (size_t i = 0; allocated && i < store.bufferCount; i++)
+        {
+            auto& buffers = store.buffers[i];
+            buffers.scratch = PoolAllocWired(PageSize(), CompressedTag);
+            buffers.workspace = PoolAllocWired(sl::LzWorkspaceSize,
+                CompressedTag);
+            allocated = buffers.scratch != nullptr
+                && buffers.workspace != nullptr;
+        }
+
+        if (!allocated)
+        {
+            Log("Failed to allocate compressed store buffers, store disabled",
+                LogLevel::Error);
+            store.enabled = false;
+            return;
+        }
+
+        store.reserve.depth = sl::Max<size_t>(
+            ReadConfigUint("npk.vm.compressed_reserve", DefaultReserveDepth), 2);
+        store.reserve.refill.function = RefillReserves;
+        store.reserve.refill.arg = nullptr;
+        FillReserve(store.reserve.entries, sizeof(CompressedEntry));
+        FillReserve(store.reserve.pages, sizeof(CompressedPage));
+
+        Log("Compressed store enabled: %zu size classes, max blob %zu bytes",
+            LogLevel::Verbose, store.classCount, store.maxStoredSize);
+    }
+
+    bool CompressedStoreEnabled()
+    {
+        return store.enabled;
+    }
+
+    NpkStatus CompressedStoreSave(void** handle, PageInfo* page)
+    {
+        NPK_CHECK(handle != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(page != nullptr, NpkStatus::InvalidArg);
+
+        if (!store.enabled)
+            return NpkStatus::Unsupported;
+
+        //if the reserve is empty the page is left for a swap device.
+        void* ptr = TakeReserved(store.reserve.entries);
+        if (ptr == nullptr)
+            return NpkStatus::Shortage;
+        auto* entry = new(ptr) CompressedEntry {};
+        entry->refs.Store(1, sl::Relaxed);
+
+        auto source = AccessPage(page);
+        if (IsSameFilled(source->value, &entry->fill))
+        {
+            entry->page = nullptr;
+            store.stats.storedPages.Add(1, sl::Relaxed);
+            store.stats.sameFilledPages.Add(1, sl::Relaxed);
+
+            *handle = entry;
+            return NpkStatus::Success;
+        }
+
+        const Ipl prevIpl = RaiseIpl(Ipl::Dpc);
+        const CpuId cpu = MyCoreId();
+        NPK_ASSERT(cpu < store.bufferCount);
+        auto& buffers = store.buffers[cpu];
+
+        const size_t length = sl::LzCompress(source->value, PageSize(),
+            buffers.scratch, store.maxStoredSize, buffers.workspace);
+        if (length == 0)
+        {
+            LowerIpl(prevIpl);
+            ReleaseReserved(store.reserve.entries, entry, sizeof(*entry));
+            store.stats.rejectedPages.Add(1, sl::Relaxed);
+
+            return NpkStatus::NotAvailable;
+        }
+
+        const size_t sizeClass = (length - 1) / ClassGranularity;
+        entry->page = AllocSlot(sizeClass, &entry->slot);
+        if (entry->page == nullptr)
+        {
+            LowerIpl(prevIpl);
+            ReleaseReserved(store.reserve.entries, entry, sizeof(*entry));
+
+            return NpkStatus::Shortage;
+        }
+        entry->length = length;
+
+        auto dest = AccessPage(entry->page->page);
+        const size_t offset = entry->slot * store.classes[sizeClass].slotSize;
+        sl::MemCopy(static_cast<char*>(dest->value) + offset, buffers.scratch,
+            length);
+        LowerIpl(prevIpl);
+
+        store.stats.storedPages.Add(1, sl::Relaxed);
+        store.stats.storedBytes.Add(length, sl::Relaxed);
+
+        *handle = entry;
+        return NpkStatus::Success;
+    }
+
+    NpkStatus CompressedStoreLoad(PageInfo* page, void* handle)
+    {
+        NPK_CHECK(page != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(handle != nullptr, NpkStatus::InvalidArg);
+
+        const auto begin = GetMonotonicTime();
+        auto* entry = static_cast<CompressedEntry*>(handle);
+        auto dest = AccessPage(page);
+
+        if (entry->page == nullptr)
+        {
+            auto* words = static_cast<uint64_t*>(dest->value);
+            for (size_t i = 0; i < PageSize() / sizeof(uint64_t); i++)
+                words[i] = entry->fill;
+        }
+        else
+        {
+            const auto& sc = store.classes[entry->page->sizeClass];
+            auto source = AccessPage(entry->page->page);
+            const char* blob = static_cast<const char*>(source->value)
+                + entry->slot * sc.slotSize;
+
+            const size_t length = sl::LzDecompress(blob, entry->length,
+                dest->value, PageSize());
+            if (length != PageSize())
+            {
+                Log("Corrupt compressed page: entry=%p, length=%zu",
+                    LogLevel::Error, entry, length);
+                return NpkStatus::InternalError;
+            }
+        }
+
+        const auto latency = (GetMonotonicTime() - begin).epoch;
+        store.stats.loads.Add(1, sl::Relaxed);
+        store.stats.loadLatency[LatencyBucket(latency)].Add(1, sl::Relaxed);
+
+        return NpkStatus::Success;
+    }
+
+    void CompressedStoreRef(void* handle)
+    {
+        NPK_CHECK(handle != nullptr, );
+
+        auto* entry = static_cast<CompressedEntry*>(handle);
+        entry->refs.Add(1, sl::Relaxed);
+    }
+
+    void CompressedStoreFree(void* handle)
+    {
+        NPK_CHECK(handle != nullptr, );
+
+        auto* entry = static_cast<CompressedEntry*>(handle);
+        if (entry->refs.FetchSub(1, sl::AcqRel) != 1)
+            return;
+
+        if (entry->page == nullptr)
+            store.stats.sameFilledPages.Sub(1, sl::Relaxed);
+        else
+        {
+            store.stats.storedBytes.Sub(entry->length, sl::Relaxed);
+            FreeSlot(entry->page, entry->slot);
+        }
+        store.stats.storedPages.Sub(1, sl::Relaxed);
+
+        ReleaseReserved(store.reserve.entries, entry, sizeof(*entry));
+    }
+}
+
+namespace Npk
+{
+    void GetCompressedStoreStats(CompressedStoreStats& stats)
+    {
+        using namespace Private;
+
+        stats.storedPages = store.stats.storedPages.Load(sl::Relaxed);
+        stats.sameFilledPages = store.stats.sameFilledPages.Load(sl::Relaxed);
+        stats.storedBytes = store.stats.storedBytes.Load(sl::Relaxed);
+        stats.backingPages = store.stats.backingPages.Load(sl::Relaxed);
+        stats.rejectedPages = store.stats.rejectedPages.Load(sl::Relaxed);
+        stats.loads = store.stats.loads.Load(sl::Relaxed);
+
+        for (size_t i = 0; i < CompressedLatencyBuckets; i++)
+            stats.loadLatency[i] = store.stats.loadLatency[i].Load(sl::Relaxed);
+    }
+
+    void LogCompressedStoreStats()
+    {
+        CompressedStoreStats stats;
+        GetCompressedStoreStats(stats);
+
+        //ratio is reported in hundredths, and is measured against the pages
+        //backing the store (including unused slots) rather than blob sizes.
+        const size_t original = stats.storedPages * PageSize();
+        const size_t used = stats.backingPages * PageSize();
+        const size_t ratio = used == 0 ? 0 : original * 100 / used;
+        auto conv = sl::ConvertUnits(original);
+        auto usedConv = sl::ConvertUnits(used);
+
+        Log("Compressed store: %zu pages (%zu same-filled), %zu.%zu %sB -> "
+            "%zu.%zu %sB, ratio %zu.%02zu, %zu rejected", LogLevel::Info,
+            stats.storedPages, stats.sameFilledPages, conv.major, conv.minor,
+            conv.prefix, usedConv.major, usedConv.minor, usedConv.prefix,
+            ratio / 100, ratio % 100, stats.rejectedPages);
+
+        for (size_t i = 0; i < CompressedLatencyBuckets; i++)
+        {
+            if (stats.loadLatency[i] == 0)
+                continue;
+
+            const size_t limit = 1ul << (CompressedLatencyBase + i);
+            const bool last = i == CompressedLatencyBuckets - 1;
+            Log("  decompress %s %zuns: %zu", LogLevel::Info,
+                last ? ">=" : "<", last ? limit >> 1 : limit,
+                stats.loadLatency[i]);
+        }
+    }
+}
@@ -1,9 +1,23 @@
 #include <private/Vm.hpp>
 #include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
 
 namespace Npk
 {
     constexpr size_t MaxPageFaultAttempts = 4;
+    constexpr size_t DefaultFaultAroundPages = 16;
+    constexpr size_t MaxFaultAroundPages = 64;
+    constexpr size_t SequentialFaultAroundScale = 4;
+    constexpr size_t PopulateBatchPages = 64;
+
+    static size_t faultAroundPages = DefaultFaultAroundPages;
+
+    void Private::InitFaultAround()
+    {
+        faultAroundPages = sl::Min(MaxFaultAroundPages,
+            ReadConfigUint("npk.vm.fault_around_pages",
+            DefaultFaultAroundPages));
+    }
 
     static size_t NextAmapSlotCount(size_t baseIndex, size_t max)
     {
@@ -13,14 +27,63 @@ namespace Npk
         return sl::Min(baseIndex, max);
     }
 
-    static NpkStatus TryCompletePageFault(VmSpace& space, uintptr_t addr, 
-        bool write)
+    //NOTE: assumes range->mutex is held. Hints the page cache about an
+    //access to `sourceIndex`, according to the range's advice.
+    static void RangeReadahead(VmRange* range, size_t sourceIndex)
     {
-        VmRange* range;
-        auto result = SpaceLookup(&range, space, addr);
-        if (result != NpkStatus::Success)
-            return result;
+        if (range->advice == VmAdvice::Random)
+            return;
+
+        Private::CacheReadahead(*range->source, range->readahead, sourceIndex,
+            1, range->advice == VmAdvice::Sequential);
+    }
 
+    //NOTE: assumes range->mutex is held. Maps any resident cache pages in
+    //the aligned window around `addr` (read-only), so accesses to nearby
+    //pages don't need to fault. Pages with an amap entry or an existing
+    //mapping are left alone.
+    static void FaultAround(VmSpace& space, VmRange* range, uintptr_t addr,
+        VmFlags flags)
+    {
+        size_t window = faultAroundPages;
+        if (range->advice == VmAdvice::Random)
+            return;
+        if (range->advice == VmAdvice::Sequential)
+            window = sl::Min(MaxFaultAroundPages,
+                window * SequentialFaultAroundScale);
+        if (window < 2)
+            return;
+
+        const size_t slot = (addr - range->base) >> PfnShift();
+        const size_t first = sl::AlignDown(slot, window);
+        const size_t count = sl::Min(window,
+            (range->length >> PfnShift()) - first);
+
+        PageInfo* pages[MaxFaultAroundPages];
+        const size_t found = Private::CacheLookupPages(*range->source,
+            (range->offset >> PfnShift()) + first, { pages, count });
+        if (found < 2)
+            return;
+
+        flags.Clear(VmFlag::Write);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (pages[i] == nullptr || first + i == slot)
+                continue;
+            if (range->amapRef.Valid()
+                && Private::AnonMapLookup(*range->amapRef, first + i).Valid())
+                continue;
+
+            const uintptr_t vaddr = range->base + ((first + i) << PfnShift());
+            SetMap(space.map, vaddr, LookupPagePaddr(pages[i]), flags);
+        }
+    }
+
+    //NOTE: assumes range->mutex is held
+    static NpkStatus TryCompleteRangeFault(VmSpace& space, VmRange* range,
+        uintptr_t addr, bool write)
+    {
+        NpkStatus result;
         VmFlags flags {};
         if (range->flags.Has(VmFlag::Mmio))
             flags.Set(VmFlag::Mmio);
@@ -28,7 +91,10 @@ namespace Npk
             flags.Set(VmFlag::Fetch);
 
         const size_t amapSlot = (addr - range->base) >> PfnShift();
+        const size_t sourceIndex = (range->offset >> PfnShift()) + amapSlot;
+        PageInfo* sourcePage = nullptr;
         Paddr paddr {};
+        bool splitMerged = false;
 
         if (write)
         {
@@ -99,10 +165,23 @@ namespace Npk
             {
                 auto ref = Private::AnonMapLookup(*range->amapRef, amapSlot);
 
-                if (ref.Valid())
+                if (ref.Valid() && !Private::UnmergeAnonPage(*ref))
+                {
+                    //the page is shared with other amaps by page merging,
+                    //this slot gets a private copy of it.
+                    PageInfo* page;
+                    result = Private::SplitMergedPage(&page, *range->amapRef,
+                        amapSlot, ref);
+                    if (result != NpkStatus::Success)
+                        return result;
+
+                    paddr = LookupPagePaddr(page);
+                    splitMerged = true;
+                }
+                else if (ref.Valid())
                 {
                     PageInfo* page;
-                    result = Private::AnonPageGetPage(&page, ref);
+                    result = Private::AnonPageGetPage(&page, ref, true);
                     if (result != NpkStatus::Success)
                         return result;
 
@@ -113,44 +192,42 @@ namespace Npk
 
             if (result != NpkStatus::Success && range->source != nullptr)
             {
-                //TODO:
+                //shared mappings write directly to the cached page, which
+                //is marked dirty. Private mappings take a copy of it below.
+                RangeReadahead(range, sourceIndex);
+                result = Private::CacheGetPage(&sourcePage, *range->source,
+                    sourceIndex, !isCow);
+                if (result != NpkStatus::Success)
+                    return result;
+
                 if (isCow)
-                    NPK_UNREACHABLE(); //add page to amap, copied from source
+                    result = NpkStatus::NotAvailable;
                 else
-                    NPK_UNREACHABLE(); //map directly to source page.
+                    paddr = LookupPagePaddr(sourcePage);
             }
 
-            if (result != NpkStatus::Success && range->source == nullptr 
-                && isCow)
+            if (result != NpkStatus::Success && isCow)
             {
-                //there's no backing object and this object is CoW, so we'll
-                //allocate a fresh page and insert it into the amap.
+                //there's no page in the amap and this range is CoW, so we'll
+                //allocate a fresh page and insert it into the amap. If there
+                //is a backing object the page is a copy of its contents.
 
-                auto page = AllocPage(false);
+                PageInfo* page;
+                if (AllocPages({ &page, 1 }) == 0)
+                    return NpkStatus::Shortage;
                 paddr = LookupPagePaddr(page);
 
-                AnonPage* anon;
-                result = Private::CreateAnonPage(&anon);
-                if (result != NpkStatus::Success)
-                    return result;
-
-                //the lock isn't necessary here, I'm using it for ordering.
-                anon->lock.Lock();
-                anon->page = page;
-                anon->lock.Unlock();
-                page->vm.refcount++; //TODO: make atomic!
-                AnonPageRef ref = anon;
-
-                result = Private::AnonMapAdd(*range->amapRef, amapSlot, ref);
-                if (result != NpkStatus::Success)
+                if (sourcePage != nullptr)
                 {
-                    ref = {};
-                    anon->refcount--;
-                    anon->page = nullptr;
+                    auto dest = AccessPage(page);
+                    auto src = AccessPage(sourcePage);
+                    sl::MemCopy(dest->value, src->value, PageSize());
+                }
 
-                    Private::DestroyAnonPage(anon);
+                result = Private::AnonMapAddPage(*range->amapRef, amapSlot,
+                    page);
+                if (result != NpkStatus::Success)
                     FreePage(page);
-                }
             }
 
             if (result == NpkStatus::Success)
@@ -164,20 +241,28 @@ namespace Npk
 
                 if (result == NpkStatus::Success)
                 {
-                    //TODO: there was something mapped here before, handle that.
-                    //How we handle it depends on the layer, and is kind of 
-                    //the inverse of the 'read' path (see below).
-                    //If the page came an amap: copy the anon page and decrement its
-                    //refcount, or if the refcount is already 1, make it writable
-                    //since its now ours anyway.
-                    //If the page came from the source layer and the range is not
-                    //CoW, ensure its writable (this shouldnt happen honestly).
-                    //If it is CoW, we need to make a copy of the page into the
-                    //anon layer, then we can de-ref the page via the source layer.
-                    //If the page didnt come from the amap layer and there is no
-                    //source, it must be the zero-page (we can assert this, and then
-                    //do nothing).
-                    NPK_ASSERT(prevPaddr == MySystemDomain().zeroPage);
+                    //something was mapped here before. By now the new page
+                    //is owned by the amap (or is the cached page itself, for
+                    //shared mappings), so all that's left is to check the old
+                    //mapping was one we expect to replace:
+                    //- the zero page, mapped by an earlier read fault.
+                    //- the same page, mapped read-only (e.g. an anon page
+                    //  that was swapped in by a read, or a cached page of a
+                    //  shared mapping).
+                    //- the cached source page, which a CoW write has just
+                    //  copied into the amap.
+                    //- a merged page that was split, which is still mapped
+                    //  by other spaces.
+                    //Whenever the physical page changed, other cpus may still
+                    //have the old translation cached and keep reading (or
+                    //writing) the previous page, so they must be flushed.
+                    const bool wasSourcePage = sourcePage != nullptr
+                        && prevPaddr == LookupPagePaddr(sourcePage);
+                    NPK_ASSERT(prevPaddr == MySystemDomain().zeroPage
+                        || prevPaddr == paddr || wasSourcePage || splitMerged);
+
+                    if (prevPaddr != paddr)
+                        Private::ShootdownTlbs(AlignDownPage(addr), PageSize());
                 }
 
                 result = NpkStatus::Success;
@@ -193,7 +278,7 @@ namespace Npk
                 if (ref.Valid())
                 {
                     PageInfo* page;
-                    result = Private::AnonPageGetPage(&page, ref);
+                    result = Private::AnonPageGetPage(&page, ref, false);
                     if (result != NpkStatus::Success)
                         return result;
 
@@ -203,7 +288,18 @@ namespace Npk
             }
 
             if (result != NpkStatus::Success && range->source != nullptr)
-            { NPK_UNREACHABLE(); } //TODO: implement
+            {
+                //reads always map the cached page read-only, regardless of
+                //the range type: a write will fault again so we can either
+                //mark the page dirty or take a private copy.
+                RangeReadahead(range, sourceIndex);
+                result = Private::CacheGetPage(&sourcePage, *range->source,
+                    sourceIndex, false);
+                if (result != NpkStatus::Success)
+                    return result;
+
+                paddr = LookupPagePaddr(sourcePage);
+            }
 
             if (result != NpkStatus::Success 
                 && range->flags.Has(VmFlag::CopyOnWrite))
@@ -224,6 +320,191 @@ namespace Npk
             NPK_UNREACHABLE();
         }
 
+        if (!write && sourcePage != nullptr)
+            FaultAround(space, range, addr, flags);
+
+        return result;
+    }
+
+    //NOTE: assumes range.mutex is held. Fills `pages` with new anon pages
+    //for slots starting at `slot`, copying the source contents if there is
+    //a source. Returns the number of pages added to the amap.
+    static size_t PopulateAnonPages(VmRange& range, size_t slot,
+        sl::Span<PageInfo*> pages)
+    {
+        const size_t count = AllocPages(pages);
+        const size_t sourceIndex = (range.offset >> PfnShift()) + slot;
+
+        size_t added = 0;
+        for (; added < count; added++)
+        {
+            //pages past the end of the source are left zeroed.
+            PageInfo* sourcePage;
+            auto result = NpkStatus::InvalidArg;
+            if (range.source != nullptr)
+            {
+                result = Private::CacheGetPage(&sourcePage, *range.source,
+                    sourceIndex + added, false);
+            }
+
+            if (result == NpkStatus::Success)
+            {
+                auto dest = AccessPage(pages[added]);
+                auto src = AccessPage(sourcePage);
+                sl::MemCopy(dest->value, src->value, PageSize());
+            }
+            else if (result != NpkStatus::InvalidArg)
+                break;
+
+            if (Private::AnonMapAddPage(*range.amapRef, slot + added,
+                pages[added]) != NpkStatus::Success)
+                break;
+        }
+
+        for (size_t i = added; i < count; i++)
+            FreePage(pages[i]);
+
+        return added;
+    }
+
+    //NOTE: assumes range.mutex is held. Fills `pages` with the cached source
+    //pages for slots starting at `slot`, returns the number found.
+    static size_t PopulateSourcePages(VmRange& range, size_t slot,
+        sl::Span<PageInfo*> pages, bool write)
+    {
+        const size_t sourceIndex = (range.offset >> PfnShift()) + slot;
+
+        for (size_t i = 0; i < pages.Size(); i++)
+        {
+            if (Private::CacheGetPage(&pages[i], *range.source,
+                sourceIndex + i, write) != NpkStatus::Success)
+                return i;
+        }
+
+        return pages.Size();
+    }
+
+    //NOTE: assumes range.mutex is held. Populating is best-effort, so
+    //failures aren't reported: see SpaceAttach().
+    void Private::PopulateRange(VmSpace& space, VmRange& range)
+    {
+        if (range.flags.Has(VmFlag::Mmio))
+            return;
+
+        //writable private ranges get their own copies of every page (as if
+        //each page had been written to). Other ranges with a source map the
+        //cached pages directly, read-only unless the range is shared.
+        //Read-only anonymous memory has nothing worth populating.
+        const bool isCow = range.flags.Has(VmFlag::CopyOnWrite);
+        const bool writable = range.flags.Has(VmFlag::Write);
+        const bool copyPages = isCow && writable;
+        if (!copyPages && range.source == nullptr)
+            return;
+
+        const size_t slotCount = range.length >> PfnShift();
+        if (copyPages && !range.amapRef.Valid())
+        {
+            AnonMap* mapPtr;
+            if (CreateAnonMap(&mapPtr, slotCount) != NpkStatus::Success)
+                return;
+
+            range.amapOffset = 0;
+            range.amapRef = mapPtr;
+            mapPtr->refcount--;
+        }
+
+        //start reading the whole range in the background, so the
+        //synchronous lookups below mostly find pages already on their way.
+        if (range.source != nullptr)
+        {
+            CachePrefetch(*range.source, range.offset >> PfnShift(),
+                slotCount);
+        }
+
+        VmFlags flags {};
+        if (range.flags.Has(VmFlag::Fetch))
+            flags.Set(VmFlag::Fetch);
+        if (writable && (copyPages || !isCow))
+            flags.Set(VmFlag::Write);
+
+        PageInfo* pages[PopulateBatchPages];
+        for (size_t slot = 0; slot < slotCount; slot += PopulateBatchPages)
+        {
+            const size_t count = sl::Min(PopulateBatchPages, slotCount - slot);
+            const size_t ready = copyPages
+                ? PopulateAnonPages(range, slot, { pages, count })
+                : PopulateSourcePages(range, slot, { pages, count },
+                    flags.Has(VmFlag::Write));
+
+            const uintptr_t vaddr = range.base + (slot << PfnShift());
+            const size_t mapped = SetMapRun(space.map, vaddr,
+                { pages, ready }, flags);
+
+            //anything left over will be faulted in on demand as usual.
+            if (ready != count || mapped != ready)
+                return;
+        }
+    }
+
+    NpkStatus Private::ResolveRangePage(PageInfo** page, AnonPageRef& anon,
+        VmSpace& space, VmRange& range, uintptr_t addr, bool write)
+    {
+        //writes go through the regular fault path first, so any private copy
+        //is made (or the cached page dirtied) before we look the page up.
+        if (write)
+        {
+            auto result = TryCompleteRangeFault(space, &range, addr, true);
+            if (result != NpkStatus::Success)
+                return result;
+        }
+
+        const size_t slot = (addr - range.base) >> PfnShift();
+        if (range.amapRef.Valid())
+        {
+            auto ref = Private::AnonMapLookup(*range.amapRef, slot);
+            if (ref.Valid())
+            {
+                auto result = Private::AnonPageGetPage(page, ref, write);
+                if (result == NpkStatus::Success)
+                    anon = ref;
+                return result;
+            }
+        }
+
+        if (range.source != nullptr)
+        {
+            const size_t sourceIndex = (range.offset >> PfnShift()) + slot;
+            return Private::CacheGetPage(page, *range.source, sourceIndex,
+                write);
+        }
+
+        //a successful write fault on plain anonymous memory always leaves a
+        //page in the amap, so only reads can end up here.
+        NPK_CHECK(!write, NpkStatus::InternalError);
+        if (!range.flags.Has(VmFlag::CopyOnWrite))
+            return NpkStatus::NotAvailable;
+
+        *page = LookupPageInfo(MySystemDomain().zeroPage);
+        return NpkStatus::Success;
+    }
+
+    static NpkStatus TryCompletePageFault(VmSpace& space, uintptr_t addr, 
+        bool write)
+    {
+        VmRange* range;
+        auto result = SpaceLookup(&range, space, addr);
+        if (result != NpkStatus::Success)
+            return result;
+
+        //the range mutex is held while resolving the fault, this prevents
+        //the page we find being swapped out before it's mapped.
+        result = AcquireMutex(&range->mutex, sl::NoTimeout, NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return result;
+
+        result = TryCompleteRangeFault(space, range, addr, write);
+        ReleaseMutex(&range->mutex);
+
         return result;
     }
 
@@ -0,0 +1,354 @@
+#include <private/Vm.hpp>
+#include <private/Namespace.hpp>
+#include <private/Io.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+
+/* A file source is a VmSource backed by an IoInterface (usually provided by
+ * a filesystem driver), with all access going through the page cache. The
+ * `cacheIoi` interface accepts Read and Write IOPs for the file and services
+ * them from the cache, only touching the backing interface on cache misses
+ * and writeback.
+ */
+namespace Npk::Private
+{
+    enum class FileSourceError : size_t
+    {
+        BadIopType = 1,
+        BadRange,
+        CacheError,
+    };
+
+    struct FileSource
+    {
+        VmSource source;
+        sl::RefCount refcount;
+        IoInterface* backing;
+        IoInterface cacheIoi;
+
+        //there's no notion of an open file handle yet, so all IOPs issued
+        //to `cacheIoi` share one readahead stream.
+        Mutex readaheadMutex;
+        ReadaheadState readahead;
+    };
+
+    struct FileReadahead
+    {
+        FileSource* file;
+        size_t offset;
+        size_t count;
+        PagerCallback callback;
+        void* opaque;
+    };
+
+    static FileSource* AsFileSource(VmSource* src)
+    {
+        return reinterpret_cast<FileSource*>(src);
+    }
+
+    static bool FileSourceRef(VmSource* src, PagerFlags flags)
+    {
+        (void)flags;
+
+        return sl::IncrementRefCount<FileSource, &FileSource::refcount>(
+            AsFileSource(src));
+    }
+
+    static void FileSourceUnref(VmSource* src)
+    {
+        auto* file = AsFileSource(src);
+        if (!sl::DecrementRefCount<FileSource, &FileSource::refcount>(file))
+            return;
+
+        DestroyCacheSource(file->source);
+        UnrefIoInterface(file->backing);
+        PoolFreeWired(file, sizeof(*file), VmSourceTag);
+    }
+
+    //returns the number of `pages` starting at `offset` that are within
+    //the file, and the number of bytes of the last of these to transfer.
+    static size_t FileSourceExtent(FileSource* file, size_t offset,
+        size_t pages, size_t* tail)
+    {
+        //the last page may be partially past the end of the file, only
+        //transfer the bytes that exist.
+        const size_t length = file->source.length;
+        const size_t count = sl::Min(pages,
+            AlignUpPage(length - offset) >> PfnShift());
+        const size_t end = offset + (count << PfnShift());
+        *tail = end > length ? PageSize() - (end - length) : PageSize();
+
+        return count;
+    }
+
+    static void LogFileSourceError(FileSource* file, IoType type,
+        size_t offset, size_t count, NpkStatus result, size_t abortCode)
+    {
+        Log("File source %p %s failed: offset=0x%zx, count=%zu, status=%s,"
+            " abort=%zu", LogLevel::Error, file,
+            type == IoType::Read ? "read" : "write", offset, count,
+            StatusStr(result), abortCode);
+    }
+
+    static NpkStatus FileSourceIo(FileSource* file, IoType type,
+        sl::Span<PageInfo*> pages, size_t pagesOffset)
+    {
+        const size_t offset = pagesOffset << PfnShift();
+        if (offset >= file->source.length)
+            return NpkStatus::InvalidArg;
+
+        size_t tail;
+        const size_t count = FileSourceExtent(file, offset, pages.Size(),
+            &tail);
+
+        size_t abortCode = 0;
+        const auto result = SyncPageIo(file->backing, type, offset,
+            pages.Subspan(0, count), tail, &abortCode);
+        if (result != NpkStatus::Success)
+        {
+            LogFileSourceError(file, type, offset, count, result, abortCode);
+            return result;
+        }
+
+        if (type != IoType::Read)
+            return NpkStatus::Success;
+
+        //zero anything past the end of the file.
+        if (tail != PageSize())
+        {
+            auto access = AccessPage(pages[count - 1]);
+            sl::MemSet(static_cast<char*>(access->value) + tail, 0,
+                PageSize() - tail);
+        }
+        for (size_t i = count; i < pages.Size(); i++)
+        {
+            auto access = AccessPage(pages[i]);
+            sl::MemSet(access->value, 0, PageSize());
+        }
+
+        return NpkStatus::Success;
+    }
+
+    static NpkStatus FileSourceGet(VmSource* src, sl::Span<PageInfo*> pages,
+        size_t pagesOffset, PagerFlags flags)
+    {
+        (void)flags;
+
+        return FileSourceIo(AsFileSource(src), IoType::Read, pages,
+            pagesOffset);
+    }
+
+    static void FileSourceGetDone(void* opaque, NpkStatus result,
+        size_t abortCode)
+    {
+        auto* request = static_cast<FileReadahead*>(opaque);
+        if (result != NpkStatus::Success)
+        {
+            LogFileSourceError(request->file, IoType::Read, request->offset,
+                request->count, result, abortCode);
+        }
+
+        const auto callback = request->callback;
+        void* callbackOpaque = request->opaque;
+        PoolFreeWired(request, sizeof(*request), VmSourceTag);
+
+        callback(callbackOpaque, result);
+    }
+
+    static NpkStatus FileSourceGetAsync(VmSource* src,
+        sl::Span<PageInfo*> pages, size_t pagesOffset, PagerFlags flags,
+        PagerCallback callback, void* opaque)
+    {
+        (void)flags;
+
+        auto* file = AsFileSource(src);
+        const size_t offset = pagesOffset << PfnShift();
+        if (offset >= file->source.length)
+            return NpkStatus::InvalidArg;
+
+        //nothing is touched after the IO completes, so anything past the
+        //end of the file is zeroed now.
+        size_t tail;
+        const size_t count = FileSourceExtent(file, offset, pages.Size(),
+            &tail);
+        if (tail != PageSize())
+        {
+            auto access = AccessPage(pages[count - 1]);
+            sl::MemSet(static_cast<char*>(access->value) + tail, 0,
+                PageSize() - tail);
+        }
+        for (size_t i = count; i < pages.Size(); i++)
+        {
+            auto access = AccessPage(pages[i]);
+            sl::MemSet(access->value, 0, PageSize());
+        }
+
+        void* ptr = PoolAllocWired(sizeof(FileReadahead), VmSourceTag);
+        if (ptr == nullptr)
+            return NpkStatus::Shortage;
+
+        auto* request = new(ptr) FileReadahead {};
+        request->file = file;
+        request->offset = offset;
+        request->count = count;
+        request->callback = callback;
+        request->opaque = opaque;
+
+        const auto result = StartPageIo(file->backing, IoType::Read, offset,
+            pages.Subspan(0, count), tail, FileSourceGetDone, request);
+        if (result != NpkStatus::Pending)
+            PoolFreeWired(request, sizeof(*request), VmSourceTag);
+
+        return result;
+    }
+
+    static NpkStatus FileSourcePut(VmSource* src, sl::Span<PageInfo*> pages,
+        size_t pagesOffset, PagerFlags flags)
+    {
+        (void)flags;
+
+        return FileSourceIo(AsFileSource(src), IoType::Write, pages,
+            pagesOffset);
+    }
+
+    static void FileSourceFlush(VmSource* src, size_t offsetPages,
+        size_t lengthPages, PagerFlags flags)
+    {
+        (void)flags;
+
+        CacheWriteback(*src, offsetPages, lengthPages);
+    }
+
+    constexpr VmPagerOps FileSourceOps
+    {
+        .RefObj = FileSourceRef,
+        .UnrefObj = FileSourceUnref,
+        .Get = FileSourceGet,
+        .GetAsync = FileSourceGetAsync,
+        .Fault = nullptr,
+        .Put = FileSourcePut,
+        .Flush = FileSourceFlush,
+        .Release = nullptr,
+    };
+
+    static IoStatus FileCacheBegin(Iop* iop, void* opaque, void** stash)
+    {
+        (void)stash;
+
+        auto* file = static_cast<FileSource*>(opaque);
+        auto& frame = iop->frames[iop->frameIndex];
+
+        if (iop->type != IoType::Read && iop->type != IoType::Write)
+        {
+            frame.abortCode = static_cast<size_t>(FileSourceError::BadIopType);
+            return IoStatus::Abort;
+        }
+
+        const bool write = iop->type == IoType::Write;
+        size_t offset = iop->frames[0].params.readwrite.offset;
+
+        if (!write && offset < file->source.length)
+        {
+            size_t length = 0;
+            for (size_t i = 0; i < iop->buffers.Size(); i++)
+            {
+                if (iop->buffers[i].type != IoBufferType::None)
+                    length += iop->buffers[i].length;
+            }
+            length = sl::Min(length, file->source.length - offset);
+
+            const size_t first = offset >> PfnShift();
+            const size_t last = (offset + length + PageMask()) >> PfnShift();
+            if (AcquireMutex(&file->readaheadMutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION) == NpkStatus::Success)
+            {
+                CacheReadahead(file->source, file->readahead, first,
+                    last - first, false);
+                ReleaseMutex(&file->readaheadMutex);
+            }
+        }
+
+        for (size_t i = 0; i < iop->buffers.Size(); i++)
+        {
+            auto& buffer = iop->buffers[i];
+            if (buffer.type == IoBufferType::None)
+                continue;
+
+            if (offset + buffer.length > file->source.length
+                || offset + buffer.length < offset)
+            {
+                frame.abortCode =
+                    static_cast<size_t>(FileSourceError::BadRange);
+                return IoStatus::Abort;
+            }
+
+            const auto result = CacheTransfer(file->source, offset, buffer,
+                write);
+            if (result != NpkStatus::Success)
+            {
+                frame.abortCode =
+                    static_cast<size_t>(FileSourceError::CacheError);
+                return IoStatus::Abort;
+            }
+
+            offset += buffer.length;
+        }
+
+        return IoStatus::Complete;
+    }
+
+    NpkStatus CreateFileSource(VmSource** source, IoInterface* backing,
+        size_t length)
+    {
+        NPK_CHECK(source != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(backing != nullptr, NpkStatus::InvalidArg);
+
+        if (!RefIoInterface(backing))
+            return NpkStatus::ObjRefFailed;
+
+        void* ptr = PoolAllocWired(sizeof(FileSource), VmSourceTag);
+        if (ptr == nullptr)
+        {
+            UnrefIoInterface(backing);
+            return NpkStatus::Shortage;
+        }
+
+        auto* file = new(ptr) FileSource {};
+        //the cache source is registered for eviction once initialized, so
+        //it must be the last thing that can fail.
+        auto result = ResetMutex(&file->readaheadMutex, 1);
+        if (result == NpkStatus::Success)
+            result = InitCacheSource(file->source, &FileSourceOps, length);
+        if (result != NpkStatus::Success)
+        {
+            PoolFreeWired(file, sizeof(*file), VmSourceTag);
+            UnrefIoInterface(backing);
+            return result;
+        }
+
+        file->refcount = 1;
+        file->backing = backing;
+        file->cacheIoi.refcount = 1;
+        file->cacheIoi.parent = nullptr;
+        file->cacheIoi.opaque = file;
+        file->cacheIoi.Begin = FileCacheBegin;
+        file->cacheIoi.End = nullptr;
+
+        *source = &file->source;
+        return NpkStatus::Success;
+    }
+
+    IoInterface* GetFileSourceIoInterface(VmSource& source)
+    {
+        NPK_CHECK(source.ops == &FileSourceOps, nullptr);
+
+        return &AsFileSource(&source)->cacheIoi;
+    }
+
+    NpkStatus FlushFileSource(VmSource& source)
+    {
+        NPK_CHECK(source.ops == &FileSourceOps, NpkStatus::InvalidArg);
+
+        return CacheWriteback(source, 0, -1);
+    }
+}
@@ -1,23 +1,249 @@
 #include <private/Vm.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
 
+/* Kernel stacks live in their own arena of system space, which is divided
+ * into fixed size slots: an unmapped guard page followed by the stack, so
+ * running off the end of a stack faults instead of corrupting whatever is
+ * below it. Recently freed stacks are kept mapped in a small per-cpu cache,
+ * so thread churn doesn't need to touch the page tables (or shoot down tlbs)
+ * each time.
+ */
 namespace Npk
 {
     constexpr HeapTag KernelStackTag = NPK_MAKE_HEAP_TAG("Stck");
+    constexpr size_t DefaultStackSlots = 4096;
+    constexpr size_t MaxKernelStackPages = 16;
+    constexpr size_t StackCacheDepth = 8;
+    constexpr size_t StackBitmapWordBits = sizeof(uint64_t) * 8;
 
-    NpkStatus AllocKernelStack(void** stack)
+    struct StackArena
+    {
+        Mutex mutex;
+        uintptr_t base;
+        size_t slotCount;
+        size_t freeSlots;
+        size_t nextSlot;
+        uint64_t* bitmap; //set bits are slots in use
+    };
+
+    struct StackCache
+    {
+        size_t count;
+        uintptr_t stacks[StackCacheDepth];
+    };
+
+    static StackArena arena;
+
+    CPU_LOCAL(StackCache, static stackCache);
+
+    CPU_LOCAL_CTOR(
+    {
+        new(stackCache.Get()) StackCache {};
+    });
+
+    static size_t SlotStride()
+    {
+        return KernelStackSize() + PageSize();
+    }
+
+    //the stack occupies the top of its slot, with the guard page below it.
+    static uintptr_t SlotStackTop(size_t slot)
+    {
+        return arena.base + (slot + 1) * SlotStride();
+    }
+
+    static size_t StackTopSlot(uintptr_t top)
+    {
+        return (top - arena.base) / SlotStride() - 1;
+    }
+
+    void Private::InitKernelStacks()
+    {
+        NPK_ASSERT(KernelStackPages() <= MaxKernelStackPages);
+
+        const size_t slots = sl::Max<size_t>(1,
+            ReadConfigUint("npk.vm.kernel_stack_slots", DefaultStackSlots));
+        const size_t bitmapLength = sl::AlignUp(slots, StackBitmapWordBits) / 8;
+
+        void* ptr = PoolAllocWired(bitmapLength, KernelStackTag);
+        NPK_ASSERT(ptr != nullptr);
+        sl::MemSet(ptr, 0, bitmapLength);
+
+        uintptr_t base;
+        const auto result = SpaceAlloc(*MySystemDomain().kernelSpace, &base,
+            slots * SlotStride());
+        NPK_ASSERT(result == NpkStatus::Success);
+        NPK_ASSERT(ResetMutex(&arena.mutex, 1) == NpkStatus::Success);
+
+        arena.base = base;
+        arena.slotCount = slots;
+        arena.freeSlots = slots;
+        arena.nextSlot = 0;
+        arena.bitmap = static_cast<uint64_t*>(ptr);
+
+        auto conv = sl::ConvertUnits(slots * SlotStride());
+        Log("Kernel stack arena: 0x%tx-0x%tx (%zu.%zu %sB), %zu slots",
+            LogLevel::Verbose, base, base + slots * SlotStride(),
+            conv.major, conv.minor, conv.prefix, slots);
+    }
+
+    static bool AllocStackSlot(size_t* slot)
+    {
+        if (AcquireMutex(&arena.mutex, sl::NoTimeout, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return false;
+
+        bool found = false;
+        for (size_t i = 0; i < arena.slotCount && arena.freeSlots != 0; i++)
+        {
+            const size_t scan = (arena.nextSlot + i) % arena.slotCount;
+            uint64_t& word = arena.bitmap[scan / StackBitmapWordBits];
+            const uint64_t bit = 1ull << (scan % StackBitmapWordBits);
+            if ((word & bit) != 0)
+                continue;
+
+            word |= bit;
+            arena.freeSlots--;
+            arena.nextSlot = (scan + 1) % arena.slotCount;
+            *slot = scan;
+            found = true;
+            break;
+        }
+        ReleaseMutex(&arena.mutex);
+
+        return found;
+    }
+
+    static void FreeStackSlot(size_t slot)
+    {
+        NPK_ASSERT(AcquireMutex(&arena.mutex, sl::NoTimeout, NPK_WAIT_LOCATION)
+            == NpkStatus::Success);
+
+        uint64_t& word = arena.bitmap[slot / StackBitmapWordBits];
+        const uint64_t bit = 1ull << (slot % StackBitmapWordBits);
+        NPK_ASSERT((word & bit) != 0);
+
+        word &= ~bit;
+        arena.freeSlots++;
+        ReleaseMutex(&arena.mutex);
+    }
+
+    static void UnmapStackPages(uintptr_t base, size_t count)
+    {
+        PageInfo* pages[MaxKernelStackPages];
+        size_t found = 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            Paddr paddr;
+            if (ClearKernelMap(base + (i << PfnShift()), &paddr)
+                == NpkStatus::Success)
+                pages[found++] = LookupPageInfo(paddr);
+        }
+        Private::ShootdownTlbs(base, count << PfnShift());
+
+        for (size_t i = 0; i < found; i++)
+            FreePage(pages[i]);
+    }
+
+    static NpkStatus MapStack(uintptr_t top)
     {
-        void* ptr = PoolAllocWired(KernelStackSize(), KernelStackTag);
-        if (ptr == nullptr)
+        const size_t count = KernelStackPages();
+        const uintptr_t base = top - KernelStackSize();
+
+        PageInfo* pages[MaxKernelStackPages];
+        const size_t allocated = AllocPages({ pages, count });
+        if (allocated == count)
+        {
+            const size_t mapped = Private::SetMapRun(
+                MySystemDomain().kernelSpace->map, base, { pages, count },
+                VmFlag::Write);
+            if (mapped == count)
+                return NpkStatus::Success;
+
+            //the pages that were mapped are freed by the unmap.
+            UnmapStackPages(base, mapped);
+            for (size_t i = mapped; i < count; i++)
+                FreePage(pages[i]);
             return NpkStatus::Shortage;
+        }
+
+        for (size_t i = 0; i < allocated; i++)
+            FreePage(pages[i]);
+        return NpkStatus::Shortage;
+    }
 
-        *stack = ptr;
+    //the cache is per-cpu, raising the ipl keeps us on this cpu while
+    //accessing it.
+    static bool TakeCachedStack(uintptr_t* top)
+    {
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        auto& cache = *stackCache;
+        const bool found = cache.count != 0;
+        if (found)
+            *top = cache.stacks[--cache.count];
+
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+        return found;
+    }
+
+    static bool CacheStack(uintptr_t top)
+    {
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        auto& cache = *stackCache;
+        const bool cached = cache.count != StackCacheDepth;
+        if (cached)
+            cache.stacks[cache.count++] = top;
+
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+        return cached;
+    }
+
+    NpkStatus AllocKernelStack(void** stack)
+    {
+        NPK_CHECK(stack != nullptr, NpkStatus::InvalidArg);
+
+        uintptr_t top;
+        if (!TakeCachedStack(&top))
+        {
+            size_t slot;
+            if (!AllocStackSlot(&slot))
+                return NpkStatus::Shortage;
+
+            top = SlotStackTop(slot);
+            const auto result = MapStack(top);
+            if (result != NpkStatus::Success)
+            {
+                FreeStackSlot(slot);
+                return result;
+            }
+        }
+
+        *stack = reinterpret_cast<void*>(top);
         return NpkStatus::Success;
     }
 
     void FreeKernelStack(void* stack)
     {
-        auto succ = PoolFreeWired(stack, KernelStackSize(), KernelStackTag);
+        const uintptr_t top = reinterpret_cast<uintptr_t>(stack);
+        NPK_ASSERT(top > arena.base);
+        NPK_ASSERT(top <= arena.base + arena.slotCount * SlotStride());
+        NPK_ASSERT((top - arena.base) % SlotStride() == 0);
+
+        if (CacheStack(top))
+            return;
 
-        NPK_ASSERT(succ);
+        UnmapStackPages(top - KernelStackSize(), KernelStackPages());
+        FreeStackSlot(StackTopSlot(top));
     }
 }
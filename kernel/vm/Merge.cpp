@@ -0,0 +1,471 @@
+#include <private/Vm.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+
+/* Same-page merging: a periodic scanner walks the amaps of address spaces
+ * that have opted in, looking for anon pages with identical contents. Pages
+ * are only considered once their checksum has been the same for two scans
+ * in a row, since frequently written pages aren't worth merging.
+ * Merged pages live in the 'stable' table, keyed by checksum, and are mapped
+ * read-only everywhere. A candidate matching a stable page is compared in
+ * full and replaced by a reference to it. Candidates without a match are
+ * remembered in the 'unstable' table (by checksum only), and the first
+ * candidate to match an unstable entry becomes a merged page itself, so the
+ * other one is merged with it on its next scan.
+ * Writing to a merged page faults, and the writer is given a private copy
+ * (see Fault.cpp). Merged pages are never swapped out, so they're always
+ * resident.
+ *
+ * Lock ordering: VmRange::mutex -> stable table lock -> AnonPage::lock.
+ */
+namespace Npk
+{
+    constexpr size_t DefaultMergeIntervalMs = 200;
+    constexpr size_t DefaultMergePages = 1024;
+    constexpr size_t StableBuckets = 1024;
+    constexpr size_t UnstableEntries = 4096;
+    constexpr uint64_t ChecksumPrime = 0x100000001B3;
+
+    using MergeSpaceList = sl::List<VmSpace, &VmSpace::mergeHook>;
+
+    struct UnstableEntry
+    {
+        uint32_t checksum;
+        const AnonPage* owner; //only compared against, never accessed
+    };
+
+    struct PageMerger
+    {
+        Mutex mutex; //also held while scanning
+        MergeSpaceList spaces;
+        size_t spaceCount;
+        UnstableEntry unstable[UnstableEntries];
+
+        IplSpinLock<Ipl::Dpc> stableLock;
+        AnonPage* stable[StableBuckets];
+
+        sl::TimeCount interval;
+        size_t pagesPerInterval;
+        sl::Atomic<bool> armed;
+        ClockEvent clockEvent;
+        Dpc dpc;
+        WorkItem work;
+
+        sl::Atomic<size_t> scannedPages;
+        sl::Atomic<size_t> mergedPages;
+        sl::Atomic<size_t> splitPages;
+    };
+
+    static PageMerger merger;
+
+    static uint32_t PageChecksum(PageInfo* page)
+    {
+        auto access = AccessPage(page);
+        auto* words = static_cast<const uint64_t*>(access->value);
+
+        uint64_t hash = 0;
+        for (size_t i = 0; i < PageSize() / sizeof(uint64_t); i++)
+            hash = (hash ^ words[i]) * ChecksumPrime;
+
+        return static_cast<uint32_t>(hash ^ (hash >> 32));
+    }
+
+    static bool PagesEqual(PageInfo* a, PageInfo* b)
+    {
+        auto accessA = AccessPage(a);
+        auto accessB = AccessPage(b);
+
+        return sl::MemCompare(accessA->value, accessB->value, PageSize()) == 0;
+    }
+
+    //NOTE: assumes merger.stableLock is held
+    static void UnlinkStablePage(AnonPage* page)
+    {
+        AnonPage** scan = &merger.stable[page->mergeChecksum % StableBuckets];
+        while (*scan != nullptr && *scan != page)
+            scan = &(*scan)->mergeNext;
+
+        NPK_ASSERT(*scan == page);
+        *scan = page->mergeNext;
+        page->mergeNext = nullptr;
+    }
+
+    //returns a reference to a merged page with the given checksum, if there
+    //is one. Pages that are being destroyed can't be referenced, and are
+    //skipped.
+    static AnonPageRef FindStablePage(uint32_t checksum)
+    {
+        AnonPageRef found {};
+
+        merger.stableLock.Lock();
+        AnonPage* scan = merger.stable[checksum % StableBuckets];
+        for (; scan != nullptr && !found.Valid(); scan = scan->mergeNext)
+        {
+            if (scan->mergeChecksum == checksum)
+                found = scan;
+        }
+        merger.stableLock.Unlock();
+
+        return found;
+    }
+
+    //NOTE: assumes merger.mutex is held. Returns whether a different page
+    //with the same checksum was seen recently, otherwise `owner` is
+    //remembered in its place.
+    static bool CheckUnstable(uint32_t checksum, const AnonPage* owner)
+    {
+        auto& entry = merger.unstable[checksum % UnstableEntries];
+        if (entry.owner != nullptr && entry.owner != owner
+            && entry.checksum == checksum)
+        {
+            entry = {};
+            return true;
+        }
+
+        entry.checksum = checksum;
+        entry.owner = owner;
+        return false;
+    }
+
+    static void MapMergedPage(VmSpace& space, VmRange& range, uintptr_t addr,
+        PageInfo* page)
+    {
+        VmFlags flags {};
+        if (range.flags.Has(VmFlag::Fetch))
+            flags.Set(VmFlag::Fetch);
+
+        //if this fails the next access will fault the page in instead.
+        SetMap(space.map, addr, LookupPagePaddr(page), flags);
+    }
+
+    //NOTE: assumes range.mutex and merger.mutex are held
+    static void ScanSlot(VmSpace& space, VmRange& range, size_t slot)
+    {
+        auto anon = Private::AnonMapLookup(*range.amapRef, slot);
+        if (!anon.Valid())
+            return;
+
+        //only pages referenced by this amap alone (it holds a reference, as
+        //do we) are candidates, since we can't find other mappings of them.
+        anon->lock.Lock();
+        PageInfo* page = anon->page;
+        const bool candidate = page != nullptr && page->vm.wireCount == 0
+            && !anon->merged && !anon->lazyFree
+            && anon->refcount.Load(sl::Relaxed) == 2;
+        anon->lock.Unlock();
+
+        if (!candidate)
+            return;
+        merger.scannedPages.Add(1, sl::Relaxed);
+
+        const uint32_t checksum = PageChecksum(page);
+        if (checksum != anon->mergeChecksum)
+        {
+            anon->mergeChecksum = checksum;
+            return;
+        }
+
+        auto stable = FindStablePage(checksum);
+        if (!stable.Valid() && !CheckUnstable(checksum, &*anon))
+            return;
+
+        //unmap the page so its contents can't change while we compare them,
+        //if it's not merged it'll be faulted back in as usual.
+        const uintptr_t addr = range.base + (slot << PfnShift());
+        if (ClearMap(space.map, addr, nullptr) == NpkStatus::Success)
+            Private::ShootdownTlbs(addr, PageSize());
+
+        const uint32_t latest = PageChecksum(page);
+        if (latest != checksum)
+        {
+            anon->mergeChecksum = latest;
+            return;
+        }
+
+        if (!stable.Valid())
+        {
+            //this page becomes the merged copy, other pages with the same
+            //contents will be merged with it when they're next scanned.
+            merger.stableLock.Lock();
+            anon->lock.Lock();
+            anon->merged = true;
+            anon->lock.Unlock();
+
+            auto& bucket = merger.stable[checksum % StableBuckets];
+            anon->mergeNext = bucket;
+            bucket = &*anon;
+            merger.stableLock.Unlock();
+
+            MapMergedPage(space, range, addr, page);
+            return;
+        }
+
+        stable->lock.Lock();
+        PageInfo* stablePage = stable->page;
+        const bool usable = stablePage != nullptr && !stable->lazyFree;
+        stable->lock.Unlock();
+
+        if (!usable || !PagesEqual(page, stablePage))
+            return;
+
+        //replacing the amap entry drops its reference to `anon`, our
+        //reference is the last one.
+        if (Private::AnonMapAdd(*range.amapRef, slot, stable)
+            != NpkStatus::Success)
+            return;
+
+        merger.mergedPages.Add(1, sl::Relaxed);
+        MapMergedPage(space, range, addr, stablePage);
+    }
+
+    //NOTE: assumes space.rangesMutex (shared) and merger.mutex are held.
+    //Scans slots of `range` from `begin`, returning the address scanning
+    //stopped at.
+    static uintptr_t MergeScanRange(VmSpace& space, VmRange& range,
+        uintptr_t begin, size_t* budget)
+    {
+        const uintptr_t top = range.base + range.length;
+        if (AcquireMutex(&range.mutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return top;
+
+        //merging replaces amap entries, which must only be visible to this
+        //range.
+        if (!range.flags.Has(VmFlag::CopyOnWrite)
+            || range.flags.Has(VmFlag::AmapNeedsCopy)
+            || !range.amapRef.Valid()
+            || range.amapRef->refcount.Load(sl::Relaxed) != 1)
+        {
+            ReleaseMutex(&range.mutex);
+            return top;
+        }
+
+        const size_t slotLimit = sl::Min(range.amapRef->slotCount,
+            range.length >> PfnShift());
+        size_t slot = 0;
+        if (begin > range.base)
+            slot = (begin - range.base) >> PfnShift();
+
+        for (; slot < slotLimit && *budget != 0; slot++)
+        {
+            (*budget)--;
+            ScanSlot(space, range, slot);
+        }
+        ReleaseMutex(&range.mutex);
+
+        return slot >= slotLimit ? top : range.base + (slot << PfnShift());
+    }
+
+    //NOTE: assumes merger.mutex is held
+    static void MergeScanSpace(VmSpace& space, size_t budget)
+    {
+        if (AcquireSxMutexShared(&space.rangesMutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return;
+
+        const uintptr_t cursor = space.mergeCursor;
+        VmRange* it = space.ranges.First();
+        while (it != nullptr && it->base + it->length <= cursor)
+            it = VmRangeTree::Successor(it);
+
+        uintptr_t stopped = cursor;
+        for (; it != nullptr && budget != 0; it = VmRangeTree::Successor(it))
+        {
+            if (it->flags.Has(VmFlag::Mmio))
+                continue;
+
+            stopped = MergeScanRange(space, *it, cursor, &budget);
+            if (stopped < it->base + it->length)
+                break;
+        }
+        ReleaseSxMutexShared(&space.rangesMutex);
+
+        space.mergeCursor = it == nullptr ? 0 : stopped;
+    }
+
+    static void ArmMerger()
+    {
+        if (merger.interval.ticks == 0 || merger.armed.Exchange(true))
+            return;
+
+        merger.clockEvent.expiry = GetMonotonicTime() + merger.interval;
+        AddClockEvent(&merger.clockEvent);
+    }
+
+    static void MergerWork(WorkItem* item, void* arg)
+    {
+        (void)item;
+        (void)arg;
+
+        if (AcquireMutex(&merger.mutex, {}, NPK_WAIT_LOCATION)
+            == NpkStatus::Success)
+        {
+            const size_t budget = merger.spaceCount == 0 ? 0
+                : sl::Max<size_t>(1,
+                merger.pagesPerInterval / merger.spaceCount);
+
+            for (auto it = merger.spaces.Begin(); it != merger.spaces.End();
+                ++it)
+                MergeScanSpace(*it, budget);
+            ReleaseMutex(&merger.mutex);
+        }
+
+        merger.armed.Store(false, sl::Release);
+        if (!merger.spaces.Empty())
+            ArmMerger();
+    }
+
+    static void MergerDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        (void)arg;
+
+        QueueWorkItem(&merger.work, {});
+    }
+
+    void Private::InitPageMerging()
+    {
+        NPK_ASSERT(ResetMutex(&merger.mutex, 1) == NpkStatus::Success);
+        merger.spaceCount = 0;
+        merger.interval = sl::TimeCount(sl::Millis,
+            ReadConfigUint("npk.vm.merge_scan_interval_ms",
+            DefaultMergeIntervalMs));
+        merger.pagesPerInterval = ReadConfigUint("npk.vm.merge_scan_pages",
+            DefaultMergePages);
+
+        merger.dpc.function = MergerDpc;
+        merger.dpc.arg = nullptr;
+        merger.work.function = MergerWork;
+        merger.work.arg = nullptr;
+        merger.clockEvent.dpc = &merger.dpc;
+        merger.clockEvent.waitable = nullptr;
+
+        if (merger.interval.ticks == 0 || merger.pagesPerInterval == 0)
+        {
+            merger.interval.ticks = 0;
+            Log("Page merging disabled", LogLevel::Info);
+            return;
+        }
+
+        Log("Page merging: %zu pages every %zums", LogLevel::Verbose,
+            merger.pagesPerInterval, (size_t)merger.interval.ticks);
+    }
+
+    void Private::ForgetMergedPage(AnonPage* page)
+    {
+        merger.stableLock.Lock();
+        UnlinkStablePage(page);
+        page->merged = false;
+        merger.stableLock.Unlock();
+    }
+
+    bool Private::UnmergeAnonPage(AnonPage& page)
+    {
+        page.lock.Lock();
+        const bool merged = page.merged;
+        page.lock.Unlock();
+
+        if (!merged)
+            return true;
+
+        //new references to merged pages are only taken with the stable
+        //table locked, so the count can't grow while we hold it.
+        merger.stableLock.Lock();
+        const bool exclusive = page.refcount.Load(sl::Relaxed) == 2;
+        if (exclusive)
+        {
+            UnlinkStablePage(&page);
+            page.lock.Lock();
+            page.merged = false;
+            page.lock.Unlock();
+        }
+        merger.stableLock.Unlock();
+
+        return exclusive;
+    }
+
+    NpkStatus Private::SplitMergedPage(PageInfo** copy, AnonMap& amap,
+        size_t slot, AnonPageRef& anon)
+    {
+        NPK_CHECK(copy != nullptr, NpkStatus::InvalidArg);
+
+        PageInfo* shared;
+        auto result = AnonPageGetPage(&shared, anon, false);
+        if (result != NpkStatus::Success)
+            return result;
+
+        PageInfo* page = AllocPage(false);
+        if (page == nullptr)
+            return NpkStatus::Shortage;
+
+        {
+            auto dest = AccessPage(page);
+            auto src = AccessPage(shared);
+            sl::MemCopy(dest->value, src->value, PageSize());
+        }
+
+        result = AnonMapAddPage(amap, slot, page);
+        if (result != NpkStatus::Success)
+        {
+            FreePage(page);
+            return result;
+        }
+
+        merger.splitPages.Add(1, sl::Relaxed);
+        *copy = page;
+        return NpkStatus::Success;
+    }
+
+    NpkStatus SpaceEnableMerging(VmSpace& space, bool enable)
+    {
+        auto result = AcquireMutex(&merger.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return result;
+
+        if (space.mergeEnabled != enable)
+        {
+            if (enable)
+            {
+                space.mergeCursor = 0;
+                merger.spaces.PushBack(&space);
+                merger.spaceCount++;
+            }
+            else
+            {
+                merger.spaces.Remove(&space);
+                merger.spaceCount--;
+            }
+            space.mergeEnabled = enable;
+        }
+        ReleaseMutex(&merger.mutex);
+
+        if (enable)
+            ArmMerger();
+        return NpkStatus::Success;
+    }
+
+    void GetPageMergeStats(PageMergeStats& stats)
+    {
+        stats.sharedPages = 0;
+        stats.sharingPages = 0;
+
+        //each amap referencing a merged page holds a reference to it, the
+        //count also includes any references held temporarily.
+        merger.stableLock.Lock();
+        for (size_t i = 0; i < StableBuckets; i++)
+        {
+            for (auto* it = merger.stable[i]; it != nullptr; it = it->mergeNext)
+            {
+                const size_t refs = it->refcount.Load(sl::Relaxed);
+                stats.sharedPages++;
+                stats.sharingPages += refs == 0 ? 0 : refs - 1;
+            }
+        }
+        merger.stableLock.Unlock();
+
+        stats.scannedPages = merger.scannedPages.Load(sl::Relaxed);
+        stats.mergedPages = merger.mergedPages.Load(sl::Relaxed);
+        stats.splitPages = merger.splitPages.Load(sl::Relaxed);
+    }
+}
@@ -0,0 +1,1380 @@
+#include <private/Vm.hpp>
+#include <private/Io.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
+
+/* The page cache holds the contents of VmSources (typically files) in memory,
+ * it is shared by page faults on ranges mapping a source and read/write IOPs
+ * issued to the source's IoInterface. Each source indexes its pages by offset
+ * using a radix tree, with interior nodes allocated from the wired pool.
+ * Cached pages have the following states, tracked in `PageInfo::vm.flags`:
+ * - Busy: the page is being filled by the pager and its contents are not
+ *   valid yet. Anyone wanting the page waits on the `CacheFill` covering it.
+ * - Dirty: the page has been modified and needs to be written back.
+ * - Writeback: the page is being written back. It may still be read and
+ *   modified, which will mark it dirty again.
+ * - MappedWrite: the page has been mapped writable by a page fault. Without a
+ *   reverse map we can't write-protect these again, so they are treated as
+ *   always dirty.
+ * - Mapped: the page has been handed to a page fault (or fault-around), so
+ *   it may be mapped by any number of spaces. For the same reason these
+ *   pages stay cached until the source is destroyed.
+ * - Referenced: the page was accessed since the eviction scan last saw it.
+ *
+ * Clean pages that aren't mapped, busy, under writeback or held by a transfer
+ * (counted in `PageInfo::vm.wireCount`) are evicted when memory is reclaimed.
+ * Each source is scanned in index order like a clock: a page accessed since
+ * the hand last passed it gets a second chance, otherwise it's freed, so the
+ * least recently used pages are evicted first.
+ *
+ * Each stream of accesses (a VmRange for page faults, or a file source for
+ * IOPs) has a ReadaheadState. When accesses are sequential the cache reads
+ * a window of pages ahead of them using the pager's `GetAsync()`, starting
+ * small and doubling each time the stream reaches the start of the previous
+ * window (up to `npk.vm.readahead_max_pages`). The next window is requested
+ * while the current one is still being consumed, so a sequential reader
+ * should rarely wait on IO. A non-sequential access drops the window, so
+ * random access doesn't pay for reading pages it won't use.
+ *
+ * Cache space is divided into cache segments (csegs): fixed-size windows
+ * onto a range of a source's pages. Read/write IOPs copy data through csegs,
+ * and unused csegs are kept mapped (in LRU order) so repeated accesses to hot
+ * files don't need to look up or map pages again. If no cseg is available
+ * the transfer falls back to the temporary mapping cache.
+ */
+namespace Npk
+{
+    //tracks an in-progress fill of `count` pages starting at `base`, threads
+    //wanting one of these pages wait on `complete`. Asynchronous fills
+    //(readahead) also use `work` to finish the fill from a worker thread.
+    struct CacheFill
+    {
+        CacheFill* next;
+        size_t base;
+        size_t count;
+        size_t waiters;
+        bool done;
+        Condition complete;
+
+        VmSource* source;
+        NpkStatus result;
+        WorkItem work;
+    };
+}
+
+namespace Npk::Private
+{
+    constexpr HeapTag PageCacheTag = NPK_MAKE_HEAP_TAG("PgCa");
+    constexpr size_t CacheRadixBits = 6;
+    constexpr size_t CacheRadixFanout = 1 << CacheRadixBits;
+    constexpr size_t MaxCacheHeight = (sizeof(size_t) * 8 + CacheRadixBits - 1)
+        / CacheRadixBits;
+    constexpr size_t MaxWritebackPages = 32;
+    constexpr size_t CsegPages = 16;
+    constexpr size_t DefaultCsegCount = 512;
+    constexpr size_t CsegHashBuckets = 64;
+    constexpr size_t ReadaheadInitialPages = 4;
+    constexpr size_t DefaultReadaheadMaxPages = 64;
+    constexpr size_t MaxReadaheadBatch = 32;
+    constexpr size_t EvictScanRatio = 4;
+    constexpr uint32_t EvictBlockers = CachePageBusy | CachePageDirty
+        | CachePageWriteback | CachePageMappedWrite | CachePageMapped;
+
+    struct CacheNode
+    {
+        void* slots[CacheRadixFanout];
+        size_t count;
+    };
+
+    struct CacheSegment
+    {
+        sl::ListHook lruHook;
+        CacheSegment* hashNext;
+        VmSource* source;
+        size_t base;
+        size_t users;
+        uint32_t mapped;
+        uintptr_t vaddr;
+    };
+
+    using CacheSegmentList = sl::List<CacheSegment, &CacheSegment::lruHook>;
+    static_assert(CsegPages <= sizeof(CacheSegment::mapped) * 8);
+
+    struct CsegState
+    {
+        Mutex mutex;
+        size_t count;
+        CacheSegment* segments;
+        CacheSegment* buckets[CsegHashBuckets];
+        CacheSegmentList lru;
+    };
+
+    using CacheSourceList = sl::List<VmSource, &VmSource::cacheHook>;
+
+    struct CacheSourceRegistry
+    {
+        Mutex mutex;
+        size_t count;
+        CacheSourceList sources;
+    };
+
+    static CsegState csegs;
+    static CacheSourceRegistry registry;
+    static size_t readaheadMaxPages;
+
+    static size_t SourcePageCount(VmSource& source)
+    {
+        return AlignUpPage(source.length) >> PfnShift();
+    }
+
+    static bool IndexFits(size_t index, size_t height)
+    {
+        const size_t bits = height * CacheRadixBits;
+        return bits >= sizeof(size_t) * 8 || (index >> bits) == 0;
+    }
+
+    static size_t SlotOf(size_t index, size_t level)
+    {
+        return (index >> ((level - 1) * CacheRadixBits))
+            & (CacheRadixFanout - 1);
+    }
+
+    static CacheNode* AllocNode()
+    {
+        void* ptr = PoolAllocWired(sizeof(CacheNode), PageCacheTag);
+        if (ptr == nullptr)
+            return nullptr;
+
+        return new(ptr) CacheNode {};
+    }
+
+    //NOTE: assumes source.mutex is held (shared or exclusive)
+    static PageInfo* IndexLookup(VmSource& source, size_t index)
+    {
+        if (source.cacheRoot == nullptr
+            || !IndexFits(index, source.cacheHeight))
+            return nullptr;
+
+        void* scan = source.cacheRoot;
+        for (size_t level = source.cacheHeight; level > 0; level--)
+        {
+            scan = static_cast<CacheNode*>(scan)->slots[SlotOf(index, level)];
+            if (scan == nullptr)
+                return nullptr;
+        }
+
+        return static_cast<PageInfo*>(scan);
+    }
+
+    //NOTE: assumes source.mutex is held exclusively
+    static NpkStatus IndexInsert(VmSource& source, size_t index,
+        PageInfo* page)
+    {
+        while (source.cacheRoot == nullptr
+            || !IndexFits(index, source.cacheHeight))
+        {
+            CacheNode* root = AllocNode();
+            if (root == nullptr)
+                return NpkStatus::Shortage;
+
+            if (source.cacheRoot != nullptr)
+            {
+                root->slots[0] = source.cacheRoot;
+                root->count = 1;
+                source.cacheHeight++;
+            }
+            else
+                source.cacheHeight = 1;
+            source.cacheRoot = root;
+        }
+
+        auto* node = static_cast<CacheNode*>(source.cacheRoot);
+        for (size_t level = source.cacheHeight; level > 1; level--)
+        {
+            void*& child = node->slots[SlotOf(index, level)];
+            if (child == nullptr)
+            {
+                child = AllocNode();
+                if (child == nullptr)
+                    return NpkStatus::Shortage;
+                node->count++;
+            }
+            node = static_cast<CacheNode*>(child);
+        }
+
+        void*& slot = node->slots[SlotOf(index, 1)];
+        NPK_ASSERT(slot == nullptr);
+        slot = page;
+        node->count++;
+        source.cachedPages++;
+
+        return NpkStatus::Success;
+    }
+
+    //NOTE: assumes source.mutex is held exclusively. Removes the page at
+    //`index` and frees any interior nodes left empty.
+    static PageInfo* IndexRemove(VmSource& source, size_t index)
+    {
+        if (source.cacheRoot == nullptr
+            || !IndexFits(index, source.cacheHeight))
+            return nullptr;
+
+        CacheNode* path[MaxCacheHeight];
+        auto* node = static_cast<CacheNode*>(source.cacheRoot);
+        for (size_t level = source.cacheHeight; level > 0; level--)
+        {
+            path[level - 1] = node;
+            if (level == 1)
+                break;
+
+            node = static_cast<CacheNode*>(node->slots[SlotOf(index, level)]);
+            if (node == nullptr)
+                return nullptr;
+        }
+
+        auto* page = static_cast<PageInfo*>(path[0]->slots[SlotOf(index, 1)]);
+        if (page == nullptr)
+            return nullptr;
+
+        for (size_t level = 1; level <= source.cacheHeight; level++)
+        {
+            CacheNode* current = path[level - 1];
+            current->slots[SlotOf(index, level)] = nullptr;
+            if (--current->count != 0)
+                break;
+
+            PoolFreeWired(current, sizeof(CacheNode), PageCacheTag);
+            if (level == source.cacheHeight)
+            {
+                source.cacheRoot = nullptr;
+                source.cacheHeight = 0;
+            }
+        }
+        source.cachedPages--;
+
+        return page;
+    }
+
+    //returns the first page at or after `*index` within the subtree rooted
+    //at `node` (which covers indices starting at `base`), updating `*index`.
+    static PageInfo* NodeNext(CacheNode* node, size_t level, size_t base,
+        size_t* index)
+    {
+        const size_t shift = (level - 1) * CacheRadixBits;
+        size_t i = *index > base ? (*index - base) >> shift : 0;
+
+        for (; i < CacheRadixFanout; i++)
+        {
+            void* child = node->slots[i];
+            if (child == nullptr)
+                continue;
+
+            const size_t childBase = base + (i << shift);
+            if (level == 1)
+            {
+                *index = childBase;
+                return static_cast<PageInfo*>(child);
+            }
+
+            auto* found = NodeNext(static_cast<CacheNode*>(child), level - 1,
+                childBase, index);
+            if (found != nullptr)
+                return found;
+        }
+
+        return nullptr;
+    }
+
+    //NOTE: assumes source.mutex is held (shared or exclusive)
+    static PageInfo* IndexNext(VmSource& source, size_t* index)
+    {
+        if (source.cacheRoot == nullptr
+            || !IndexFits(*index, source.cacheHeight))
+            return nullptr;
+
+        return NodeNext(static_cast<CacheNode*>(source.cacheRoot),
+            source.cacheHeight, 0, index);
+    }
+
+    static void FreeNodes(CacheNode* node, size_t level)
+    {
+        if (level > 1)
+        {
+            for (size_t i = 0; i < CacheRadixFanout; i++)
+            {
+                if (node->slots[i] != nullptr)
+                    FreeNodes(static_cast<CacheNode*>(node->slots[i]),
+                        level - 1);
+            }
+        }
+
+        PoolFreeWired(node, sizeof(CacheNode), PageCacheTag);
+    }
+
+    //NOTE: assumes source.mutex is held exclusively
+    static void MarkDirty(VmSource& source, PageInfo* page)
+    {
+        if ((page->vm.flags & CachePageDirty) != 0)
+            return;
+
+        page->vm.flags |= CachePageDirty;
+        source.dirtyPages++;
+    }
+
+    //NOTE: assumes source.mutex is held exclusively, and releases it before
+    //returning. Waits for the fill covering the busy page at `index`.
+    static NpkStatus WaitForFill(VmSource& source, size_t index)
+    {
+        CacheFill* fill = source.fills;
+        while (fill != nullptr
+            && (index < fill->base || index >= fill->base + fill->count))
+            fill = fill->next;
+        NPK_ASSERT(fill != nullptr);
+
+        fill->waiters++;
+        ReleaseSxMutexExclusive(&source.mutex);
+
+        WaitEntry entry {};
+        auto result = WaitOne(&fill->complete, &entry, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+
+        NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+        fill->waiters--;
+        const bool freeFill = fill->done && fill->waiters == 0;
+        ReleaseSxMutexExclusive(&source.mutex);
+
+        if (freeFill)
+            PoolFreeWired(fill, sizeof(*fill), PageCacheTag);
+
+        return result;
+    }
+
+    //NOTE: assumes source.mutex is held exclusively. Inserts `pages` as busy
+    //entries starting at `base` (these indices must be empty) and creates a
+    //fill covering them. If only some pages could be inserted the fill
+    //covers those and the rest are freed, if none could be inserted all
+    //pages are freed and an error is returned.
+    static NpkStatus BeginFill(CacheFill** found, VmSource& source,
+        size_t base, PageInfo** pages, size_t count)
+    {
+        CacheFill* fill = nullptr;
+        NpkStatus result = NpkStatus::Shortage;
+        if (void* ptr = PoolAllocWired(sizeof(CacheFill), PageCacheTag))
+        {
+            fill = new(ptr) CacheFill {};
+            result = ResetCondition(&fill->complete, 1);
+        }
+
+        size_t inserted = 0;
+        for (; result == NpkStatus::Success && inserted < count; inserted++)
+        {
+            pages[inserted]->vm.flags = CachePageBusy;
+            pages[inserted]->vm.wireCount = 0;
+            pages[inserted]->vm.vmo = &source;
+            result = IndexInsert(source, base + inserted, pages[inserted]);
+            if (result != NpkStatus::Success)
+                break;
+        }
+
+        for (size_t i = inserted; i < count; i++)
+        {
+            pages[i]->vm.flags = 0;
+            pages[i]->vm.vmo = nullptr;
+            FreePage(pages[i]);
+        }
+
+        if (inserted == 0)
+        {
+            if (fill != nullptr)
+                PoolFreeWired(fill, sizeof(*fill), PageCacheTag);
+            return result;
+        }
+
+        fill->base = base;
+        fill->count = inserted;
+        fill->waiters = 0;
+        fill->done = false;
+        fill->source = &source;
+        fill->next = source.fills;
+        source.fills = fill;
+
+        *found = fill;
+        return NpkStatus::Success;
+    }
+
+    //NOTE: assumes source.mutex is held exclusively. Makes the pages covered
+    //by `fill` available if `result` indicates success, otherwise removes
+    //and frees them. Wakes any waiters, `fill` should not be accessed after
+    //this returns.
+    static void CompleteFill(VmSource& source, CacheFill* fill,
+        NpkStatus result)
+    {
+        for (CacheFill** scan = &source.fills; *scan != nullptr;
+            scan = &(*scan)->next)
+        {
+            if (*scan != fill)
+                continue;
+            *scan = fill->next;
+            break;
+        }
+
+        for (size_t i = 0; i < fill->count; i++)
+        {
+            const size_t index = fill->base + i;
+            if (result == NpkStatus::Success)
+            {
+                PageInfo* page = IndexLookup(source, index);
+                NPK_ASSERT(page != nullptr);
+                page->vm.flags &= ~CachePageBusy;
+                continue;
+            }
+
+            PageInfo* page = IndexRemove(source, index);
+            NPK_ASSERT(page != nullptr);
+            page->vm.flags = 0;
+            page->vm.vmo = nullptr;
+            FreePage(page);
+        }
+
+        fill->done = true;
+        SetCondition(&fill->complete);
+        if (fill->waiters == 0)
+            PoolFreeWired(fill, sizeof(*fill), PageCacheTag);
+    }
+
+    //NOTE: assumes source.mutex is held exclusively, it is released while
+    //the pager runs and re-acquired before returning. Inserts `pages` as busy
+    //entries starting at `base` (these indices must be empty) and fills them
+    //with the source contents. On failure the pages are removed from the
+    //index and freed.
+    static NpkStatus FillPages(VmSource& source, size_t base,
+        PageInfo** pages, size_t count)
+    {
+        CacheFill* fill;
+        auto result = BeginFill(&fill, source, base, pages, count);
+        if (result != NpkStatus::Success)
+            return result;
+
+        ReleaseSxMutexExclusive(&source.mutex);
+        result = source.ops->Get(&source, { pages, fill->count }, base, {});
+        NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+
+        CompleteFill(source, fill, result);
+        return result;
+    }
+
+    //runs on a worker thread, which is allowed to block: the source mutex is
+    //only ever held briefly (never across IO), and dropping what may be the
+    //last reference can write back and destroy the source.
+    static void FinishReadahead(WorkItem* item, void* arg)
+    {
+        (void)item;
+
+        auto* fill = static_cast<CacheFill*>(arg);
+        VmSource& source = *fill->source;
+
+        NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+        CompleteFill(source, fill, fill->result);
+        ReleaseSxMutexExclusive(&source.mutex);
+
+        source.ops->UnrefObj(&source);
+    }
+
+    //IOP completion callback, this must not block so the rest of the work
+    //is always deferred.
+    static void ReadaheadDone(void* opaque, NpkStatus result)
+    {
+        auto* fill = static_cast<CacheFill*>(opaque);
+
+        fill->result = result;
+        fill->work.function = FinishReadahead;
+        fill->work.arg = fill;
+        QueueWorkItem(&fill->work, {});
+    }
+
+    //starts asynchronous fills for any pages in `[index, index + count)`
+    //that aren't already cached. This is speculative: it gives up (without
+    //reclaiming memory) as soon as something fails.
+    static void StartReadahead(VmSource& source, size_t index, size_t count)
+    {
+        const size_t end = sl::Min(index + count, SourcePageCount(source));
+
+        while (index < end)
+        {
+            if (AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION) != NpkStatus::Success)
+                return;
+
+            while (index < end && IndexLookup(source, index) != nullptr)
+                index++;
+
+            PageInfo* pages[MaxReadaheadBatch];
+            const size_t base = index;
+            size_t batch = 0;
+            while (index < end && batch < MaxReadaheadBatch
+                && IndexLookup(source, index) == nullptr)
+            {
+                pages[batch] = AllocPage(true);
+                if (pages[batch] == nullptr)
+                    break;
+                batch++;
+                index++;
+            }
+
+            CacheFill* fill = nullptr;
+            if (batch == 0 || !source.ops->RefObj(&source, {}))
+            {
+                for (size_t i = 0; i < batch; i++)
+                    FreePage(pages[i]);
+                batch = 0;
+            }
+            else if (BeginFill(&fill, source, base, pages, batch)
+                != NpkStatus::Success)
+            {
+                source.ops->UnrefObj(&source);
+                batch = 0;
+            }
+            ReleaseSxMutexExclusive(&source.mutex);
+
+            if (batch == 0)
+                return;
+
+            auto result = source.ops->GetAsync(&source,
+                { pages, fill->count }, base, {}, ReadaheadDone, fill);
+            if (result == NpkStatus::Pending)
+                continue;
+
+            NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION) == NpkStatus::Success);
+            CompleteFill(source, fill, result);
+            ReleaseSxMutexExclusive(&source.mutex);
+            source.ops->UnrefObj(&source);
+
+            if (result != NpkStatus::Success)
+                return;
+        }
+    }
+
+    static size_t CsegHash(VmSource* source, size_t base)
+    {
+        const uintptr_t key = reinterpret_cast<uintptr_t>(source) >> 4;
+        return (key ^ (base / CsegPages)) % CsegHashBuckets;
+    }
+
+    //NOTE: assumes csegs.mutex is held
+    static void UnmapSegment(CacheSegment& seg)
+    {
+        if (seg.mapped == 0)
+            return;
+
+        for (size_t i = 0; i < CsegPages; i++)
+        {
+            if ((seg.mapped & (1u << i)) != 0)
+                ClearKernelMap(seg.vaddr + (i << PfnShift()), nullptr);
+        }
+        ShootdownTlbs(seg.vaddr, CsegPages << PfnShift());
+        seg.mapped = 0;
+    }
+
+    //NOTE: assumes csegs.mutex is held
+    static void UnhashSegment(CacheSegment& seg)
+    {
+        CacheSegment** scan = &csegs.buckets[CsegHash(seg.source, seg.base)];
+        while (*scan != &seg)
+            scan = &(*scan)->hashNext;
+        *scan = seg.hashNext;
+
+        seg.hashNext = nullptr;
+        seg.source = nullptr;
+    }
+
+    //NOTE: assumes csegs.mutex is held
+    static CacheSegment* FindSegment(VmSource& source, size_t base)
+    {
+        CacheSegment* seg = csegs.buckets[CsegHash(&source, base)];
+        while (seg != nullptr && (seg->source != &source || seg->base != base))
+            seg = seg->hashNext;
+
+        return seg;
+    }
+
+    //NOTE: assumes csegs.mutex is held. Removes the cseg mapping of the page
+    //at `index` of `source` (if any), returning the segment it was mapped in.
+    //The caller must flush the segment's translations.
+    static CacheSegment* UnmapSegmentPage(VmSource& source, size_t index)
+    {
+        if (csegs.count == 0)
+            return nullptr;
+
+        const size_t base = sl::AlignDown(index, CsegPages);
+        CacheSegment* seg = FindSegment(source, base);
+        if (seg == nullptr)
+            return nullptr;
+
+        const uint32_t bit = 1u << (index - base);
+        if ((seg->mapped & bit) == 0)
+            return nullptr;
+
+        ClearKernelMap(seg->vaddr + ((index - base) << PfnShift()), nullptr);
+        seg->mapped &= ~bit;
+        return seg;
+    }
+
+    //finds (or recycles) the cseg mapping `base` of `source`, where `base`
+    //is a multiple of CsegPages, and maps `pages` (the pages of `source`
+    //starting at `index`) into it. Returns NotAvailable if all csegs are in
+    //use. On success `usable` has a bit set for each of `pages` that is
+    //mapped, counting from `base`.
+    static NpkStatus AcquireSegment(CacheSegment** found, VmSource& source,
+        size_t base, size_t index, sl::Span<PageInfo*> pages, uint32_t* usable)
+    {
+        if (csegs.count == 0)
+            return NpkStatus::NotAvailable;
+
+        auto result = AcquireMutex(&csegs.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return result;
+
+        CacheSegment* seg = FindSegment(source, base);
+        if (seg == nullptr)
+        {
+            seg = csegs.lru.PopFront();
+            if (seg == nullptr)
+            {
+                ReleaseMutex(&csegs.mutex);
+                return NpkStatus::NotAvailable;
+            }
+
+            if (seg->source != nullptr)
+                UnhashSegment(*seg);
+            UnmapSegment(*seg);
+
+            const size_t bucket = CsegHash(&source, base);
+            seg->source = &source;
+            seg->base = base;
+            seg->hashNext = csegs.buckets[bucket];
+            csegs.buckets[bucket] = seg;
+        }
+        else if (seg->users == 0)
+            csegs.lru.Remove(seg);
+        seg->users++;
+
+        //a mapped slot always refers to the page currently cached at that
+        //index, eviction removes the mapping before freeing a page.
+        VmFlags flags {};
+        flags.Set(VmFlag::Write);
+        for (size_t i = 0; i < pages.Size(); i++)
+        {
+            const size_t slot = index + i - base;
+            if ((seg->mapped & (1u << slot)) != 0)
+                continue;
+
+            const uintptr_t vaddr = seg->vaddr + (slot << PfnShift());
+            if (SetKernelMap(vaddr, LookupPagePaddr(pages[i]), flags)
+                == NpkStatus::Success)
+                seg->mapped |= 1u << slot;
+        }
+        *usable = seg->mapped;
+        ReleaseMutex(&csegs.mutex);
+
+        *found = seg;
+        return NpkStatus::Success;
+    }
+
+    //releases a segment acquired by AcquireSegment(), first removing the
+    //mappings of any slots set in `discard`.
+    static void ReleaseSegment(CacheSegment* seg, uint32_t discard)
+    {
+        NPK_ASSERT(AcquireMutex(&csegs.mutex, sl::NoTimeout, NPK_WAIT_LOCATION)
+            == NpkStatus::Success);
+
+        discard &= seg->mapped;
+        if (discard != 0)
+        {
+            for (size_t i = 0; i < CsegPages; i++)
+            {
+                if ((discard & (1u << i)) != 0)
+                    ClearKernelMap(seg->vaddr + (i << PfnShift()), nullptr);
+            }
+            ShootdownTlbs(seg->vaddr, CsegPages << PfnShift());
+            seg->mapped &= ~discard;
+        }
+
+        NPK_ASSERT(seg->users != 0);
+        if (--seg->users == 0)
+            csegs.lru.PushBack(seg);
+
+        ReleaseMutex(&csegs.mutex);
+    }
+
+    static void PurgeSegments(VmSource& source)
+    {
+        if (csegs.count == 0)
+            return;
+
+        NPK_ASSERT(AcquireMutex(&csegs.mutex, sl::NoTimeout, NPK_WAIT_LOCATION)
+            == NpkStatus::Success);
+        for (size_t i = 0; i < csegs.count; i++)
+        {
+            auto& seg = csegs.segments[i];
+            if (seg.source != &source)
+                continue;
+
+            NPK_ASSERT(seg.users == 0);
+            UnhashSegment(seg);
+            UnmapSegment(seg);
+
+            //move the segment to the front of the lru, so it's reused first.
+            csegs.lru.Remove(&seg);
+            csegs.lru.PushFront(&seg);
+        }
+        ReleaseMutex(&csegs.mutex);
+    }
+
+    void InitPageCache(uintptr_t base, size_t length)
+    {
+        const size_t segLength = CsegPages << PfnShift();
+        const size_t count = sl::Min<size_t>(length / segLength,
+            ReadConfigUint("npk.vm.cache_segments", DefaultCsegCount));
+
+        readaheadMaxPages = ReadConfigUint("npk.vm.readahead_max_pages",
+            DefaultReadaheadMaxPages);
+
+        NPK_ASSERT(ResetMutex(&registry.mutex, 1) == NpkStatus::Success);
+        registry.count = 0;
+        NPK_ASSERT(ResetMutex(&csegs.mutex, 1) == NpkStatus::Success);
+        csegs.count = 0;
+        if (count == 0)
+            return;
+
+        void* ptr = PoolAllocWired(count * sizeof(CacheSegment), PageCacheTag);
+        if (ptr == nullptr)
+        {
+            Log("Failed to allocate cache segments, file IO will be slower",
+                LogLevel::Error);
+            return;
+        }
+
+        csegs.segments = static_cast<CacheSegment*>(ptr);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto* seg = new(&csegs.segments[i]) CacheSegment {};
+            seg->source = nullptr;
+            seg->users = 0;
+            seg->mapped = 0;
+            seg->vaddr = base + i * segLength;
+            csegs.lru.PushBack(seg);
+        }
+        csegs.count = count;
+
+        auto conv = sl::ConvertUnits(count * segLength);
+        Log("Page cache has %zu segments (%zu.%zu %sB of cache space)",
+            LogLevel::Verbose, count, conv.major, conv.minor, conv.prefix);
+    }
+
+    NpkStatus InitCacheSource(VmSource& source, const VmPagerOps* ops,
+        size_t length)
+    {
+        NPK_CHECK(ops != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(ops->Get != nullptr, NpkStatus::InvalidArg);
+
+        auto result = ResetSxMutex(&source.mutex);
+        if (result != NpkStatus::Success)
+            return result;
+
+        source.ops = ops;
+        source.length = length;
+        source.cacheRoot = nullptr;
+        source.cacheHeight = 0;
+        source.cachedPages = 0;
+        source.dirtyPages = 0;
+        source.fills = nullptr;
+        source.evictCursor = 0;
+
+        NPK_ASSERT(AcquireMutex(&registry.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+        registry.sources.PushBack(&source);
+        registry.count++;
+        ReleaseMutex(&registry.mutex);
+
+        return NpkStatus::Success;
+    }
+
+    void DestroyCacheSource(VmSource& source)
+    {
+        //this waits for any eviction scan of the source to finish.
+        NPK_ASSERT(AcquireMutex(&registry.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+        registry.sources.Remove(&source);
+        registry.count--;
+        ReleaseMutex(&registry.mutex);
+
+        if (source.dirtyPages != 0)
+        {
+            const auto result = CacheWriteback(source, 0,
+                SourcePageCount(source));
+            if (result != NpkStatus::Success)
+            {
+                Log("Failed to write back source %p, %zu dirty pages lost",
+                    LogLevel::Error, &source, source.dirtyPages);
+            }
+        }
+
+        PurgeSegments(source);
+
+        //no one else can reference the source now, so no locks are needed.
+        NPK_ASSERT(source.fills == nullptr);
+        size_t index = 0;
+        while (PageInfo* page = IndexNext(source, &index))
+        {
+            page->vm.flags = 0;
+            page->vm.vmo = nullptr;
+            FreePage(page);
+            index++;
+        }
+
+        if (source.cacheRoot != nullptr)
+        {
+            FreeNodes(static_cast<CacheNode*>(source.cacheRoot),
+                source.cacheHeight);
+        }
+        source.cacheRoot = nullptr;
+        source.cacheHeight = 0;
+        source.cachedPages = 0;
+        source.dirtyPages = 0;
+    }
+
+    enum class PageUse
+    {
+        Map,
+        MapWrite,
+        Transfer,
+        Overwrite,
+    };
+
+    //returns the page at `index`, reading it in if needed. Pages used for a
+    //transfer are held (see CacheTransfer()) and must be released. Pages
+    //that will be entirely overwritten aren't read in: `*fill` is set and
+    //the page is busy until the caller completes the fill.
+    static NpkStatus GetPage(PageInfo** page, CacheFill** fill,
+        VmSource& source, size_t index, PageUse use)
+    {
+        PageInfo* spare = nullptr;
+        *fill = nullptr;
+        while (true)
+        {
+            //fast path: page is resident and was already mapped, only a
+            //shared lock is needed.
+            if (use == PageUse::Map)
+            {
+                if (AcquireSxMutexShared(&source.mutex, sl::NoTimeout,
+                    NPK_WAIT_LOCATION) != NpkStatus::Success)
+                    break;
+
+                PageInfo* found = IndexLookup(source, index);
+                const bool mapped = found != nullptr && (found->vm.flags
+                    & (CachePageBusy | CachePageMapped)) == CachePageMapped;
+                ReleaseSxMutexShared(&source.mutex);
+
+                if (mapped)
+                {
+                    if (spare != nullptr)
+                        FreePage(spare);
+
+                    *page = found;
+                    return NpkStatus::Success;
+                }
+            }
+
+            auto result = AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION);
+            if (result != NpkStatus::Success)
+                break;
+
+            PageInfo* found = IndexLookup(source, index);
+            if (found != nullptr && (found->vm.flags & CachePageBusy) != 0)
+            {
+                WaitForFill(source, index);
+                continue;
+            }
+
+            if (found == nullptr)
+            {
+                //allocate outside of the lock, in case this requires
+                //reclaiming memory. Running out of memory fails the access
+                //rather than the kernel.
+                if (spare == nullptr)
+                {
+                    ReleaseSxMutexExclusive(&source.mutex);
+                    if (AllocPages({ &spare, 1 }) == 0)
+                        return NpkStatus::Shortage;
+                    continue;
+                }
+
+                if (use == PageUse::Overwrite)
+                    result = BeginFill(fill, source, index, &spare, 1);
+                else
+                    result = FillPages(source, index, &spare, 1);
+                found = spare;
+                spare = nullptr;
+                if (result != NpkStatus::Success)
+                {
+                    ReleaseSxMutexExclusive(&source.mutex);
+                    return result;
+                }
+            }
+
+            switch (use)
+            {
+            case PageUse::MapWrite:
+                found->vm.flags |= CachePageMappedWrite;
+                MarkDirty(source, found);
+                [[fallthrough]];
+            case PageUse::Map:
+                found->vm.flags |= CachePageMapped;
+                break;
+            case PageUse::Transfer:
+            case PageUse::Overwrite:
+                NPK_ASSERT(found->vm.wireCount != 0xFFFF);
+                found->vm.wireCount++;
+                found->vm.flags |= CachePageReferenced;
+                break;
+            }
+            ReleaseSxMutexExclusive(&source.mutex);
+
+            if (spare != nullptr)
+                FreePage(spare);
+            *page = found;
+            return NpkStatus::Success;
+        }
+
+        if (spare != nullptr)
+            FreePage(spare);
+        return NpkStatus::InternalError;
+    }
+
+    NpkStatus CacheGetPage(PageInfo** page, VmSource& source, size_t index,
+        bool mapWrite)
+    {
+        NPK_CHECK(page != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(index < SourcePageCount(source), NpkStatus::InvalidArg);
+
+        CacheFill* fill;
+        return GetPage(page, &fill, source, index,
+            mapWrite ? PageUse::MapWrite : PageUse::Map);
+    }
+
+    void CacheReadahead(VmSource& source, ReadaheadState& state, size_t index,
+        size_t count, bool assumeSequential)
+    {
+        if (source.ops->GetAsync == nullptr || readaheadMaxPages == 0
+            || count == 0)
+            return;
+
+        const bool sequential = assumeSequential || index == state.next
+            || (state.size != 0 && index >= state.start
+            && index < state.start + state.size);
+        state.next = index + count;
+
+        if (!sequential)
+        {
+            state.size = 0;
+            return;
+        }
+
+        if (state.size == 0)
+        {
+            //start of a sequential run: read the accessed pages and the
+            //first window in one go, the next window is requested once
+            //the stream moves past the accessed pages.
+            const size_t initial = assumeSequential ? readaheadMaxPages
+                : sl::Max(ReadaheadInitialPages, count * 2);
+
+            state.start = index;
+            state.size = sl::Min(readaheadMaxPages, initial);
+            state.trigger = index + count;
+        }
+        else if (index + count > state.trigger)
+        {
+            const size_t next = state.start + state.size;
+            state.start = sl::Max(next, index);
+            state.size = sl::Min(readaheadMaxPages, state.size * 2);
+            state.trigger = state.start;
+        }
+        else
+            return;
+
+        StartReadahead(source, state.start, state.size);
+    }
+
+    void CachePrefetch(VmSource& source, size_t index, size_t count)
+    {
+        if (source.ops->GetAsync == nullptr)
+            return;
+
+        StartReadahead(source, index, count);
+    }
+
+    size_t CacheLookupPages(VmSource& source, size_t index,
+        sl::Span<PageInfo*> pages)
+    {
+        for (size_t i = 0; i < pages.Size(); i++)
+            pages[i] = nullptr;
+
+        //the pages are about to be mapped, which keeps them from being
+        //evicted.
+        if (AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) != NpkStatus::Success)
+            return 0;
+
+        size_t found = 0;
+        for (size_t i = 0; i < pages.Size(); i++)
+        {
+            PageInfo* page = IndexLookup(source, index + i);
+            if (page == nullptr || (page->vm.flags & CachePageBusy) != 0)
+                continue;
+
+            page->vm.flags |= CachePageMapped;
+            pages[i] = page;
+            found++;
+        }
+        ReleaseSxMutexExclusive(&source.mutex);
+
+        return found;
+    }
+
+    struct HeldPage
+    {
+        PageInfo* page;
+        CacheFill* fill;
+        size_t copied;
+    };
+
+    //drops the holds taken on `pages` by a transfer, marking any that were
+    //written to as dirty. Pages that were being overwritten instead of read
+    //in are only kept if they were fully written.
+    static void ReleasePages(VmSource& source, sl::Span<HeldPage> pages,
+        bool write)
+    {
+        NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION) == NpkStatus::Success);
+        for (size_t i = 0; i < pages.Size(); i++)
+        {
+            auto& held = pages[i];
+            NPK_ASSERT(held.page->vm.wireCount != 0);
+            held.page->vm.wireCount--;
+
+            if (held.fill != nullptr)
+            {
+                const bool complete = held.copied == PageSize();
+                CompleteFill(source, held.fill, complete
+                    ? NpkStatus::Success : NpkStatus::InvalidArg);
+                if (!complete)
+                    continue;
+            }
+
+            //the page is marked dirty after modifying it, so a concurrent
+            //writeback can't clear the flag before the new data is present.
+            if (write && held.copied != 0)
+                MarkDirty(source, held.page);
+        }
+        ReleaseSxMutexExclusive(&source.mutex);
+    }
+
+    NpkStatus CacheTransfer(VmSource& source, size_t offset, IoBuffer& buffer,
+        bool write)
+    {
+        NPK_CHECK(offset + buffer.length >= offset, NpkStatus::InvalidArg);
+        NPK_CHECK(offset + buffer.length <= source.length,
+            NpkStatus::InvalidArg);
+
+        NpkStatus result = NpkStatus::Success;
+        size_t done = 0;
+
+        //the transfer is done one cseg at a time: the pages it covers are
+        //held (so they can't be evicted), mapped into the cseg together, then
+        //copied and released.
+        while (done < buffer.length && result == NpkStatus::Success)
+        {
+            const size_t index = offset >> PfnShift();
+            const size_t segBase = sl::AlignDown(index, CsegPages);
+            const size_t end = sl::Min(segBase + CsegPages,
+                AlignUpPage(offset + buffer.length - done) >> PfnShift());
+
+            HeldPage held[CsegPages];
+            PageInfo* pages[CsegPages];
+            size_t count = 0;
+            for (; count < end - index; count++)
+            {
+                //a write covering the whole page doesn't need its old
+                //contents read in first.
+                const size_t pageStart = (index + count) << PfnShift();
+                const bool overwrite = write && pageStart >= offset
+                    && pageStart + PageSize() <= offset + buffer.length - done;
+
+                held[count].copied = 0;
+                result = GetPage(&held[count].page, &held[count].fill, source,
+                    index + count, overwrite ? PageUse::Overwrite
+                    : PageUse::Transfer);
+                if (result != NpkStatus::Success)
+                    break;
+                pages[count] = held[count].page;
+            }
+            if (count == 0)
+                break;
+
+            CacheSegment* seg = nullptr;
+            uint32_t usable = 0;
+            if (AcquireSegment(&seg, source, segBase, index, { pages, count },
+                &usable) != NpkStatus::Success)
+                seg = nullptr;
+
+            uint32_t discard = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                const size_t slot = index + i - segBase;
+                const size_t pageOffset = offset & PageMask();
+                const size_t chunk = sl::Min(PageSize() - pageOffset,
+                    buffer.length - done);
+
+                PageAccessRef pageRef {};
+                char* cachePtr;
+                if (seg != nullptr && (usable & (1u << slot)) != 0)
+                {
+                    cachePtr = reinterpret_cast<char*>(seg->vaddr
+                        + (slot << PfnShift()));
+                }
+                else
+                {
+                    pageRef = AccessPage(held[i].page);
+                    cachePtr = static_cast<char*>(pageRef->value);
+                }
+                cachePtr += pageOffset;
+
+                size_t& copied = held[i].copied;
+                while (copied < chunk)
+                {
+                    PageAccessRef bufferRef {};
+                    char* bufferPtr = nullptr;
+                    size_t length = GetIoBufferChunk(buffer, done, &bufferPtr,
+                        bufferRef);
+                    if (length == 0)
+                        break;
+
+                    length = sl::Min(length, chunk - copied);
+                    if (write)
+                        sl::MemCopy(cachePtr + copied, bufferPtr, length);
+                    else
+                        sl::MemCopy(bufferPtr, cachePtr + copied, length);
+
+                    copied += length;
+                    done += length;
+                }
+
+                //a page being overwritten that didn't get all of its data
+                //is dropped, so its cseg mapping must go too.
+                if (held[i].fill != nullptr && copied != PageSize())
+                    discard |= 1u << slot;
+                if (copied != chunk)
+                {
+                    result = NpkStatus::InvalidArg;
+                    for (size_t j = i + 1; j < count; j++)
+                    {
+                        if (held[j].fill != nullptr)
+                            discard |= 1u << (index + j - segBase);
+                    }
+                    break;
+                }
+                offset += chunk;
+            }
+
+            if (seg != nullptr)
+                ReleaseSegment(seg, discard);
+            ReleasePages(source, { held, count }, write);
+        }
+
+        return result;
+    }
+
+    //NOTE: assumes source.mutex is held exclusively, and csegs.mutex if
+    //there are any csegs. Moves up to `count` evictable pages of `source`
+    //into `evicted`, returning how many were taken. Their cseg mappings have
+    //been flushed by the time this returns.
+    static size_t EvictSourcePages(VmSource& source, size_t count,
+        PageList& evicted)
+    {
+        size_t budget = sl::Min(source.cachedPages, count * EvictScanRatio);
+        size_t index = source.evictCursor;
+        bool wrapped = false;
+        size_t taken = 0;
+        CacheSegment* flush = nullptr;
+
+        while (taken < count && budget != 0)
+        {
+            PageInfo* page = IndexNext(source, &index);
+            if (page == nullptr)
+            {
+                if (wrapped)
+                    break;
+                wrapped = true;
+                index = 0;
+                continue;
+            }
+            budget--;
+            const size_t current = index++;
+
+            if ((page->vm.flags & EvictBlockers) != 0
+                || page->vm.wireCount != 0)
+                continue;
+            if ((page->vm.flags & CachePageReferenced) != 0)
+            {
+                page->vm.flags &= ~CachePageReferenced;
+                continue;
+            }
+
+            NPK_ASSERT(IndexRemove(source, current) == page);
+            page->vm.flags = 0;
+            page->vm.vmo = nullptr;
+            evicted.PushBack(page);
+            taken++;
+
+            //pages are visited in order, so flushing a segment once we've
+            //moved past it covers all of its evicted pages.
+            CacheSegment* seg = UnmapSegmentPage(source, current);
+            if (seg == nullptr || seg == flush)
+                continue;
+            if (flush != nullptr)
+                ShootdownTlbs(flush->vaddr, CsegPages << PfnShift());
+            flush = seg;
+        }
+
+        if (flush != nullptr)
+            ShootdownTlbs(flush->vaddr, CsegPages << PfnShift());
+        source.evictCursor = index;
+
+        return taken;
+    }
+
+    size_t EvictCachePages(size_t count)
+    {
+        if (AcquireMutex(&registry.mutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return 0;
+        if (csegs.count != 0 && AcquireMutex(&csegs.mutex, {},
+            NPK_WAIT_LOCATION) != NpkStatus::Success)
+        {
+            ReleaseMutex(&registry.mutex);
+            return 0;
+        }
+
+        //sources are rotated through, so each reclaim continues from where
+        //the previous one left off.
+        PageList evicted {};
+        size_t taken = 0;
+        for (size_t i = registry.count; i != 0 && taken < count; i--)
+        {
+            VmSource* source = registry.sources.PopFront();
+            registry.sources.PushBack(source);
+
+            if (AcquireSxMutexExclusive(&source->mutex, {}, NPK_WAIT_LOCATION)
+                != NpkStatus::Success)
+                continue;
+            taken += EvictSourcePages(*source, count - taken, evicted);
+            ReleaseSxMutexExclusive(&source->mutex);
+        }
+
+        if (csegs.count != 0)
+            ReleaseMutex(&csegs.mutex);
+        ReleaseMutex(&registry.mutex);
+
+        while (!evicted.Empty())
+            FreePage(evicted.PopFront());
+
+        return taken;
+    }
+
+    NpkStatus CacheWriteback(VmSource& source, size_t index, size_t count)
+    {
+        if (source.ops->Put == nullptr)
+            return NpkStatus::Unsupported;
+
+        const size_t pageCount = SourcePageCount(source);
+        if (index >= pageCount)
+            return NpkStatus::Success;
+        const size_t end = count > pageCount - index ? pageCount
+            : index + count;
+        NpkStatus result = NpkStatus::Success;
+
+        while (index < end)
+        {
+            auto lockResult = AcquireSxMutexExclusive(&source.mutex,
+                sl::NoTimeout, NPK_WAIT_LOCATION);
+            if (lockResult != NpkStatus::Success)
+                return lockResult;
+
+            //gather a run of consecutive dirty pages, skipping any pages
+            //already under writeback by someone else.
+            PageInfo* pages[MaxWritebackPages];
+            size_t base = 0;
+            size_t run = 0;
+            while (index < end && run < MaxWritebackPages)
+            {
+                size_t next = index;
+                PageInfo* page = IndexNext(source, &next);
+                if (page == nullptr || next >= end)
+                {
+                    index = end;
+                    break;
+                }
+
+                const uint32_t flags = page->vm.flags;
+                const bool eligible = (flags & CachePageDirty) != 0
+                    && (flags & (CachePageBusy | CachePageWriteback)) == 0;
+                if (run != 0 && (!eligible || next != base + run))
+                    break;
+
+                index = next + 1;
+                if (!eligible)
+                    continue;
+
+                if (run == 0)
+                    base = next;
+                pages[run++] = page;
+
+                page->vm.flags |= CachePageWriteback;
+                if ((flags & CachePageMappedWrite) == 0)
+                {
+                    page->vm.flags &= ~CachePageDirty;
+                    source.dirtyPages--;
+                }
+            }
+            ReleaseSxMutexExclusive(&source.mutex);
+
+            if (run == 0)
+                continue;
+
+            const auto putResult = source.ops->Put(&source, { pages, run },
+                base, {});
+
+            NPK_ASSERT(AcquireSxMutexExclusive(&source.mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION) == NpkStatus::Success);
+            for (size_t i = 0; i < run; i++)
+            {
+                pages[i]->vm.flags &= ~CachePageWriteback;
+                if (putResult != NpkStatus::Success)
+                    MarkDirty(source, pages[i]);
+            }
+            ReleaseSxMutexExclusive(&source.mutex);
+
+            if (putResult != NpkStatus::Success)
+                result = putResult;
+        }
+
+        return result;
+    }
+}
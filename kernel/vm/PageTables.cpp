@@ -1,8 +1,11 @@
 #include <private/Vm.hpp>
 #include <Core.hpp>
+#include <lib/Maths.hpp>
 
 namespace Npk
 {
+    constexpr size_t ShootdownBatch = 64;
+
     MmuFlags Private::VmToMmuFlags(VmFlags flags, MmuFlags extra)
     {
         MmuFlags outFlags = extra;
@@ -15,6 +18,36 @@ namespace Npk
         return outFlags;
     }
 
+    void Private::ShootdownTlbs(uintptr_t base, size_t length)
+    {
+        const auto prevIpl = RaiseIpl(Ipl::Dpc);
+        HwFlushTlb(base, length);
+
+        //the request is sent to a batch of cpus at once, and we only wait
+        //for each batch to acknowledge, rather than each cpu in turn.
+        CpuId targets[ShootdownBatch];
+        size_t targetCount = 0;
+
+        const CpuId self = MyCoreId();
+        const CpuId cpuCount = MySystemDomain().smpControls.Size();
+        for (CpuId i = 0; i < cpuCount; i++)
+        {
+            if (i != self)
+                targets[targetCount++] = i;
+            if (targetCount != ShootdownBatch
+                && (i + 1 != cpuCount || targetCount == 0))
+                continue;
+
+            FlushRequest request {};
+            request.base = base;
+            request.length = length;
+            FlushRemoteTlbs({ targets, targetCount }, &request, true);
+            targetCount = 0;
+        }
+
+        LowerIpl(prevIpl);
+    }
+
     sl::Opt<Paddr> Private::AllocatePageTable(size_t level)
     {
         const size_t ptSize = HwGetPageTableSize(level);
@@ -99,6 +132,50 @@ namespace Npk
         return NpkStatus::Success;
     }
 
+    size_t Private::SetMapRun(HwMap map, uintptr_t vaddr,
+        sl::Span<PageInfo*> pages, VmFlags flags)
+    {
+        const size_t ptesPerTable = HwGetPageTableSize(0) / sizeof(HwPte);
+        const auto mmuFlags = VmToMmuFlags(flags, {});
+
+        size_t done = 0;
+        while (done < pages.Size())
+        {
+            //walk to (or create) the leaf table covering the next page, then
+            //fill in as many entries of that table as we can.
+            const uintptr_t base = vaddr + (done << PfnShift());
+            MmuWalkResult result {};
+            PageAccessRef ptRef {};
+
+            if (!HwWalkMap(map, base, result, &ptRef))
+                break;
+            if (!result.complete
+                && PrimeMapping(map, base, result, ptRef) != NpkStatus::Success)
+                break;
+            NPK_ASSERT(result.level == 0);
+
+            const size_t first = (base >> PfnShift()) % ptesPerTable;
+            const size_t count = sl::Min(ptesPerTable - first,
+                pages.Size() - done);
+            for (size_t i = 0; i < count; i++)
+            {
+                HwPte* pte = result.pte + i;
+                if (HwPteValid(pte, {}))
+                    continue;
+
+                HwPte local {};
+                HwPteValid(&local, true);
+                HwPteAddr(&local, LookupPagePaddr(pages[done + i]));
+                HwPteFlags(&local, mmuFlags);
+                HwCopyPte(pte, &local);
+            }
+
+            done += count;
+        }
+
+        return done;
+    }
+
     NpkStatus ClearMap(HwMap map, uintptr_t vaddr, Paddr* paddr)
     {
         MmuWalkResult result {};
@@ -0,0 +1,272 @@
+#include <private/Vm.hpp>
+#include <private/Io.hpp>
+#include <lib/Maths.hpp>
+
+/* Pinning resolves the pages backing a range of user memory (faulting them
+ * in as needed) and holds onto them, so they can be handed to devices as
+ * PageList buffers. Anon pages are wired (which keeps them from being swapped
+ * out) and referenced, pages from the cache hold a reference to their source
+ * instead, since the cache never evicts pages that have been handed out for
+ * mapping while the source is alive.
+ * Either way the pages outlive the range they came from, if the memory is
+ * unmapped while pinned.
+ */
+namespace Npk
+{
+    constexpr HeapTag UserPinTag = NPK_MAKE_HEAP_TAG("UPin");
+    constexpr size_t MaxPinAttempts = 4;
+    constexpr uint16_t MaxWireCount = 0xFFFF;
+
+    struct PinnedPage
+    {
+        PageInfo* page;
+        AnonPageRef anon;
+        VmSource* source;
+    };
+
+    struct UserPin
+    {
+        size_t capacity;
+        size_t pageCount;
+        size_t bufferCount;
+        IoBuffer* buffers;
+        PinnedPage pages[];
+    };
+
+    static size_t UserPinSize(size_t pageCount)
+    {
+        return sizeof(UserPin) + pageCount * sizeof(PinnedPage);
+    }
+
+    static void UnpinPage(PinnedPage& pin)
+    {
+        if (pin.anon.Valid())
+        {
+            pin.anon->lock.Lock();
+            NPK_ASSERT(pin.page->vm.wireCount != 0);
+            pin.page->vm.wireCount--;
+            pin.anon->lock.Unlock();
+
+            pin.anon = {};
+        }
+
+        if (pin.source != nullptr)
+            pin.source->ops->UnrefObj(pin.source);
+        pin.source = nullptr;
+        pin.page = nullptr;
+    }
+
+    //NOTE: assumes range.mutex is held
+    static NpkStatus PinPage(PinnedPage& pin, VmSpace& space, VmRange& range,
+        uintptr_t addr, bool write)
+    {
+        for (size_t i = 0; i < MaxPinAttempts; i++)
+        {
+            PageInfo* page;
+            AnonPageRef anon {};
+            auto result = Private::ResolveRangePage(&page, anon, space, range,
+                addr, write);
+            if (result != NpkStatus::Success)
+                return result;
+
+            if (!anon.Valid())
+            {
+                //cached page or the zero page, neither of which need wiring.
+                if (range.source != nullptr
+                    && !range.source->ops->RefObj(range.source, {}))
+                    return NpkStatus::ObjRefFailed;
+
+                pin.page = page;
+                pin.source = range.source;
+                return NpkStatus::Success;
+            }
+
+            //the anon page may have been reclaimed between being looked up
+            //and us taking the lock, in which case try again.
+            anon->lock.Lock();
+            const bool resident = anon->page == page;
+            const bool wirable = page->vm.wireCount != MaxWireCount;
+            if (resident && wirable)
+                page->vm.wireCount++;
+            anon->lock.Unlock();
+
+            if (!wirable)
+                return NpkStatus::Shortage;
+            if (!resident)
+                continue;
+
+            pin.page = page;
+            pin.anon = anon;
+            return NpkStatus::Success;
+        }
+
+        return NpkStatus::Busy;
+    }
+
+    static bool PagesContiguous(PageInfo* prev, PageInfo* next)
+    {
+        return next == prev + 1
+            && LookupPagePaddr(next) == LookupPagePaddr(prev) + PageSize();
+    }
+
+    //describes the pinned pages with as few PageList buffers as possible,
+    //one per physically contiguous run.
+    static NpkStatus BuildPinBuffers(UserPin& pin, size_t offset,
+        size_t length)
+    {
+        size_t runs = 1;
+        for (size_t i = 1; i < pin.pageCount; i++)
+        {
+            if (!PagesContiguous(pin.pages[i - 1].page, pin.pages[i].page))
+                runs++;
+        }
+
+        auto result = AllocIoBuffers(&pin.buffers, runs, false);
+        if (result != NpkStatus::Success)
+            return result;
+        pin.bufferCount = runs;
+
+        size_t runStart = 0;
+        size_t index = 0;
+        for (size_t i = 1; i <= pin.pageCount; i++)
+        {
+            if (i != pin.pageCount
+                && PagesContiguous(pin.pages[i - 1].page, pin.pages[i].page))
+                continue;
+
+            const size_t runPages = i - runStart;
+            auto& buffer = pin.buffers[index++];
+            buffer.type = IoBufferType::PageList;
+            buffer.offset = offset;
+            buffer.length = sl::Min(length, (runPages << PfnShift()) - offset);
+            buffer.physical.pages = { pin.pages[runStart].page, runPages };
+
+            length -= buffer.length;
+            offset = 0;
+            runStart = i;
+        }
+        NPK_ASSERT(index == runs && length == 0);
+
+        return NpkStatus::Success;
+    }
+
+    NpkStatus PinUserBuffer(UserPin** pin, sl::Span<IoBuffer>* buffers,
+        VmSpace& space, uintptr_t base, size_t length, bool write)
+    {
+        NPK_CHECK(pin != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(buffers != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(length != 0, NpkStatus::InvalidArg);
+        NPK_CHECK(base + length > base, NpkStatus::InvalidArg);
+
+        const uintptr_t first = AlignDownPage(base);
+        const size_t count = (AlignUpPage(base + length) - first)
+            >> PfnShift();
+
+        void* ptr = PoolAllocWired(UserPinSize(count), UserPinTag);
+        if (ptr == nullptr)
+            return NpkStatus::Shortage;
+
+        auto* handle = new(ptr) UserPin {};
+        handle->capacity = count;
+        for (size_t i = 0; i < count; i++)
+            new(&handle->pages[i]) PinnedPage {};
+
+        //the space's range tree is held shared for the whole walk, so none of
+        //the ranges can be detached and freed while we're pinning them. Each
+        //range's mutex is also held while pinning its pages, the same as when
+        //resolving a fault.
+        NpkStatus result = AcquireSxMutexShared(&space.rangesMutex,
+            sl::NoTimeout, NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+        {
+            UnpinUserBuffer(handle);
+            return result;
+        }
+
+        const uintptr_t end = first + (count << PfnShift());
+        for (auto it = space.ranges.First(); it != nullptr && it->base < end
+            && result == NpkStatus::Success; it = VmRangeTree::Successor(it))
+        {
+            uintptr_t addr = first + (handle->pageCount << PfnShift());
+            const uintptr_t rangeTop = it->base + it->length;
+            if (rangeTop <= addr)
+                continue;
+            if (it->base > addr)
+                break;
+
+            result = AcquireMutex(&it->mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION);
+            if (result != NpkStatus::Success)
+                break;
+
+            while (handle->pageCount < count && addr < rangeTop)
+            {
+                result = PinPage(handle->pages[handle->pageCount], space,
+                    *it, addr, write);
+                if (result != NpkStatus::Success)
+                    break;
+
+                handle->pageCount++;
+                addr += PageSize();
+            }
+            ReleaseMutex(&it->mutex);
+        }
+        ReleaseSxMutexShared(&space.rangesMutex);
+
+        //a hole in the buffer leaves pages unpinned.
+        if (result == NpkStatus::Success && handle->pageCount != count)
+            result = NpkStatus::BadVaddr;
+
+        if (result == NpkStatus::Success)
+            result = BuildPinBuffers(*handle, base & PageMask(), length);
+        if (result != NpkStatus::Success)
+        {
+            UnpinUserBuffer(handle);
+            return result;
+        }
+
+        *pin = handle;
+        *buffers = { handle->buffers, handle->bufferCount };
+        return NpkStatus::Success;
+    }
+
+    void UnpinUserBuffer(UserPin* pin)
+    {
+        if (pin == nullptr)
+            return;
+
+        if (pin->buffers != nullptr)
+            FreeIoBuffers(pin->buffers, pin->bufferCount);
+        for (size_t i = 0; i < pin->pageCount; i++)
+            UnpinPage(pin->pages[i]);
+
+        const bool success = PoolFreeWired(pin, UserPinSize(pin->capacity),
+            UserPinTag);
+        NPK_ASSERT(success);
+    }
+
+    NpkStatus CreateUserIop(Iop** result, IoInterface* target, IoType type,
+        IoFlags flags, IopParams* params, VmSpace& space, uintptr_t base,
+        size_t length)
+    {
+        NPK_CHECK(result != nullptr, NpkStatus::InvalidArg);
+
+        //a read stores data into the user buffer.
+        UserPin* pin;
+        sl::Span<IoBuffer> buffers;
+        auto status = PinUserBuffer(&pin, &buffers, space, base, length,
+            type == IoType::Read);
+        if (status != NpkStatus::Success)
+            return status;
+
+        status = CreateIop(result, target, type, flags, params, buffers);
+        if (status != NpkStatus::Success)
+        {
+            UnpinUserBuffer(pin);
+            return status;
+        }
+
+        (*result)->userPin = pin;
+        return NpkStatus::Success;
+    }
+}
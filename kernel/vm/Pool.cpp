@@ -132,6 +132,39 @@ namespace Npk::Private
         return true;
     }
 
+    static Node* TryCoalesce(Pool& pool, Node* node)
+    {
+        auto before = pool.nodesByAddr.Before(node);
+        if (before != pool.nodesByAddr.End() && before->tag == FreeTag)
+        {
+            const size_t l1Index = GetL1Index(before->length);
+            auto beforeNode = &*before;
+            auto& level2 = pool.freeNodes[l1Index];
+            level2.Remove(beforeNode);
+
+            pool.nodesByAddr.Remove(node);
+            beforeNode->length += node->length;
+            FreeNode(pool, node);
+
+            node = beforeNode;
+        }
+
+        auto after = pool.nodesByAddr.After(node);
+        if (after != pool.nodesByAddr.End() && after->tag == FreeTag)
+        {
+            const size_t l1Index = GetL1Index(after->length);
+            auto afterNode = &*after;
+            auto& level2 = pool.freeNodes[l1Index];
+            level2.Remove(afterNode);
+
+            pool.nodesByAddr.Remove(afterNode);
+            node->length += after->length;
+            FreeNode(pool, afterNode);
+        }
+
+        return node;
+    }
+
     void* PoolAlloc(size_t len, HeapTag tag, bool paged, sl::TimeCount timeout)
     {
         NPK_CHECK(len != 0, nullptr);
@@ -142,126 +175,129 @@ namespace Npk::Private
         const size_t l1Index = GetL1Index(len);
         auto& pool = paged ? pagedPool : wiredPool;
 
-        //try acquire the mutex for this pool
-        auto result = AcquireMutex(&pool.mutex, timeout, NPK_WAIT_LOCATION);
-        if (result != NpkStatus::Success)
-            return nullptr;
-
-        //find a node with enough space
-        Node* selected = nullptr;
-        for (size_t i = l1Index; i < Level1Count; i++)
+        //page freed up by reclaim on a previous attempt, see below.
+        PageInfo* spare = nullptr;
+        while (true)
         {
-            auto& level2 = pool.freeNodes[i];
-
-            if (level2.Empty())
-                continue;
+            //try acquire the mutex for this pool
+            auto result = AcquireMutex(&pool.mutex, timeout,
+                NPK_WAIT_LOCATION);
+            if (result != NpkStatus::Success)
+                break;
 
-            for (auto it = level2.Begin(); it != level2.End(); ++it)
+            //find a node with enough space
+            Node* selected = nullptr;
+            for (size_t i = l1Index; i < Level1Count; i++)
             {
-                if (it->length < len)
+                auto& level2 = pool.freeNodes[i];
+
+                if (level2.Empty())
                     continue;
 
-                selected = &*it;
-                break;
+                for (auto it = level2.Begin(); it != level2.End(); ++it)
+                {
+                    if (it->length < len)
+                        continue;
+
+                    selected = &*it;
+                    break;
+                }
+
+                if (selected != nullptr)
+                {
+                    level2.Remove(selected);
+                    break;
+                }
             }
 
-            if (selected != nullptr)
+            if (selected == nullptr)
             {
-                level2.Remove(selected);
+                ReleaseMutex(&pool.mutex);
                 break;
             }
-        }
 
-        if (selected == nullptr)
-        {
-            ReleaseMutex(&pool.mutex);
-            return nullptr;
-        }
-
-        TrySplitNode(pool, selected, len);
+            TrySplitNode(pool, selected, len);
 
-        uintptr_t mapBegin = AlignDownPage(selected->base);
-        uintptr_t mapEnd = AlignUpPage(selected->base + selected->length);
+            uintptr_t mapBegin = AlignDownPage(selected->base);
+            uintptr_t mapEnd = AlignUpPage(selected->base + selected->length);
 
-        auto prev = pool.nodesByAddr.Before(selected);
-        while (prev != pool.nodesByAddr.End() 
-            && AlignUpPage(prev->base + prev->length) >= mapBegin)
-        {
-            if (prev->tag == FreeTag)
+            auto prev = pool.nodesByAddr.Before(selected);
+            while (prev != pool.nodesByAddr.End() 
+                && AlignUpPage(prev->base + prev->length) >= mapBegin)
             {
-                prev = pool.nodesByAddr.Before(&*prev);
-                continue;
-            }
+                if (prev->tag == FreeTag)
+                {
+                    prev = pool.nodesByAddr.Before(&*prev);
+                    continue;
+                }
 
-            mapBegin = sl::Max(mapBegin, prev->base + prev->length);
-            mapBegin = AlignUpPage(mapBegin);
-            break;
-        }
+                mapBegin = sl::Max(mapBegin, prev->base + prev->length);
+                mapBegin = AlignUpPage(mapBegin);
+                break;
+            }
 
-        auto next = pool.nodesByAddr.After(selected);
-        while (next != pool.nodesByAddr.End() && 
-            AlignDownPage(next->base) < mapEnd)
-        {
-            if (next->tag == FreeTag)
+            auto next = pool.nodesByAddr.After(selected);
+            while (next != pool.nodesByAddr.End() && 
+                AlignDownPage(next->base) < mapEnd)
             {
-                next = pool.nodesByAddr.After(&*next);
-                continue;
-            }
+                if (next->tag == FreeTag)
+                {
+                    next = pool.nodesByAddr.After(&*next);
+                    continue;
+                }
 
-            mapEnd = sl::Min(mapEnd, next->base);
-            mapEnd = AlignDownPage(mapEnd);
-            break;
-        }
+                mapEnd = sl::Min(mapEnd, next->base);
+                mapEnd = AlignDownPage(mapEnd);
+                break;
+            }
 
-        for (uintptr_t i = mapBegin; i < mapEnd; i += PageSize())
-        {
-            auto page = AllocPage(false);
-            NPK_ASSERT(page != nullptr);
+            uintptr_t mapped = mapBegin;
+            for (; mapped < mapEnd; mapped += PageSize())
+            {
+                auto page = spare != nullptr ? spare : AllocPage(true);
+                spare = nullptr;
+                if (page == nullptr)
+                    break;
 
-            auto paddr = LookupPagePaddr(page);
-            auto result = SetKernelMap(i, paddr, VmFlag::Write);
-            NPK_ASSERT(result == NpkStatus::Success);
+                auto paddr = LookupPagePaddr(page);
+                result = SetKernelMap(mapped, paddr, VmFlag::Write);
+                NPK_ASSERT(result == NpkStatus::Success);
 
-            //TODO: if paged pool, add this page to the active lists
-        }
+                //TODO: if paged pool, add this page to the active lists
+            }
 
-        selected->tag = tag;
-        ReleaseMutex(&pool.mutex);
+            if (mapped == mapEnd)
+            {
+                selected->tag = tag;
+                ReleaseMutex(&pool.mutex);
 
-        return reinterpret_cast<void*>(selected->base);
-    }
-    
-    static Node* TryCoalesce(Pool& pool, Node* node)
-    {
-        auto before = pool.nodesByAddr.Before(node);
-        if (before != pool.nodesByAddr.End() && before->tag == FreeTag)
-        {
-            const size_t l1Index = GetL1Index(before->length);
-            auto beforeNode = &*before;
-            auto& level2 = pool.freeNodes[l1Index];
-            level2.Remove(beforeNode);
+                return reinterpret_cast<void*>(selected->base);
+            }
 
-            pool.nodesByAddr.Remove(node);
-            beforeNode->length += node->length;
-            FreeNode(pool, node);
+            //out of free pages. Reclaiming memory may allocate from the pool
+            //itself, so it can't be done while holding the pool mutex: put
+            //the node back and try again once a page has been freed up.
+            for (uintptr_t i = mapBegin; i < mapped; i += PageSize())
+            {
+                Paddr paddr;
+                result = ClearKernelMap(i, &paddr);
+                NPK_ASSERT(result == NpkStatus::Success);
 
-            node = beforeNode;
-        }
+                FreePage(LookupPageInfo(paddr));
+            }
 
-        auto after = pool.nodesByAddr.After(node);
-        if (after != pool.nodesByAddr.End() && after->tag == FreeTag)
-        {
-            const size_t l1Index = GetL1Index(after->length);
-            auto afterNode = &*after;
-            auto& level2 = pool.freeNodes[l1Index];
-            level2.Remove(afterNode);
+            if (pool.allowCoalescing)
+                selected = TryCoalesce(pool, selected);
+            InsertFreeNode(pool, selected);
+            ReleaseMutex(&pool.mutex);
 
-            pool.nodesByAddr.Remove(afterNode);
-            node->length += after->length;
-            FreeNode(pool, afterNode);
+            spare = AllocPage(false);
         }
 
-        return node;
+        if (spare != nullptr)
+            FreePage(spare);
+
+        return nullptr;
     }
 
     bool PoolFree(void* ptr, size_t len, HeapTag tag, bool paged, 
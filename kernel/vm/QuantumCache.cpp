@@ -0,0 +1,266 @@
+#include <private/Vm.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+
+/* Quantum caches, in the style of vmem: small unconstrained allocations of
+ * system space (up to `npk.vm.quantum_cache_pages` pages) are served from
+ * per-cpu magazines of free addresses, one per size class, so the common case
+ * doesn't touch the free tree or its mutex. Each size class also has a depot
+ * shared by all cpus. Empty magazines are refilled from the depot, or by
+ * importing a batch of contiguous allocations from the free tree at once.
+ * Full magazines spill half their contents into the depot, and once the
+ * depot is full the surplus is exported back to the tree in a single batch.
+ * Addresses held by the caches aren't free as far as the tree is concerned,
+ * so they can't be allocated by address. This also means the free tree can't
+ * catch double frees of cached addresses, if the kernel is built with
+ * `NPK_HAS_DEBUG_CHECKS` frees are checked against the local magazine and the
+ * depot instead. Other cpus' magazines aren't checked.
+ */
+namespace Npk
+{
+    constexpr size_t MaxQuantumClasses = 8;
+    constexpr size_t MagazineSize = 16;
+    constexpr size_t QuantumBatch = MagazineSize / 2;
+    constexpr size_t DepotSize = 64;
+    static_assert(QuantumBatch < Private::MaxFreeBatch);
+
+    struct QuantumMagazine
+    {
+        size_t count;
+        uintptr_t addrs[MagazineSize];
+    };
+
+    struct QuantumCpuCache
+    {
+        QuantumMagazine classes[MaxQuantumClasses];
+    };
+
+    struct QuantumDepot
+    {
+        sl::SpinLock lock;
+        size_t count;
+        uintptr_t addrs[DepotSize];
+    };
+
+    static size_t quantumClasses;
+    static QuantumDepot depots[MaxQuantumClasses];
+
+    CPU_LOCAL(QuantumCpuCache, static quantumCache);
+
+    CPU_LOCAL_CTOR(
+    {
+        new(quantumCache.Get()) QuantumCpuCache {};
+    });
+
+    //returns the size class for an allocation, or `quantumClasses` if it
+    //isn't cached.
+    static size_t QuantumClass(VmSpace& space, size_t length)
+    {
+        if (&space != MySystemDomain().kernelSpace || length == 0)
+            return quantumClasses;
+
+        const size_t pages = AlignUpPage(length) >> PfnShift();
+        if (pages > quantumClasses)
+            return quantumClasses;
+
+        return pages - 1;
+    }
+
+    static bool Cacheable(const AllocConstraints& constr)
+    {
+        return constr.preferredAddr == 0 && constr.minAddr == 0
+            && constr.maxAddr == static_cast<uintptr_t>(-1)
+            && constr.alignment <= PageSize() && !constr.topDown;
+    }
+
+    //the magazines are per-cpu, raising the ipl keeps us on this cpu while
+    //accessing them.
+    static Ipl EnterMagazines()
+    {
+        const Ipl prevIpl = CurrentIpl();
+        if (prevIpl < Ipl::Dpc)
+            RaiseIpl(Ipl::Dpc);
+
+        return prevIpl;
+    }
+
+    static void ExitMagazines(Ipl prevIpl)
+    {
+        if (prevIpl < Ipl::Dpc)
+            LowerIpl(prevIpl);
+    }
+
+    //moves as many of `addrs` into the depot as will fit, returning the
+    //number left over. These remain at the start of `addrs`.
+    static size_t FillDepot(size_t index, uintptr_t* addrs, size_t count)
+    {
+        auto& depot = depots[index];
+
+        depot.lock.Lock();
+        while (count != 0 && depot.count != DepotSize)
+            depot.addrs[depot.count++] = addrs[--count];
+        depot.lock.Unlock();
+
+        return count;
+    }
+
+#ifdef NPK_HAS_DEBUG_CHECKS
+    //NOTE: assumes the magazines have been entered
+    static bool IsCached(size_t index, uintptr_t base)
+    {
+        const auto& mag = quantumCache->classes[index];
+        for (size_t i = 0; i < mag.count; i++)
+        {
+            if (mag.addrs[i] == base)
+                return true;
+        }
+
+        auto& depot = depots[index];
+        bool found = false;
+        depot.lock.Lock();
+        for (size_t i = 0; i < depot.count && !found; i++)
+            found = depot.addrs[i] == base;
+        depot.lock.Unlock();
+
+        return found;
+    }
+#endif
+
+    static void ExportAddresses(VmSpace& space, size_t index,
+        uintptr_t* addrs, size_t count)
+    {
+        if (count == 0)
+            return;
+
+        const size_t size = (index + 1) << PfnShift();
+        const auto result = Private::SpaceFreeBatch(space, { addrs, count },
+            size, sl::NoTimeout);
+        if (result != NpkStatus::Success)
+        {
+            Log("Quantum cache failed to export %zu allocations of %zu bytes: "
+                "%s", LogLevel::Error, count, size, StatusStr(result));
+        }
+    }
+
+    void Private::InitQuantumCaches()
+    {
+        quantumClasses = sl::Min(MaxQuantumClasses,
+            ReadConfigUint("npk.vm.quantum_cache_pages", MaxQuantumClasses));
+
+        if (quantumClasses == 0)
+            Log("Quantum caches disabled", LogLevel::Info);
+        else
+        {
+            Log("Quantum caches enabled for allocations up to %zu pages",
+                LogLevel::Verbose, quantumClasses);
+        }
+    }
+
+    bool Private::QuantumCacheAlloc(VmSpace& space, uintptr_t* addr,
+        size_t length, const AllocConstraints& constr)
+    {
+        const size_t index = QuantumClass(space, length);
+        if (index >= quantumClasses || !Cacheable(constr))
+            return false;
+
+        //fast path: this cpu's magazine, refilling it from the depot if
+        //it's empty.
+        const Ipl prevIpl = EnterMagazines();
+        auto& mag = quantumCache->classes[index];
+        if (mag.count == 0)
+        {
+            auto& depot = depots[index];
+
+            depot.lock.Lock();
+            const size_t take = sl::Min(depot.count, QuantumBatch);
+            depot.count -= take;
+            sl::MemCopy(mag.addrs, &depot.addrs[depot.count],
+                take * sizeof(uintptr_t));
+            mag.count = take;
+            depot.lock.Unlock();
+        }
+
+        const bool found = mag.count != 0;
+        if (found)
+            *addr = mag.addrs[--mag.count];
+        ExitMagazines(prevIpl);
+
+        if (found)
+            return true;
+
+        //slow path: import a batch of allocations from the free tree in one
+        //go, we keep one and the rest go into the magazine.
+        const size_t size = (index + 1) << PfnShift();
+        AllocConstraints importConstr {};
+        importConstr.timeout = constr.timeout;
+
+        uintptr_t base;
+        if (SpaceAllocUncached(space, &base, size * QuantumBatch, importConstr)
+            != NpkStatus::Success)
+            return false;
+        *addr = base;
+
+        uintptr_t spare[QuantumBatch - 1];
+        size_t spareCount = 0;
+        for (size_t i = 1; i < QuantumBatch; i++)
+            spare[spareCount++] = base + i * size;
+
+        //we may have moved cpus (or another thread refilled the magazine)
+        //since we last looked at it.
+        EnterMagazines();
+        auto& refill = quantumCache->classes[index];
+        while (spareCount != 0 && refill.count != MagazineSize)
+            refill.addrs[refill.count++] = spare[--spareCount];
+        if (spareCount != 0)
+            spareCount = FillDepot(index, spare, spareCount);
+        ExitMagazines(prevIpl);
+
+        ExportAddresses(space, index, spare, spareCount);
+        return true;
+    }
+
+    bool Private::QuantumCacheFree(VmSpace& space, uintptr_t base,
+        size_t length, NpkStatus* result)
+    {
+        const size_t index = QuantumClass(space, length);
+        if (index >= quantumClasses || (base & PageMask()) != 0)
+            return false;
+
+        *result = NpkStatus::Success;
+        const Ipl prevIpl = EnterMagazines();
+#ifdef NPK_HAS_DEBUG_CHECKS
+        if (IsCached(index, base))
+        {
+            ExitMagazines(prevIpl);
+            Log("Double free at 0x%tx in VM space %p", LogLevel::Error,
+                base, &space);
+            *result = NpkStatus::BadVaddr;
+
+            return true;
+        }
+#endif
+
+        auto& mag = quantumCache->classes[index];
+        if (mag.count != MagazineSize)
+        {
+            mag.addrs[mag.count++] = base;
+            ExitMagazines(prevIpl);
+
+            return true;
+        }
+
+        //the magazine is full, move half of it (and this address) to the
+        //depot, or back to the free tree if the depot is full too.
+        uintptr_t spill[QuantumBatch + 1];
+        spill[0] = base;
+        mag.count -= QuantumBatch;
+        sl::MemCopy(&spill[1], &mag.addrs[mag.count],
+            QuantumBatch * sizeof(uintptr_t));
+
+        const size_t leftover = FillDepot(index, spill, QuantumBatch + 1);
+        ExitMagazines(prevIpl);
+
+        ExportAddresses(space, index, spill, leftover);
+        return true;
+    }
+}
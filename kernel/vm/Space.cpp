@@ -5,6 +5,7 @@
 namespace Npk
 {
     constexpr HeapTag SpaceHeapTag = NPK_MAKE_HEAP_TAG("Spac");
+    constexpr size_t AdviseBatchPages = 32;
 
     void InitKernelVmSpace(uintptr_t lowBase, size_t lowLen, uintptr_t highBase,
         size_t highLen)
@@ -25,7 +26,11 @@ namespace Npk
             LogLevel::Verbose, poolBase, poolBase + poolSize,
             conv.major, conv.minor, conv.prefix);
 
-        //2. TODO: implement csegs and explain why this is useful/how it works.
+        //2. Initialize the page cache. Cache space is divided into cache
+        //segments (csegs), windows which map part of a file into kernel
+        //memory. Read/write IOPs for files are serviced by copying through
+        //these, and since they stay mapped until reused, frequently accessed
+        //files can be read without touching the cache index at all.
         const uintptr_t cacheBase = poolBase + poolSize;
         const size_t cacheSize = AlignDownPage(lowLen / 4);
 
@@ -33,6 +38,7 @@ namespace Npk
         Log("Cache space: 0x%tx-0x%tx (%zu.%zu %sB)",
             LogLevel::Verbose, cacheBase, cacheBase + cacheSize,
             conv.major, conv.minor, conv.prefix);
+        Private::InitPageCache(cacheBase, cacheSize);
 
         const uintptr_t systemLowBase = cacheBase + cacheSize;
         const size_t systemLowSize = AlignDownPage(lowLen / 2);
@@ -75,6 +81,27 @@ namespace Npk
         Log("General space (high): 0x%tx-0x%tx (%zu.%zu %sB)",
             LogLevel::Verbose, highBase, highBase + highLen,
             conv.major, conv.minor, conv.prefix);
+
+        //the quantum caches sit in front of the free tree, for small
+        //allocations in system space.
+        Private::InitQuantumCaches();
+
+        //4. Kernel stacks are carved out of system space, in an arena of
+        //slots with a guard page below each stack.
+        Private::InitKernelStacks();
+
+        //5. Compressed store for anonymous memory, this is the first tier
+        //reclaim uses before falling back to swap devices (if any).
+        Private::InitCompressedStore();
+        Private::InitFaultAround();
+
+        //6. Working set estimation, the kernel space is tracked from the
+        //start and other spaces can opt in.
+        Private::InitWorkingSetScanner();
+        SpaceTrackWorkingSet(*mySpace, true);
+
+        //7. Same-page merging for anonymous memory, spaces must opt in.
+        Private::InitPageMerging();
     }
 
     bool VmFreeRangeAggregator::Aggregate(VmFreeRange* range)
@@ -139,8 +166,8 @@ namespace Npk
         tree.Insert(range);
     }
 
-    NpkStatus SpaceAlloc(VmSpace& space, uintptr_t* addr, size_t length,
-        AllocConstraints constr)
+    NpkStatus Private::SpaceAllocUncached(VmSpace& space, uintptr_t* addr,
+        size_t length, AllocConstraints constr)
     {
         if (constr.alignment < 1)
             constr.alignment = 1;
@@ -365,23 +392,23 @@ namespace Npk
         return status;
     }
 
-    NpkStatus SpaceFree(VmSpace& space, uintptr_t base, size_t length, 
-        sl::TimeCount timeout)
+    NpkStatus SpaceAlloc(VmSpace& space, uintptr_t* addr, size_t length,
+        AllocConstraints constr)
     {
-        void* sparePtr = PoolAllocWired(sizeof(VmFreeRange), SpaceHeapTag);
-        if (sparePtr == nullptr)
-            return NpkStatus::Shortage;
-        VmFreeRange* spareRange = new(sparePtr) VmFreeRange{};
-
-        auto result = AcquireMutex(&space.freeRangesMutex, timeout, 
-            NPK_WAIT_LOCATION);
-        if (result != NpkStatus::Success)
-        {
-            PoolFreeWired(spareRange, sizeof(*spareRange), SpaceHeapTag);
+        if (addr != nullptr && Private::QuantumCacheAlloc(space, addr, length,
+            constr))
+            return NpkStatus::Success;
 
-            return result;
-        }
+        return Private::SpaceAllocUncached(space, addr, length, constr);
+    }
 
+    //NOTE: assumes space.freeRangesMutex is held. Returns `length` bytes at
+    //`base` to the free tree, coalescing with neighbouring free ranges. If a
+    //new node is needed it's taken from `spares`, and any node made redundant
+    //by coalescing is added to it instead. `spares` must have room for one.
+    static NpkStatus InsertFreeRange(VmSpace& space, uintptr_t base,
+        size_t length, VmFreeRange** spares, size_t* spareCount)
+    {
         VmFreeRange* pred = nullptr;
         VmFreeRange* succ = nullptr;
         auto scan = space.freeRanges.GetRoot();
@@ -418,14 +445,11 @@ namespace Npk
         {
             Log("Double free at 0x%tx in VM space %p", LogLevel::Error,
                 base, &space);
-            ReleaseMutex(&space.freeRangesMutex);
-            PoolFreeWired(spareRange, sizeof(*spareRange), SpaceHeapTag);
 
             return NpkStatus::BadVaddr;
         }
 
         //try coalesce with nearby free ranges, if any
-        VmFreeRange* toFree = nullptr;
         VmFreeRange* latest = nullptr;
         if (succ != nullptr && succ->base == base + length)
         {
@@ -439,14 +463,14 @@ namespace Npk
             length += pred->length;
             base = pred->base;
             if (latest != nullptr)
-                toFree = latest;
+                spares[(*spareCount)++] = latest;
             latest = pred;
         }
 
         if (latest == nullptr)
         {
-            latest = spareRange;
-            spareRange = nullptr;
+            NPK_ASSERT(*spareCount != 0);
+            latest = spares[--*spareCount];
         }
 
         latest->base = base;
@@ -454,14 +478,60 @@ namespace Npk
         latest->largestChild = latest->length;
         space.freeRanges.Insert(latest);
 
-        ReleaseMutex(&space.freeRangesMutex);
+        return NpkStatus::Success;
+    }
 
-        if (toFree != nullptr)
-            PoolFreeWired(toFree, sizeof(*toFree), SpaceHeapTag);
-        if (spareRange != nullptr)
-            PoolFreeWired(spareRange, sizeof(*spareRange), SpaceHeapTag);
+    NpkStatus Private::SpaceFreeBatch(VmSpace& space, sl::Span<uintptr_t> bases,
+        size_t length, sl::TimeCount timeout)
+    {
+        NPK_CHECK(bases.Size() <= MaxFreeBatch, NpkStatus::InvalidArg);
+
+        //Each free needs at most one new node and coalescing can make at
+        //most one redundant, so allocating a node per free (outside of the
+        //mutex) is always enough.
+        VmFreeRange* spares[MaxFreeBatch * 2];
+        size_t spareCount = 0;
+        for (; spareCount < bases.Size(); spareCount++)
+        {
+            void* sparePtr = PoolAllocWired(sizeof(VmFreeRange), SpaceHeapTag);
+            if (sparePtr == nullptr)
+                break;
+            spares[spareCount] = new(sparePtr) VmFreeRange{};
+        }
 
-        return NpkStatus::Success;
+        auto result = NpkStatus::Shortage;
+        if (spareCount == bases.Size())
+        {
+            result = AcquireMutex(&space.freeRangesMutex, timeout, 
+                NPK_WAIT_LOCATION);
+        }
+
+        if (result == NpkStatus::Success)
+        {
+            for (size_t i = 0; i < bases.Size(); i++)
+            {
+                auto status = InsertFreeRange(space, bases[i], length, spares,
+                    &spareCount);
+                if (status != NpkStatus::Success)
+                    result = status;
+            }
+            ReleaseMutex(&space.freeRangesMutex);
+        }
+
+        for (size_t i = 0; i < spareCount; i++)
+            PoolFreeWired(spares[i], sizeof(*spares[i]), SpaceHeapTag);
+
+        return result;
+    }
+
+    NpkStatus SpaceFree(VmSpace& space, uintptr_t base, size_t length, 
+        sl::TimeCount timeout)
+    {
+        NpkStatus result;
+        if (Private::QuantumCacheFree(space, base, length, &result))
+            return result;
+
+        return Private::SpaceFreeBatch(space, { &base, 1 }, length, timeout);
     }
 
     //NOTE: assumes space.rangesMutex is held (shared or exclusive)
@@ -554,6 +624,7 @@ namespace Npk
         }
 
         auto* vmr = new(ptr) VmRange {};
+        NPK_ASSERT(ResetMutex(&vmr->mutex, 1) == NpkStatus::Success);
         vmr->flags = flags;
         vmr->base = base;
         vmr->length = length;
@@ -585,11 +656,25 @@ namespace Npk
             vmr->offset = 0;
         }
 
+        //faults on the range block until it's been populated.
+        const bool populate = flags.Has(VmFlag::Populate);
+        if (populate)
+        {
+            NPK_ASSERT(AcquireMutex(&vmr->mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION) == NpkStatus::Success);
+        }
+
         space.ranges.Insert(vmr);
         *range = vmr;
 
         ReleaseSxMutexExclusive(&space.rangesMutex);
 
+        if (populate)
+        {
+            Private::PopulateRange(space, *vmr);
+            ReleaseMutex(&vmr->mutex);
+        }
+
         return NpkStatus::Success;
     }
 
@@ -624,6 +709,9 @@ namespace Npk
             range->source->ops->UnrefObj(range->source);
             range->source = nullptr;
         }
+        if (range->pageAges != nullptr)
+            PoolFreeWired(range->pageAges, length >> PfnShift(),
+                Private::WorkingSetTag);
 
         PoolFreeWired(range, sizeof(*range), SpaceHeapTag);
         range = nullptr;
@@ -709,6 +797,7 @@ namespace Npk
             //mappings to the amap.
 
             auto* latest = new(ptr) VmRange {};
+            NPK_ASSERT(ResetMutex(&latest->mutex, 1) == NpkStatus::Success);
             latest->base = it->base;
             latest->length = it->length;
             latest->flags = it->flags;
@@ -716,6 +805,7 @@ namespace Npk
             latest->amapOffset = it->amapOffset;
             latest->amapRef = it->amapRef;
             latest->source = it->source;
+            latest->advice = it->advice;
 
             if (latest->source != nullptr)
             {
@@ -772,6 +862,200 @@ namespace Npk
         return NpkStatus::Success;
     }
 
+    //NOTE: assumes range.mutex is held. Starts bringing in the contents of
+    //slots [first, first + count): swapped out anon pages are read back
+    //immediately, source pages are read asynchronously.
+    static void AdviseWillNeed(VmRange& range, size_t first, size_t count)
+    {
+        if (range.source != nullptr)
+        {
+            Private::CachePrefetch(*range.source,
+                (range.offset >> PfnShift()) + first, count);
+        }
+
+        if (!range.amapRef.Valid())
+            return;
+
+        for (size_t i = first; i < first + count; i++)
+        {
+            auto anon = Private::AnonMapLookup(*range.amapRef, i);
+            if (!anon.Valid())
+                continue;
+
+            PageInfo* page;
+            if (Private::AnonPageGetPage(&page, anon, false)
+                == NpkStatus::Shortage)
+                break;
+        }
+    }
+
+    //NOTE: assumes range.mutex is held. Unmaps slots [first, first + count)
+    //and removes them from the amap, anon pages are freed once no other amap
+    //references them. Cached source pages are only unmapped.
+    static NpkStatus AdviseDontNeed(VmSpace& space, VmRange& range,
+        size_t first, size_t count)
+    {
+        if (range.amapRef.Valid() && range.flags.Has(VmFlag::AmapNeedsCopy))
+        {
+            //the amap is shared with another range, take a private copy
+            //before removing anything from it.
+            AnonMapRef copy {};
+            auto result = Private::AnonMapClone(&copy, *range.amapRef);
+            if (result != NpkStatus::Success)
+                return result;
+
+            range.amapRef = copy;
+            range.flags.Clear(VmFlag::AmapNeedsCopy);
+        }
+
+        AnonPageRef anons[AdviseBatchPages];
+        for (size_t base = first; base < first + count;
+            base += AdviseBatchPages)
+        {
+            const size_t batch = sl::Min(AdviseBatchPages,
+                first + count - base);
+            const uintptr_t vaddr = range.base + (base << PfnShift());
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                ClearMap(space.map, vaddr + (i << PfnShift()), nullptr);
+                if (range.amapRef.Valid())
+                    anons[i] = Private::AnonMapRemove(*range.amapRef, base + i);
+            }
+
+            //stale TLB entries may still reference the pages, so they can
+            //only be released after the shootdown.
+            Private::ShootdownTlbs(vaddr, batch << PfnShift());
+            for (size_t i = 0; i < batch; i++)
+                anons[i] = {};
+        }
+
+        return NpkStatus::Success;
+    }
+
+    //NOTE: assumes range.mutex is held. Marks resident anon pages in slots
+    //[first, first + count) as lazily freeable and unmaps them, so the next
+    //write faults (clearing the mark). Swapped out pages are dropped now.
+    static void AdviseFree(VmSpace& space, VmRange& range, size_t first,
+        size_t count)
+    {
+        //pages of an amap shared with another range may still be needed.
+        if (!range.amapRef.Valid()
+            || range.amapRef->refcount.Load(sl::Relaxed) != 1)
+            return;
+
+        AnonPageRef dropped[AdviseBatchPages];
+        for (size_t base = first; base < first + count;
+            base += AdviseBatchPages)
+        {
+            const size_t batch = sl::Min(AdviseBatchPages,
+                first + count - base);
+            const uintptr_t vaddr = range.base + (base << PfnShift());
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                auto anon = Private::AnonMapLookup(*range.amapRef, base + i);
+                if (!anon.Valid())
+                    continue;
+
+                //only pages owned by this amap alone (which is also holding
+                //a reference, hence 2) can be discarded.
+                anon->lock.Lock();
+                const bool exclusive = anon->refcount.Load(sl::Relaxed) == 2;
+                const bool resident = anon->page != nullptr;
+                if (exclusive && resident)
+                    anon->lazyFree = true;
+                anon->lock.Unlock();
+
+                if (!exclusive)
+                    continue;
+
+                ClearMap(space.map, vaddr + (i << PfnShift()), nullptr);
+                if (!resident)
+                    dropped[i] = Private::AnonMapRemove(*range.amapRef,
+                        base + i);
+            }
+
+            Private::ShootdownTlbs(vaddr, batch << PfnShift());
+            for (size_t i = 0; i < batch; i++)
+                dropped[i] = {};
+        }
+    }
+
+    NpkStatus SpaceAdvise(VmSpace& space, uintptr_t base, size_t length,
+        VmAdvice advice)
+    {
+        NPK_CHECK(length != 0, NpkStatus::InvalidArg);
+        NPK_CHECK(base + length > base, NpkStatus::InvalidArg);
+
+        const uintptr_t end = AlignUpPage(base + length);
+        base = AlignDownPage(base);
+
+        auto result = AcquireSxMutexShared(&space.rangesMutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return result;
+
+        bool found = false;
+        for (auto it = space.ranges.First(); it != nullptr && it->base < end;
+            it = VmRangeTree::Successor(it))
+        {
+            if (it->base + it->length <= base)
+                continue;
+            found = true;
+
+            const uintptr_t top = sl::Min(end, it->base + it->length);
+            const size_t first = (sl::Max(base, it->base) - it->base)
+                >> PfnShift();
+            const size_t count = ((top - it->base) >> PfnShift()) - first;
+
+            result = AcquireMutex(&it->mutex, sl::NoTimeout,
+                NPK_WAIT_LOCATION);
+            if (result != NpkStatus::Success)
+                break;
+
+            switch (advice)
+            {
+            case VmAdvice::Normal:
+            case VmAdvice::Sequential:
+            case VmAdvice::Random:
+                it->advice = advice;
+                it->readahead = {};
+                break;
+
+            case VmAdvice::WillNeed:
+                if (!it->flags.Has(VmFlag::Mmio))
+                    AdviseWillNeed(*it, first, count);
+                break;
+
+            case VmAdvice::DontNeed:
+                if (!it->flags.Has(VmFlag::Mmio))
+                    result = AdviseDontNeed(space, *it, first, count);
+                break;
+
+            case VmAdvice::Free:
+                if (it->source != nullptr || it->flags.Has(VmFlag::Mmio))
+                    result = NpkStatus::InvalidArg;
+                else
+                    AdviseFree(space, *it, first, count);
+                break;
+
+            default:
+                result = NpkStatus::InvalidArg;
+                break;
+            }
+            ReleaseMutex(&it->mutex);
+
+            if (result != NpkStatus::Success)
+                break;
+        }
+        ReleaseSxMutexShared(&space.rangesMutex);
+
+        if (result == NpkStatus::Success && !found)
+            return NpkStatus::BadVaddr;
+        return result;
+    }
+
     NpkStatus SpaceLookup(VmRange** found, VmSpace& space, uintptr_t addr)
     {
         NPK_CHECK(found != nullptr, NpkStatus::InvalidArg);
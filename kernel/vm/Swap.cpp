@@ -0,0 +1,875 @@
+#include <private/Vm.hpp>
+#include <private/Core.hpp>
+#include <Process.hpp>
+#include <private/Io.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+#include <lib/Units.hpp>
+
+/* Swap slots are page-sized blocks on a swap device, each device has a bitmap
+ * tracking which slots are allocated and a 'swap cache': pages holding the
+ * contents of a slot that are not currently owned by an AnonPage. Pages enter
+ * the swap cache via readahead, and are claimed by the AnonPage referencing
+ * that slot when it's faulted in (or dropped under memory pressure).
+ * An AnonPage can be in one of three states:
+ * - `page` set, `swapSlot` null: resident and dirty, there is no copy in swap.
+ * - `page` set, `swapSlot` set: resident and clean, the page only ever
+ *   mapped read-only and can be dropped without writing it out again. Write
+ *   faults release the swap slot since the contents will diverge.
+ * - `page` null, `swapSlot` set: swapped out.
+ * When the compressed store is enabled `swapSlot` may instead hold a handle
+ * to a compressed copy of the page, see IsCompressedHandle(). Compressed
+ * copies are always released when the page is brought back in, so there's no
+ * equivalent of the clean state for them.
+ * Resident pages marked `lazyFree` (see VmAdvice::Free) are discarded rather
+ * than swapped out, unless they're written to first.
+ * Since the anon page struct is shared by all amaps referencing it, swapping
+ * in a page for one amap makes it available to all of them.
+ *
+ * Lock ordering: VmRange::mutex -> AnonMap::mutex -> SwapDevice::mutex ->
+ * AnonPage::lock. The device mutex also serializes IO to the device.
+ */
+namespace Npk::Private
+{
+    constexpr HeapTag SwapTag = NPK_MAKE_HEAP_TAG("Swap");
+    constexpr size_t MaxSwapDevices = 8;
+    constexpr size_t SwapSlotIndexBits = 48;
+    constexpr size_t MaxSwapClusterPages = 32;
+    constexpr size_t MaxSwapReadaheadPages = 32;
+    constexpr size_t DefaultSwapClusterPages = 16;
+    constexpr size_t DefaultSwapReadaheadPages = 8;
+    constexpr size_t BitmapWordBits = sizeof(uint64_t) * 8;
+
+    struct SwapDevice
+    {
+        Mutex mutex;
+        IoInterface* ioi;
+        size_t slotCount;
+        size_t freeSlots;
+        size_t nextFit;
+        size_t cachedPages;
+        uint64_t* bitmap;
+        PageInfo** cache;
+    };
+
+    static sl::SpinLock swapDevicesLock;
+    static SwapDevice* swapDevices[MaxSwapDevices];
+    static sl::Atomic<size_t> swapDeviceCount;
+    static size_t swapClusterPages = DefaultSwapClusterPages;
+    static size_t swapReadaheadPages = DefaultSwapReadaheadPages;
+
+    static void* EncodeSwapSlot(size_t device, size_t slot)
+    {
+        //the low bit is always set to distinguish these handles from those
+        //belonging to the compressed store, this also means null is never
+        //a valid handle.
+        const uintptr_t value = (device << SwapSlotIndexBits) | slot;
+        return reinterpret_cast<void*>((value << 1) | 1);
+    }
+
+    static SwapDevice* DecodeSwapSlot(void* handle, size_t* slot)
+    {
+        const uintptr_t value = reinterpret_cast<uintptr_t>(handle) >> 1;
+        const size_t device = value >> SwapSlotIndexBits;
+        *slot = value & ((1ul << SwapSlotIndexBits) - 1);
+
+        NPK_CHECK(device < swapDeviceCount.Load(sl::Acquire), nullptr);
+        auto* dev = swapDevices[device];
+        NPK_CHECK(*slot < dev->slotCount, nullptr);
+
+        return dev;
+    }
+
+    //NOTE: assumes dev.mutex is held
+    static bool SlotInUse(SwapDevice& dev, size_t slot)
+    {
+        const uint64_t mask = 1ull << (slot % BitmapWordBits);
+        return dev.bitmap[slot / BitmapWordBits] & mask;
+    }
+
+    //NOTE: assumes dev.mutex is held
+    static void MarkSlot(SwapDevice& dev, size_t slot, bool used)
+    {
+        const uint64_t mask = 1ull << (slot % BitmapWordBits);
+        if (used)
+        {
+            dev.bitmap[slot / BitmapWordBits] |= mask;
+            dev.freeSlots--;
+        }
+        else
+        {
+            dev.bitmap[slot / BitmapWordBits] &= ~mask;
+            dev.freeSlots++;
+        }
+    }
+
+    //NOTE: assumes dev.mutex is held. Searches for a run of `count` free
+    //slots, starting at the next-fit hint. If no run is long enough the
+    //longest run found is used instead. Returns the length of the allocated
+    //run, which is zero if the device is full.
+    static size_t AllocSlotRun(SwapDevice& dev, size_t count, size_t* base)
+    {
+        if (dev.freeSlots == 0)
+            return 0;
+
+        size_t bestBase = 0;
+        size_t bestLength = 0;
+        size_t runBase = 0;
+        size_t runLength = 0;
+
+        for (size_t i = 0; i < dev.slotCount && bestLength < count; i++)
+        {
+            const size_t slot = (dev.nextFit + i) % dev.slotCount;
+            if (slot == 0)
+                runLength = 0; //runs cannot wrap around the end of the device
+
+            if (slot % BitmapWordBits == 0
+                && dev.bitmap[slot / BitmapWordBits] == ~0ull
+                && i + BitmapWordBits <= dev.slotCount)
+            {
+                //fast path: skip fully allocated bitmap words.
+                runLength = 0;
+                i += BitmapWordBits - 1;
+                continue;
+            }
+
+            if (SlotInUse(dev, slot))
+            {
+                runLength = 0;
+                continue;
+            }
+
+            if (runLength == 0)
+                runBase = slot;
+            runLength++;
+
+            if (runLength > bestLength)
+            {
+                bestBase = runBase;
+                bestLength = runLength;
+            }
+        }
+
+        bestLength = sl::Min(bestLength, count);
+        for (size_t i = 0; i < bestLength; i++)
+            MarkSlot(dev, bestBase + i, true);
+
+        dev.nextFit = (bestBase + bestLength) % dev.slotCount;
+        *base = bestBase;
+        return bestLength;
+    }
+
+    //performs a synchronous transfer between `count` pages and consecutive
+    //slots of a swap device, starting at `slot`. The device mutex serializes
+    //all IO to the device, so it must be held by the caller.
+    static NpkStatus SwapIo(SwapDevice& dev, IoType type, size_t slot,
+        PageInfo** pages, size_t count)
+    {
+        size_t abortCode = 0;
+        const auto result = SyncPageIo(dev.ioi, type, slot << PfnShift(),
+            { pages, count }, PageSize(), &abortCode);
+        if (result != NpkStatus::Success)
+        {
+            Log("Swap %s failed: slot=%zu, count=%zu, status=%s, abort=%zu",
+                LogLevel::Error, type == IoType::Read ? "read" : "write",
+                slot, count, StatusStr(result), abortCode);
+        }
+
+        return result;
+    }
+
+    //pages dropped while scanning a range can't be freed until they've been
+    //unmapped on every cpu, they're collected here so the whole batch only
+    //needs a single shootdown.
+    struct DroppedPages
+    {
+        uintptr_t low;
+        uintptr_t high;
+        size_t count;
+        PageInfo* pages[MaxSwapClusterPages];
+        AnonPageRef anons[MaxSwapClusterPages];
+    };
+
+    static void FlushDroppedPages(DroppedPages& dropped)
+    {
+        if (dropped.count == 0)
+            return;
+
+        ShootdownTlbs(dropped.low, dropped.high - dropped.low);
+        for (size_t i = 0; i < dropped.count; i++)
+        {
+            if (dropped.pages[i] != nullptr)
+                FreePage(dropped.pages[i]);
+            dropped.pages[i] = nullptr;
+            dropped.anons[i] = {};
+        }
+        dropped.count = 0;
+    }
+
+    static void AddDroppedPage(DroppedPages& dropped, uintptr_t addr,
+        PageInfo* page, AnonPageRef&& anon)
+    {
+        if (dropped.count == 0)
+            dropped.low = addr;
+        dropped.high = addr + PageSize();
+        dropped.pages[dropped.count] = page;
+        dropped.anons[dropped.count] = sl::Move(anon);
+        dropped.count++;
+
+        if (dropped.count == MaxSwapClusterPages)
+            FlushDroppedPages(dropped);
+    }
+
+    //NOTE: assumes range.mutex is held. Releases the physical page of an
+    //anon page that already has an up to date copy in swap.
+    static bool DropCleanPage(VmSpace& space, uintptr_t addr,
+        AnonPageRef& anon, DroppedPages& dropped)
+    {
+        anon->lock.Lock();
+        PageInfo* page = anon->page;
+        if (page == nullptr || anon->swapSlot == nullptr
+            || page->vm.wireCount != 0)
+        {
+            anon->lock.Unlock();
+            return false;
+        }
+        anon->page = nullptr;
+        anon->lock.Unlock();
+
+        ClearMap(space.map, addr, nullptr);
+        AddDroppedPage(dropped, addr, page, {});
+
+        return true;
+    }
+
+    //NOTE: assumes range.mutex is held. Drops an anon page marked by
+    //VmAdvice::Free, later accesses to this address will see zeroes.
+    static bool DiscardLazyPage(VmSpace& space, AnonMap& amap, size_t slot,
+        uintptr_t addr, DroppedPages& dropped)
+    {
+        auto removed = AnonMapRemove(amap, slot);
+        if (!removed.Valid())
+            return false;
+
+        //the page is freed with the last reference to the anon page, so
+        //that's held until the shootdown.
+        ClearMap(space.map, addr, nullptr);
+        AddDroppedPage(dropped, addr, nullptr, sl::Move(removed));
+
+        return true;
+    }
+
+    //NOTE: assumes range.mutex is held, and releases it before returning.
+    //Writes out a cluster of dirty anon pages to consecutive swap slots.
+    //Returns the number of pages released.
+    static size_t WriteCluster(VmSpace& space, VmRange& range,
+        AnonPageRef* anons, uintptr_t* addrs, size_t count)
+    {
+        SwapDevice* dev = nullptr;
+        size_t devIndex = 0;
+        size_t base = 0;
+        size_t run = 0;
+
+        //like the range mutexes, busy devices are skipped: the thread that
+        //started this reclaim may be holding the device mutex (swapping in).
+        const size_t deviceCount = swapDeviceCount.Load(sl::Acquire);
+        for (devIndex = 0; devIndex < deviceCount; devIndex++)
+        {
+            dev = swapDevices[devIndex];
+            if (AcquireMutex(&dev->mutex, {}, NPK_WAIT_LOCATION)
+                != NpkStatus::Success)
+                continue;
+
+            run = AllocSlotRun(*dev, count, &base);
+            if (run != 0)
+                break;
+            ReleaseMutex(&dev->mutex);
+        }
+
+        if (run == 0)
+        {
+            ReleaseMutex(&range.mutex);
+            return 0;
+        }
+
+        //detach the pages from their anon structs and park them in the swap
+        //cache while the writeout is in progress. Any faults on these pages
+        //will block on the device mutex until the pages are written.
+        PageInfo* pages[MaxSwapClusterPages];
+        for (size_t i = 0; i < run; i++)
+        {
+            pages[i] = nullptr;
+            auto& anon = anons[i];
+
+            anon->lock.Lock();
+            PageInfo* page = anon->page;
+            if (page != nullptr && anon->swapSlot == nullptr
+                && page->vm.wireCount == 0)
+            {
+                pages[i] = page;
+                anon->page = nullptr;
+                anon->swapSlot = EncodeSwapSlot(devIndex, base + i);
+                dev->cache[base + i] = page;
+                dev->cachedPages++;
+            }
+            anon->lock.Unlock();
+        }
+
+        for (size_t i = 0; i < run; i++)
+        {
+            if (pages[i] != nullptr)
+                ClearMap(space.map, addrs[i], nullptr);
+        }
+        ShootdownTlbs(addrs[0], addrs[run - 1] + PageSize() - addrs[0]);
+        ReleaseMutex(&range.mutex);
+
+        //issue the writes, splitting the cluster around any pages that
+        //changed state before they could be detached.
+        size_t released = 0;
+        for (size_t i = 0; i < run;)
+        {
+            if (pages[i] == nullptr)
+            {
+                MarkSlot(*dev, base + i, false);
+                i++;
+                continue;
+            }
+
+            size_t length = 1;
+            while (i + length < run && pages[i + length] != nullptr)
+                length++;
+
+            const auto result = SwapIo(*dev, IoType::Write, base + i,
+                &pages[i], length);
+
+            for (size_t j = i; j < i + length; j++)
+            {
+                dev->cache[base + j] = nullptr;
+                dev->cachedPages--;
+
+                if (result == NpkStatus::Success)
+                {
+                    FreePage(pages[j]);
+                    released++;
+                    continue;
+                }
+
+                //writeout failed, return the page to its owner. It will be
+                //mapped again on the next access.
+                anons[j]->lock.Lock();
+                anons[j]->page = pages[j];
+                anons[j]->swapSlot = nullptr;
+                anons[j]->lock.Unlock();
+                MarkSlot(*dev, base + j, false);
+            }
+
+            i += length;
+        }
+
+        ReleaseMutex(&dev->mutex);
+
+        return released;
+    }
+
+    //NOTE: assumes range.mutex is held. Moves as many pages of a cluster as
+    //possible into the compressed store, any pages that could not be
+    //compressed are left at the start of `anons` and `addrs`, and `*count`
+    //is updated to reflect this. Returns the number of pages released.
+    static size_t CompressCluster(VmSpace& space, AnonPageRef* anons,
+        uintptr_t* addrs, size_t* count)
+    {
+        //unmap the whole cluster first, so the contents can't change while
+        //they're being compressed. Faults on these pages will block on the
+        //range mutex until we're done.
+        for (size_t i = 0; i < *count; i++)
+            ClearMap(space.map, addrs[i], nullptr);
+        ShootdownTlbs(addrs[0], addrs[*count - 1] + PageSize() - addrs[0]);
+
+        size_t released = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < *count; i++)
+        {
+            auto& anon = anons[i];
+
+            anon->lock.Lock();
+            PageInfo* page = anon->page;
+            const bool eligible = page != nullptr && anon->swapSlot == nullptr
+                && page->vm.wireCount == 0;
+            anon->lock.Unlock();
+
+            void* handle = nullptr;
+            if (eligible && CompressedStoreSave(&handle, page)
+                == NpkStatus::Success)
+            {
+                anon->lock.Lock();
+                const bool unchanged = anon->page == page
+                    && anon->swapSlot == nullptr;
+                if (unchanged)
+                {
+                    anon->page = nullptr;
+                    anon->swapSlot = handle;
+                }
+                anon->lock.Unlock();
+
+                if (unchanged)
+                {
+                    FreePage(page);
+                    released++;
+                    continue;
+                }
+                CompressedStoreFree(handle);
+            }
+
+            if (!eligible)
+                continue;
+
+            if (kept != i)
+            {
+                anons[kept] = sl::Move(anon);
+                addrs[kept] = addrs[i];
+            }
+            kept++;
+        }
+
+        for (size_t i = kept; i < *count; i++)
+            anons[i] = {};
+        *count = kept;
+
+        return released;
+    }
+
+    //NOTE: assumes range.mutex is held, and releases it before returning.
+    //Pages are offered to the compressed store first, anything it rejects
+    //is written out to a swap device.
+    static size_t ReleaseCluster(VmSpace& space, VmRange& range,
+        AnonPageRef* anons, uintptr_t* addrs, size_t count)
+    {
+        size_t released = 0;
+        if (CompressedStoreEnabled())
+            released = CompressCluster(space, anons, addrs, &count);
+
+        if (count == 0 || swapDeviceCount.Load(sl::Acquire) == 0)
+        {
+            ReleaseMutex(&range.mutex);
+            return released;
+        }
+
+        return released + WriteCluster(space, range, anons, addrs, count);
+    }
+
+    //NOTE: assumes space.rangesMutex is held (shared or exclusive)
+    static size_t SwapOutRange(VmSpace& space, VmRange& range, size_t count,
+        uintptr_t begin)
+    {
+        //if the range is busy (likely with a page fault), skip it rather than
+        //blocking: we may have been called while the holder of the range
+        //mutex is trying to allocate a page.
+        if (AcquireMutex(&range.mutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return 0;
+        if (!range.amapRef.Valid())
+        {
+            ReleaseMutex(&range.mutex);
+            return 0;
+        }
+
+        AnonMap& amap = *range.amapRef;
+        const size_t slotLimit = sl::Min(amap.slotCount,
+            range.length >> PfnShift());
+        size_t slot = 0;
+        if (begin > range.base)
+            slot = (begin - range.base) >> PfnShift();
+
+        AnonPageRef anons[MaxSwapClusterPages];
+        uintptr_t addrs[MaxSwapClusterPages];
+        size_t clusterCount = 0;
+        size_t released = 0;
+        DroppedPages dropped {};
+
+        for (; slot < slotLimit && released < count; slot++)
+        {
+            const uintptr_t addr = range.base + (slot << PfnShift());
+            auto anon = AnonMapLookup(amap, slot);
+            if (!anon.Valid())
+                continue;
+
+            //only pages referenced by a single amap (which is also holding a
+            //reference, hence 2) can be swapped out: we have no way to find
+            //other ranges mapping this page. Merged pages are left alone too,
+            //they may be shared again at any moment.
+            anon->lock.Lock();
+            const bool resident = anon->page != nullptr
+                && anon->page->vm.wireCount == 0 && !anon->merged;
+            const bool clean = anon->swapSlot != nullptr;
+            const bool exclusive = anon->refcount.Load(sl::Relaxed) == 2;
+            const bool lazyFree = anon->lazyFree;
+            anon->lock.Unlock();
+
+            if (!resident || !exclusive)
+                continue;
+
+            //lazily freed pages haven't been written since they were
+            //advised, their contents can be thrown away.
+            if (lazyFree && amap.refcount.Load(sl::Relaxed) == 1)
+            {
+                anon = {};
+                if (DiscardLazyPage(space, amap, slot, addr, dropped))
+                    released++;
+                continue;
+            }
+
+            if (clean)
+            {
+                if (DropCleanPage(space, addr, anon, dropped))
+                    released++;
+                continue;
+            }
+
+            anons[clusterCount] = sl::Move(anon);
+            addrs[clusterCount] = addr;
+            clusterCount++;
+
+            if (clusterCount != swapClusterPages
+                && clusterCount + released != count)
+                continue;
+
+            FlushDroppedPages(dropped);
+            released += ReleaseCluster(space, range, anons, addrs,
+                clusterCount);
+            for (size_t i = 0; i < clusterCount; i++)
+                anons[i] = {};
+            clusterCount = 0;
+
+            if (AcquireMutex(&range.mutex, {}, NPK_WAIT_LOCATION)
+                != NpkStatus::Success)
+            {
+                space.swapCursor.Store(addr + PageSize(), sl::Relaxed);
+                return released;
+            }
+        }
+
+        FlushDroppedPages(dropped);
+        if (clusterCount != 0)
+        {
+            released += ReleaseCluster(space, range, anons, addrs,
+                clusterCount);
+            for (size_t i = 0; i < clusterCount; i++)
+                anons[i] = {};
+        }
+        else
+            ReleaseMutex(&range.mutex);
+
+        space.swapCursor.Store(range.base + (slot << PfnShift()), sl::Relaxed);
+        return released;
+    }
+
+    //releases up to `count` pages held in swap caches, these pages have not
+    //been claimed by their anon page and can be re-read on demand.
+    static size_t DropSwapCache(size_t count)
+    {
+        size_t released = 0;
+        const size_t deviceCount = swapDeviceCount.Load(sl::Acquire);
+
+        for (size_t i = 0; i < deviceCount && released < count; i++)
+        {
+            auto& dev = *swapDevices[i];
+            if (AcquireMutex(&dev.mutex, {}, NPK_WAIT_LOCATION)
+                != NpkStatus::Success)
+                continue;
+
+            for (size_t j = 0; j < dev.slotCount && dev.cachedPages != 0
+                && released < count; j++)
+            {
+                if (dev.cache[j] == nullptr)
+                    continue;
+
+                FreePage(dev.cache[j]);
+                dev.cache[j] = nullptr;
+                dev.cachedPages--;
+                released++;
+            }
+
+            ReleaseMutex(&dev.mutex);
+        }
+
+        return released;
+    }
+
+    NpkStatus SwapIn(PageInfo** page, void* swapSlot)
+    {
+        NPK_CHECK(page != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(swapSlot != nullptr, NpkStatus::InvalidArg);
+        NPK_CHECK(!IsCompressedHandle(swapSlot), NpkStatus::InvalidArg);
+
+        size_t slot;
+        SwapDevice* dev = DecodeSwapSlot(swapSlot, &slot);
+        if (dev == nullptr)
+            return NpkStatus::InvalidArg;
+
+        //allocate the main page before taking the device mutex, this may
+        //need to reclaim memory (which can require the device mutex).
+        PageInfo* pages[MaxSwapReadaheadPages + 1];
+        pages[0] = AllocPage(false);
+
+        auto result = AcquireMutex(&dev->mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+        {
+            FreePage(pages[0]);
+            return result;
+        }
+
+        if (dev->cache[slot] != nullptr)
+        {
+            *page = dev->cache[slot];
+            dev->cache[slot] = nullptr;
+            dev->cachedPages--;
+            ReleaseMutex(&dev->mutex);
+            FreePage(pages[0]);
+
+            return NpkStatus::Success;
+        }
+
+        if (!SlotInUse(*dev, slot))
+        {
+            ReleaseMutex(&dev->mutex);
+            FreePage(pages[0]);
+
+            return NpkStatus::NotFound;
+        }
+
+        //read ahead any following slots that are in use but not cached,
+        //pages are swapped out in clusters of adjacent addresses so there's
+        //a good chance these will be needed soon.
+        size_t count = 1;
+        for (size_t i = 1; i <= swapReadaheadPages; i++)
+        {
+            const size_t next = slot + i;
+            if (next >= dev->slotCount || !SlotInUse(*dev, next)
+                || dev->cache[next] != nullptr)
+                break;
+
+            pages[count] = AllocPage(true);
+            if (pages[count] == nullptr)
+                break;
+            count++;
+        }
+
+        result = SwapIo(*dev, IoType::Read, slot, pages, count);
+        if (result != NpkStatus::Success && count > 1)
+        {
+            //the readahead may have been the problem, try the required
+            //page on its own.
+            for (size_t i = 1; i < count; i++)
+                FreePage(pages[i]);
+            count = 1;
+            result = SwapIo(*dev, IoType::Read, slot, pages, count);
+        }
+
+        if (result != NpkStatus::Success)
+        {
+            ReleaseMutex(&dev->mutex);
+            FreePage(pages[0]);
+
+            return result;
+        }
+
+        for (size_t i = 1; i < count; i++)
+        {
+            dev->cache[slot + i] = pages[i];
+            dev->cachedPages++;
+        }
+        ReleaseMutex(&dev->mutex);
+
+        *page = pages[0];
+        return NpkStatus::Success;
+    }
+
+    void SwapSlotFree(void* swapSlot)
+    {
+        NPK_CHECK(swapSlot != nullptr, );
+
+        if (IsCompressedHandle(swapSlot))
+            return CompressedStoreFree(swapSlot);
+
+        size_t slot;
+        SwapDevice* dev = DecodeSwapSlot(swapSlot, &slot);
+        if (dev == nullptr)
+            return;
+
+        auto result = AcquireMutex(&dev->mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        NPK_ASSERT(result == NpkStatus::Success);
+
+        NPK_ASSERT(SlotInUse(*dev, slot));
+        MarkSlot(*dev, slot, false);
+
+        PageInfo* cached = dev->cache[slot];
+        if (cached != nullptr)
+        {
+            dev->cache[slot] = nullptr;
+            dev->cachedPages--;
+        }
+        ReleaseMutex(&dev->mutex);
+
+        if (cached != nullptr)
+            FreePage(cached);
+    }
+
+    size_t ReclaimAnonPages(size_t count)
+    {
+        //clean cached file pages and swap cache pages can be dropped without
+        //any IO, so they go first.
+        size_t released = DropSwapCache(count);
+        if (released < count)
+            released += EvictCachePages(count - released);
+        if (released < count)
+            released += SwapOutProcesses(count - released);
+
+        VmSpace* space = MySystemDomain().kernelSpace;
+        if (released < count && space != nullptr)
+            released += SwapOutSpace(*space, count - released);
+
+        return released;
+    }
+}
+
+namespace Npk
+{
+    NpkStatus AddSwapDevice(IoInterface* ioi, size_t length)
+    {
+        using namespace Private;
+
+        NPK_CHECK(ioi != nullptr, NpkStatus::InvalidArg);
+
+        const size_t slotCount = length >> PfnShift();
+        NPK_CHECK(slotCount != 0, NpkStatus::InvalidArg);
+        NPK_CHECK(slotCount < (1ul << SwapSlotIndexBits),
+            NpkStatus::InvalidArg);
+
+        if (!RefIoInterface(ioi))
+            return NpkStatus::ObjRefFailed;
+
+        const size_t bitmapLength = sl::AlignUp(slotCount, BitmapWordBits)
+            / BitmapWordBits * sizeof(uint64_t);
+        const size_t cacheLength = slotCount * sizeof(PageInfo*);
+
+        void* ptr = PoolAllocWired(sizeof(SwapDevice), SwapTag);
+        void* bitmap = PoolAllocWired(bitmapLength, SwapTag);
+        void* cache = PoolAllocWired(cacheLength, SwapTag);
+        if (ptr == nullptr || bitmap == nullptr || cache == nullptr)
+        {
+            if (ptr != nullptr)
+                PoolFreeWired(ptr, sizeof(SwapDevice), SwapTag);
+            if (bitmap != nullptr)
+                PoolFreeWired(bitmap, bitmapLength, SwapTag);
+            if (cache != nullptr)
+                PoolFreeWired(cache, cacheLength, SwapTag);
+            UnrefIoInterface(ioi);
+
+            return NpkStatus::Shortage;
+        }
+
+        auto* dev = new(ptr) SwapDevice {};
+        NPK_ASSERT(ResetMutex(&dev->mutex, 1) == NpkStatus::Success);
+        dev->ioi = ioi;
+        dev->slotCount = slotCount;
+        dev->freeSlots = slotCount;
+        dev->nextFit = 0;
+        dev->cachedPages = 0;
+        dev->bitmap = static_cast<uint64_t*>(bitmap);
+        dev->cache = static_cast<PageInfo**>(cache);
+        sl::MemSet(dev->bitmap, 0, bitmapLength);
+        sl::MemSet(dev->cache, 0, cacheLength);
+
+        swapDevicesLock.Lock();
+        const size_t index = swapDeviceCount.Load(sl::Relaxed);
+        if (index == MaxSwapDevices)
+        {
+            swapDevicesLock.Unlock();
+
+            PoolFreeWired(dev, sizeof(SwapDevice), SwapTag);
+            PoolFreeWired(bitmap, bitmapLength, SwapTag);
+            PoolFreeWired(cache, cacheLength, SwapTag);
+            UnrefIoInterface(ioi);
+
+            return NpkStatus::Shortage;
+        }
+
+        if (index == 0)
+        {
+            swapClusterPages = sl::Clamp<size_t>(
+                ReadConfigUint("npk.vm.swap_cluster_pages",
+                DefaultSwapClusterPages), 1, MaxSwapClusterPages);
+            swapReadaheadPages = sl::Min<size_t>(
+                ReadConfigUint("npk.vm.swap_readahead_pages",
+                DefaultSwapReadaheadPages), MaxSwapReadaheadPages);
+        }
+
+        swapDevices[index] = dev;
+        swapDeviceCount.Store(index + 1, sl::Release);
+        swapDevicesLock.Unlock();
+
+        auto conv = sl::ConvertUnits(slotCount << PfnShift());
+        Log("Added swap device %zu: ioi=%p, %zu.%zu %sB (%zu slots)",
+            LogLevel::Info, index, ioi, conv.major, conv.minor, conv.prefix,
+            slotCount);
+
+        return NpkStatus::Success;
+    }
+
+    size_t SwapOutSpace(VmSpace& space, size_t count)
+    {
+        using namespace Private;
+
+        if (count == 0)
+            return 0;
+        if (swapDeviceCount.Load(sl::Acquire) == 0 && !CompressedStoreEnabled())
+            return 0;
+
+        //reclaim can be started by any allocation, including one made while
+        //holding this space's ranges mutex exclusively. Don't wait for it.
+        auto result = AcquireSxMutexShared(&space.rangesMutex, {},
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return 0;
+
+        //resume from the range containing the cursor, wrapping around to the
+        //first range once. This approximates a clock: pages are swapped out
+        //in address order rather than hammering the start of the space.
+        const uintptr_t cursor = space.swapCursor.Load(sl::Relaxed);
+        VmRange* start = space.ranges.First();
+        for (auto it = start; it != nullptr; it = VmRangeTree::Successor(it))
+        {
+            if (cursor < it->base + it->length)
+            {
+                start = it;
+                break;
+            }
+        }
+
+        size_t released = 0;
+        bool wrapped = false;
+        for (auto it = start; it != nullptr && released < count;)
+        {
+            if (!it->flags.Has(VmFlag::Mmio))
+            {
+                const uintptr_t begin = it == start && !wrapped ? cursor : 0;
+                released += SwapOutRange(space, *it, count - released, begin);
+            }
+
+            it = VmRangeTree::Successor(it);
+            if (it == nullptr && !wrapped)
+            {
+                wrapped = true;
+                it = space.ranges.First();
+            }
+            if (wrapped && it == start)
+                break;
+        }
+
+        ReleaseSxMutexShared(&space.rangesMutex);
+
+        return released;
+    }
+}
@@ -0,0 +1,273 @@
+#include <private/Vm.hpp>
+#include <lib/Maths.hpp>
+#include <lib/Memory.hpp>
+
+/* Working set estimation: a periodic scanner walks the mapped pages of each
+ * tracked address space, sampling and clearing the accessed bit of each
+ * PTE. Each page's idle age (the number of passes since it was last seen
+ * accessed) is kept in its range, and a histogram of these ages is built up
+ * over a full pass of the space before being published.
+ * The scanner is rate limited to a fixed number of pages per period, so a
+ * pass over a large space may span many periods. Busy ranges are skipped
+ * rather than waited on, since the scanner runs as a work item.
+ */
+namespace Npk
+{
+    constexpr size_t DefaultScanIntervalMs = 1000;
+    constexpr size_t DefaultScanPages = 8192;
+    constexpr size_t MinSpaceScanPages = 64;
+    constexpr uint8_t MaxPageAge = 0xFF;
+
+    using WorkingSetList = sl::List<VmSpace, &VmSpace::wsetHook>;
+
+    struct WorkingSetScanner
+    {
+        Mutex mutex;
+        WorkingSetList spaces;
+        size_t spaceCount;
+
+        sl::TimeCount interval;
+        size_t pagesPerInterval;
+        sl::Atomic<bool> armed;
+        ClockEvent clockEvent;
+        Dpc dpc;
+        WorkItem work;
+    };
+
+    static WorkingSetScanner scanner;
+
+    static size_t AgeBucket(uint8_t age)
+    {
+        size_t bucket = 0;
+        while (age != 0 && bucket + 1 < WorkingSetBuckets)
+        {
+            age >>= 1;
+            bucket++;
+        }
+
+        return bucket;
+    }
+
+    static void ArmScanner()
+    {
+        if (scanner.interval.ticks == 0 || scanner.armed.Exchange(true))
+            return;
+
+        scanner.clockEvent.expiry = GetMonotonicTime() + scanner.interval;
+        AddClockEvent(&scanner.clockEvent);
+    }
+
+    //NOTE: assumes space.rangesMutex is held (shared). Scans pages of `range`
+    //from `begin`, returning the address scanning stopped at.
+    static uintptr_t ScanRange(VmSpace& space, VmRange& range,
+        uintptr_t begin, size_t* budget)
+    {
+        const uintptr_t top = range.base + range.length;
+        if (AcquireMutex(&range.mutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return top;
+
+        const size_t pageCount = range.length >> PfnShift();
+        if (range.pageAges == nullptr)
+        {
+            void* ptr = PoolAllocWired(pageCount, Private::WorkingSetTag);
+            if (ptr == nullptr)
+            {
+                ReleaseMutex(&range.mutex);
+                return top;
+            }
+
+            sl::MemSet(ptr, 0, pageCount);
+            range.pageAges = static_cast<uint8_t*>(ptr);
+        }
+
+        uintptr_t addr = sl::Max(begin, range.base);
+        for (; addr < top && *budget != 0; addr += PageSize())
+        {
+            (*budget)--;
+
+            MmuWalkResult result {};
+            PageAccessRef ptRef {};
+            if (!HwWalkMap(space.map, addr, result, &ptRef)
+                || !result.complete)
+                continue;
+
+            uint8_t& age = range.pageAges[(addr - range.base) >> PfnShift()];
+            if (HwPteTestAndClearAccessed(result.pte))
+                age = 0;
+            else if (age != MaxPageAge)
+                age++;
+
+            space.wsetBuilding[AgeBucket(age)]++;
+        }
+        ReleaseMutex(&range.mutex);
+
+        return addr;
+    }
+
+    static void PublishPass(VmSpace& space)
+    {
+        const auto now = GetMonotonicTime();
+
+        space.wsetLock.Lock();
+        space.wset.mappedPages = 0;
+        for (size_t i = 0; i < WorkingSetBuckets; i++)
+        {
+            space.wset.idlePages[i] = space.wsetBuilding[i];
+            space.wset.mappedPages += space.wsetBuilding[i];
+        }
+        space.wset.completedPasses++;
+        space.wset.lastPassNs = (now - space.wsetPassBegin).epoch;
+        space.wsetLock.Unlock();
+
+        sl::MemSet(space.wsetBuilding, 0, sizeof(space.wsetBuilding));
+        space.wsetPassBegin = now;
+    }
+
+    //NOTE: assumes scanner.mutex is held
+    static void ScanSpace(VmSpace& space, size_t budget)
+    {
+        if (AcquireSxMutexShared(&space.rangesMutex, {}, NPK_WAIT_LOCATION)
+            != NpkStatus::Success)
+            return;
+
+        //resume from where the last period left off, a pass is complete once
+        //we run off the end of the last range.
+        const uintptr_t cursor = space.wsetCursor;
+        VmRange* it = space.ranges.First();
+        while (it != nullptr && it->base + it->length <= cursor)
+            it = VmRangeTree::Successor(it);
+
+        uintptr_t stopped = cursor;
+        for (; it != nullptr && budget != 0; it = VmRangeTree::Successor(it))
+        {
+            if (it->flags.Has(VmFlag::Mmio))
+                continue;
+
+            stopped = ScanRange(space, *it, cursor, &budget);
+            if (stopped < it->base + it->length)
+                break;
+        }
+        ReleaseSxMutexShared(&space.rangesMutex);
+
+        if (it == nullptr)
+        {
+            PublishPass(space);
+            space.wsetCursor = 0;
+        }
+        else
+            space.wsetCursor = stopped;
+    }
+
+    static void ScannerWork(WorkItem* item, void* arg)
+    {
+        (void)item;
+        (void)arg;
+
+        //work items shouldn't block, if someone is changing the set of
+        //tracked spaces just try again next period.
+        if (AcquireMutex(&scanner.mutex, {}, NPK_WAIT_LOCATION)
+            == NpkStatus::Success)
+        {
+            const size_t budget = scanner.spaceCount == 0 ? 0
+                : sl::Max(MinSpaceScanPages,
+                scanner.pagesPerInterval / scanner.spaceCount);
+
+            for (auto it = scanner.spaces.Begin(); it != scanner.spaces.End();
+                ++it)
+                ScanSpace(*it, budget);
+            ReleaseMutex(&scanner.mutex);
+        }
+
+        //`armed` covers the work item too, so it's never queued twice.
+        scanner.armed.Store(false, sl::Release);
+        ArmScanner();
+    }
+
+    static void ScannerDpc(Dpc* dpc, void* arg)
+    {
+        (void)dpc;
+        (void)arg;
+
+        QueueWorkItem(&scanner.work, {});
+    }
+
+    void Private::InitWorkingSetScanner()
+    {
+        NPK_ASSERT(ResetMutex(&scanner.mutex, 1) == NpkStatus::Success);
+        scanner.spaceCount = 0;
+        scanner.interval = sl::TimeCount(sl::Millis,
+            ReadConfigUint("npk.vm.wset_scan_interval_ms",
+            DefaultScanIntervalMs));
+        scanner.pagesPerInterval = ReadConfigUint("npk.vm.wset_scan_pages",
+            DefaultScanPages);
+
+        scanner.dpc.function = ScannerDpc;
+        scanner.dpc.arg = nullptr;
+        scanner.work.function = ScannerWork;
+        scanner.work.arg = nullptr;
+        scanner.clockEvent.dpc = &scanner.dpc;
+        scanner.clockEvent.waitable = nullptr;
+
+        if (scanner.interval.ticks == 0 || scanner.pagesPerInterval == 0)
+        {
+            scanner.interval.ticks = 0;
+            Log("Working set scanner disabled", LogLevel::Info);
+            return;
+        }
+
+        Log("Working set scanner: %zu pages every %zums", LogLevel::Verbose,
+            scanner.pagesPerInterval, (size_t)scanner.interval.ticks);
+    }
+
+    NpkStatus SpaceTrackWorkingSet(VmSpace& space, bool enable)
+    {
+        auto result = AcquireMutex(&scanner.mutex, sl::NoTimeout,
+            NPK_WAIT_LOCATION);
+        if (result != NpkStatus::Success)
+            return result;
+
+        if (space.wsetTracked == enable)
+        {
+            ReleaseMutex(&scanner.mutex);
+            return NpkStatus::Success;
+        }
+
+        if (enable)
+        {
+            space.wsetCursor = 0;
+            space.wsetPassBegin = GetMonotonicTime();
+            sl::MemSet(space.wsetBuilding, 0, sizeof(space.wsetBuilding));
+            scanner.spaces.PushBack(&space);
+            scanner.spaceCount++;
+        }
+        else
+        {
+            scanner.spaces.Remove(&space);
+            scanner.spaceCount--;
+        }
+
+        space.wsetLock.Lock();
+        space.wsetTracked = enable;
+        space.wset = {};
+        space.wsetLock.Unlock();
+        ReleaseMutex(&scanner.mutex);
+
+        if (enable)
+            ArmScanner();
+        return NpkStatus::Success;
+    }
+
+    NpkStatus SpaceGetWorkingSet(VmSpace& space, WorkingSetInfo* info)
+    {
+        NPK_CHECK(info != nullptr, NpkStatus::InvalidArg);
+
+        space.wsetLock.Lock();
+        const bool tracked = space.wsetTracked;
+        if (tracked)
+            *info = space.wset;
+        space.wsetLock.Unlock();
+
+        return tracked ? NpkStatus::Success : NpkStatus::NotAvailable;
+    }
+}
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Converts kernel scheduler traces into chrome trace event json, which can be
+loaded by chrome://tracing or ui.perfetto.dev.
+
+Input is either kernel log output containing `schedtrace:` lines (written
+when `npk.sched.trace_dump_ms` is set), or with `--ring` the raw memory of a
+cpu's trace ring (`RemoteCpuStatus::schedTrace`), as dumped by a debugger.
+Each cpu is shown as a track, with a slice for each thread that ran on it
+and each idle period. Other events are shown as instant events.
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+EVENT_NAMES = [ "switch", "wake", "enqueue", "migrate", "preempt",
+    "idle-enter", "idle-exit" ]
+THREAD_STATES = [ "dead", "standby", "ready", "executing", "waiting" ]
+
+LOG_PATTERN = re.compile(r"schedtrace: cpu=(\d+) ts=(\d+) ev=([\w-]+) "
+    r"thread=(0x[0-9a-fA-F]+) arg=(\d+) prio=(\d+)")
+RING_HEADER = struct.Struct("<QQQQ")
+RING_SLOT = struct.Struct("<QQQIHBB")
+
+
+def parse_log(lines):
+    for line in lines:
+        match = LOG_PATTERN.search(line)
+        if match is None:
+            continue
+        yield {
+            "cpu": int(match.group(1)),
+            "ts": int(match.group(2)),
+            "ev": match.group(3),
+            "thread": int(match.group(4), 16),
+            "arg": int(match.group(5)),
+            "prio": int(match.group(6)),
+        }
+
+
+def parse_ring(data, cpu):
+    head, mask, _, _ = RING_HEADER.unpack_from(data, 0)
+    capacity = mask + 1
+    first = max(head - capacity, 0)
+    for index in range(first, head):
+        offset = RING_HEADER.size + (index & mask) * RING_SLOT.size
+        seq, ts, thread, arg, _, ev, prio = RING_SLOT.unpack_from(data, offset)
+        if seq != index + 1 or ev >= len(EVENT_NAMES):
+            continue
+        yield {
+            "cpu": cpu,
+            "ts": ts,
+            "ev": EVENT_NAMES[ev],
+            "thread": thread,
+            "arg": arg,
+            "prio": prio,
+        }
+
+
+def describe_arg(event):
+    ev = event["ev"]
+    arg = event["arg"]
+    if ev == "switch":
+        state = THREAD_STATES[arg] if arg < len(THREAD_STATES) else str(arg)
+        return { "prev_state": state }
+    if ev == "migrate":
+        return { "from": arg >> 16, "to": arg & 0xFFFF }
+    if ev in ("wake", "enqueue", "preempt"):
+        return { "cpu": arg }
+    return { "state": arg }
+
+
+def convert(events):
+    # timestamps are in nanoseconds, chrome trace uses microseconds.
+    events = sorted(events, key=lambda e: e["ts"])
+    output = []
+    running = {}
+    idle = {}
+
+    def end_slice(table, cpu, ts):
+        begin = table.pop(cpu, None)
+        if begin is None:
+            return
+        name, start, args = begin
+        output.append({ "name": name, "ph": "X", "pid": 0, "tid": cpu,
+            "ts": start / 1000, "dur": (ts - start) / 1000, "args": args })
+
+    for event in events:
+        cpu = event["cpu"]
+        ts = event["ts"]
+        ev = event["ev"]
+        thread = "thread 0x%x" % event["thread"]
+
+        if ev == "switch":
+            end_slice(running, cpu, ts)
+            running[cpu] = (thread, ts, { "priority": event["prio"] })
+        elif ev == "idle-enter":
+            idle[cpu] = ("idle state %u" % event["arg"], ts, {})
+        elif ev == "idle-exit":
+            end_slice(idle, cpu, ts)
+        else:
+            args = describe_arg(event)
+            args["priority"] = event["prio"]
+            output.append({ "name": "%s %s" % (ev, thread), "ph": "i",
+                "s": "t", "pid": 0, "tid": cpu, "ts": ts / 1000,
+                "args": args })
+
+    # anything still running is cut off at the end of the trace.
+    last = events[-1]["ts"] if events else 0
+    cpus = set(running) | set(idle)
+    for cpu in cpus:
+        end_slice(running, cpu, last)
+        end_slice(idle, cpu, last)
+    for cpu in cpus:
+        output.append({ "name": "thread_name", "ph": "M", "pid": 0,
+            "tid": cpu, "args": { "name": "cpu %u" % cpu } })
+    return { "traceEvents": output, "displayTimeUnit": "ns" }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("input", help="log file or ring dump, '-' for stdin")
+    parser.add_argument("-o", "--output", help="output file, default stdout")
+    parser.add_argument("--ring", action="store_true",
+        help="input is the raw memory of a trace ring")
+    parser.add_argument("--cpu", type=int, default=0,
+        help="cpu the ring belongs to, when using --ring")
+    args = parser.parse_args()
+
+    if args.ring:
+        with open(args.input, "rb") as file:
+            events = list(parse_ring(file.read(), args.cpu))
+    elif args.input == "-":
+        events = list(parse_log(sys.stdin))
+    else:
+        with open(args.input, "r", errors="replace") as file:
+            events = list(parse_log(file))
+
+    trace = convert(events)
+    if args.output is None:
+        json.dump(trace, sys.stdout)
+    else:
+        with open(args.output, "w") as file:
+            json.dump(trace, file)
+
+
+if __name__ == "__main__":
+    main()